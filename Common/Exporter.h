@@ -38,6 +38,8 @@
 
 // Export |image| to |path| with UTI type and quality.  The |type| should be one of: jpeg, png, or tiff
 // and quality is between 0 and 1.  If |path| is lacking an extension, the type will be used.
+// The file is written beside |path| and then renamed, so an existing image is replaced atomically.
+// PNG images are compressed on all processors.
 // Return the name of the file written, or nil if there was an error.
 + (NSString *)exportImage:(CGImageRef)image path:(NSString *)path type:(NSString *)type quality:(CGFloat)quality;
 
@@ -12,11 +12,20 @@
 // License for the specific language governing permissions and limitations under
 // the License.
 
+#import <unistd.h>
+
 #import "Exporter.h"
 #import "NSScreen+Convenience.h"
+#import "PNGEncoderCore.h"
 
 static const int kMaxCachedDrawings = 10;
 
+@interface Exporter(PrivateMethods)
++ (BOOL)writePNGImage:(CGImageRef)image fd:(int)fd;
++ (BOOL)writeImage:(CGImageRef)image path:(NSString *)path type:(NSString *)type 
+           quality:(CGFloat)quality;
+@end
+
 @implementation Exporter
 //------------------------------------------------------------------------------
 + (NSString *)supportDirectory:(NSString *)subdir {
@@ -124,10 +133,146 @@ static const int kMaxCachedDrawings = 10;
 
 //------------------------------------------------------------------------------
 + (NSString *)exportImage:(CGImageRef)image path:(NSString *)path type:(NSString *)type quality:(CGFloat)quality {
-  NSMutableData *data = [[NSMutableData alloc] init];
+  if (![[path pathExtension] length])
+    path = [path stringByAppendingPathExtension:type];
+  
+  // Write to a temporary file next to |path| and rename it into place, so that
+  // a partially written image is never seen
+  NSString *dir = [path stringByDeletingLastPathComponent];
+  NSString *tempName = [NSString stringWithFormat:@".%@.XXXXXX", [path lastPathComponent]];
+  const char *tempTemplate = [[dir stringByAppendingPathComponent:tempName] fileSystemRepresentation];
+  char *tempPath = strdup(tempTemplate);
+  int fd = mkstemp(tempPath);
+  BOOL success = NO;
+  
+  if (fd < 0) {
+    MethodLog("Unable to create %s (%d)", tempPath, errno);
+    free(tempPath);
+    return nil;
+  }
+  
+  fchmod(fd, 0644);
+  
+  if ([type isEqualToString:@"png"]) {
+    success = [self writePNGImage:image fd:fd];
+    success = (close(fd) == 0) && success;
+  } else {
+    close(fd);
+    NSFileManager *fm = [NSFileManager defaultManager];
+    NSString *temp = [fm stringWithFileSystemRepresentation:tempPath length:strlen(tempPath)];
+    success = [self writeImage:image path:temp type:type quality:quality];
+  }
+  
+  if (success && rename(tempPath, [path fileSystemRepresentation]) != 0) {
+    MethodLog("Unable to rename to %@ (%d)", path, errno);
+    success = NO;
+  }
+  
+  if (!success) {
+    unlink(tempPath);
+    path = nil;
+  }
+  
+  free(tempPath);
+  
+  return path;
+}
+
+//------------------------------------------------------------------------------
+// The image that PNGEncoderCore draws its bands from
+typedef struct {
+  CGImageRef image;
+  CGColorSpaceRef colorSpace;
+  BOOL hasAlpha;
+} PNGImageRows;
+
+//------------------------------------------------------------------------------
+// Draw just the requested rows of the image into the band's buffer
+static int DrawImageRows(void *context, size_t first, size_t count, uint8_t *rows,
+                         size_t rowBytes) {
+  const PNGImageRows *source = (const PNGImageRows *)context;
+  size_t width = CGImageGetWidth(source->image);
+  size_t height = CGImageGetHeight(source->image);
+  CGBitmapInfo info = kCGBitmapByteOrder32Big | 
+    (source->hasAlpha ? kCGImageAlphaPremultipliedLast : kCGImageAlphaNoneSkipLast);
+  CGContextRef band = CGBitmapContextCreate(rows, width, count, 8, rowBytes, source->colorSpace,
+                                            info);
+  
+  if (!band)
+    return 0;
+  
+  // The band's top row is |first| rows from the top of the image
+  CGContextSetBlendMode(band, kCGBlendModeCopy);
+  CGContextDrawImage(band, CGRectMake(0, (CGFloat)first + count - height, width, height),
+                     source->image);
+  CGContextRelease(band);
+  
+  return 1;
+}
+
+//------------------------------------------------------------------------------
+// Bands of the image are compressed in parallel and written to |fd| as they're
+// finished.  Each band is drawn into its own small buffer as it's encoded, so
+// apart from the image itself only the bands in progress are in memory.
++ (BOOL)writePNGImage:(CGImageRef)image fd:(int)fd {
+  size_t width = CGImageGetWidth(image);
+  size_t height = CGImageGetHeight(image);
+  CGImageAlphaInfo alphaInfo = CGImageGetAlphaInfo(image);
+  BOOL hasAlpha = !(alphaInfo == kCGImageAlphaNone || alphaInfo == kCGImageAlphaNoneSkipFirst ||
+                    alphaInfo == kCGImageAlphaNoneSkipLast);
+  CGColorSpaceRef cs = CGImageGetColorSpace(image);
+  PNGEncoderParameters params;
+  PNGImageRows source;
+  
+  if (!width || !height)
+    return NO;
+  
+  // Keep the color space (and embed its profile) as long as it's RGB
+  if (cs && CGColorSpaceGetModel(cs) == kCGColorSpaceModelRGB)
+    CGColorSpaceRetain(cs);
+  else
+    cs = CGColorSpaceCreateDeviceRGB();
+  
+  source.image = image;
+  source.colorSpace = cs;
+  source.hasAlpha = hasAlpha;
+  
+  CFDataRef profile = CGColorSpaceCopyICCProfile(cs);
+  
+  bzero(&params, sizeof(params));
+  params.getRows = DrawImageRows;
+  params.getRowsContext = &source;
+  params.width = width;
+  params.height = height;
+  params.premultiplied = YES;
+  params.hasAlpha = hasAlpha;
+  params.level = -1;
+  params.iccProfile = profile ? CFDataGetBytePtr(profile) : NULL;
+  params.iccProfileLength = profile ? CFDataGetLength(profile) : 0;
+  params.fd = fd;
+  
+  BOOL success = PNGEncoderWrite(&params, WorkQueueGetShared()) ? YES : NO;
+  
+  if (!success)
+    MethodLog("Unable to write PNG (%d)", errno);
+  
+  if (profile)
+    CFRelease(profile);
+  
+  CGColorSpaceRelease(cs);
+  
+  return success;
+}
+
+//------------------------------------------------------------------------------
+// Encode with ImageIO straight to |path|
++ (BOOL)writeImage:(CGImageRef)image path:(NSString *)path type:(NSString *)type 
+           quality:(CGFloat)quality {
   NSString *utiType = [NSString stringWithFormat:@"public.%@", type];
-  CGImageDestinationRef dest = CGImageDestinationCreateWithData((CFMutableDataRef)data,
-                                                                (CFStringRef)utiType, 1, nil);
+  NSURL *url = [NSURL fileURLWithPath:path];
+  CGImageDestinationRef dest = CGImageDestinationCreateWithURL((CFURLRef)url, (CFStringRef)utiType, 
+                                                               1, nil);
+  BOOL success = NO;
   
   if (dest) {
     NSDictionary *properties = 
@@ -135,24 +280,11 @@ static const int kMaxCachedDrawings = 10;
      [NSNumber numberWithFloat:quality], (NSString *)kCGImageDestinationLossyCompressionQuality,
      nil];
     CGImageDestinationAddImage(dest, image, (CFDictionaryRef)properties);
-    CGImageDestinationFinalize(dest);
-    
-    NSString *ext = [path pathExtension];
-    
-    if (![ext length])
-      path = [path stringByAppendingPathExtension:type];
-    
-    if (![data writeToFile:path atomically:NO])
-      path = nil;
-
+    success = CGImageDestinationFinalize(dest);
     CFRelease(dest);
-  } else {
-    path = nil;
   }
-
-  [data release];
   
-  return path;
+  return success;
 }
 
 @end
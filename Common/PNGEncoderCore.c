@@ -0,0 +1,488 @@
+// Copyright 2008 Google Inc.
+//
+// Licensed under the Apache License, Version 2.0 (the "License"); you may not
+// use this file except in compliance with the License.  You may obtain a copy
+// of the License at
+//
+// http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS, WITHOUT
+// WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.  See the
+// License for the specific language governing permissions and limitations under
+// the License.
+
+#include <errno.h>
+#include <pthread.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <zlib.h>
+
+#include "PNGEncoderCore.h"
+
+// Aim for this many bytes of filtered rows per band
+#define kPNGBandBytes (256 * 1024)
+
+// Adaptive row filters
+enum {
+  kPNGFilterNone = 0,
+  kPNGFilterSub,
+  kPNGFilterUp,
+  kPNGFilterAverage,
+  kPNGFilterPaeth,
+  kPNGFilterCount
+};
+
+typedef struct {
+  uint8_t *data;          // Deflated rows
+  size_t length;
+  uLong adler;            // Of the filtered rows
+  size_t filteredLength;
+  int error;              // errno if the band couldn't be encoded
+  int isDone;
+} PNGBand;
+
+typedef struct {
+  const PNGEncoderParameters *params;
+  size_t channels;
+  size_t filteredRowBytes;  // Including the filter type byte
+  size_t bandRows;
+  size_t bandCount;
+  PNGBand *bands;
+  uint8_t *scratch;       // Two rows, the filter candidates and, without
+  size_t scratchBytes;    // |pixels|, a band of RGBA rows for each worker
+  pthread_mutex_t lock;   // Protects the following
+  size_t nextBand;        // To be written
+  uLong adler;            // Of the bands written so far
+  int error;              // errno of the first failure
+} PNGEncoder;
+
+static const uint8_t kPNGSignature[8] = { 137, 'P', 'N', 'G', '\r', '\n', 26, '\n' };
+
+//------------------------------------------------------------------------------
+static inline void StoreBigEndian(uint8_t *dst, uint32_t value) {
+  dst[0] = value >> 24;
+  dst[1] = value >> 16;
+  dst[2] = value >> 8;
+  dst[3] = value;
+}
+
+//------------------------------------------------------------------------------
+static int WriteAll(int fd, const void *data, size_t length) {
+  const uint8_t *bytes = (const uint8_t *)data;
+  
+  while (length) {
+    ssize_t written = write(fd, bytes, length);
+    
+    if (written < 0) {
+      if (errno == EINTR)
+        continue;
+      
+      return 0;
+    }
+    
+    bytes += written;
+    length -= written;
+  }
+  
+  return 1;
+}
+
+//------------------------------------------------------------------------------
+// A chunk whose data is the concatenation of |count| parts
+static int WriteChunk(int fd, const char *type, const void **parts, const size_t *lengths,
+                      int count) {
+  uint8_t header[8], trailer[4];
+  uint32_t length = 0;
+  uLong crc = crc32(0, (const Bytef *)type, 4);
+  
+  for (int i = 0; i < count; ++i) {
+    length += lengths[i];
+    crc = crc32(crc, (const Bytef *)parts[i], lengths[i]);
+  }
+  
+  StoreBigEndian(header, length);
+  memcpy(header + 4, type, 4);
+  StoreBigEndian(trailer, crc);
+  
+  if (!WriteAll(fd, header, sizeof(header)))
+    return 0;
+  
+  for (int i = 0; i < count; ++i) {
+    if (!WriteAll(fd, parts[i], lengths[i]))
+      return 0;
+  }
+  
+  return WriteAll(fd, trailer, sizeof(trailer));
+}
+
+//------------------------------------------------------------------------------
+// The zlib stream header for |level|, matching what deflate() would write
+static void ZlibHeader(int level, uint8_t header[2]) {
+  int levelFlags;
+  
+  if (level < 0)
+    level = 6;
+  
+  if (level < 2)
+    levelFlags = 0;
+  else if (level < 6)
+    levelFlags = 1;
+  else if (level == 6)
+    levelFlags = 2;
+  else
+    levelFlags = 3;
+  
+  header[0] = 0x78;     // Deflate with a 32K window
+  header[1] = levelFlags << 6;
+  header[1] += 31 - ((header[0] << 8) + header[1]) % 31;
+}
+
+//------------------------------------------------------------------------------
+// Copy |row| to |dst| without premultiplication or the alpha byte, as needed
+static void UnpackRow(const PNGEncoderParameters *params, const uint8_t *row, uint8_t *dst) {
+  size_t width = params->width;
+  
+  if (!params->hasAlpha) {
+    for (size_t x = 0; x < width; ++x, row += 4, dst += 3) {
+      dst[0] = row[0];
+      dst[1] = row[1];
+      dst[2] = row[2];
+    }
+  } else if (!params->premultiplied) {
+    memcpy(dst, row, width * 4);
+  } else {
+    for (size_t x = 0; x < width; ++x, row += 4, dst += 4) {
+      unsigned a = row[3];
+      
+      if (a == 255) {
+        memcpy(dst, row, 4);
+      } else if (!a) {
+        memset(dst, 0, 4);
+      } else {
+        for (int k = 0; k < 3; ++k) {
+          unsigned c = (row[k] * 255 + a / 2) / a;
+          dst[k] = c > 255 ? 255 : c;
+        }
+        
+        dst[3] = a;
+      }
+    }
+  }
+}
+
+//------------------------------------------------------------------------------
+static inline uint8_t Paeth(int a, int b, int c) {
+  int p = a + b - c;
+  int pa = abs(p - a), pb = abs(p - b), pc = abs(p - c);
+  
+  if (pa <= pb && pa <= pc)
+    return a;
+  
+  return pb <= pc ? b : c;
+}
+
+//------------------------------------------------------------------------------
+static unsigned long FilterSum(const uint8_t *filtered, size_t length) {
+  unsigned long sum = 0;
+  
+  for (size_t i = 0; i < length; ++i)
+    sum += filtered[i] < 128 ? filtered[i] : 256 - filtered[i];
+  
+  return sum;
+}
+
+//------------------------------------------------------------------------------
+// Filter |row| with each filter type into |candidates| and return the one with
+// the smallest sum of absolute (signed) differences
+static uint8_t *FilterRow(const uint8_t *row, const uint8_t *prior, size_t length, size_t bpp,
+                          uint8_t *candidates, size_t stride) {
+  uint8_t *none = candidates;
+  uint8_t *sub = none + stride;
+  uint8_t *up = sub + stride;
+  uint8_t *average = up + stride;
+  uint8_t *paeth = average + stride;
+  uint8_t *best = none;
+  unsigned long bestSum;
+  size_t i;
+  
+  none[0] = kPNGFilterNone;
+  sub[0] = kPNGFilterSub;
+  up[0] = kPNGFilterUp;
+  average[0] = kPNGFilterAverage;
+  paeth[0] = kPNGFilterPaeth;
+  
+  memcpy(none + 1, row, length);
+  
+  for (i = 0; i < bpp; ++i) {
+    sub[i + 1] = row[i];
+    up[i + 1] = row[i] - prior[i];
+    average[i + 1] = row[i] - (prior[i] >> 1);
+    paeth[i + 1] = row[i] - prior[i];
+  }
+  
+  for (; i < length; ++i) {
+    sub[i + 1] = row[i] - row[i - bpp];
+    up[i + 1] = row[i] - prior[i];
+    average[i + 1] = row[i] - ((row[i - bpp] + prior[i]) >> 1);
+    paeth[i + 1] = row[i] - Paeth(row[i - bpp], prior[i], prior[i - bpp]);
+  }
+  
+  bestSum = FilterSum(none + 1, length);
+  
+  for (int type = kPNGFilterSub; type < kPNGFilterCount; ++type) {
+    uint8_t *filtered = candidates + type * stride;
+    unsigned long sum = FilterSum(filtered + 1, length);
+    
+    if (sum < bestSum) {
+      bestSum = sum;
+      best = filtered;
+    }
+  }
+  
+  return best;
+}
+
+//------------------------------------------------------------------------------
+// Write the bands that are done, in order.  The last band carries the trailer.
+static void WriteFinishedBands(PNGEncoder *encoder) {
+  const PNGEncoderParameters *params = encoder->params;
+  
+  while (encoder->nextBand < encoder->bandCount && encoder->bands[encoder->nextBand].isDone) {
+    PNGBand *band = &encoder->bands[encoder->nextBand];
+    uint8_t header[2], trailer[4];
+    const void *parts[3];
+    size_t lengths[3];
+    int count = 0;
+    
+    if (!encoder->nextBand) {
+      ZlibHeader(params->level, header);
+      parts[count] = header;
+      lengths[count++] = sizeof(header);
+      encoder->adler = band->adler;
+    } else {
+      encoder->adler = adler32_combine(encoder->adler, band->adler, band->filteredLength);
+    }
+    
+    parts[count] = band->data;
+    lengths[count++] = band->length;
+    
+    if (encoder->nextBand == encoder->bandCount - 1) {
+      StoreBigEndian(trailer, encoder->adler);
+      parts[count] = trailer;
+      lengths[count++] = sizeof(trailer);
+    }
+    
+    if (!encoder->error && !band->data)
+      encoder->error = band->error ? band->error : ENOMEM;
+    
+    if (!encoder->error && !WriteChunk(params->fd, "IDAT", parts, lengths, count))
+      encoder->error = errno;
+    
+    free(band->data);
+    band->data = NULL;
+    ++encoder->nextBand;
+  }
+}
+
+//------------------------------------------------------------------------------
+static void EncodeBand(void *context, size_t index, int worker) {
+  PNGEncoder *encoder = (PNGEncoder *)context;
+  const PNGEncoderParameters *params = encoder->params;
+  PNGBand *band = &encoder->bands[index];
+  size_t rowLength = encoder->filteredRowBytes - 1;
+  size_t first = index * encoder->bandRows;
+  size_t last = first + encoder->bandRows;
+  uint8_t *scratch = encoder->scratch + (size_t)worker * encoder->scratchBytes;
+  uint8_t *prior = scratch;
+  uint8_t *row = prior + rowLength;
+  uint8_t *candidates = row + rowLength;
+  const uint8_t *pixels = params->pixels;
+  size_t rowBytes = params->rowBytes;
+  size_t pixelsFirst = 0;     // Row of the image at |pixels|
+  z_stream stream;
+  
+  if (last > params->height)
+    last = params->height;
+  
+  band->filteredLength = (last - first) * encoder->filteredRowBytes;
+  band->adler = adler32(0, NULL, 0);
+  
+  pthread_mutex_lock(&encoder->lock);
+  int skip = encoder->error;
+  pthread_mutex_unlock(&encoder->lock);
+  
+  // Read the band's rows, and the row before it for filtering
+  if (!skip && !pixels) {
+    uint8_t *bandPixels = candidates + kPNGFilterCount * encoder->filteredRowBytes;
+    
+    pixelsFirst = first ? first - 1 : first;
+    rowBytes = params->width * 4;
+    pixels = bandPixels;
+    
+    if (!params->getRows(params->getRowsContext, pixelsFirst, last - pixelsFirst, bandPixels,
+                         rowBytes)) {
+      band->error = EIO;
+      skip = 1;
+    }
+  }
+  
+  memset(&stream, 0, sizeof(stream));
+  
+  if (!skip && deflateInit2(&stream, params->level, Z_DEFLATED, -15, 8, 
+                            Z_DEFAULT_STRATEGY) == Z_OK) {
+    // Room for the sync flush marker, too
+    size_t capacity = deflateBound(&stream, band->filteredLength) + 16;
+    band->data = (uint8_t *)malloc(capacity);
+    stream.next_out = band->data;
+    stream.avail_out = capacity;
+    
+    if (first)
+      UnpackRow(params, pixels + (first - 1 - pixelsFirst) * rowBytes, prior);
+    else
+      memset(prior, 0, rowLength);
+    
+    for (size_t y = first; band->data && y < last; ++y) {
+      UnpackRow(params, pixels + (y - pixelsFirst) * rowBytes, row);
+      
+      uint8_t *filtered = FilterRow(row, prior, rowLength, encoder->channels, candidates,
+                                    encoder->filteredRowBytes);
+      int flush = Z_NO_FLUSH;
+      
+      if (y == last - 1)
+        flush = index == encoder->bandCount - 1 ? Z_FINISH : Z_SYNC_FLUSH;
+      
+      band->adler = adler32(band->adler, filtered, encoder->filteredRowBytes);
+      stream.next_in = filtered;
+      stream.avail_in = encoder->filteredRowBytes;
+      
+      int result = deflate(&stream, flush);
+      
+      if ((result != Z_OK && result != Z_STREAM_END) || stream.avail_in) {
+        free(band->data);
+        band->data = NULL;
+      }
+      
+      uint8_t *swap = prior;
+      prior = row;
+      row = swap;
+    }
+    
+    band->length = band->data ? stream.next_out - band->data : 0;
+    deflateEnd(&stream);
+  }
+  
+  pthread_mutex_lock(&encoder->lock);
+  band->isDone = 1;
+  WriteFinishedBands(encoder);
+  pthread_mutex_unlock(&encoder->lock);
+}
+
+//------------------------------------------------------------------------------
+static int WriteHeader(const PNGEncoderParameters *params) {
+  uint8_t ihdr[13];
+  const void *parts[1] = { ihdr };
+  size_t lengths[1] = { sizeof(ihdr) };
+  
+  StoreBigEndian(ihdr, params->width);
+  StoreBigEndian(ihdr + 4, params->height);
+  ihdr[8] = 8;                          // Bits per channel
+  ihdr[9] = params->hasAlpha ? 6 : 2;   // RGBA or RGB
+  ihdr[10] = 0;                         // Deflate
+  ihdr[11] = 0;                         // Adaptive filtering
+  ihdr[12] = 0;                         // Not interlaced
+  
+  if (!WriteAll(params->fd, kPNGSignature, sizeof(kPNGSignature)) ||
+      !WriteChunk(params->fd, "IHDR", parts, lengths, 1))
+    return 0;
+  
+  if (params->iccProfile && params->iccProfileLength) {
+    static const char kName[] = "ICC Profile";   // Includes the terminator
+    uint8_t method = 0;
+    uLongf length = compressBound(params->iccProfileLength);
+    uint8_t *profile = (uint8_t *)malloc(length);
+    const void *iccParts[3] = { kName, &method, profile };
+    size_t iccLengths[3] = { sizeof(kName), 1, 0 };
+    int result;
+    
+    if (!profile) {
+      errno = ENOMEM;
+      return 0;
+    }
+    
+    if (compress2(profile, &length, (const Bytef *)params->iccProfile, params->iccProfileLength,
+                  Z_BEST_COMPRESSION) != Z_OK) {
+      free(profile);
+      errno = EINVAL;
+      return 0;
+    }
+    
+    iccLengths[2] = length;
+    result = WriteChunk(params->fd, "iCCP", iccParts, iccLengths, 3);
+    free(profile);
+    
+    return result;
+  }
+  
+  return 1;
+}
+
+//------------------------------------------------------------------------------
+int PNGEncoderWrite(const PNGEncoderParameters *params, WorkQueue *queue) {
+  PNGEncoder encoder;
+  int threads = queue ? WorkQueueThreadCount(queue) : 1;
+  
+  if (!params->width || !params->height || params->width > 0x7FFFFFFF || 
+      params->height > 0x7FFFFFFF || (!params->pixels && !params->getRows)) {
+    errno = EINVAL;
+    return 0;
+  }
+  
+  memset(&encoder, 0, sizeof(encoder));
+  encoder.params = params;
+  encoder.channels = params->hasAlpha ? 4 : 3;
+  encoder.filteredRowBytes = 1 + params->width * encoder.channels;
+  encoder.bandRows = kPNGBandBytes / encoder.filteredRowBytes;
+  
+  if (encoder.bandRows < 8)
+    encoder.bandRows = 8;
+  
+  encoder.bandCount = (params->height + encoder.bandRows - 1) / encoder.bandRows;
+  encoder.scratchBytes = 2 * (encoder.filteredRowBytes - 1) + 
+    kPNGFilterCount * encoder.filteredRowBytes;
+  
+  if (!params->pixels)
+    encoder.scratchBytes += (encoder.bandRows + 1) * params->width * 4;
+  
+  encoder.bands = (PNGBand *)calloc(encoder.bandCount, sizeof(PNGBand));
+  encoder.scratch = (uint8_t *)malloc(encoder.scratchBytes * threads);
+  
+  if (!encoder.bands || !encoder.scratch) {
+    free(encoder.bands);
+    free(encoder.scratch);
+    errno = ENOMEM;
+    return 0;
+  }
+  
+  pthread_mutex_init(&encoder.lock, NULL);
+  
+  if (!WriteHeader(params))
+    encoder.error = errno ? errno : EIO;
+  else
+    WorkQueueApply(queue, encoder.bandCount, EncodeBand, &encoder);
+  
+  if (!encoder.error && !WriteChunk(params->fd, "IEND", NULL, NULL, 0))
+    encoder.error = errno;
+  
+  pthread_mutex_destroy(&encoder.lock);
+  free(encoder.bands);
+  free(encoder.scratch);
+  
+  if (encoder.error) {
+    errno = encoder.error;
+    return 0;
+  }
+  
+  return 1;
+}
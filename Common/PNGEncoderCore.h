@@ -0,0 +1,63 @@
+// Copyright 2008 Google Inc.
+//
+// Licensed under the Apache License, Version 2.0 (the "License"); you may not
+// use this file except in compliance with the License.  You may obtain a copy
+// of the License at
+//
+// http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS, WITHOUT
+// WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.  See the
+// License for the specific language governing permissions and limitations under
+// the License.
+
+// PNG encoding of an RGBA buffer straight to a file descriptor.  The image is
+// split into bands of rows that are filtered and deflated in parallel on a
+// WorkQueue.  Instead of a buffer, the rows of each band can be supplied by a
+// function, so that only the bands being encoded need to be in RGBA.  Every band but the last ends with a sync flush, so the bands
+// concatenate into a single zlib stream; each one is written as an IDAT chunk
+// as soon as the bands before it have been written.  The output only depends
+// on the image, not the number of threads.
+
+#ifndef PNGENCODERCORE_H
+#define PNGENCODERCORE_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+#include "WorkQueue.h"
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+// Fill |rows| with rows |first| to |first| + |count| - 1 of the image as R, G,
+// B, A bytes, |rowBytes| apart.  Called on the WorkQueue's threads, for
+// different bands at once.  Returns 0 if the rows couldn't be read.
+typedef int (*PNGEncoderRowFunction)(void *context, size_t first, size_t count, uint8_t *rows,
+                                     size_t rowBytes);
+
+typedef struct {
+  const uint8_t *pixels;  // R, G, B, A bytes.  Row 0 is the top.
+  PNGEncoderRowFunction getRows;  // If |pixels| is NULL, called for each band's
+  void *getRowsContext;           // rows (and the row before it)
+  size_t width;
+  size_t height;
+  size_t rowBytes;        // Of |pixels|
+  int premultiplied;      // Colors are premultiplied by alpha
+  int hasAlpha;           // Otherwise, the alpha bytes are ignored (and RGB is written)
+  int level;              // zlib compression level, 0 - 9 or -1 for the default
+  const void *iccProfile; // Optional ICC profile to embed
+  size_t iccProfileLength;
+  int fd;                 // Written from its current offset
+} PNGEncoderParameters;
+
+// Returns 0 if the image couldn't be compressed or written, with errno set
+int PNGEncoderWrite(const PNGEncoderParameters *params, WorkQueue *queue);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif  // PNGENCODERCORE_H
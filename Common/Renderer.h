@@ -18,6 +18,7 @@
 
 // Notifications                        // userInfo
 extern NSString *RendererDidFinish;     // NSDictionary of below keys
+extern NSString *RendererDidProgress;   // NSDictionary with RendererProgressKey
 
 extern NSString *RendererOutputKey;     // NSString of the image file created
 extern NSString *RendererErrorKey;      // NSString of any errors (empty if none)
@@ -25,6 +26,8 @@ extern NSString *RendererErrorLineKey;  // NSNumber of line with error
 extern NSString *RendererLogKey;        // NSString of any logging message (empty if none) - separated by \n
 extern NSString *RendererTimeKey;       // NSNumber of elapsed time of render
 extern NSString *RendererSeedKey;       // NSNumber of the seed used for randomization
+extern NSString *RendererPhaseTimesKey; // NSDictionary of NSNumber seconds by phase name
+extern NSString *RendererProgressKey;   // NSNumber between 0 and 1
 
 extern NSString *kDefaultScriptName;
 extern NSString *kScriptExtension;
@@ -38,8 +41,14 @@ extern NSString *kScriptExtension;
   unsigned long seed_;
   BOOL shouldSplit_;
   NSTask *task_;
-  NSMutableData *taskResponse_;
+  NSMutableData *taskResponse_;         // Unread events while rendering
   BOOL taskResponseContainedErrors_;
+  NSMutableString *output_;
+  NSString *error_;
+  int errorLine_;
+  NSMutableString *log_;
+  NSMutableDictionary *phaseTimes_;
+  float progress_;
   NSString *outputPath_;
   NSTimeInterval startTime_;
   NSTimeInterval endTime_;
@@ -70,6 +79,9 @@ extern NSString *kScriptExtension;
 
 - (void)renderInBackgroundAndNotify;
 - (BOOL)isRendering;
+
+// Fraction of the current render that's done, updated with RendererDidProgress
+- (float)progress;
 - (void)cancelRender;
 
 // Synchronous rendering
@@ -12,10 +12,15 @@
 // License for the specific language governing permissions and limitations under
 // the License.
 
+#import <fcntl.h>
+#import <signal.h>
+
 #import "Exporter.h"
 #import "Renderer.h"
+#import "RendererEvent.h"
 
 NSString *RendererDidFinish = @"RendererDidFinish";
+NSString *RendererDidProgress = @"RendererDidProgress";
 
 NSString *RendererOutputKey = @"RendererOutputKey";
 NSString *RendererErrorKey = @"RendererErrorKey";
@@ -23,6 +28,8 @@ NSString *RendererErrorLineKey = @"RendererErrorLineKey";
 NSString *RendererLogKey = @"RendererLogKey";
 NSString *RendererTimeKey = @"RendererTimeKey";
 NSString *RendererSeedKey = @"RendererSeedKey";
+NSString *RendererPhaseTimesKey = @"RendererPhaseTimesKey";
+NSString *RendererProgressKey = @"RendererProgressKey";
 
 NSString *kDefaultScriptName = @"Built-in";
 NSString *kScriptExtension = @"tds";
@@ -32,6 +39,12 @@ static NSString *kRendererName = @"TopDrawRenderer";
 @interface Renderer(PrivateMethods)
 - (void)renderData:(NSNotification *)note;
 - (void)renderFinished:(NSNotification *)note;
+- (void)serverTerminated:(NSNotification *)note;
+- (void)readEvents;
+- (void)handleEvent:(NSDictionary *)event;
+- (NSString *)timeStringForEvent:(NSDictionary *)event;
+- (BOOL)launchServer;
+- (void)stopServer;
 - (NSString *)rendererExecutablePath;
 @end
 
@@ -42,130 +55,211 @@ static NSString *kRendererName = @"TopDrawRenderer";
 //------------------------------------------------------------------------------
 - (void)renderFinished:(NSNotification *)note {
   NSNotificationCenter *center = [NSNotificationCenter defaultCenter];
-  [center removeObserver:self];
-  
-  [task_ terminate];
   endTime_ = CFAbsoluteTimeGetCurrent();
+
+  // Create a notification with the data
+  NSDictionary *userInfo = [NSDictionary dictionaryWithObjectsAndKeys:
+                            output_ ? (NSString *)output_ : @"", RendererOutputKey,
+                            error_ ? error_ : @"", RendererErrorKey,
+                            [NSNumber numberWithInt:errorLine_], RendererErrorLineKey,
+                            log_ ? (NSString *)log_ : @"", RendererLogKey,
+                            [NSNumber numberWithDouble:[self elapsedTime]], RendererTimeKey,
+                            [NSNumber numberWithUnsignedInt:seed_], RendererSeedKey,
+                            phaseTimes_ ? (NSDictionary *)phaseTimes_ : [NSDictionary dictionary], 
+                            RendererPhaseTimesKey,
+                            nil];
+  
+  // Cleanup
+  [outputPath_ release];
+  outputPath_ = nil;
+  [taskResponse_ release];
+  taskResponse_ = nil;
+  [output_ release];
+  output_ = nil;
+  [error_ release];
+  error_ = nil;
+  errorLine_ = 0;
+  [log_ release];
+  log_ = nil;
+  [phaseTimes_ release];
+  phaseTimes_ = nil;
+  
+  if (!cancelNotifications_)
+    [center postNotificationName:RendererDidFinish object:self userInfo:userInfo];  
+}
+
+//------------------------------------------------------------------------------
+- (void)renderData:(NSNotification *)note {
+  NSData *data = [[note userInfo] objectForKey:NSFileHandleNotificationDataItem];
   
+  // An empty read is the end of the file, so the server has exited
+  if (![data length])
+    return;
+  
+  [taskResponse_ appendData:data];
+  
+  // Continue reading
+  [[note object] readInBackgroundAndNotify];
+  [self readEvents];
+}
+
+//------------------------------------------------------------------------------
+- (void)serverTerminated:(NSNotification *)note {
   // If there was any pending data, add it here
   NSData *data;
   while ((data = [[[task_ standardOutput] fileHandleForReading] availableData]) && [data length]) {
     [taskResponse_ appendData:data];
   }
+  
+  [self stopServer];
+  [self readEvents];
+  
+  if ([self isRendering]) {
+    if (!error_) {
+      error_ = [[NSString alloc] initWithFormat:@"%@ exited", kRendererName];
+      taskResponseContainedErrors_ = YES;
+    }
+    
+    [self renderFinished:nil];
+  }
+}
 
-  // There may be multiple Log and a single Error message from the renderer.
-  NSString *errorStr = @"";
-  NSMutableString *logStr = [NSMutableString string];
-  int errorLineNumber = 0;
-  NSMutableString *outputPath = [NSMutableString string];
-  NSString *outputSeparator = @"";
-  
-  if ([taskResponse_ length]) {
-    NSString *renderOutput = [[NSString alloc] initWithData:taskResponse_ encoding:NSUTF8StringEncoding];    
-    NSScanner *scanner = [NSScanner scannerWithString:renderOutput];
-    NSCharacterSet *ws = [NSCharacterSet characterSetWithCharactersInString:@" \n\r\t"];
-    NSCharacterSet *alphaNum = [NSCharacterSet alphanumericCharacterSet];
-    NSString *temp = nil;
-
-    [scanner setCharactersToBeSkipped:ws];
+//------------------------------------------------------------------------------
+// Handle each complete event as it arrives and keep only the unread remainder
+- (void)readEvents {
+  NSMutableData *response = [taskResponse_ retain];
+  NSUInteger offset = 0;
+  NSDictionary *event;
+  
+  // A progress observer may cancel (or restart) the render
+  while (response && response == taskResponse_ &&
+         (event = [RendererEvent eventFromData:response offset:&offset])) {
+    if ([[event objectForKey:RendererEventTypeKey] isEqualToString:RendererDoneEvent])
+      [self renderFinished:nil];
+    else
+      [self handleEvent:event];
+  }
+  
+  [response replaceBytesInRange:NSMakeRange(0, offset) withBytes:NULL length:0];
+  [response release];
+}
+
+//------------------------------------------------------------------------------
+- (void)handleEvent:(NSDictionary *)event {
+  NSString *type = [event objectForKey:RendererEventTypeKey];
+  
+  if ([type isEqualToString:RendererLogEvent]) {
+    if (!log_)
+      log_ = [[NSMutableString alloc] init];
     
-    NSDateFormatter *dateFormatter = [[[NSDateFormatter alloc] init] autorelease];
-    [dateFormatter setFormatterBehavior:NSDateFormatterBehavior10_4];
-    [dateFormatter setDateStyle:NSDateFormatterNoStyle];
-    [dateFormatter setDateFormat:@"hh:mm:ss.SSS"];
+    [log_ appendFormat:@"%@: %@\n", [self timeStringForEvent:event], 
+     [event objectForKey:RendererEventMessageKey]];
+  } else if ([type isEqualToString:RendererErrorEvent]) {
+    // There's only a single error from the renderer
+    [error_ release];
+    error_ = [[NSString alloc] initWithFormat:@"%@: %@", [self timeStringForEvent:event],
+              [event objectForKey:RendererEventMessageKey]];
+    errorLine_ = [[event objectForKey:RendererEventLineKey] intValue];
+    taskResponseContainedErrors_ = YES;
+  } else if ([type isEqualToString:RendererOutputEvent]) {
+    NSString *path = [NSString stringWithFormat:@"%@:%@", [event objectForKey:RendererEventScreenKey],
+                      [event objectForKey:RendererEventPathKey]];
     
-    while (![scanner isAtEnd]) {
-      BOOL foundValidInput = NO;
-      double seconds;
-      
-      // All entries should be in the form: <time> <type>:msg
-      [scanner scanDouble:&seconds];
-      [scanner scanCharactersFromSet:ws intoString:nil];
-      NSDate *date = [NSDate dateWithTimeIntervalSinceReferenceDate:seconds];
-      NSString *timeStr = [dateFormatter stringFromDate:date];
-
-      if ([scanner scanString:@"Error:" intoString:nil]) {
-        [scanner scanInt:&errorLineNumber];
-        [scanner scanUpToCharactersFromSet:alphaNum intoString:nil];
-        int currentScanLocation = [scanner scanLocation];
-        
-        if (![scanner scanUpToString:@"\n" intoString:&temp])
-          temp = [renderOutput substringFromIndex:currentScanLocation];
-        
-        errorStr = [NSString stringWithFormat:@"%@: %@", 
-                    timeStr, [temp stringByTrimmingCharactersInSet:ws]];
-        foundValidInput = YES;
-        taskResponseContainedErrors_ = YES;
-      }
-      
-      if ([scanner scanString:@"Log:" intoString:nil]) {
-        [scanner scanUpToString:@"\n" intoString:&temp];
-        temp = [temp stringByTrimmingCharactersInSet:ws];
-        [logStr appendFormat:@"%@: %@\n", timeStr, temp];
-        foundValidInput = YES;
-      }
-      
-      if ([scanner scanString:@"Seed:" intoString:nil]) {
-        long long seed;
-        [scanner scanLongLong:&seed];
-        seed_ = (unsigned long)seed;
-        [scanner scanUpToString:@"\n" intoString:nil];
-        foundValidInput = YES;
-      }
-      
-      if ([scanner scanString:@"Output:" intoString:nil]) {
-        NSString *path;
-        [scanner scanUpToString:@"\n" intoString:&path];
-        [outputPath appendFormat:@"%@%@", outputSeparator, path];
-        outputSeparator = @",";
-        foundValidInput = YES;
-      }
-      
-      if ([scanner scanString:@"Preamble:" intoString:nil]) {
-        [scanner scanUpToString:@"\n" intoString:&temp];
-        foundValidInput = YES;
-      }
-      
-      if (!foundValidInput) {
-        [logStr appendFormat:@"Unknown: %@\n", renderOutput];
-        break;
-      }
-    }
+    if (!output_)
+      output_ = [path mutableCopy];
+    else
+      [output_ appendFormat:@",%@", path];
+  } else if ([type isEqualToString:RendererSeedEvent]) {
+    seed_ = [[event objectForKey:RendererEventSeedKey] unsignedLongValue];
+  } else if ([type isEqualToString:RendererPhaseEvent]) {
+    if (!phaseTimes_)
+      phaseTimes_ = [[NSMutableDictionary alloc] init];
+    
+    [phaseTimes_ setObject:[event objectForKey:RendererEventDurationKey]
+                    forKey:[event objectForKey:RendererEventPhaseKey]];
+  } else if ([type isEqualToString:RendererProgressEvent]) {
+    progress_ = [[event objectForKey:RendererEventProgressKey] floatValue];
     
-    [renderOutput release];
+    if (!cancelNotifications_) {
+      NSDictionary *userInfo = [NSDictionary dictionaryWithObject:[NSNumber numberWithFloat:progress_]
+                                                           forKey:RendererProgressKey];
+      [[NSNotificationCenter defaultCenter] postNotificationName:RendererDidProgress object:self 
+                                                        userInfo:userInfo];
+    }
   }
+}
 
-  // Cleanup
-  [outputPath_ release];
-  outputPath_ = nil;
-  [taskResponse_ release];
-  taskResponse_ = nil;
-  [task_ release];
-  task_ = nil;
+//------------------------------------------------------------------------------
+- (NSString *)timeStringForEvent:(NSDictionary *)event {
+  static NSDateFormatter *sDateFormatter = nil;
+  
+  if (!sDateFormatter) {
+    sDateFormatter = [[NSDateFormatter alloc] init];
+    [sDateFormatter setFormatterBehavior:NSDateFormatterBehavior10_4];
+    [sDateFormatter setDateStyle:NSDateFormatterNoStyle];
+    [sDateFormatter setDateFormat:@"hh:mm:ss.SSS"];
+  }
   
-  // Create a notification with the data
-  NSDictionary *userInfo = [NSDictionary dictionaryWithObjectsAndKeys:
-                            outputPath, RendererOutputKey,
-                            errorStr, RendererErrorKey,
-                            [NSNumber numberWithInt:errorLineNumber], RendererErrorLineKey,
-                            logStr, RendererLogKey,
-                            [NSNumber numberWithDouble:[self elapsedTime]], RendererTimeKey,
-                            [NSNumber numberWithUnsignedInt:seed_], RendererSeedKey,
-                            nil];
+  double seconds = [[event objectForKey:RendererEventTimeKey] doubleValue];
+  NSDate *date = [NSDate dateWithTimeIntervalSinceReferenceDate:seconds];
   
-  if (!cancelNotifications_)
-    [center postNotificationName:RendererDidFinish object:self userInfo:userInfo];  
+  return [sDateFormatter stringFromDate:date];
 }
 
 //------------------------------------------------------------------------------
-- (void)renderData:(NSNotification *)note {
-  NSData *data = [[note userInfo] objectForKey:NSFileHandleNotificationDataItem];
+// Launch a renderer that stays running and renders each job written to it
+- (BOOL)launchServer {
+  NSString *executablePath = [self rendererExecutablePath];
   
-  if ([data length])
-    [taskResponse_ appendData:data];
+  if (!executablePath)
+    return NO;
   
-  // Continue reading
-  [[note object] readInBackgroundAndNotify];  
+  task_ = [[NSTask alloc] init];
+  [task_ setLaunchPath:executablePath];
+  [task_ setArguments:[NSArray arrayWithObject:@"-S"]];
+  
+  NSPipe *input = [NSPipe pipe];
+  [task_ setStandardInput:input];
+  
+  // A renderer that has exited closes its end of the pipe.  Writing to it
+  // should raise an exception rather than SIGPIPE killing this process.
+#ifdef F_SETNOSIGPIPE
+  fcntl([[input fileHandleForWriting] fileDescriptor], F_SETNOSIGPIPE, 1);
+#endif
+  
+  // The output is only RendererEvents.  Anything else the renderer logs goes
+  // to stderr, which is shared with this process.
+  [task_ setStandardOutput:[NSPipe pipe]];
+  
+  [task_ setEnvironment:[NSDictionary dictionaryWithObjectsAndKeys:
+                         [NSNumber numberWithInt:1], @"LSUIElement",
+                         nil]];
+  
+  // Observe the data availablity and task finishing
+  NSNotificationCenter *center = [NSNotificationCenter defaultCenter];
+  [center addObserver:self selector:@selector(renderData:) 
+                 name:NSFileHandleReadCompletionNotification 
+               object:[[task_ standardOutput] fileHandleForReading]];
+  [center addObserver:self selector:@selector(serverTerminated:)
+                 name:NSTaskDidTerminateNotification
+               object:task_];
+  [[[task_ standardOutput] fileHandleForReading] readInBackgroundAndNotify];
+  [task_ launch];
+  
+  return YES;
+}
+
+//------------------------------------------------------------------------------
+- (void)stopServer {
+  NSNotificationCenter *center = [NSNotificationCenter defaultCenter];
+  [center removeObserver:self name:NSFileHandleReadCompletionNotification object:nil];
+  [center removeObserver:self name:NSTaskDidTerminateNotification object:nil];
+  
+  if ([task_ isRunning])
+    [task_ terminate];
+  
+  [task_ release];
+  task_ = nil;
 }
 
 //------------------------------------------------------------------------------
@@ -310,10 +404,6 @@ static NSString *kRendererName = @"TopDrawRenderer";
   [outputPath_ release];
   outputPath_ = nil;
 
-  // Write the data to a temporary file using the document identifier
-  NSString *sourceName = [NSString stringWithFormat:@"%p.tds", reference_];
-  NSString *sourcePath = [NSTemporaryDirectory() stringByAppendingPathComponent:sourceName];
-  
   if (!destination_) {
     NSString *fileName = [NSString stringWithFormat:@"%p.%@", reference_, type_];
     outputPath_ = [[NSTemporaryDirectory() stringByAppendingPathComponent:fileName] retain];
@@ -323,71 +413,83 @@ static NSString *kRendererName = @"TopDrawRenderer";
   
   NSData *sourceData = [source_ dataUsingEncoding:NSUTF8StringEncoding];
   
-  if (![sourceData writeToFile:sourcePath atomically:NO]) {
-    NSLog(@"Unable to write TDS (%ld bytes) to %@ (%d)", (long)[sourceData length], sourcePath, errno);
-    return;
-  }
-  
-  // Run the script and wait for a notification of its success
+  // The job has the same settings as the command line arguments
   CGFloat quality = 1.0;
-  NSMutableArray *arguments = [NSMutableArray array];
+  NSMutableString *header = [NSMutableString string];
+  NSCharacterSet *newlines = [NSCharacterSet characterSetWithCharactersInString:@"\r\n"];
+  NSString *name = [[name_ componentsSeparatedByCharactersInSet:newlines] componentsJoinedByString:@" "];
 
-  if (disableMenubarRendering_)
-    [arguments addObject:@"-d"];
-  
-  if (shouldSplit_)
-    [arguments addObject:@"-s"];
-  
-  [arguments addObject:[NSString stringWithFormat:@"-r%ld", (long)seed_]];
-  [arguments addObject:[NSString stringWithFormat:@"-o%@", outputPath_]];
-  [arguments addObject:[NSString stringWithFormat:@"-t%@", type_]];
-  [arguments addObject:[NSString stringWithFormat:@"-q%f", quality]];
+  [header appendFormat:@"Seed: %lu\n", seed_];
+  [header appendFormat:@"Output: %@\n", outputPath_];
+  [header appendFormat:@"Type: %@\n", type_];
+  [header appendFormat:@"Quality: %f\n", quality];
+  [header appendFormat:@"Split: %d\n", shouldSplit_ ? 1 : 0];
+  [header appendFormat:@"DisableMenubar: %d\n", disableMenubarRendering_ ? 1 : 0];
   
-  if ([name_ length])
-    [arguments addObject:[NSString stringWithFormat:@"-n%@", name_]];
+  if ([name length])
+    [header appendFormat:@"Name: %@\n", name];
   
   if (size_.width > 0 && size_.height > 0) {
     NSUInteger width = floor(size_.width);
     NSUInteger height = floor(size_.height);
-    [arguments addObject:[NSString stringWithFormat:@"-m%lulx%lu", (unsigned long)width, (unsigned long)height]];
+    [header appendFormat:@"Size: %lux%lu\n", (unsigned long)width, (unsigned long)height];
   }
   
-  [arguments addObject:sourcePath];
+  [header appendFormat:@"Length: %lu\n\n", (unsigned long)[sourceData length]];
   
-  NSString *executablePath = [self rendererExecutablePath];
-  task_ = [[NSTask alloc] init];
-  [task_ setLaunchPath:executablePath];
-  [task_ setArguments:arguments];
-
-  [task_ setStandardOutput:[NSPipe pipe]];
-  [task_ setStandardError:[task_ standardOutput]];
-
-  [task_ setEnvironment:[NSDictionary dictionaryWithObjectsAndKeys:
-                         [NSNumber numberWithInt:1], @"LSUIElement",
-                         nil]];
+  // Reuse the running renderer, or start one if it isn't (or has exited)
+  if (![task_ isRunning])
+    [self stopServer];
+  
+  if (!task_ && ![self launchServer]) {
+    NSLog(@"Unable to launch %@", kRendererName);
+    return;
+  }
   
   taskResponse_ = [[NSMutableData alloc] init];
   taskResponseContainedErrors_ = NO;
+  progress_ = 0;
   
-  // Observe the data availablity and task finishing
-  NSNotificationCenter *center = [NSNotificationCenter defaultCenter];
-  [center addObserver:self selector:@selector(renderData:) 
-                 name:NSFileHandleReadCompletionNotification 
-               object:[[task_ standardOutput] fileHandleForReading]];
-  [center addObserver:self selector:@selector(renderFinished:)
-                 name:NSTaskDidTerminateNotification
-               object:task_];
-  [[[task_ standardOutput] fileHandleForReading] readInBackgroundAndNotify];
-  [task_ launch];
+  NSFileHandle *input = [[task_ standardInput] fileHandleForWriting];
+  
+#ifndef F_SETNOSIGPIPE
+  // Ignore SIGPIPE just while writing; this code also runs in the Saver's host
+  void (*previousHandler)(int) = signal(SIGPIPE, SIG_IGN);
+#endif
+  
+  @try {
+    [input writeData:[header dataUsingEncoding:NSUTF8StringEncoding]];
+    [input writeData:sourceData];
+  }
+  
+  @catch (NSException *e) {
+    // The renderer went away before it read the job.  Fail this render as if
+    // it had exited; the next one launches a new renderer.
+    NSLog(@"Unable to send job to %@: %@", kRendererName, e);
+    error_ = [[NSString alloc] initWithFormat:@"Unable to send job to %@", kRendererName];
+    taskResponseContainedErrors_ = YES;
+    [self serverTerminated:nil];
+  }
+  
+#ifndef F_SETNOSIGPIPE
+  signal(SIGPIPE, previousHandler);
+#endif
 }
 
 //------------------------------------------------------------------------------
 - (BOOL)isRendering {
-  return task_ ? YES : NO;
+  return taskResponse_ ? YES : NO;
+}
+
+//------------------------------------------------------------------------------
+- (float)progress {
+  return progress_;
 }
 
 //------------------------------------------------------------------------------
 - (void)cancelRender {
+  // Stop the renderer so that it's not working on a render that isn't wanted
+  [self stopServer];
   [self renderFinished:nil];
 }
 
@@ -398,7 +500,7 @@ static NSString *kRendererName = @"TopDrawRenderer";
   cancelNotifications_ = YES;
   [self renderInBackgroundAndNotify];
   
-  while(task_) {
+  while([self isRendering]) {
     [loop runUntilDate:[NSDate dateWithTimeIntervalSinceNow:0.1]];
   }
   
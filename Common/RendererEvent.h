@@ -0,0 +1,53 @@
+// Copyright 2008 Google Inc.
+//
+// Licensed under the Apache License, Version 2.0 (the "License"); you may not
+// use this file except in compliance with the License.  You may obtain a copy
+// of the License at
+//
+// http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS, WITHOUT
+// WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.  See the
+// License for the specific language governing permissions and limitations under
+// the License.
+
+// Events sent from the command line renderer to its client.  Each event is a
+// dictionary with a type and a time, written as a 4 byte big-endian length and
+// then a binary property list of that length.  Events are written as they
+// happen, so the client can show progress and logging before the render ends.
+
+#import <Foundation/Foundation.h>
+
+// Keys                                     // Value
+extern NSString *RendererEventTypeKey;      // NSString, one of the types below
+extern NSString *RendererEventTimeKey;      // NSNumber of the CFAbsoluteTime it was sent
+extern NSString *RendererEventMessageKey;   // NSString (Log, Error)
+extern NSString *RendererEventLineKey;      // NSNumber of the script line (Error)
+extern NSString *RendererEventProgressKey;  // NSNumber between 0 and 1 (Progress)
+extern NSString *RendererEventPhaseKey;     // NSString name of the phase (Phase)
+extern NSString *RendererEventDurationKey;  // NSNumber of seconds in the phase (Phase)
+extern NSString *RendererEventScreenKey;    // NSString screen ID or "default" (Output)
+extern NSString *RendererEventPathKey;      // NSString of the image written (Output)
+extern NSString *RendererEventSeedKey;      // NSNumber (Seed)
+
+// Types
+extern NSString *RendererLogEvent;
+extern NSString *RendererErrorEvent;
+extern NSString *RendererProgressEvent;
+extern NSString *RendererPhaseEvent;
+extern NSString *RendererOutputEvent;
+extern NSString *RendererSeedEvent;
+extern NSString *RendererDoneEvent;         // Last event of each render
+
+@interface RendererEvent : NSObject
+
+// Return |event| with its length prefix, or nil if it can't be serialized
++ (NSData *)dataWithEvent:(NSDictionary *)event;
+
+// Return the event in |data| at |offset| and advance |offset| past it.  Return
+// nil if |data| doesn't hold a complete event yet.  An event that can't be
+// read is skipped and returned as an empty dictionary.
++ (NSDictionary *)eventFromData:(NSData *)data offset:(NSUInteger *)offset;
+
+@end
@@ -0,0 +1,91 @@
+// Copyright 2008 Google Inc.
+//
+// Licensed under the Apache License, Version 2.0 (the "License"); you may not
+// use this file except in compliance with the License.  You may obtain a copy
+// of the License at
+//
+// http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS, WITHOUT
+// WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.  See the
+// License for the specific language governing permissions and limitations under
+// the License.
+
+#import "RendererEvent.h"
+
+NSString *RendererEventTypeKey = @"Type";
+NSString *RendererEventTimeKey = @"Time";
+NSString *RendererEventMessageKey = @"Message";
+NSString *RendererEventLineKey = @"Line";
+NSString *RendererEventProgressKey = @"Progress";
+NSString *RendererEventPhaseKey = @"Phase";
+NSString *RendererEventDurationKey = @"Duration";
+NSString *RendererEventScreenKey = @"Screen";
+NSString *RendererEventPathKey = @"Path";
+NSString *RendererEventSeedKey = @"Seed";
+
+NSString *RendererLogEvent = @"Log";
+NSString *RendererErrorEvent = @"Error";
+NSString *RendererProgressEvent = @"Progress";
+NSString *RendererPhaseEvent = @"Phase";
+NSString *RendererOutputEvent = @"Output";
+NSString *RendererSeedEvent = @"Seed";
+NSString *RendererDoneEvent = @"Done";
+
+static const NSUInteger kLengthSize = sizeof(uint32_t);
+
+@implementation RendererEvent
+//------------------------------------------------------------------------------
++ (NSData *)dataWithEvent:(NSDictionary *)event {
+  NSString *error = nil;
+  NSData *plist = [NSPropertyListSerialization dataFromPropertyList:event
+                                                             format:NSPropertyListBinaryFormat_v1_0
+                                                   errorDescription:&error];
+  
+  if (!plist) {
+    MethodLog("Unable to serialize %@: %@", event, error);
+    [error release];
+    return nil;
+  }
+  
+  uint32_t length = CFSwapInt32HostToBig((uint32_t)[plist length]);
+  NSMutableData *data = [NSMutableData dataWithCapacity:kLengthSize + [plist length]];
+  [data appendBytes:&length length:kLengthSize];
+  [data appendData:plist];
+  
+  return data;
+}
+
+//------------------------------------------------------------------------------
++ (NSDictionary *)eventFromData:(NSData *)data offset:(NSUInteger *)offset {
+  NSUInteger available = [data length] - *offset;
+  uint32_t length;
+  
+  if (available < kLengthSize)
+    return nil;
+  
+  [data getBytes:&length range:NSMakeRange(*offset, kLengthSize)];
+  length = CFSwapInt32BigToHost(length);
+  
+  if (available - kLengthSize < length)
+    return nil;
+  
+  NSData *plist = [data subdataWithRange:NSMakeRange(*offset + kLengthSize, length)];
+  NSString *error = nil;
+  id event = [NSPropertyListSerialization propertyListFromData:plist
+                                              mutabilityOption:NSPropertyListImmutable
+                                                        format:NULL
+                                              errorDescription:&error];
+  *offset += kLengthSize + length;
+  
+  if (![event isKindOfClass:[NSDictionary class]]) {
+    MethodLog("Invalid event: %@", error);
+    [error release];
+    return [NSDictionary dictionary];
+  }
+  
+  return event;
+}
+
+@end
@@ -0,0 +1,66 @@
+// Copyright 2008 Google Inc.
+//
+// Licensed under the Apache License, Version 2.0 (the "License"); you may not
+// use this file except in compliance with the License.  You may obtain a copy
+// of the License at
+//
+// http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS, WITHOUT
+// WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.  See the
+// License for the specific language governing permissions and limitations under
+// the License.
+
+#include "ColoredRectCore.h"
+
+static inline float Clamp(float v) {
+  return v < 0 ? 0 : (v > 1 ? 1 : v);
+}
+
+//------------------------------------------------------------------------------
+void ColoredRectFill(const ColoredRectParameters *params) {
+  size_t width = params->width;
+  size_t height = params->height;
+  float c[4][4];
+  
+  if (!width || !height)
+    return;
+  
+  // Premultiply the corners
+  for (int i = 0; i < 4; ++i) {
+    float alpha = Clamp(params->corners[i][3]);
+    
+    for (int k = 0; k < 3; ++k)
+      c[i][k] = Clamp(params->corners[i][k]) * alpha;
+    
+    c[i][3] = alpha;
+  }
+  
+  float invWidth = 1.0f / width;
+  
+  for (size_t row = 0; row < height; ++row) {
+    // Row 0 is the top, so it's closest to the top colors
+    float ty = (height - row - 0.5f) / height;
+    float left[4], delta[4];
+    uint8_t *pixel = params->pixels + row * params->rowBytes;
+    
+    for (int k = 0; k < 4; ++k) {
+      float l = c[kColoredRectBottomLeft][k] + 
+        (c[kColoredRectTopLeft][k] - c[kColoredRectBottomLeft][k]) * ty;
+      float r = c[kColoredRectBottomRight][k] + 
+        (c[kColoredRectTopRight][k] - c[kColoredRectBottomRight][k]) * ty;
+      
+      // Scaled to bytes, with 0.5 added for rounding
+      left[k] = l * 255.0f + 0.5f;
+      delta[k] = (r - l) * 255.0f;
+    }
+    
+    for (size_t x = 0; x < width; ++x, pixel += 4) {
+      float tx = (x + 0.5f) * invWidth;
+      
+      for (int k = 0; k < 4; ++k)
+        pixel[k] = (uint8_t)(left[k] + delta[k] * tx);
+    }
+  }
+}
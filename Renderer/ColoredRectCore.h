@@ -0,0 +1,52 @@
+// Copyright 2008 Google Inc.
+//
+// Licensed under the Apache License, Version 2.0 (the "License"); you may not
+// use this file except in compliance with the License.  You may obtain a copy
+// of the License at
+//
+// http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS, WITHOUT
+// WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.  See the
+// License for the specific language governing permissions and limitations under
+// the License.
+
+// Fill a pixel buffer with the bilinear blend of four corner colors, as in
+// Layer's coloredRect().  Each pixel is sampled at its center and the colors
+// are interpolated premultiplied.  The inner loop is written so that the
+// compiler can vectorize it.
+
+#ifndef COLOREDRECTCORE_H
+#define COLOREDRECTCORE_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+// Corner indexes, in the order that coloredRect() takes them
+enum {
+  kColoredRectBottomLeft = 0,
+  kColoredRectTopLeft,
+  kColoredRectTopRight,
+  kColoredRectBottomRight
+};
+
+typedef struct {
+  uint8_t *pixels;        // Premultiplied RGBA.  Row 0 is the top.
+  size_t width;
+  size_t height;
+  size_t rowBytes;
+  float corners[4][4];    // RGBA [0, 1], not premultiplied
+} ColoredRectParameters;
+
+void ColoredRectFill(const ColoredRectParameters *params);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif  // COLOREDRECTCORE_H
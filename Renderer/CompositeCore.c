@@ -0,0 +1,379 @@
+// Copyright 2008 Google Inc.
+//
+// Licensed under the Apache License, Version 2.0 (the "License"); you may not
+// use this file except in compliance with the License.  You may obtain a copy
+// of the License at
+//
+// http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS, WITHOUT
+// WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.  See the
+// License for the specific language governing permissions and limitations under
+// the License.
+
+#include <math.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "CompositeCore.h"
+
+// Rows per WorkQueue task
+#define kCompositeBandRows 32
+
+typedef struct {
+  const CompositeParameters *params;
+  int shifts[4];          // Bit positions of red, green, blue and alpha
+  size_t srcX;            // First overlapping column of the source
+  size_t dstX;
+  size_t columns;
+  size_t srcRow;          // First overlapping row of the source
+  size_t dstRow;
+  size_t rows;
+  float *scratch;         // 8 floats per column for each worker
+} CompositeContext;
+
+typedef void (*BlendFunction)(float *d, const float *s, size_t count);
+
+//------------------------------------------------------------------------------
+static inline float SoftLightD(float cb) {
+  return cb <= 0.25f ? ((16 * cb - 12) * cb + 4) * cb : sqrtf(cb);
+}
+
+// Blend the unpremultiplied colors with |expr| of |cb| (backdrop) and |cs|
+// (source), then composite source-over
+#define SeparableBlend(name, expr) \
+static void name(float *d, const float *s, size_t count) { \
+  for (size_t i = 0; i < count; ++i, d += 4, s += 4) { \
+    float sa = s[3], da = d[3]; \
+    float isa = sa > 0 ? 1 / sa : 0, ida = da > 0 ? 1 / da : 0; \
+    for (int k = 0; k < 3; ++k) { \
+      float cs = fminf(s[k] * isa, 1), cb = fminf(d[k] * ida, 1); \
+      d[k] = s[k] * (1 - da) + d[k] * (1 - sa) + sa * da * (expr); \
+    } \
+    d[3] = sa + da - sa * da; \
+  } \
+}
+
+SeparableBlend(BlendMultiply, cb * cs)
+SeparableBlend(BlendScreen, cb + cs - cb * cs)
+SeparableBlend(BlendOverlay, cb <= 0.5f ? 2 * cb * cs : 1 - 2 * (1 - cb) * (1 - cs))
+SeparableBlend(BlendDarken, fminf(cb, cs))
+SeparableBlend(BlendLighten, fmaxf(cb, cs))
+SeparableBlend(BlendColorDodge, cb <= 0 ? 0 : (cs >= 1 ? 1 : fminf(1, cb / (1 - cs))))
+SeparableBlend(BlendColorBurn, cb >= 1 ? 1 : (cs <= 0 ? 0 : 1 - fminf(1, (1 - cb) / cs)))
+SeparableBlend(BlendSoftLight, cs <= 0.5f ? cb - (1 - 2 * cs) * cb * (1 - cb) :
+               cb + (2 * cs - 1) * (SoftLightD(cb) - cb))
+SeparableBlend(BlendHardLight, cs <= 0.5f ? 2 * cb * cs : 1 - 2 * (1 - cb) * (1 - cs))
+SeparableBlend(BlendDifference, fabsf(cb - cs))
+SeparableBlend(BlendExclusion, cb + cs - 2 * cb * cs)
+
+#undef SeparableBlend
+
+//------------------------------------------------------------------------------
+static inline float Lum(const float *c) {
+  return 0.3f * c[0] + 0.59f * c[1] + 0.11f * c[2];
+}
+
+static inline float Sat(const float *c) {
+  return fmaxf(c[0], fmaxf(c[1], c[2])) - fminf(c[0], fminf(c[1], c[2]));
+}
+
+static void ClipColor(float *c) {
+  float l = Lum(c);
+  float n = fminf(c[0], fminf(c[1], c[2]));
+  float x = fmaxf(c[0], fmaxf(c[1], c[2]));
+  
+  for (int k = 0; k < 3; ++k) {
+    if (n < 0)
+      c[k] = l + (c[k] - l) * l / (l - n);
+    if (x > 1)
+      c[k] = l + (c[k] - l) * (1 - l) / (x - l);
+  }
+}
+
+static void SetLum(float *c, float l) {
+  float delta = l - Lum(c);
+  
+  for (int k = 0; k < 3; ++k)
+    c[k] += delta;
+  
+  ClipColor(c);
+}
+
+static void SetSat(float *c, float s) {
+  int max = 0, min = 0, mid;
+  
+  for (int k = 1; k < 3; ++k) {
+    if (c[k] > c[max])
+      max = k;
+    if (c[k] < c[min])
+      min = k;
+  }
+  
+  if (max == min) {
+    c[0] = c[1] = c[2] = 0;
+    return;
+  }
+  
+  mid = 3 - max - min;
+  c[mid] = (c[mid] - c[min]) * s / (c[max] - c[min]);
+  c[max] = s;
+  c[min] = 0;
+}
+
+static void BlendNonSeparable(float *d, const float *s, size_t count, CompositeMode mode) {
+  for (size_t i = 0; i < count; ++i, d += 4, s += 4) {
+    float sa = s[3], da = d[3];
+    float isa = sa > 0 ? 1 / sa : 0, ida = da > 0 ? 1 / da : 0;
+    float cs[3], cb[3], b[3];
+    
+    for (int k = 0; k < 3; ++k) {
+      cs[k] = fminf(s[k] * isa, 1);
+      cb[k] = fminf(d[k] * ida, 1);
+    }
+    
+    switch (mode) {
+      case kCompositeHue:
+        memcpy(b, cs, sizeof(b));
+        SetSat(b, Sat(cb));
+        SetLum(b, Lum(cb));
+        break;
+      case kCompositeSaturation:
+        memcpy(b, cb, sizeof(b));
+        SetSat(b, Sat(cs));
+        SetLum(b, Lum(cb));
+        break;
+      case kCompositeColor:
+        memcpy(b, cs, sizeof(b));
+        SetLum(b, Lum(cb));
+        break;
+      default: // kCompositeLuminosity
+        memcpy(b, cb, sizeof(b));
+        SetLum(b, Lum(cs));
+        break;
+    }
+    
+    for (int k = 0; k < 3; ++k)
+      d[k] = s[k] * (1 - da) + d[k] * (1 - sa) + sa * da * b[k];
+    
+    d[3] = sa + da - sa * da;
+  }
+}
+
+#define NonSeparableBlend(name, mode) \
+static void name(float *d, const float *s, size_t count) { \
+  BlendNonSeparable(d, s, count, mode); \
+}
+
+NonSeparableBlend(BlendHue, kCompositeHue)
+NonSeparableBlend(BlendSaturation, kCompositeSaturation)
+NonSeparableBlend(BlendColor, kCompositeColor)
+NonSeparableBlend(BlendLuminosity, kCompositeLuminosity)
+
+#undef NonSeparableBlend
+
+//------------------------------------------------------------------------------
+static void BlendClear(float *d, const float *s, size_t count) {
+  (void)s;
+  memset(d, 0, sizeof(float) * 4 * count);
+}
+
+//------------------------------------------------------------------------------
+// |expr| of the premultiplied |sc|, |dc| and the alphas, for every channel
+#define PorterDuffBlend(name, expr) \
+static void name(float *d, const float *s, size_t count) { \
+  for (size_t i = 0; i < count; ++i, d += 4, s += 4) { \
+    float sa = s[3], da = d[3]; \
+    (void)sa; (void)da; \
+    for (int k = 0; k < 4; ++k) { \
+      float sc = s[k], dc = d[k]; \
+      (void)sc; (void)dc; \
+      d[k] = (expr); \
+    } \
+  } \
+}
+
+PorterDuffBlend(BlendSourceIn, sc * da)
+PorterDuffBlend(BlendSourceOut, sc * (1 - da))
+PorterDuffBlend(BlendSourceAtop, sc * da + dc * (1 - sa))
+PorterDuffBlend(BlendDestinationOver, sc * (1 - da) + dc)
+PorterDuffBlend(BlendDestinationIn, dc * sa)
+PorterDuffBlend(BlendDestinationOut, dc * (1 - sa))
+PorterDuffBlend(BlendDestinationAtop, sc * (1 - da) + dc * sa)
+PorterDuffBlend(BlendXOR, sc * (1 - da) + dc * (1 - sa))
+PorterDuffBlend(BlendPlusLighter, fminf(1, sc + dc))
+
+// R = MAX(0, 1 - ((1 - D) + (1 - S))) for opaque colors.  With premultiplied
+// colors, 1 is the result alpha and the inverted colors are taken from each
+// alpha so that transparent pixels have no effect.
+PorterDuffBlend(BlendPlusDarker, fmaxf(0, (sa + da - sa * da) - ((da - dc) + (sa - sc))))
+
+#undef PorterDuffBlend
+
+//------------------------------------------------------------------------------
+static BlendFunction BlendFunctionForMode(CompositeMode mode) {
+  switch (mode) {
+    case kCompositeMultiply: return BlendMultiply;
+    case kCompositeScreen: return BlendScreen;
+    case kCompositeOverlay: return BlendOverlay;
+    case kCompositeDarken: return BlendDarken;
+    case kCompositeLighten: return BlendLighten;
+    case kCompositeColorDodge: return BlendColorDodge;
+    case kCompositeColorBurn: return BlendColorBurn;
+    case kCompositeSoftLight: return BlendSoftLight;
+    case kCompositeHardLight: return BlendHardLight;
+    case kCompositeDifference: return BlendDifference;
+    case kCompositeExclusion: return BlendExclusion;
+    case kCompositeHue: return BlendHue;
+    case kCompositeSaturation: return BlendSaturation;
+    case kCompositeColor: return BlendColor;
+    case kCompositeLuminosity: return BlendLuminosity;
+    case kCompositeClear: return BlendClear;
+    case kCompositeSourceIn: return BlendSourceIn;
+    case kCompositeSourceOut: return BlendSourceOut;
+    case kCompositeSourceAtop: return BlendSourceAtop;
+    case kCompositeDestinationOver: return BlendDestinationOver;
+    case kCompositeDestinationIn: return BlendDestinationIn;
+    case kCompositeDestinationOut: return BlendDestinationOut;
+    case kCompositeDestinationAtop: return BlendDestinationAtop;
+    case kCompositeXOR: return BlendXOR;
+    case kCompositePlusDarker: return BlendPlusDarker;
+    case kCompositePlusLighter: return BlendPlusLighter;
+    default: return NULL;
+  }
+}
+
+//------------------------------------------------------------------------------
+static void Unpack(float *f, const uint32_t *pixels, size_t count, const int *shifts) {
+  const float scale = 1.0f / 255.0f;
+  
+  for (size_t i = 0; i < count; ++i, f += 4) {
+    uint32_t p = pixels[i];
+    
+    for (int k = 0; k < 4; ++k)
+      f[k] = ((p >> shifts[k]) & 0xFF) * scale;
+  }
+}
+
+//------------------------------------------------------------------------------
+static void Pack(uint32_t *pixels, const float *f, size_t count, const int *shifts) {
+  for (size_t i = 0; i < count; ++i, f += 4) {
+    uint32_t p = 0;
+    
+    for (int k = 0; k < 4; ++k) {
+      float v = f[k] < 0 ? 0 : (f[k] > 1 ? 1 : f[k]);
+      p |= (uint32_t)(v * 255.0f + 0.5f) << shifts[k];
+    }
+    
+    pixels[i] = p;
+  }
+}
+
+//------------------------------------------------------------------------------
+// Scale each of the four bytes of |p| by |alpha| / 255, rounded, two at a time
+static inline uint32_t ScalePixel(uint32_t p, uint32_t alpha) {
+  uint32_t rb = (p & 0x00FF00FF) * alpha + 0x00800080;
+  uint32_t ag = ((p >> 8) & 0x00FF00FF) * alpha + 0x00800080;
+  
+  rb = ((rb + ((rb >> 8) & 0x00FF00FF)) >> 8) & 0x00FF00FF;
+  ag = (ag + ((ag >> 8) & 0x00FF00FF)) & 0xFF00FF00;
+  
+  return rb | ag;
+}
+
+//------------------------------------------------------------------------------
+static void CompositeNormalRow(uint32_t *d, const uint32_t *s, size_t count, int alphaShift) {
+  for (size_t i = 0; i < count; ++i) {
+    uint32_t sa = (s[i] >> alphaShift) & 0xFF;
+    
+    // A valid premultiplied pixel can't overflow a channel
+    if (sa == 0xFF)
+      d[i] = s[i];
+    else if (sa || s[i])
+      d[i] = s[i] + ScalePixel(d[i], 0xFF - sa);
+  }
+}
+
+//------------------------------------------------------------------------------
+static void CompositeBand(void *context, size_t index, int worker) {
+  CompositeContext *composite = (CompositeContext *)context;
+  const CompositeParameters *params = composite->params;
+  size_t start = index * kCompositeBandRows;
+  size_t end = start + kCompositeBandRows;
+  size_t columns = composite->columns;
+  BlendFunction blend = BlendFunctionForMode(params->mode);
+  float *dstFloats = composite->scratch + (size_t)worker * columns * 8;
+  float *srcFloats = dstFloats + columns * 4;
+  
+  if (end > composite->rows)
+    end = composite->rows;
+  
+  for (size_t row = start; row < end; ++row) {
+    uint32_t *d = params->destination.pixels + 
+      (composite->dstRow + row) * params->destination.rowPixels + composite->dstX;
+    const uint32_t *s = params->source.pixels + 
+      (composite->srcRow + row) * params->source.rowPixels + composite->srcX;
+    
+    if (params->mode == kCompositeNormal) {
+      CompositeNormalRow(d, s, columns, composite->shifts[3]);
+    } else if (params->mode == kCompositeCopy) {
+      memcpy(d, s, columns * sizeof(uint32_t));
+    } else if (blend) {
+      Unpack(dstFloats, d, columns, composite->shifts);
+      Unpack(srcFloats, s, columns, composite->shifts);
+      blend(dstFloats, srcFloats, columns);
+      Pack(d, dstFloats, columns, composite->shifts);
+    }
+  }
+}
+
+//------------------------------------------------------------------------------
+void CompositeBuffers(const CompositeParameters *params, WorkQueue *queue) {
+  const CompositeBuffer *dst = &params->destination;
+  const CompositeBuffer *src = &params->source;
+  CompositeContext context;
+  union { uint32_t word; uint8_t bytes[4]; } endian = { 1 };
+  
+  memset(&context, 0, sizeof(context));
+  context.params = params;
+  
+  // Convert the byte offsets to the bit positions in a native word
+  for (int k = 0; k < 4; ++k)
+    context.shifts[k] = endian.bytes[0] ? params->offsets[k] * 8 : 24 - params->offsets[k] * 8;
+  
+  // Columns of the overlap
+  long left = params->x < 0 ? 0 : params->x;
+  long right = params->x + (long)src->width;
+  
+  if (right > (long)dst->width)
+    right = dst->width;
+  
+  // Rows, from the top.  The source's top row is at this destination row:
+  long top = (long)dst->height - params->y - (long)src->height;
+  long first = top < 0 ? 0 : top;
+  long last = top + (long)src->height;
+  
+  if (last > (long)dst->height)
+    last = dst->height;
+  
+  if (left >= right || first >= last)
+    return;
+  
+  context.dstX = left;
+  context.srcX = left - params->x;
+  context.columns = right - left;
+  context.dstRow = first;
+  context.srcRow = first - top;
+  context.rows = last - first;
+  
+  int threads = queue ? WorkQueueThreadCount(queue) : 1;
+  context.scratch = (float *)malloc(sizeof(float) * context.columns * 8 * threads);
+  
+  if (!context.scratch)
+    return;
+  
+  size_t bands = (context.rows + kCompositeBandRows - 1) / kCompositeBandRows;
+  WorkQueueApply(queue, bands, CompositeBand, &context);
+  free(context.scratch);
+}
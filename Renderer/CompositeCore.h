@@ -0,0 +1,92 @@
+// Copyright 2008 Google Inc.
+//
+// Licensed under the Apache License, Version 2.0 (the "License"); you may not
+// use this file except in compliance with the License.  You may obtain a copy
+// of the License at
+//
+// http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS, WITHOUT
+// WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.  See the
+// License for the specific language governing permissions and limitations under
+// the License.
+
+// Composite one 32-bit premultiplied pixel buffer onto another with any of the
+// blend modes that Layer supports.  The blend modes follow the PDF / Canvas
+// compositing definitions that Quartz uses: the separable and non-separable
+// modes are blended with the unpremultiplied colors and then composited
+// source-over; the Porter-Duff modes work on the premultiplied colors.
+//
+// The rows are split into bands that are composited on a WorkQueue.  Each row
+// is unpacked into floats, blended by a loop for its mode, and packed again,
+// so that the compiler can vectorize the blending.  Normal and copy have
+// integer fast paths.
+
+#ifndef COMPOSITECORE_H
+#define COMPOSITECORE_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+#include "WorkQueue.h"
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+typedef enum {
+  kCompositeNormal,
+  kCompositeMultiply,
+  kCompositeScreen,
+  kCompositeOverlay,
+  kCompositeDarken,
+  kCompositeLighten,
+  kCompositeColorDodge,
+  kCompositeColorBurn,
+  kCompositeSoftLight,
+  kCompositeHardLight,
+  kCompositeDifference,
+  kCompositeExclusion,
+  kCompositeHue,
+  kCompositeSaturation,
+  kCompositeColor,
+  kCompositeLuminosity,
+  kCompositeClear,
+  kCompositeCopy,
+  kCompositeSourceIn,
+  kCompositeSourceOut,
+  kCompositeSourceAtop,
+  kCompositeDestinationOver,
+  kCompositeDestinationIn,
+  kCompositeDestinationOut,
+  kCompositeDestinationAtop,
+  kCompositeXOR,
+  kCompositePlusDarker,
+  kCompositePlusLighter
+} CompositeMode;
+
+typedef struct {
+  uint32_t *pixels;       // Row 0 is the top
+  size_t width;
+  size_t height;
+  size_t rowPixels;       // Distance between rows, in pixels
+} CompositeBuffer;
+
+typedef struct {
+  CompositeBuffer destination;
+  CompositeBuffer source;
+  long x;                 // Bottom left of |source| in |destination|, with y up
+  long y;
+  CompositeMode mode;
+  int offsets[4];         // Byte offsets of red, green, blue and alpha in a pixel
+} CompositeParameters;
+
+// Composite the part of |source| that overlaps |destination|
+void CompositeBuffers(const CompositeParameters *params, WorkQueue *queue);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif  // COMPOSITECORE_H
@@ -0,0 +1,244 @@
+// Copyright 2008 Google Inc.
+//
+// Licensed under the Apache License, Version 2.0 (the "License"); you may not
+// use this file except in compliance with the License.  You may obtain a copy
+// of the License at
+//
+// http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS, WITHOUT
+// WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.  See the
+// License for the specific language governing permissions and limitations under
+// the License.
+
+// Checks CompositeCore against Quartz, which is what Layer used before.  For
+// every blend mode, random premultiplied pixels are composited both by
+// CompositeBuffers() and by drawing the source into a CGBitmapContext with the
+// matching CGBlendMode, in RGBA and ARGB byte orders and with the source partly
+// outside of the destination.  Every channel of the two results must agree to
+// within the tolerance.  It isn't part of the Xcode targets; build it on Mac OS
+// X with:
+//
+//   cc -O3 -std=c99 -o CompositeCoreQuartzTest CompositeCoreQuartzTest.c
+//     CompositeCore.c WorkQueue.c -framework ApplicationServices
+//
+// Exits with a nonzero status if any mode is out of tolerance.
+
+#include <ApplicationServices/ApplicationServices.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "CompositeCore.h"
+
+// Largest difference allowed in any channel, in 8-bit levels.  Quartz blends
+// in 8 bits, so it rounds more than CompositeCore does.
+#define kTolerance 3
+
+typedef struct {
+  CompositeMode mode;
+  CGBlendMode blendMode;
+  const char *name;
+} TestMode;
+
+static const TestMode kModes[] = {
+  { kCompositeNormal, kCGBlendModeNormal, "normal" },
+  { kCompositeMultiply, kCGBlendModeMultiply, "multiply" },
+  { kCompositeScreen, kCGBlendModeScreen, "screen" },
+  { kCompositeOverlay, kCGBlendModeOverlay, "overlay" },
+  { kCompositeDarken, kCGBlendModeDarken, "darken" },
+  { kCompositeLighten, kCGBlendModeLighten, "lighten" },
+  { kCompositeColorDodge, kCGBlendModeColorDodge, "colorDodge" },
+  { kCompositeColorBurn, kCGBlendModeColorBurn, "colorBurn" },
+  { kCompositeSoftLight, kCGBlendModeSoftLight, "softLight" },
+  { kCompositeHardLight, kCGBlendModeHardLight, "hardLight" },
+  { kCompositeDifference, kCGBlendModeDifference, "difference" },
+  { kCompositeExclusion, kCGBlendModeExclusion, "exclusion" },
+  { kCompositeHue, kCGBlendModeHue, "hue" },
+  { kCompositeSaturation, kCGBlendModeSaturation, "saturation" },
+  { kCompositeColor, kCGBlendModeColor, "color" },
+  { kCompositeLuminosity, kCGBlendModeLuminosity, "luminosity" },
+  { kCompositeClear, kCGBlendModeClear, "clear" },
+  { kCompositeCopy, kCGBlendModeCopy, "copy" },
+  { kCompositeSourceIn, kCGBlendModeSourceIn, "sourceIn" },
+  { kCompositeSourceOut, kCGBlendModeSourceOut, "sourceOut" },
+  { kCompositeSourceAtop, kCGBlendModeSourceAtop, "sourceAtop" },
+  { kCompositeDestinationOver, kCGBlendModeDestinationOver, "destinationOver" },
+  { kCompositeDestinationIn, kCGBlendModeDestinationIn, "destinationIn" },
+  { kCompositeDestinationOut, kCGBlendModeDestinationOut, "destinationOut" },
+  { kCompositeDestinationAtop, kCGBlendModeDestinationAtop, "destinationAtop" },
+  { kCompositeXOR, kCGBlendModeXOR, "xor" },
+  { kCompositePlusDarker, kCGBlendModePlusDarker, "plusDarker" },
+  { kCompositePlusLighter, kCGBlendModePlusLighter, "plusLighter" },
+};
+
+#define kModeCount (sizeof(kModes) / sizeof(kModes[0]))
+
+typedef struct {
+  const char *name;
+  int offsets[4];
+  CGBitmapInfo bitmapInfo;
+} TestLayout;
+
+static const TestLayout kLayouts[] = {
+  { "RGBA", { 0, 1, 2, 3 }, kCGImageAlphaPremultipliedLast | kCGBitmapByteOrder32Big },
+  { "ARGB", { 1, 2, 3, 0 }, kCGImageAlphaPremultipliedFirst | kCGBitmapByteOrder32Big },
+};
+
+#define kLayoutCount (sizeof(kLayouts) / sizeof(kLayouts[0]))
+
+//------------------------------------------------------------------------------
+static uint32_t Random(uint32_t *state) {
+  uint32_t x = *state;
+  
+  x ^= x << 13;
+  x ^= x >> 17;
+  x ^= x << 5;
+  
+  return *state = x;
+}
+
+//------------------------------------------------------------------------------
+// A valid premultiplied pixel, with transparent and opaque pixels common
+static uint32_t RandomPixel(uint32_t *state, const int *offsets) {
+  uint32_t r = Random(state), pixel;
+  uint8_t *bytes = (uint8_t *)&pixel;
+  int alpha;
+  
+  switch (r & 7) {
+    case 0: alpha = 0; break;
+    case 1: case 2: alpha = 255; break;
+    default: alpha = (r >> 8) & 0xFF; break;
+  }
+  
+  for (int k = 0; k < 3; ++k)
+    bytes[offsets[k]] = (uint8_t)(Random(state) % (alpha + 1));
+  
+  bytes[offsets[3]] = (uint8_t)alpha;
+  
+  return pixel;
+}
+
+//------------------------------------------------------------------------------
+// Draw |src| into |dst| with Quartz, at (x, y) with y up.  Returns 0 if the
+// context or image couldn't be made.
+static int QuartzComposite(const TestMode *mode, const TestLayout *layout, uint32_t *dst,
+                           size_t dstWidth, size_t dstHeight, const uint32_t *src,
+                           size_t srcWidth, size_t srcHeight, long x, long y) {
+  CGColorSpaceRef cs = CGColorSpaceCreateDeviceRGB();
+  CGContextRef context = CGBitmapContextCreate(dst, dstWidth, dstHeight, 8, dstWidth * 4, cs,
+                                               layout->bitmapInfo);
+  CGDataProviderRef provider = CGDataProviderCreateWithData(NULL, src, 
+                                                            srcWidth * srcHeight * 4, NULL);
+  CGImageRef image = NULL;
+  
+  if (provider)
+    image = CGImageCreate(srcWidth, srcHeight, 8, 32, srcWidth * 4, cs, layout->bitmapInfo,
+                          provider, NULL, false, kCGRenderingIntentDefault);
+  
+  if (context && image) {
+    CGContextSetInterpolationQuality(context, kCGInterpolationNone);
+    CGContextSetBlendMode(context, mode->blendMode);
+    CGContextDrawImage(context, CGRectMake(x, y, srcWidth, srcHeight), image);
+  }
+  
+  int ok = context && image;
+  
+  CGImageRelease(image);
+  CGDataProviderRelease(provider);
+  CGContextRelease(context);
+  CGColorSpaceRelease(cs);
+  
+  return ok;
+}
+
+//------------------------------------------------------------------------------
+// Largest channel difference between CompositeCore and Quartz, or -1 if Quartz
+// couldn't draw
+static int CheckMode(const TestMode *mode, const TestLayout *layout) {
+  const size_t dstWidth = 67, dstHeight = 45, srcWidth = 50, srcHeight = 40;
+  const long x = -5, y = 10;
+  uint32_t state = 0x9E3779B9u ^ (uint32_t)mode->mode;
+  uint32_t core[dstWidth * dstHeight], quartz[dstWidth * dstHeight], src[srcWidth * srcHeight];
+  CompositeParameters params;
+  int maxError = 0;
+  
+  for (size_t i = 0; i < dstWidth * dstHeight; ++i)
+    core[i] = quartz[i] = RandomPixel(&state, layout->offsets);
+  
+  for (size_t i = 0; i < srcWidth * srcHeight; ++i)
+    src[i] = RandomPixel(&state, layout->offsets);
+  
+  if (!QuartzComposite(mode, layout, quartz, dstWidth, dstHeight, src, srcWidth, srcHeight,
+                       x, y))
+    return -1;
+  
+  memset(&params, 0, sizeof(params));
+  params.destination.pixels = core;
+  params.destination.width = dstWidth;
+  params.destination.height = dstHeight;
+  params.destination.rowPixels = dstWidth;
+  params.source.pixels = src;
+  params.source.width = srcWidth;
+  params.source.height = srcHeight;
+  params.source.rowPixels = srcWidth;
+  params.x = x;
+  params.y = y;
+  params.mode = mode->mode;
+  memcpy(params.offsets, layout->offsets, sizeof(params.offsets));
+  CompositeBuffers(&params, NULL);
+  
+  // Only the part under the source is compared.  CompositeCoreTest checks that
+  // the rest is untouched.
+  long top = (long)dstHeight - y - (long)srcHeight;
+  long firstRow = top < 0 ? 0 : top, lastRow = top + (long)srcHeight;
+  long firstCol = x < 0 ? 0 : x, lastCol = x + (long)srcWidth;
+  
+  if (lastRow > (long)dstHeight)
+    lastRow = (long)dstHeight;
+  
+  if (lastCol > (long)dstWidth)
+    lastCol = (long)dstWidth;
+  
+  for (long row = firstRow; row < lastRow; ++row) {
+    for (long col = firstCol; col < lastCol; ++col) {
+      const uint8_t *a = (const uint8_t *)&core[row * dstWidth + col];
+      const uint8_t *b = (const uint8_t *)&quartz[row * dstWidth + col];
+      
+      for (int k = 0; k < 4; ++k) {
+        int error = abs((int)a[k] - (int)b[k]);
+        
+        if (error > maxError)
+          maxError = error;
+      }
+    }
+  }
+  
+  return maxError;
+}
+
+//------------------------------------------------------------------------------
+int main(void) {
+  int failed = 0;
+  
+  printf("tolerance %d\n", kTolerance);
+  
+  for (size_t m = 0; m < kModeCount; ++m) {
+    int ok = 1;
+    
+    printf("%-16s", kModes[m].name);
+    
+    for (size_t l = 0; l < kLayoutCount; ++l) {
+      int error = CheckMode(&kModes[m], &kLayouts[l]);
+      
+      printf(" %s error %2d", kLayouts[l].name, error);
+      ok &= error >= 0 && error <= kTolerance;
+    }
+    
+    printf("  %s\n", ok ? "ok" : "FAILED");
+    failed |= !ok;
+  }
+  
+  return failed;
+}
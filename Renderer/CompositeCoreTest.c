@@ -0,0 +1,500 @@
+// Copyright 2008 Google Inc.
+//
+// Licensed under the Apache License, Version 2.0 (the "License"); you may not
+// use this file except in compliance with the License.  You may obtain a copy
+// of the License at
+//
+// http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS, WITHOUT
+// WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.  See the
+// License for the specific language governing permissions and limitations under
+// the License.
+
+// Standalone test and benchmark for CompositeCore.  Every blend mode is run
+// on random premultiplied pixels, in RGBA and ARGB byte orders and with the
+// source partly outside of the destination, and each channel is checked
+// against the PDF / W3C compositing formulas evaluated in doubles.  The
+// results on one thread and on a 4 thread WorkQueue must be identical, and
+// pixels outside of the source must be untouched.  Each mode is then timed at
+// 1080p.  It isn't part of the Xcode targets; build it anywhere with:
+//
+//   cc -O3 -std=c99 -D_POSIX_C_SOURCE=200809L -o CompositeCoreTest
+//     CompositeCoreTest.c CompositeCore.c WorkQueue.c -lpthread -lm
+//
+// Usage: CompositeCoreTest [iterations]
+//
+// Exits with a nonzero status if any mode is out of tolerance.
+
+#include <math.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include "CompositeCore.h"
+
+// Largest difference allowed in any channel, in 8-bit levels
+#define kTolerance 2
+
+typedef struct {
+  CompositeMode mode;
+  const char *name;
+} TestMode;
+
+static const TestMode kModes[] = {
+  { kCompositeNormal, "normal" },
+  { kCompositeMultiply, "multiply" },
+  { kCompositeScreen, "screen" },
+  { kCompositeOverlay, "overlay" },
+  { kCompositeDarken, "darken" },
+  { kCompositeLighten, "lighten" },
+  { kCompositeColorDodge, "colorDodge" },
+  { kCompositeColorBurn, "colorBurn" },
+  { kCompositeSoftLight, "softLight" },
+  { kCompositeHardLight, "hardLight" },
+  { kCompositeDifference, "difference" },
+  { kCompositeExclusion, "exclusion" },
+  { kCompositeHue, "hue" },
+  { kCompositeSaturation, "saturation" },
+  { kCompositeColor, "color" },
+  { kCompositeLuminosity, "luminosity" },
+  { kCompositeClear, "clear" },
+  { kCompositeCopy, "copy" },
+  { kCompositeSourceIn, "sourceIn" },
+  { kCompositeSourceOut, "sourceOut" },
+  { kCompositeSourceAtop, "sourceAtop" },
+  { kCompositeDestinationOver, "destinationOver" },
+  { kCompositeDestinationIn, "destinationIn" },
+  { kCompositeDestinationOut, "destinationOut" },
+  { kCompositeDestinationAtop, "destinationAtop" },
+  { kCompositeXOR, "xor" },
+  { kCompositePlusDarker, "plusDarker" },
+  { kCompositePlusLighter, "plusLighter" },
+};
+
+#define kModeCount (sizeof(kModes) / sizeof(kModes[0]))
+
+typedef struct {
+  const char *name;
+  int offsets[4];
+} TestLayout;
+
+static const TestLayout kLayouts[] = {
+  { "RGBA", { 0, 1, 2, 3 } },
+  { "ARGB", { 1, 2, 3, 0 } },
+};
+
+//------------------------------------------------------------------------------
+static double Now(void) {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec + ts.tv_nsec * 1e-9;
+}
+
+//------------------------------------------------------------------------------
+static uint32_t Random(uint32_t *state) {
+  uint32_t x = *state;
+  
+  x ^= x << 13;
+  x ^= x >> 17;
+  x ^= x << 5;
+  
+  return *state = x;
+}
+
+//------------------------------------------------------------------------------
+// A valid premultiplied pixel, with transparent and opaque pixels common
+static void RandomPixel(uint32_t *state, uint8_t *rgba) {
+  uint32_t r = Random(state);
+  int alpha;
+  
+  switch (r & 7) {
+    case 0: alpha = 0; break;
+    case 1: case 2: alpha = 255; break;
+    default: alpha = (r >> 8) & 0xFF; break;
+  }
+  
+  for (int k = 0; k < 3; ++k)
+    rgba[k] = (uint8_t)(Random(state) % (alpha + 1));
+  
+  rgba[3] = (uint8_t)alpha;
+}
+
+//------------------------------------------------------------------------------
+static uint32_t PackPixel(const uint8_t *rgba, const int *offsets) {
+  uint32_t pixel;
+  uint8_t *bytes = (uint8_t *)&pixel;
+  
+  for (int k = 0; k < 4; ++k)
+    bytes[offsets[k]] = rgba[k];
+  
+  return pixel;
+}
+
+//------------------------------------------------------------------------------
+static void UnpackPixel(uint32_t pixel, const int *offsets, uint8_t *rgba) {
+  const uint8_t *bytes = (const uint8_t *)&pixel;
+  
+  for (int k = 0; k < 4; ++k)
+    rgba[k] = bytes[offsets[k]];
+}
+
+//------------------------------------------------------------------------------
+// Separable blend functions of the unpremultiplied backdrop and source
+static double Multiply(double cb, double cs) { return cb * cs; }
+static double Screen(double cb, double cs) { return cb + cs - cb * cs; }
+
+static double HardLight(double cb, double cs) {
+  return cs <= 0.5 ? Multiply(cb, 2 * cs) : Screen(cb, 2 * cs - 1);
+}
+
+static double SoftLight(double cb, double cs) {
+  if (cs <= 0.5)
+    return cb - (1 - 2 * cs) * cb * (1 - cb);
+  
+  double d = cb <= 0.25 ? ((16 * cb - 12) * cb + 4) * cb : sqrt(cb);
+  
+  return cb + (2 * cs - 1) * (d - cb);
+}
+
+static double SeparableBlend(CompositeMode mode, double cb, double cs) {
+  switch (mode) {
+    case kCompositeMultiply: return Multiply(cb, cs);
+    case kCompositeScreen: return Screen(cb, cs);
+    case kCompositeOverlay: return HardLight(cs, cb);
+    case kCompositeDarken: return cb < cs ? cb : cs;
+    case kCompositeLighten: return cb > cs ? cb : cs;
+    case kCompositeColorDodge:
+      if (cb == 0)
+        return 0;
+      return cs == 1 ? 1 : fmin(1, cb / (1 - cs));
+    case kCompositeColorBurn:
+      if (cb == 1)
+        return 1;
+      return cs == 0 ? 0 : 1 - fmin(1, (1 - cb) / cs);
+    case kCompositeSoftLight: return SoftLight(cb, cs);
+    case kCompositeHardLight: return HardLight(cb, cs);
+    case kCompositeDifference: return fabs(cb - cs);
+    default: return cb + cs - 2 * cb * cs; // kCompositeExclusion
+  }
+}
+
+//------------------------------------------------------------------------------
+// Non-separable blend functions
+static double Lum(const double *c) {
+  return 0.3 * c[0] + 0.59 * c[1] + 0.11 * c[2];
+}
+
+static double Sat(const double *c) {
+  return fmax(c[0], fmax(c[1], c[2])) - fmin(c[0], fmin(c[1], c[2]));
+}
+
+static void ClipColor(double *c) {
+  double l = Lum(c);
+  double n = fmin(c[0], fmin(c[1], c[2]));
+  double x = fmax(c[0], fmax(c[1], c[2]));
+  
+  for (int k = 0; k < 3; ++k) {
+    if (n < 0)
+      c[k] = l + (c[k] - l) * l / (l - n);
+    if (x > 1)
+      c[k] = l + (c[k] - l) * (1 - l) / (x - l);
+  }
+}
+
+static void SetLum(double *c, double l) {
+  double delta = l - Lum(c);
+  
+  for (int k = 0; k < 3; ++k)
+    c[k] += delta;
+  
+  ClipColor(c);
+}
+
+static void SetSat(double *c, double s) {
+  // Order the channels as min, mid, max
+  int order[3] = { 0, 1, 2 };
+  
+  for (int i = 0; i < 2; ++i) {
+    for (int j = 0; j < 2 - i; ++j) {
+      if (c[order[j]] > c[order[j + 1]]) {
+        int t = order[j];
+        order[j] = order[j + 1];
+        order[j + 1] = t;
+      }
+    }
+  }
+  
+  double min = c[order[0]], mid = c[order[1]], max = c[order[2]];
+  
+  if (max > min) {
+    c[order[1]] = (mid - min) * s / (max - min);
+    c[order[2]] = s;
+  } else {
+    c[order[1]] = c[order[2]] = 0;
+  }
+  
+  c[order[0]] = 0;
+}
+
+static void NonSeparableBlend(CompositeMode mode, const double *cb, const double *cs, double *b) {
+  switch (mode) {
+    case kCompositeHue:
+      memcpy(b, cs, 3 * sizeof(double));
+      SetSat(b, Sat(cb));
+      SetLum(b, Lum(cb));
+      break;
+    case kCompositeSaturation:
+      memcpy(b, cb, 3 * sizeof(double));
+      SetSat(b, Sat(cs));
+      SetLum(b, Lum(cb));
+      break;
+    case kCompositeColor:
+      memcpy(b, cs, 3 * sizeof(double));
+      SetLum(b, Lum(cb));
+      break;
+    default: // kCompositeLuminosity
+      memcpy(b, cb, 3 * sizeof(double));
+      SetLum(b, Lum(cs));
+      break;
+  }
+}
+
+//------------------------------------------------------------------------------
+// Porter-Duff fractions of the source and destination: co = fa * cs + fb * cb
+static int PorterDuffFractions(CompositeMode mode, double sa, double da, double *fa, double *fb) {
+  switch (mode) {
+    case kCompositeNormal: *fa = 1; *fb = 1 - sa; return 1;
+    case kCompositeClear: *fa = 0; *fb = 0; return 1;
+    case kCompositeCopy: *fa = 1; *fb = 0; return 1;
+    case kCompositeSourceIn: *fa = da; *fb = 0; return 1;
+    case kCompositeSourceOut: *fa = 1 - da; *fb = 0; return 1;
+    case kCompositeSourceAtop: *fa = da; *fb = 1 - sa; return 1;
+    case kCompositeDestinationOver: *fa = 1 - da; *fb = 1; return 1;
+    case kCompositeDestinationIn: *fa = 0; *fb = sa; return 1;
+    case kCompositeDestinationOut: *fa = 0; *fb = 1 - sa; return 1;
+    case kCompositeDestinationAtop: *fa = 1 - da; *fb = sa; return 1;
+    case kCompositeXOR: *fa = 1 - da; *fb = 1 - sa; return 1;
+    default: return 0;
+  }
+}
+
+//------------------------------------------------------------------------------
+// Composite premultiplied |s| onto |d|, as 8-bit RGBA
+static void ReferenceComposite(CompositeMode mode, const uint8_t *s8, uint8_t *d8) {
+  double s[4], d[4], r[4];
+  double fa, fb;
+  
+  for (int k = 0; k < 4; ++k) {
+    s[k] = s8[k] / 255.0;
+    d[k] = d8[k] / 255.0;
+  }
+  
+  double sa = s[3], da = d[3];
+  
+  if (PorterDuffFractions(mode, sa, da, &fa, &fb)) {
+    for (int k = 0; k < 4; ++k)
+      r[k] = fa * s[k] + fb * d[k];
+  } else if (mode == kCompositePlusLighter) {
+    for (int k = 0; k < 4; ++k)
+      r[k] = fmin(1, s[k] + d[k]);
+  } else if (mode == kCompositePlusDarker) {
+    // 1 - ((1 - D) + (1 - S)), with each color inverted within its alpha
+    double ra = sa + da - sa * da;
+    
+    for (int k = 0; k < 4; ++k)
+      r[k] = fmax(0, ra - ((da - d[k]) + (sa - s[k])));
+  } else {
+    double cs[3], cb[3], b[3];
+    
+    for (int k = 0; k < 3; ++k) {
+      cs[k] = sa > 0 ? fmin(1, s[k] / sa) : 0;
+      cb[k] = da > 0 ? fmin(1, d[k] / da) : 0;
+    }
+    
+    if (mode >= kCompositeHue && mode <= kCompositeLuminosity) {
+      NonSeparableBlend(mode, cb, cs, b);
+    } else {
+      for (int k = 0; k < 3; ++k)
+        b[k] = SeparableBlend(mode, cb[k], cs[k]);
+    }
+    
+    for (int k = 0; k < 3; ++k)
+      r[k] = (1 - da) * s[k] + (1 - sa) * d[k] + sa * da * b[k];
+    
+    r[3] = sa + da - sa * da;
+  }
+  
+  for (int k = 0; k < 4; ++k) {
+    double v = r[k] < 0 ? 0 : (r[k] > 1 ? 1 : r[k]);
+    d8[k] = (uint8_t)floor(v * 255 + 0.5);
+  }
+}
+
+//------------------------------------------------------------------------------
+// Largest channel difference of |mode| from the reference, or -1 if the
+// serial and queued results differ or a pixel outside the source changed
+static int CheckMode(CompositeMode mode, const TestLayout *layout, WorkQueue *queue) {
+  const size_t dstWidth = 67, dstHeight = 45, srcWidth = 50, srcHeight = 40;
+  const long x = -5, y = 10;
+  uint32_t state = 0x9E3779B9u ^ (uint32_t)mode;
+  uint32_t dst[dstWidth * dstHeight], src[srcWidth * srcHeight];
+  uint32_t serial[dstWidth * dstHeight], queued[dstWidth * dstHeight];
+  uint8_t rgba[4];
+  CompositeParameters params;
+  int maxError = 0;
+  
+  for (size_t i = 0; i < dstWidth * dstHeight; ++i) {
+    RandomPixel(&state, rgba);
+    dst[i] = PackPixel(rgba, layout->offsets);
+  }
+  
+  for (size_t i = 0; i < srcWidth * srcHeight; ++i) {
+    RandomPixel(&state, rgba);
+    src[i] = PackPixel(rgba, layout->offsets);
+  }
+  
+  memcpy(serial, dst, sizeof(dst));
+  memcpy(queued, dst, sizeof(dst));
+  memset(&params, 0, sizeof(params));
+  params.destination.width = dstWidth;
+  params.destination.height = dstHeight;
+  params.destination.rowPixels = dstWidth;
+  params.source.pixels = src;
+  params.source.width = srcWidth;
+  params.source.height = srcHeight;
+  params.source.rowPixels = srcWidth;
+  params.x = x;
+  params.y = y;
+  params.mode = mode;
+  memcpy(params.offsets, layout->offsets, sizeof(params.offsets));
+  
+  params.destination.pixels = serial;
+  CompositeBuffers(&params, NULL);
+  params.destination.pixels = queued;
+  CompositeBuffers(&params, queue);
+  
+  if (memcmp(serial, queued, sizeof(serial)))
+    return -1;
+  
+  // The top row of the source is this row of the destination
+  long top = (long)dstHeight - y - (long)srcHeight;
+  
+  for (size_t row = 0; row < dstHeight; ++row) {
+    for (size_t col = 0; col < dstWidth; ++col) {
+      size_t index = row * dstWidth + col;
+      long srcRow = (long)row - top, srcCol = (long)col - x;
+      uint8_t expected[4], actual[4];
+      
+      UnpackPixel(dst[index], layout->offsets, expected);
+      UnpackPixel(serial[index], layout->offsets, actual);
+      
+      if (srcRow < 0 || srcRow >= (long)srcHeight || srcCol < 0 || srcCol >= (long)srcWidth) {
+        if (memcmp(expected, actual, sizeof(expected)))
+          return -1;
+        continue;
+      }
+      
+      UnpackPixel(src[srcRow * srcWidth + srcCol], layout->offsets, rgba);
+      ReferenceComposite(mode, rgba, expected);
+      
+      for (int k = 0; k < 4; ++k) {
+        int error = abs((int)expected[k] - (int)actual[k]);
+        
+        if (error > maxError)
+          maxError = error;
+      }
+    }
+  }
+  
+  return maxError;
+}
+
+//------------------------------------------------------------------------------
+// Best time of |iterations| full-frame composites
+static double Time(CompositeParameters *params, WorkQueue *queue, int iterations) {
+  double best = 0;
+  
+  for (int i = 0; i < iterations; ++i) {
+    double start = Now();
+    CompositeBuffers(params, queue);
+    double elapsed = Now() - start;
+    
+    if (!i || elapsed < best)
+      best = elapsed;
+  }
+  
+  return best;
+}
+
+//------------------------------------------------------------------------------
+int main(int argc, const char *argv[]) {
+  int iterations = argc > 1 ? atoi(argv[1]) : 3;
+  WorkQueue *queue = WorkQueueGetShared();
+  WorkQueue *checkQueue = WorkQueueCreate(4);
+  const size_t width = 1920, height = 1080, count = width * height;
+  uint32_t *dst = (uint32_t *)malloc(count * sizeof(uint32_t));
+  uint32_t *src = (uint32_t *)malloc(count * sizeof(uint32_t));
+  uint32_t state = 12345;
+  uint8_t rgba[4];
+  int failed = 0;
+  
+  if (!dst || !src || !checkQueue) {
+    fprintf(stderr, "Out of memory\n");
+    return 1;
+  }
+  
+  if (iterations < 1)
+    iterations = 1;
+  
+  for (size_t i = 0; i < count; ++i) {
+    RandomPixel(&state, rgba);
+    dst[i] = PackPixel(rgba, kLayouts[0].offsets);
+    RandomPixel(&state, rgba);
+    src[i] = PackPixel(rgba, kLayouts[0].offsets);
+  }
+  
+  printf("%d threads, best of %d at %zux%zu, tolerance %d\n", WorkQueueThreadCount(queue),
+         iterations, width, height, kTolerance);
+  
+  for (size_t m = 0; m < kModeCount; ++m) {
+    const TestMode *mode = &kModes[m];
+    CompositeParameters params;
+    int errors[2];
+    int ok = 1;
+    
+    for (size_t l = 0; l < sizeof(kLayouts) / sizeof(kLayouts[0]); ++l) {
+      errors[l] = CheckMode(mode->mode, &kLayouts[l], checkQueue);
+      ok &= errors[l] >= 0 && errors[l] <= kTolerance;
+    }
+    
+    memset(&params, 0, sizeof(params));
+    params.destination.pixels = dst;
+    params.destination.width = width;
+    params.destination.height = height;
+    params.destination.rowPixels = width;
+    params.source.pixels = src;
+    params.source.width = width;
+    params.source.height = height;
+    params.source.rowPixels = width;
+    params.mode = mode->mode;
+    memcpy(params.offsets, kLayouts[0].offsets, sizeof(params.offsets));
+    
+    double serialTime = Time(&params, NULL, iterations);
+    double queueTime = Time(&params, queue, iterations);
+    
+    printf("%-16s RGBA error %2d  ARGB error %2d  1 thread: %8.1f MP/s  queue: %8.1f MP/s  %s\n",
+           mode->name, errors[0], errors[1], count / serialTime * 1e-6,
+           count / queueTime * 1e-6, ok ? "ok" : "FAILED");
+    
+    failed |= !ok;
+  }
+  
+  WorkQueueRelease(checkQueue);
+  free(dst);
+  free(src);
+  
+  return failed;
+}
@@ -52,6 +52,13 @@ typedef void (*LoggingCB)(const char *msg, void *context);
 // Get the image that is the result of the evaluation
 - (CGImageRef)image;
 
+// Composite the layers over the part of the desktop in |rect| into a new
+// image, leaving the desktop itself unchanged.  After calling
+// -prepareForImagesInRects, several rects can be composited at once on
+// different threads.
+- (void)prepareForImagesInRects;
+- (CGImageRef)createImageInRect:(CGRect)rect;
+
 - (Layer *)desktop;
 - (Layer *)menubar;
 
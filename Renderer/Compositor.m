@@ -16,8 +16,10 @@
 
 #import "Color.h"
 #import "Compositor.h"
+#import "CompositeCore.h"
 #import "Filter.h"
 #import "Gradient.h"
+#import "GradientNoise.h"
 #import "GravityPoint.h"
 #import "Image.h"
 #import "Layer.h"
@@ -44,6 +46,98 @@ static inline BOOL IsEmptySize(NSSize size) {
 static int kCurrentVersion = 1;
 static Compositor *sSharedCompositor = nil;
 
+// When set in the environment, the layers are also composited with Quartz and
+// the largest difference is logged
+static const char *kVerifyCompositingVariable = "TOPDRAW_VERIFY_COMPOSITING";
+
+static BOOL CompositeModeFromBlendMode(CGBlendMode blendMode, CompositeMode *mode) {
+  switch (blendMode) {
+    case kCGBlendModeNormal: *mode = kCompositeNormal; break;
+    case kCGBlendModeMultiply: *mode = kCompositeMultiply; break;
+    case kCGBlendModeScreen: *mode = kCompositeScreen; break;
+    case kCGBlendModeOverlay: *mode = kCompositeOverlay; break;
+    case kCGBlendModeDarken: *mode = kCompositeDarken; break;
+    case kCGBlendModeLighten: *mode = kCompositeLighten; break;
+    case kCGBlendModeColorDodge: *mode = kCompositeColorDodge; break;
+    case kCGBlendModeColorBurn: *mode = kCompositeColorBurn; break;
+    case kCGBlendModeSoftLight: *mode = kCompositeSoftLight; break;
+    case kCGBlendModeHardLight: *mode = kCompositeHardLight; break;
+    case kCGBlendModeDifference: *mode = kCompositeDifference; break;
+    case kCGBlendModeExclusion: *mode = kCompositeExclusion; break;
+    case kCGBlendModeHue: *mode = kCompositeHue; break;
+    case kCGBlendModeSaturation: *mode = kCompositeSaturation; break;
+    case kCGBlendModeColor: *mode = kCompositeColor; break;
+    case kCGBlendModeLuminosity: *mode = kCompositeLuminosity; break;
+      
+    case kCGBlendModeClear: *mode = kCompositeClear; break;
+    case kCGBlendModeCopy: *mode = kCompositeCopy; break;
+    case kCGBlendModeSourceIn: *mode = kCompositeSourceIn; break;
+    case kCGBlendModeSourceOut: *mode = kCompositeSourceOut; break;
+    case kCGBlendModeSourceAtop: *mode = kCompositeSourceAtop; break;
+    case kCGBlendModeDestinationOver: *mode = kCompositeDestinationOver; break;
+    case kCGBlendModeDestinationIn: *mode = kCompositeDestinationIn; break;
+    case kCGBlendModeDestinationOut: *mode = kCompositeDestinationOut; break;
+    case kCGBlendModeDestinationAtop: *mode = kCompositeDestinationAtop; break;
+    case kCGBlendModeXOR: *mode = kCompositeXOR; break;
+    case kCGBlendModePlusDarker: *mode = kCompositePlusDarker; break;
+    case kCGBlendModePlusLighter: *mode = kCompositePlusLighter; break;
+      
+    default:
+      return NO;
+  }
+  
+  return YES;
+}
+
+// Whether transparent source pixels change the destination.  The rest of the
+// blend modes only need the pixels of a layer that were drawn.
+static BOOL BlendModeChangesUnderTransparency(CGBlendMode blendMode) {
+  switch (blendMode) {
+    case kCGBlendModeClear:
+    case kCGBlendModeCopy:
+    case kCGBlendModeSourceIn:
+    case kCGBlendModeSourceOut:
+    case kCGBlendModeDestinationIn:
+    case kCGBlendModeDestinationAtop:
+      return YES;
+      
+    default:
+      return NO;
+  }
+}
+
+static BOOL GetCompositeBuffer(CGContextRef context, CompositeBuffer *buffer) {
+  buffer->pixels = (uint32_t *)CGBitmapContextGetData(context);
+  buffer->width = CGBitmapContextGetWidth(context);
+  buffer->height = CGBitmapContextGetHeight(context);
+  buffer->rowPixels = CGBitmapContextGetBytesPerRow(context) / sizeof(uint32_t);
+  
+  return buffer->pixels && !(CGBitmapContextGetBytesPerRow(context) % sizeof(uint32_t));
+}
+
+static CGContextRef CreateBitmapContextCopy(CGContextRef context) {
+  size_t rowBytes = CGBitmapContextGetBytesPerRow(context);
+  size_t height = CGBitmapContextGetHeight(context);
+  CGContextRef copy = CGBitmapContextCreate(NULL, CGBitmapContextGetWidth(context), height,
+                                            CGBitmapContextGetBitsPerComponent(context), rowBytes,
+                                            CGBitmapContextGetColorSpace(context), 
+                                            CGBitmapContextGetBitmapInfo(context));
+  
+  if (copy && CGBitmapContextGetBytesPerRow(copy) == rowBytes)
+    memcpy(CGBitmapContextGetData(copy), CGBitmapContextGetData(context), rowBytes * height);
+  
+  return copy;
+}
+
+@interface Compositor(PrivateMethods)
+- (BOOL)compositeLayer:(Layer *)layer rect:(CGRect)rect blendMode:(CGBlendMode)blendMode 
+                  into:(CGContextRef)dest origin:(CGPoint)origin;
+- (void)drawLayer:(Layer *)layer blendMode:(CGBlendMode)blendMode 
+             into:(CGContextRef)dest origin:(CGPoint)origin;
+- (void)drawLayersInto:(CGContextRef)dest origin:(CGPoint)origin verify:(CGContextRef)verify;
+- (void)logDifferenceFromContext:(CGContextRef)verify;
+@end
+
 @implementation Compositor
 //------------------------------------------------------------------------------
 #pragma mark -
@@ -158,6 +252,7 @@ static Compositor *sSharedCompositor = nil;
   [rt registerClass:[Color class]];
   [rt registerClass:[Filter class]];
   [rt registerClass:[Gradient class]];
+  [rt registerClass:[GradientNoise class]];
   [rt registerClass:[GravityPoint class]];
   [rt registerClass:[Image class]];
   [rt registerClass:[LSystem class]];
@@ -201,7 +296,6 @@ static Compositor *sSharedCompositor = nil;
 
 //------------------------------------------------------------------------------
 - (CGImageRef)image {
-  int count = [layers_ count];
   CGContextRef dest = [desktop_ backingStore];
   
   // Restore the state and clip
@@ -210,22 +304,208 @@ static Compositor *sSharedCompositor = nil;
   rect.origin = CGPointZero;
   CGContextClipToRect(dest, rect);
   
-  // Draw each layer into the desktop
+  CGContextRef verify = NULL;
+  
+  if (getenv(kVerifyCompositingVariable))
+    verify = CreateBitmapContextCopy(dest);
+  
+  [self drawLayersInto:dest origin:CGPointZero verify:verify];
+  
+  if (verify) {
+    [self logDifferenceFromContext:verify];
+    CGContextRelease(verify);
+  }
+  
+  // Save the state for the future
+  CGContextSaveGState(dest);
+    
+  return [desktop_ cgImage];
+}
+
+//------------------------------------------------------------------------------
+- (void)prepareForImagesInRects {
+  // Create the images for Quartz compositing now, rather than racing to
+  // create them on several threads
+  for (Layer *layer in layers_)
+    [layer cgImage];
+  
+  [menubar_ cgImage];
+}
+
+//------------------------------------------------------------------------------
+- (CGImageRef)createImageInRect:(CGRect)rect {
+  CGContextRef desktop = [desktop_ backingStore];
+  size_t desktopHeight = CGBitmapContextGetHeight(desktop);
+  CGRect bounds = CGRectMake(0, 0, CGBitmapContextGetWidth(desktop), desktopHeight);
+  
+  rect = CGRectIntersection(CGRectIntegral(rect), bounds);
+  
+  if (CGRectIsEmpty(rect))
+    return NULL;
+  
+  size_t width = CGRectGetWidth(rect);
+  size_t height = CGRectGetHeight(rect);
+  CGContextRef dest = CGBitmapContextCreate(NULL, width, height, 8, 0, 
+                                            CGBitmapContextGetColorSpace(desktop),
+                                            CGBitmapContextGetBitmapInfo(desktop));
+  
+  if (!dest)
+    return NULL;
+  
+  const uint8_t *src = CGBitmapContextGetData(desktop);
+  uint8_t *data = CGBitmapContextGetData(dest);
+  
+  // Start with what was drawn on the desktop in |rect|.  Rows are from the top.
+  if (src && data && CGBitmapContextGetBitsPerPixel(desktop) == 32) {
+    size_t srcRowBytes = CGBitmapContextGetBytesPerRow(desktop);
+    size_t rowBytes = CGBitmapContextGetBytesPerRow(dest);
+    
+    src += (desktopHeight - (size_t)CGRectGetMaxY(rect)) * srcRowBytes + (size_t)CGRectGetMinX(rect) * 4;
+    
+    for (size_t y = 0; y < height; ++y, src += srcRowBytes, data += rowBytes)
+      memcpy(data, src, width * 4);
+  } else {
+    CGImageRef desktopImage = CGBitmapContextCreateImage(desktop);
+    CGContextSetBlendMode(dest, kCGBlendModeCopy);
+    CGContextDrawImage(dest, CGRectOffset(bounds, -CGRectGetMinX(rect), -CGRectGetMinY(rect)), 
+                       desktopImage);
+    CGImageRelease(desktopImage);
+  }
+  
+  [self drawLayersInto:dest origin:rect.origin verify:NULL];
+  
+  CGImageRef image = CGBitmapContextCreateImage(dest);
+  CGContextRelease(dest);
+  
+  return image;
+}
+
+//------------------------------------------------------------------------------
+- (void)drawLayersInto:(CGContextRef)dest origin:(CGPoint)origin verify:(CGContextRef)verify {
+  int count = [layers_ count];
+  
+  // Draw each layer, then the menubar, into |dest|
   for (int i = 0; i < count; ++i) {
     Layer *layer = [layers_ objectAtIndex:i];
     CGBlendMode blendMode = [Layer blendModeFromString:[blendModes_ objectAtIndex:i]];
-    CGContextSetBlendMode(dest, blendMode);
-    CGContextDrawImage(dest, [layer cgRectFrame], [layer cgImage]);
+    [self drawLayer:layer blendMode:blendMode into:dest origin:origin];
+    
+    if (verify) {
+      CGContextSetBlendMode(verify, blendMode);
+      CGContextDrawImage(verify, [layer cgRectFrame], [layer cgImage]);
+    }
+  }
+  
+  if (!disableMenubarRendering_) {
+    [self drawLayer:menubar_ blendMode:kCGBlendModeNormal into:dest origin:origin];
+    
+    if (verify) {
+      CGContextSetBlendMode(verify, kCGBlendModeNormal);
+      CGContextDrawImage(verify, [menubar_ cgRectFrame], [menubar_ cgImage]);
+    }
   }
+}
+
+//------------------------------------------------------------------------------
+// |dest| has the desktop's pixel format and |origin| is its position on the
+// desktop
+- (BOOL)compositeLayer:(Layer *)layer rect:(CGRect)rect blendMode:(CGBlendMode)blendMode 
+                  into:(CGContextRef)dest origin:(CGPoint)origin {
+  CGContextRef src = [layer backingStore];
+  CGRect frame = [layer cgRectFrame];
+  int destOffsets[4], srcOffsets[4];
+  CompositeParameters params;
   
-  // Draw the menubar
-  if (!disableMenubarRendering_)
-    CGContextDrawImage(dest, [menubar_ cgRectFrame], [menubar_ cgImage]);
+  bzero(&params, sizeof(params));
   
-  // Save the state for the future
-  CGContextSaveGState(dest);
+  // Quartz handles anything other than the same pixel format, a layer whose
+  // backing store is the size of its frame, and an unscaled desktop
+  if (!CompositeModeFromBlendMode(blendMode, &params.mode))
+    return NO;
+  
+  if (![desktop_ getPixelChannelOffsets:destOffsets] || ![layer getPixelChannelOffsets:srcOffsets] ||
+      memcmp(destOffsets, srcOffsets, sizeof(destOffsets)))
+    return NO;
+  
+  if (!GetCompositeBuffer(dest, &params.destination) || !GetCompositeBuffer(src, &params.source))
+    return NO;
+  
+  if (params.source.width != CGRectGetWidth(frame) || params.source.height != CGRectGetHeight(frame))
+    return NO;
+  
+  if (!CGAffineTransformIsIdentity(CGContextGetCTM(dest)))
+    return NO;
+  
+  // Only composite |rect| of the layer, which is in its pixels with y up
+  size_t top = params.source.height - CGRectGetMaxY(rect);
+  params.source.pixels += top * params.source.rowPixels + (size_t)CGRectGetMinX(rect);
+  params.source.width = CGRectGetWidth(rect);
+  params.source.height = CGRectGetHeight(rect);
+  params.x = CGRectGetMinX(frame) - origin.x + CGRectGetMinX(rect);
+  params.y = CGRectGetMinY(frame) - origin.y + CGRectGetMinY(rect);
+  memcpy(params.offsets, destOffsets, sizeof(params.offsets));
+  CompositeBuffers(&params, WorkQueueGetShared());
+  
+  return YES;
+}
+
+//------------------------------------------------------------------------------
+- (void)drawLayer:(Layer *)layer blendMode:(CGBlendMode)blendMode 
+             into:(CGContextRef)dest origin:(CGPoint)origin {
+  CGRect frame = CGRectOffset([layer cgRectFrame], -origin.x, -origin.y);
+  CGContextRef src = [layer backingStore];
+  CGRect bounds = CGRectMake(0, 0, CGBitmapContextGetWidth(src), CGBitmapContextGetHeight(src));
+  CGRect rect = bounds;
+  
+  // Skip the pixels that were never drawn, or the whole layer if none were
+  if (!BlendModeChangesUnderTransparency(blendMode) && CGSizeEqualToSize(bounds.size, frame.size))
+    rect = [layer dirtyRect];
+  
+  if (!CGRectIsNull(rect) && 
+      ![self compositeLayer:layer rect:rect blendMode:blendMode into:dest origin:origin]) {
+    CGContextSetBlendMode(dest, blendMode);
     
-  return [desktop_ cgImage];
+    if (CGRectEqualToRect(rect, bounds)) {
+      CGContextDrawImage(dest, frame, [layer cgImage]);
+    } else {
+      // Image rects are from the top
+      CGRect imageRect = rect;
+      imageRect.origin.y = CGRectGetHeight(bounds) - CGRectGetMaxY(rect);
+      CGImageRef image = CGImageCreateWithImageInRect([layer cgImage], imageRect);
+      CGContextDrawImage(dest, CGRectOffset(rect, CGRectGetMinX(frame), CGRectGetMinY(frame)), image);
+      CGImageRelease(image);
+    }
+  }
+}
+
+//------------------------------------------------------------------------------
+- (void)logDifferenceFromContext:(CGContextRef)verify {
+  CGContextRef dest = [desktop_ backingStore];
+  const uint8_t *expected = CGBitmapContextGetData(verify);
+  const uint8_t *actual = CGBitmapContextGetData(dest);
+  size_t rowBytes = CGBitmapContextGetBytesPerRow(dest);
+  size_t width = CGBitmapContextGetWidth(dest) * 4;
+  size_t height = CGBitmapContextGetHeight(dest);
+  unsigned long differences = 0;
+  int maxDifference = 0;
+  
+  if (!expected || !actual || CGBitmapContextGetBytesPerRow(verify) != rowBytes)
+    return;
+  
+  for (size_t y = 0; y < height; ++y, expected += rowBytes, actual += rowBytes) {
+    for (size_t x = 0; x < width; ++x) {
+      int difference = abs((int)expected[x] - (int)actual[x]);
+      
+      if (difference) {
+        ++differences;
+        maxDifference = MAX(difference, maxDifference);
+      }
+    }
+  }
+  
+  [self addLogMessage:[NSString stringWithFormat:
+                       @"Compositing: %lu components differ from Quartz, by at most %d",
+                       differences, maxDifference]];
 }
 
 //------------------------------------------------------------------------------
@@ -0,0 +1,52 @@
+// Copyright 2008 Google Inc.
+//
+// Licensed under the Apache License, Version 2.0 (the "License"); you may not
+// use this file except in compliance with the License.  You may obtain a copy
+// of the License at
+//
+// http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS, WITHOUT
+// WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.  See the
+// License for the specific language governing permissions and limitations under
+// the License.
+
+// Applies Filters to a Layer's backing store.  The Core Image context, the
+// clamp and crop filters, and the output buffer are kept between calls.  The
+// input is read straight from the backing store rather than from a snapshot,
+// and only the requested region is rendered.
+
+#import <Foundation/Foundation.h>
+#import <QuartzCore/QuartzCore.h>
+
+@class Filter;
+
+@interface FilterPipeline : NSObject {
+  CGContextRef context_;          // The Layer's backing store (not retained)
+  CGColorSpaceRef colorSpace_;
+  CIContext *ciContext_;
+  CIFilter *clamp_;
+  CIFilter *crop_;
+  
+  // Output of the filters, drawn back into |context_|
+  void *output_;
+  size_t outputSize_;
+  
+  // Filter name -> NSMutableArray of calls, link seconds, render seconds
+  NSMutableDictionary *timings_;
+}
+
+- (id)initWithContext:(CGContextRef)context;
+
+// Apply |filter| and its input filters to |rect| of the context.  Returns NO
+// if nothing was drawn.
+- (BOOL)applyFilter:(Filter *)filter inRect:(CGRect)rect;
+
+// An array of [name, calls, link milliseconds, render milliseconds] for each
+// filter that has been applied.  Core Image renders a chain of filters at
+// once, so the render time of a chain is counted for the filter that was
+// applied; its input filters only have their link time.
+- (NSArray *)timings;
+
+@end
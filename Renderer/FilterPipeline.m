@@ -0,0 +1,248 @@
+// Copyright 2008 Google Inc.
+//
+// Licensed under the Apache License, Version 2.0 (the "License"); you may not
+// use this file except in compliance with the License.  You may obtain a copy
+// of the License at
+//
+// http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS, WITHOUT
+// WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.  See the
+// License for the specific language governing permissions and limitations under
+// the License.
+
+#import "Color.h"
+#import "Filter.h"
+#import "FilterPipeline.h"
+
+static NSString *kOutputSizeKey = @"outputSize";
+
+@interface FilterPipeline(PrivateMethods)
+- (CIImage *)inputImage;
+- (void)addTime:(CFAbsoluteTime)seconds render:(BOOL)render forFilter:(Filter *)filter;
+@end
+
+@implementation FilterPipeline
+//------------------------------------------------------------------------------
+- (id)initWithContext:(CGContextRef)context {
+  if ((self = [super init])) {
+    context_ = context;
+    
+    // Use the applications colorspace
+    colorSpace_ = [Color createDefaultCGColorSpace];
+    NSDictionary *options = [NSDictionary dictionaryWithObjectsAndKeys:
+                             (id)colorSpace_, kCIContextWorkingColorSpace, 
+                             (id)colorSpace_, kCIContextOutputColorSpace, nil];
+    ciContext_ = [[CIContext contextWithCGContext:context_ options:options] retain];
+
+    // Always put an CIAffineClamp at the head so that the edge is duplicated
+    clamp_ = [[CIFilter filterWithName:@"CIAffineClamp"] retain];
+    [clamp_ setDefaults];
+    [clamp_ setValue:[NSAffineTransform transform] forKey:@"inputTransform"];
+    
+    // Always crop the output
+    crop_ = [[CIFilter filterWithName:@"CICrop"] retain];
+    
+    timings_ = [[NSMutableDictionary alloc] init];
+  }
+  
+  return self;
+}
+
+//------------------------------------------------------------------------------
+- (void)dealloc {
+  CGColorSpaceRelease(colorSpace_);
+  [ciContext_ release];
+  [clamp_ release];
+  [crop_ release];
+  [timings_ release];
+  free(output_);
+  [super dealloc];
+}
+
+//------------------------------------------------------------------------------
+- (CIImage *)inputImage {
+  size_t width = CGBitmapContextGetWidth(context_);
+  size_t height = CGBitmapContextGetHeight(context_);
+  size_t rowBytes = CGBitmapContextGetBytesPerRow(context_);
+  CGImageAlphaInfo alphaInfo = CGBitmapContextGetAlphaInfo(context_);
+  CGBitmapInfo byteOrder = CGBitmapContextGetBitmapInfo(context_) & kCGBitmapByteOrderMask;
+  
+  // Read the pixels in place if they're in a format that Core Image takes
+  if (CGBitmapContextGetBitsPerPixel(context_) == 32 && alphaInfo == kCGImageAlphaPremultipliedFirst &&
+      (byteOrder == kCGBitmapByteOrderDefault || byteOrder == kCGBitmapByteOrder32Big)) {
+    NSData *data = [NSData dataWithBytesNoCopy:CGBitmapContextGetData(context_) 
+                                        length:rowBytes * height freeWhenDone:NO];
+    return [CIImage imageWithBitmapData:data bytesPerRow:rowBytes size:CGSizeMake(width, height)
+                                 format:kCIFormatARGB8 colorSpace:colorSpace_];
+  }
+  
+  CGImageRef snapshot = CGBitmapContextCreateImage(context_);
+  CIImage *image = [CIImage imageWithCGImage:snapshot];
+  CGImageRelease(snapshot);
+  
+  return image;
+}
+
+//------------------------------------------------------------------------------
+- (void)addTime:(CFAbsoluteTime)seconds render:(BOOL)render forFilter:(Filter *)filter {
+  NSString *name = [filter name];
+  
+  if (!name)
+    return;
+  
+  NSMutableArray *timing = [timings_ objectForKey:name];
+  
+  if (!timing) {
+    timing = [NSMutableArray arrayWithObjects:[NSNumber numberWithInt:0], 
+              [NSNumber numberWithDouble:0], [NSNumber numberWithDouble:0], nil];
+    [timings_ setObject:timing forKey:name];
+  }
+  
+  int index = render ? 2 : 1;
+  double total = [[timing objectAtIndex:index] doubleValue] + seconds;
+  [timing replaceObjectAtIndex:index withObject:[NSNumber numberWithDouble:total]];
+  
+  if (!render) {
+    int calls = [[timing objectAtIndex:0] intValue] + 1;
+    [timing replaceObjectAtIndex:0 withObject:[NSNumber numberWithInt:calls]];
+  }
+}
+
+//------------------------------------------------------------------------------
+- (BOOL)applyFilter:(Filter *)filter inRect:(CGRect)rect {
+  CIFilter *ciFilter = [filter ciFilter];
+  CGRect bounds = CGRectMake(0, 0, CGBitmapContextGetWidth(context_), CGBitmapContextGetHeight(context_));
+  
+  rect = CGRectIntegral(CGRectIntersection(rect, bounds));
+  
+  if (!ciFilter || CGRectIsEmpty(rect))
+    return NO;
+  
+  // Find the first filter, keeping track of any filters that need chaining
+  NSMutableArray *filtersToChain = [NSMutableArray array];
+  Filter *firstFilter = filter;
+  
+  while ([firstFilter inputFilter]) {
+    [filtersToChain insertObject:firstFilter atIndex:0];
+    firstFilter = [firstFilter inputFilter];
+  }
+  
+  CFAbsoluteTime start = CFAbsoluteTimeGetCurrent();
+  [clamp_ setValue:[self inputImage] forKey:@"inputImage"];
+
+  // If this is a generator, it may not respond to this message
+  @try {
+    [[firstFilter ciFilter] setValue:[clamp_ valueForKey:@"outputImage"] forKey:@"inputImage"];
+  }
+  
+  @catch (NSException *e) {
+    // We don't care if there was an exception in setting the input image
+    // because we'll assume that it was a generator
+  }
+  
+  CFAbsoluteTime end = CFAbsoluteTimeGetCurrent();
+  [self addTime:end - start render:NO forFilter:firstFilter];
+  
+  // Chain the other filters, if any
+  NSEnumerator *e = [filtersToChain objectEnumerator];
+  Filter *previousFilter = firstFilter;
+  Filter *chainFilter;
+  CIVector *outputSize = [CIVector vectorWithX:CGRectGetWidth(bounds) Y:CGRectGetHeight(bounds)];
+  
+  while ((chainFilter = [e nextObject])) {
+    start = CFAbsoluteTimeGetCurrent();
+    
+    @try {
+      // Set our special outputSize on the previous fit
+      if ([[[previousFilter ciFilter] inputKeys] containsObject:kOutputSizeKey])
+        [[previousFilter ciFilter] setValue:outputSize forKey:kOutputSizeKey];
+      
+      CIImage *input = [[previousFilter ciFilter] valueForKey:@"outputImage"];
+      [[chainFilter ciFilter] setValue:input forKey:@"inputImage"];
+    }
+    
+    @catch (NSException *e) {
+      NSLog(@"Filter Chaining: %@", e);
+    }
+    
+    end = CFAbsoluteTimeGetCurrent();
+    [self addTime:end - start render:NO forFilter:chainFilter];
+    previousFilter = chainFilter;
+  }
+  
+  @try {
+    // Set our special outputSize on the filter
+    if ([[ciFilter inputKeys] containsObject:kOutputSizeKey])
+      [ciFilter setValue:outputSize forKey:kOutputSizeKey];
+  }
+  @catch (NSException *e) {
+    NSLog(@"Setting output size: %@", e);
+  }
+  
+  start = CFAbsoluteTimeGetCurrent();
+  [crop_ setValue:[CIVector vectorWithX:CGRectGetMinX(rect) Y:CGRectGetMinY(rect)
+                                      Z:CGRectGetWidth(rect) W:CGRectGetHeight(rect)] 
+           forKey:@"inputRectangle"];
+  [crop_ setValue:[ciFilter valueForKey:@"outputImage"] forKey:@"inputImage"];
+  
+  // Render the region into the output buffer
+  size_t width = CGRectGetWidth(rect);
+  size_t height = CGRectGetHeight(rect);
+  size_t rowBytes = ((4 * width) + 0xF) & ~0xF; // 16 byte alignment
+  
+  if (rowBytes * height > outputSize_) {
+    free(output_);
+    outputSize_ = rowBytes * height;
+    output_ = malloc(outputSize_);
+    
+    if (!output_) {
+      MethodLog("Unable to allocate %lu x %lu filter output", (unsigned long)width, (unsigned long)height);
+      outputSize_ = 0;
+      [clamp_ setValue:nil forKey:@"inputImage"];
+      [crop_ setValue:nil forKey:@"inputImage"];
+      return NO;
+    }
+  }
+  
+  [ciContext_ render:[crop_ valueForKey:@"outputImage"] toBitmap:output_ rowBytes:rowBytes
+              bounds:rect format:kCIFormatARGB8 colorSpace:colorSpace_];
+  
+  // The inputs refer to the backing store, which is about to change
+  [clamp_ setValue:nil forKey:@"inputImage"];
+  [crop_ setValue:nil forKey:@"inputImage"];
+  
+  // Draw the result as the filtered image was drawn before so that the
+  // transform and compositing of the context apply
+  CGContextRef outputContext = CGBitmapContextCreate(output_, width, height, 8, rowBytes, colorSpace_,
+                                                     kCGImageAlphaPremultipliedFirst | kCGBitmapByteOrder32Big);
+  CGImageRef outputImage = CGBitmapContextCreateImage(outputContext);
+  CGContextDrawImage(context_, rect, outputImage);
+  CGImageRelease(outputImage);
+  CGContextRelease(outputContext);
+  
+  end = CFAbsoluteTimeGetCurrent();
+  [self addTime:end - start render:YES forFilter:filter];
+  
+  return YES;
+}
+
+//------------------------------------------------------------------------------
+- (NSArray *)timings {
+  NSMutableArray *result = [NSMutableArray array];
+  NSEnumerator *e = [[[timings_ allKeys] sortedArrayUsingSelector:@selector(compare:)] objectEnumerator];
+  NSString *name;
+  
+  while ((name = [e nextObject])) {
+    NSArray *timing = [timings_ objectForKey:name];
+    [result addObject:[NSArray arrayWithObjects:name, [timing objectAtIndex:0],
+                       [NSNumber numberWithDouble:[[timing objectAtIndex:1] doubleValue] * 1000.0],
+                       [NSNumber numberWithDouble:[[timing objectAtIndex:2] doubleValue] * 1000.0],
+                       nil]];
+  }
+  
+  return result;
+}
+
+@end
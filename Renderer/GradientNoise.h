@@ -0,0 +1,33 @@
+// Copyright 2008 Google Inc.
+// 
+// Licensed under the Apache License, Version 2.0 (the "License"); you may not
+// use this file except in compliance with the License.  You may obtain a copy
+// of the License at
+// 
+// http://www.apache.org/licenses/LICENSE-2.0
+// 
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS, WITHOUT
+// WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.  See the
+// License for the specific language governing permissions and limitations under
+// the License.
+
+
+// Smooth fractal noise (simplex fBm) that can be drawn into a layer
+
+#import "RuntimeObject.h"
+
+@class Color;
+
+@interface GradientNoise : RuntimeObject {
+  uint64_t seed_;
+  CGFloat scale_;
+  int octaves_;
+  CGFloat persistence_;
+  CGFloat lacunarity_;
+  CGPoint offset_;
+  Color *lowColor_;
+  Color *highColor_;
+}
+
+@end
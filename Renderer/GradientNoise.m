@@ -0,0 +1,251 @@
+// Copyright 2008 Google Inc.
+// 
+// Licensed under the Apache License, Version 2.0 (the "License"); you may not
+// use this file except in compliance with the License.  You may obtain a copy
+// of the License at
+// 
+// http://www.apache.org/licenses/LICENSE-2.0
+// 
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS, WITHOUT
+// WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.  See the
+// License for the specific language governing permissions and limitations under
+// the License.
+
+
+#import "Color.h"
+#import "GradientNoise.h"
+#import "GradientNoiseCore.h"
+#import "Layer.h"
+#import "PointObject.h"
+#import "Randomizer.h"
+
+@interface GradientNoise(PrivateMethods)
+- (uint32_t)premultipliedPixelForColor:(Color *)color;
+@end
+
+@implementation GradientNoise
+//------------------------------------------------------------------------------
+#pragma mark -
+#pragma mark || Private ||
+//------------------------------------------------------------------------------
+- (uint32_t)premultipliedPixelForColor:(Color *)color {
+  CGFloat c[4];
+  [color getComponents:c];
+
+  uint32_t a = (uint32_t)rint(c[3] * 255.0);
+  uint32_t r = (uint32_t)rint(c[0] * c[3] * 255.0);
+  uint32_t g = (uint32_t)rint(c[1] * c[3] * 255.0);
+  uint32_t b = (uint32_t)rint(c[2] * c[3] * 255.0);
+
+  return a << 24 | r << 16 | g << 8 | b;
+}
+
+//------------------------------------------------------------------------------
+#pragma mark -
+#pragma mark || RuntimeObject ||
+//------------------------------------------------------------------------------
++ (NSString *)className {
+  return @"GradientNoise";
+}
+
+//------------------------------------------------------------------------------
++ (NSSet *)properties {
+  return [NSSet setWithObjects:@"scale", @"octaves", @"persistence", @"lacunarity",
+          @"offset", @"lowColor", @"highColor", nil];
+}
+
+//------------------------------------------------------------------------------
++ (NSSet *)methods {
+  return [NSSet setWithObjects:@"drawInLayer", @"toString", nil];
+}
+
+//------------------------------------------------------------------------------
+- (id)initWithArguments:(NSArray *)arguments {
+  if ((self = [super initWithArguments:arguments])) {
+    // args: [scale, [octaves]]
+    int count = [arguments count];
+
+    seed_ = RandomizerSeedValue();
+    scale_ = 100;
+    octaves_ = 4;
+    persistence_ = 0.5;
+    lacunarity_ = 2.0;
+    lowColor_ = [[Color alloc] initWithColorName:@"black"];
+    highColor_ = [[Color alloc] initWithColorName:@"white"];
+
+    if (count >= 1)
+      [self setScale:[RuntimeObject coerceObjectToDouble:[arguments objectAtIndex:0]]];
+
+    if (count >= 2)
+      [self setOctaves:[RuntimeObject coerceObjectToDouble:[arguments objectAtIndex:1]]];
+  }
+
+  return self;
+}
+
+//------------------------------------------------------------------------------
+- (void)dealloc {
+  [lowColor_ release];
+  [highColor_ release];
+  [super dealloc];
+}
+
+//------------------------------------------------------------------------------
+- (NSString *)toString {
+  return [NSString stringWithFormat:@"GradientNoise (%p): scale: %g, octaves: %d",
+          self, scale_, octaves_];
+}
+
+//------------------------------------------------------------------------------
+#pragma mark -
+#pragma mark || Public ||
+//------------------------------------------------------------------------------
+- (void)setScale:(CGFloat)scale {
+  scale_ = scale > 1 ? scale : 1;
+}
+
+//------------------------------------------------------------------------------
+- (CGFloat)scale {
+  return scale_;
+}
+
+//------------------------------------------------------------------------------
+- (void)setOctaves:(int)octaves {
+  octaves_ = MIN(MAX(octaves, 1), 16);
+}
+
+//------------------------------------------------------------------------------
+- (int)octaves {
+  return octaves_;
+}
+
+//------------------------------------------------------------------------------
+- (void)setPersistence:(CGFloat)persistence {
+  persistence_ = persistence;
+}
+
+//------------------------------------------------------------------------------
+- (CGFloat)persistence {
+  return persistence_;
+}
+
+//------------------------------------------------------------------------------
+- (void)setLacunarity:(CGFloat)lacunarity {
+  lacunarity_ = lacunarity;
+}
+
+//------------------------------------------------------------------------------
+- (CGFloat)lacunarity {
+  return lacunarity_;
+}
+
+//------------------------------------------------------------------------------
+- (void)setOffset:(id)obj {
+  PointObject *pt = [RuntimeObject coerceObject:obj toClass:[PointObject class]];
+
+  offset_ = NSPointToCGPoint([pt point]);
+}
+
+//------------------------------------------------------------------------------
+- (id)offset {
+  return [[[PointObject alloc] initWithPoint:NSPointFromCGPoint(offset_)] autorelease];
+}
+
+//------------------------------------------------------------------------------
+- (void)setLowColor:(id)obj {
+  Color *c = [RuntimeObject coerceObject:obj toClass:[Color class]];
+
+  if (c && c != lowColor_) {
+    [lowColor_ release];
+    lowColor_ = [c retain];
+  }
+}
+
+//------------------------------------------------------------------------------
+- (id)lowColor {
+  return lowColor_;
+}
+
+//------------------------------------------------------------------------------
+- (void)setHighColor:(id)obj {
+  Color *c = [RuntimeObject coerceObject:obj toClass:[Color class]];
+
+  if (c && c != highColor_) {
+    [highColor_ release];
+    highColor_ = [c retain];
+  }
+}
+
+//------------------------------------------------------------------------------
+- (id)highColor {
+  return highColor_;
+}
+
+//------------------------------------------------------------------------------
+- (void)drawInLayer:(NSArray *)arguments {
+  if ([arguments count] != 1)
+    return;
+
+  Layer *layer = [RuntimeObject coerceObject:[arguments objectAtIndex:0] toClass:[Layer class]];
+
+  if (!layer)
+    return;
+
+  CGRect rect = CGRectMake(0, 0, CGRectGetWidth([layer cgRectFrame]), CGRectGetHeight([layer cgRectFrame]));
+  GradientNoiseParameters params;
+
+  params.width = ceil(CGRectGetWidth(rect));
+  params.height = ceil(CGRectGetHeight(rect));
+
+  if (!params.width || !params.height)
+    return;
+
+  // 32-bit/pixel ARGB.  16 byte align rowbytes
+  params.rowBytes = ((4 * params.width) + 0xF) & ~0xF;
+  params.pixels = (uint8_t *)malloc(params.height * params.rowBytes);
+
+  if (!params.pixels) {
+    MethodLog("Unable to allocate %lu x %lu", (unsigned long)params.width,
+              (unsigned long)params.height);
+    return;
+  }
+
+  CGColorSpaceRef cs = [Color createDefaultCGColorSpace];
+  CGContextRef bitmap = CGBitmapContextCreate(params.pixels, params.width, params.height, 8,
+                                              params.rowBytes, cs, kCGImageAlphaPremultipliedFirst);
+  CGColorSpaceRelease(cs);
+
+  if (!bitmap) {
+    free(params.pixels);
+    return;
+  }
+
+  // Whole pixel offsets line up with the cached tiles
+  params.offsetX = lrint(offset_.x);
+  params.offsetY = lrint(offset_.y);
+  params.lowColor = [self premultipliedPixelForColor:lowColor_];
+  params.highColor = [self premultipliedPixelForColor:highColor_];
+  params.field.seed = seed_;
+  params.field.octaves = octaves_;
+  params.field.scale = scale_;
+  params.field.persistence = persistence_;
+  params.field.lacunarity = lacunarity_;
+
+  if (!GradientNoiseRender(&params, WorkQueueGetShared())) {
+    MethodLog("Unable to render %lu x %lu", (unsigned long)params.width, 
+              (unsigned long)params.height);
+    CGContextRelease(bitmap);
+    free(params.pixels);
+    return;
+  }
+
+  CGImageRef image = CGBitmapContextCreateImage(bitmap);
+  [layer markDirtyRect:rect];
+  CGContextDrawImage([layer backingStore], rect, image);
+  CGImageRelease(image);
+  CGContextRelease(bitmap);
+  free(params.pixels);
+}
+
+@end
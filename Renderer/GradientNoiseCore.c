@@ -0,0 +1,627 @@
+// Copyright 2008 Google Inc.
+//
+// Licensed under the Apache License, Version 2.0 (the "License"); you may not
+// use this file except in compliance with the License.  You may obtain a copy
+// of the License at
+//
+// http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS, WITHOUT
+// WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.  See the
+// License for the specific language governing permissions and limitations under
+// the License.
+
+
+#include <math.h>
+#include <pthread.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "GradientNoiseCore.h"
+#include "RandomStream.h"
+
+#define kTilePixels (kGradientNoiseTileSize * kGradientNoiseTileSize)
+
+// 8K values per tile, so this is 16 MB: enough for every tile of a 2560 x
+// 1600 draw, so that drawing the same frame again finds all of its tiles.
+// Tiles that a draw is using are kept until it finishes, even over the limit.
+#define kCacheDefaultTiles 2048
+#define kCacheBuckets 4096
+
+// Rows per compositing task
+#define kBandRows 32
+
+enum {
+  kTilePending,                 // Being rendered by the draw that created it
+  kTileReady,
+  kTileFailed
+};
+
+typedef struct CacheEntry {
+  GradientNoiseField field;
+  long tileX;
+  long tileY;
+  struct CacheEntry *nextInBucket;
+  struct CacheEntry *older;
+  struct CacheEntry *newer;
+  int state;
+  int isCached;                 // In a bucket and the LRU list
+  unsigned long useCount;       // Draws that are using the values
+  uint16_t values[kTilePixels];
+} CacheEntry;
+
+typedef struct {
+  const GradientNoiseParameters *params;
+  uint8_t perm[512];
+  CacheEntry **pending;
+  uint8_t *isRendered;          // For each pending tile
+  CacheEntry **grid;            // Every tile that the draw covers, row major
+  long firstTileX;
+  long firstTileY;
+  size_t gridColumns;
+} RenderJob;
+
+// The lock is only held to find, publish and release tiles.  Tiles in use by
+// a draw are never evicted, and a draw that needs a tile that another draw is
+// still rendering waits on sTileDone for it.
+static pthread_mutex_t sCacheLock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t sTileDone = PTHREAD_COND_INITIALIZER;
+static CacheEntry *sBuckets[kCacheBuckets];
+static CacheEntry *sOldest = NULL;
+static CacheEntry *sNewest = NULL;
+static size_t sEntryCount = 0;
+static size_t sCacheLimit = kCacheDefaultTiles;
+
+//------------------------------------------------------------------------------
+// Simplex
+//------------------------------------------------------------------------------
+static const float kGradients[8][2] = {
+  { 1, 1 }, { -1, 1 }, { 1, -1 }, { -1, -1 },
+  { 1, 0 }, { -1, 0 }, { 0, 1 }, { 0, -1 }
+};
+
+static void BuildPermutation(uint64_t seed, uint8_t perm[512]) {
+  RandomStream stream;
+  RandomStreamInit(&stream, seed, RandomStreamIDForName("GradientNoise"));
+
+  for (int i = 0; i < 256; ++i)
+    perm[i] = (uint8_t)i;
+
+  // Fisher-Yates
+  for (int i = 255; i > 0; --i) {
+    int j = (int)(RandomStreamNextBits(&stream) % (uint64_t)(i + 1));
+    uint8_t temp = perm[i];
+    perm[i] = perm[j];
+    perm[j] = temp;
+  }
+
+  for (int i = 0; i < 256; ++i)
+    perm[256 + i] = perm[i];
+}
+
+typedef float NoiseVector __attribute__((vector_size(16)));
+typedef int32_t NoiseMask __attribute__((vector_size(16)));
+
+// The vector path finds the simplex cells by rounding with this, so it's only
+// used for coordinates below 2^22 in magnitude
+#define kRoundingConstant 12582912.0f   // 1.5 * 2^23
+#define kVectorRange 4194304.0f         // 2^22
+
+static inline NoiseVector Splat(float value) {
+  NoiseVector result = { value, value, value, value };
+  return result;
+}
+
+static inline NoiseMask SplatMask(int32_t value) {
+  NoiseMask result = { value, value, value, value };
+  return result;
+}
+
+// Add |amplitude| times 2D simplex noise (in about [-1, 1]) at (x[n], y) to
+// sum[n] for a row of a tile, one point at a time
+static void AddSimplexRowScalar(const uint8_t *perm, const float *x, float y, float amplitude,
+                                float *sum) {
+  const float F2 = 0.366025403784f;     // (sqrt(3) - 1) / 2
+  const float G2 = 0.211324865405f;     // (3 - sqrt(3)) / 6
+
+  for (int n = 0; n < kGradientNoiseTileSize; ++n) {
+    float s = (x[n] + y) * F2;
+    float fi = floorf(x[n] + s);
+    float fj = floorf(y + s);
+    float t = (fi + fj) * G2;
+    float cx[3], cy[3], total = 0;
+    const float *g[3];
+
+    // Lower or upper triangle of the skewed cell
+    cx[0] = x[n] - (fi - t);
+    cy[0] = y - (fj - t);
+    int i1 = cx[0] > cy[0];
+    int i = (int)((long)fi & 255);
+    int j = (int)((long)fj & 255);
+
+    cx[1] = cx[0] - i1 + G2;
+    cy[1] = cy[0] - (1 - i1) + G2;
+    cx[2] = cx[0] - 1.0f + 2.0f * G2;
+    cy[2] = cy[0] - 1.0f + 2.0f * G2;
+    g[0] = kGradients[perm[i + perm[j]] & 7];
+    g[1] = kGradients[perm[i + i1 + perm[j + 1 - i1]] & 7];
+    g[2] = kGradients[perm[i + 1 + perm[j + 1]] & 7];
+
+    for (int k = 0; k < 3; ++k) {
+      float c = 0.5f - cx[k] * cx[k] - cy[k] * cy[k];
+
+      c = c < 0 ? 0 : c;
+      c *= c;
+      total += c * c * (g[k][0] * cx[k] + g[k][1] * cy[k]);
+    }
+
+    sum[n] += amplitude * (70.0f * total);
+  }
+}
+
+// The same, four points at a time.  Only the gradient lookups are scalar.
+// The results are identical to AddSimplexRowScalar().
+static void AddSimplexRowVector(const uint8_t *perm, const float *x, float y, float amplitude,
+                                float *sum) {
+  const float F2 = 0.366025403784f;
+  const float G2 = 0.211324865405f;
+  const NoiseVector zero = Splat(0), one = Splat(1.0f), half = Splat(0.5f);
+  const NoiseVector rounding = Splat(kRoundingConstant);
+  const NoiseMask oneBits = SplatMask(0x3F800000);   // 1.0f
+  const NoiseVector yv = Splat(y);
+
+  for (int n = 0; n < kGradientNoiseTileSize; n += 4) {
+    NoiseVector xv, cx[3], cy[3], gx[3], gy[3];
+    int32_t i[4], j[4], i1[4];
+    float gValues[2][3][4];
+
+    memcpy(&xv, x + n, sizeof(xv));
+
+    NoiseVector s = (xv + yv) * Splat(F2);
+
+    // Round to the nearest integer, then floor.  The low bits of the rounded
+    // value (before the constant is taken off) are the integer itself.
+    NoiseVector ri = xv + s + rounding, rj = yv + s + rounding;
+    NoiseVector fi = ri - rounding, fj = rj - rounding;
+    NoiseMask iOver = fi > xv + s, jOver = fj > yv + s;
+    NoiseMask iv = ((NoiseMask)ri + iOver) & SplatMask(255);
+    NoiseMask jv = ((NoiseMask)rj + jOver) & SplatMask(255);
+
+    fi -= (NoiseVector)(iOver & oneBits);
+    fj -= (NoiseVector)(jOver & oneBits);
+
+    NoiseVector t = (fi + fj) * Splat(G2);
+    NoiseMask upper;
+
+    cx[0] = xv - (fi - t);
+    cy[0] = yv - (fj - t);
+    upper = cx[0] > cy[0];
+
+    NoiseVector upperFloat = (NoiseVector)(upper & oneBits);
+    NoiseMask i1v = -upper;
+
+    cx[1] = cx[0] - upperFloat + Splat(G2);
+    cy[1] = cy[0] - (one - upperFloat) + Splat(G2);
+    cx[2] = cx[0] - one + Splat(2.0f * G2);
+    cy[2] = cy[0] - one + Splat(2.0f * G2);
+
+    memcpy(i, &iv, sizeof(i));
+    memcpy(j, &jv, sizeof(j));
+    memcpy(i1, &i1v, sizeof(i1));
+
+    for (int k = 0; k < 4; ++k) {
+      const float *g0 = kGradients[perm[i[k] + perm[j[k]]] & 7];
+      const float *g1 = kGradients[perm[i[k] + i1[k] + perm[j[k] + 1 - i1[k]]] & 7];
+      const float *g2 = kGradients[perm[i[k] + 1 + perm[j[k] + 1]] & 7];
+
+      gValues[0][0][k] = g0[0];
+      gValues[1][0][k] = g0[1];
+      gValues[0][1][k] = g1[0];
+      gValues[1][1][k] = g1[1];
+      gValues[0][2][k] = g2[0];
+      gValues[1][2][k] = g2[1];
+    }
+
+    NoiseVector total = zero;
+
+    for (int k = 0; k < 3; ++k) {
+      memcpy(&gx[k], gValues[0][k], sizeof(gx[k]));
+      memcpy(&gy[k], gValues[1][k], sizeof(gy[k]));
+
+      NoiseVector c = half - cx[k] * cx[k] - cy[k] * cy[k];
+
+      c = (NoiseVector)((NoiseMask)c & (c >= zero));
+      c *= c;
+      total += c * c * (gx[k] * cx[k] + gy[k] * cy[k]);
+    }
+
+    NoiseVector sums;
+
+    memcpy(&sums, sum + n, sizeof(sums));
+    sums += Splat(amplitude) * (Splat(70.0f) * total);
+    memcpy(sum + n, &sums, sizeof(sums));
+  }
+}
+
+// Rows whose skewed coordinates are all in range take the vector path
+static void AddSimplexRow(const uint8_t *perm, const float *x, float y, float amplitude,
+                          float *sum) {
+  float first = x[0], last = x[kGradientNoiseTileSize - 1];
+  float limit = kVectorRange / 4;   // Leaves room for the skew
+
+  if (fabsf(first) < limit && fabsf(last) < limit && fabsf(y) < limit)
+    AddSimplexRowVector(perm, x, y, amplitude, sum);
+  else
+    AddSimplexRowScalar(perm, x, y, amplitude, sum);
+}
+
+static int RenderTileWithPermutation(const GradientNoiseField *field, const uint8_t *perm,
+                                     long tileX, long tileY, uint16_t *dest) {
+  int octaves = field->octaves < 1 ? 1 : field->octaves;
+  float frequency = 1.0f / (field->scale > 0 ? field->scale : 1.0f);
+  float amplitude = 1.0f;
+  float total = 0;
+  float row[kGradientNoiseTileSize];
+  float *sums = (float *)calloc(kTilePixels, sizeof(float));
+  double originX = (double)tileX * kGradientNoiseTileSize;
+  double originY = (double)tileY * kGradientNoiseTileSize;
+
+  if (!sums)
+    return 0;
+
+  for (int octave = 0; octave < octaves; ++octave) {
+    // Shift each octave so that they don't all line up at the origin
+    double shift = octave * 17.31;
+
+    for (int y = 0; y < kGradientNoiseTileSize; ++y) {
+      float ny = (float)((originY + y) * frequency + shift);
+      float *sum = sums + y * kGradientNoiseTileSize;
+
+      for (int x = 0; x < kGradientNoiseTileSize; ++x)
+        row[x] = (float)((originX + x) * frequency + shift);
+
+      AddSimplexRow(perm, row, ny, amplitude, sum);
+    }
+
+    total += amplitude;
+    amplitude *= field->persistence;
+    frequency *= field->lacunarity;
+  }
+
+  // From [-total, total] to [0, 65535]
+  float toValue = 32767.5f / (total > 0 ? total : 1.0f);
+  for (int i = 0; i < kTilePixels; ++i) {
+    float v = (sums[i] * toValue) + 32767.5f;
+    dest[i] = v < 0 ? 0 : v > 65535.0f ? 65535 : (uint16_t)v;
+  }
+
+  free(sums);
+
+  return 1;
+}
+
+int GradientNoiseRenderTile(const GradientNoiseField *field, long tileX, long tileY,
+                            uint16_t *dest) {
+  uint8_t perm[512];
+
+  BuildPermutation(field->seed, perm);
+
+  return RenderTileWithPermutation(field, perm, tileX, tileY, dest);
+}
+
+//------------------------------------------------------------------------------
+// Cache
+//------------------------------------------------------------------------------
+static int FieldsAreEqual(const GradientNoiseField *a, const GradientNoiseField *b) {
+  return a->seed == b->seed && a->octaves == b->octaves && a->scale == b->scale &&
+    a->persistence == b->persistence && a->lacunarity == b->lacunarity;
+}
+
+static uint64_t FloatBits(float f) {
+  union { float f; uint32_t u; } value;
+  value.f = f;
+  return value.u;
+}
+
+static size_t BucketForTile(const GradientNoiseField *field, long tileX, long tileY) {
+  uint64_t hash = RandomStreamMix(field->seed ^ (uint64_t)field->octaves);
+  hash = RandomStreamMix(hash ^ (FloatBits(field->scale) << 32 | FloatBits(field->persistence)));
+  hash = RandomStreamMix(hash ^ FloatBits(field->lacunarity));
+  hash = RandomStreamMix(hash ^ ((uint64_t)tileX << 32 | (uint32_t)tileY));
+
+  return (size_t)(hash & (kCacheBuckets - 1));
+}
+
+static void Unlink(CacheEntry *entry) {
+  if (entry->older)
+    entry->older->newer = entry->newer;
+  else
+    sOldest = entry->newer;
+
+  if (entry->newer)
+    entry->newer->older = entry->older;
+  else
+    sNewest = entry->older;
+
+  entry->older = entry->newer = NULL;
+}
+
+static void LinkAsNewest(CacheEntry *entry) {
+  entry->older = sNewest;
+  entry->newer = NULL;
+
+  if (sNewest)
+    sNewest->newer = entry;
+  else
+    sOldest = entry;
+
+  sNewest = entry;
+}
+
+// Take |entry| out of the lookup and LRU list.  It's freed now if no draw is
+// using it, or else by the last draw to release it.
+static void Uncache(CacheEntry *entry) {
+  CacheEntry **link = &sBuckets[BucketForTile(&entry->field, entry->tileX, entry->tileY)];
+
+  while (*link != entry)
+    link = &(*link)->nextInBucket;
+
+  *link = entry->nextInBucket;
+  Unlink(entry);
+  entry->isCached = 0;
+  --sEntryCount;
+
+  if (!entry->useCount)
+    free(entry);
+}
+
+static void ReleaseEntry(CacheEntry *entry) {
+  if (!--entry->useCount && !entry->isCached)
+    free(entry);
+}
+
+// Evict the least recently used tiles that no draw is using
+static void TrimCache(void) {
+  CacheEntry *entry = sOldest;
+
+  while (sEntryCount > sCacheLimit && entry) {
+    CacheEntry *newer = entry->newer;
+
+    if (!entry->useCount)
+      Uncache(entry);
+
+    entry = newer;
+  }
+}
+
+// Find or create the entry for a tile and mark it in use.  |*isNew| is set if
+// it needs to be rendered.
+static CacheEntry *EntryForTile(const GradientNoiseField *field, long tileX, long tileY,
+                                int *isNew) {
+  size_t bucket = BucketForTile(field, tileX, tileY);
+  CacheEntry *entry;
+
+  for (entry = sBuckets[bucket]; entry; entry = entry->nextInBucket) {
+    if (entry->tileX == tileX && entry->tileY == tileY && FieldsAreEqual(&entry->field, field)) {
+      Unlink(entry);
+      LinkAsNewest(entry);
+      ++entry->useCount;
+      *isNew = 0;
+      return entry;
+    }
+  }
+
+  entry = (CacheEntry *)malloc(sizeof(CacheEntry));
+
+  if (!entry)
+    return NULL;
+
+  entry->field = *field;
+  entry->tileX = tileX;
+  entry->tileY = tileY;
+  entry->state = kTilePending;
+  entry->isCached = 1;
+  entry->useCount = 1;
+  entry->nextInBucket = sBuckets[bucket];
+  sBuckets[bucket] = entry;
+  LinkAsNewest(entry);
+  ++sEntryCount;
+  *isNew = 1;
+
+  return entry;
+}
+
+void GradientNoiseSetCacheLimit(size_t tiles) {
+  pthread_mutex_lock(&sCacheLock);
+  sCacheLimit = tiles;
+  TrimCache();
+  pthread_mutex_unlock(&sCacheLock);
+}
+
+void GradientNoiseFlushCache(void) {
+  pthread_mutex_lock(&sCacheLock);
+
+  for (CacheEntry *entry = sOldest; entry; ) {
+    CacheEntry *newer = entry->newer;
+
+    // Tiles that are still being rendered are left for their draw
+    if (entry->state != kTilePending)
+      Uncache(entry);
+
+    entry = newer;
+  }
+
+  pthread_mutex_unlock(&sCacheLock);
+}
+
+//------------------------------------------------------------------------------
+// Rendering
+//------------------------------------------------------------------------------
+static inline long FloorDivide(long value, long divisor) {
+  long quotient = value / divisor;
+
+  return (value % divisor && value < 0) ? quotient - 1 : quotient;
+}
+
+static void RenderPendingTile(void *context, size_t index, int worker) {
+  RenderJob *job = (RenderJob *)context;
+  CacheEntry *entry = job->pending[index];
+
+  (void)worker;
+
+  job->isRendered[index] = RenderTileWithPermutation(&entry->field, job->perm, entry->tileX,
+                                                     entry->tileY, entry->values);
+}
+
+static inline uint8_t Mix(uint32_t low, uint32_t high, int shift, uint32_t weight) {
+  uint32_t l = (low >> shift) & 0xFF;
+  uint32_t h = (high >> shift) & 0xFF;
+
+  return (uint8_t)((l * (65536 - weight) + h * weight + 32768) >> 16);
+}
+
+static void ComposeBand(void *context, size_t index, int worker) {
+  RenderJob *job = (RenderJob *)context;
+  const GradientNoiseParameters *p = job->params;
+  size_t firstRow = index * kBandRows;
+  size_t lastRow = firstRow + kBandRows < p->height ? firstRow + kBandRows : p->height;
+
+  (void)worker;
+
+  for (size_t y = firstRow; y < lastRow; ++y) {
+    long noiseY = (long)y + p->offsetY;
+    long tileY = FloorDivide(noiseY, kGradientNoiseTileSize);
+    long tileRow = noiseY - tileY * kGradientNoiseTileSize;
+    CacheEntry **tiles = job->grid + (tileY - job->firstTileY) * job->gridColumns;
+    uint8_t *dest = p->pixels + y * p->rowBytes;
+    size_t x = 0;
+
+    // One run per tile
+    while (x < p->width) {
+      long noiseX = (long)x + p->offsetX;
+      long tileX = FloorDivide(noiseX, kGradientNoiseTileSize);
+      long column = noiseX - tileX * kGradientNoiseTileSize;
+      size_t run = kGradientNoiseTileSize - column;
+      CacheEntry *tile = tiles[tileX - job->firstTileX];
+
+      if (run > p->width - x)
+        run = p->width - x;
+
+      if (tile) {
+        const uint16_t *values = tile->values + tileRow * kGradientNoiseTileSize + column;
+
+        for (size_t i = 0; i < run; ++i, dest += 4) {
+          uint32_t weight = values[i] + (values[i] >> 15);
+          dest[0] = Mix(p->lowColor, p->highColor, 24, weight);
+          dest[1] = Mix(p->lowColor, p->highColor, 16, weight);
+          dest[2] = Mix(p->lowColor, p->highColor, 8, weight);
+          dest[3] = Mix(p->lowColor, p->highColor, 0, weight);
+        }
+      } else {
+        dest += 4 * run;
+      }
+
+      x += run;
+    }
+  }
+}
+
+int GradientNoiseRender(const GradientNoiseParameters *params, WorkQueue *queue) {
+  if (!params->pixels || !params->width || !params->height)
+    return 1;
+
+  RenderJob job;
+  long lastTileX, lastTileY;
+  size_t gridRows, tileCount, pendingCount = 0;
+  int isComplete = 1;
+
+  job.params = params;
+  job.firstTileX = FloorDivide(params->offsetX, kGradientNoiseTileSize);
+  job.firstTileY = FloorDivide(params->offsetY, kGradientNoiseTileSize);
+  lastTileX = FloorDivide(params->offsetX + (long)params->width - 1, kGradientNoiseTileSize);
+  lastTileY = FloorDivide(params->offsetY + (long)params->height - 1, kGradientNoiseTileSize);
+  job.gridColumns = (size_t)(lastTileX - job.firstTileX + 1);
+  gridRows = (size_t)(lastTileY - job.firstTileY + 1);
+  tileCount = job.gridColumns * gridRows;
+  job.grid = (CacheEntry **)calloc(tileCount, sizeof(CacheEntry *));
+  job.pending = (CacheEntry **)calloc(tileCount, sizeof(CacheEntry *));
+  job.isRendered = (uint8_t *)calloc(tileCount, sizeof(uint8_t));
+
+  if (!job.grid || !job.pending || !job.isRendered) {
+    free(job.grid);
+    free(job.pending);
+    free(job.isRendered);
+    return 0;
+  }
+
+  BuildPermutation(params->field.seed, job.perm);
+
+  // Claim the tiles, and create the ones that this draw has to render
+  pthread_mutex_lock(&sCacheLock);
+
+  for (size_t j = 0; j < gridRows; ++j) {
+    for (size_t i = 0; i < job.gridColumns; ++i) {
+      int isNew = 0;
+      CacheEntry *entry = EntryForTile(&params->field, job.firstTileX + (long)i,
+                                       job.firstTileY + (long)j, &isNew);
+      job.grid[j * job.gridColumns + i] = entry;
+
+      if (isNew)
+        job.pending[pendingCount++] = entry;
+    }
+  }
+
+  pthread_mutex_unlock(&sCacheLock);
+
+  WorkQueueApply(queue, pendingCount, RenderPendingTile, &job);
+
+  // Publish the new tiles (a failed one is never reused), then wait for any
+  // that another draw is rendering
+  pthread_mutex_lock(&sCacheLock);
+
+  for (size_t i = 0; i < pendingCount; ++i) {
+    CacheEntry *entry = job.pending[i];
+    entry->state = job.isRendered[i] ? kTileReady : kTileFailed;
+
+    if (entry->state == kTileFailed)
+      Uncache(entry);
+  }
+
+  pthread_cond_broadcast(&sTileDone);
+
+  for (size_t i = 0; i < tileCount; ++i) {
+    CacheEntry *entry = job.grid[i];
+
+    while (entry && entry->state == kTilePending)
+      pthread_cond_wait(&sTileDone, &sCacheLock);
+
+    if (!entry || entry->state == kTileFailed) {
+      if (entry)
+        ReleaseEntry(entry);
+
+      job.grid[i] = NULL;
+      isComplete = 0;
+    }
+  }
+
+  pthread_mutex_unlock(&sCacheLock);
+
+  WorkQueueApply(queue, (params->height + kBandRows - 1) / kBandRows, ComposeBand, &job);
+
+  pthread_mutex_lock(&sCacheLock);
+
+  for (size_t i = 0; i < tileCount; ++i) {
+    if (job.grid[i])
+      ReleaseEntry(job.grid[i]);
+  }
+
+  TrimCache();
+  pthread_mutex_unlock(&sCacheLock);
+
+  free(job.grid);
+  free(job.pending);
+  free(job.isRendered);
+
+  return isComplete;
+}
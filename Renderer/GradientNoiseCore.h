@@ -0,0 +1,80 @@
+// Copyright 2008 Google Inc.
+//
+// Licensed under the Apache License, Version 2.0 (the "License"); you may not
+// use this file except in compliance with the License.  You may obtain a copy
+// of the License at
+//
+// http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS, WITHOUT
+// WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.  See the
+// License for the specific language governing permissions and limitations under
+// the License.
+
+
+// Fractal (fBm) simplex noise rendered into a premultiplied ARGB buffer.
+//
+// The noise is evaluated in 64 x 64 pixel tiles on a grid that is fixed in
+// "noise space" (pixel + offset).  Tiles are rendered in parallel on a
+// WorkQueue and kept in a process wide cache keyed by the seed, the fractal
+// parameters and the tile position, so drawing the same noise again, or with
+// a whole-pixel offset, only evaluates the tiles that haven't been seen.
+
+#ifndef GRADIENTNOISECORE_H
+#define GRADIENTNOISECORE_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+#include "WorkQueue.h"
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+#define kGradientNoiseTileSize 64
+
+typedef struct {
+  uint64_t seed;
+  int octaves;
+  float scale;            // Size of the largest features, in pixels
+  float persistence;      // Amplitude multiplier from one octave to the next
+  float lacunarity;       // Frequency multiplier from one octave to the next
+} GradientNoiseField;
+
+typedef struct {
+  uint8_t *pixels;        // A, R, G, B bytes, premultiplied
+  size_t width;
+  size_t height;
+  size_t rowBytes;
+  long offsetX;           // Noise space position of pixel (0, 0)
+  long offsetY;
+  uint32_t lowColor;      // 0xAARRGGBB, premultiplied, for a noise value of 0
+  uint32_t highColor;     // ... and for 1
+  GradientNoiseField field;
+} GradientNoiseParameters;
+
+// Returns 0 if memory ran out; the tiles that couldn't be rendered are left
+// untouched in |pixels|.  Draws on different threads share the cache.
+int GradientNoiseRender(const GradientNoiseParameters *params, WorkQueue *queue);
+
+// Fill |dest| (kGradientNoiseTileSize squared values, row major) with the
+// noise for tile (tileX, tileY), scaled to 0 - 65535.  Returns 0 if memory ran
+// out.
+int GradientNoiseRenderTile(const GradientNoiseField *field, long tileX, long tileY,
+                            uint16_t *dest);
+
+// Keep at most |tiles| tiles (8 KB each) between draws.  A draw that needs
+// more still gets them, but the extra tiles are released when it finishes.
+// The default is 2048.
+void GradientNoiseSetCacheLimit(size_t tiles);
+
+// Drop all of the cached tiles
+void GradientNoiseFlushCache(void);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif  // GRADIENTNOISECORE_H
@@ -22,6 +22,9 @@
   CGFloat gravity_;
 }
 
+- (CGPoint)cgPointLocation;
+- (CGFloat)gravity;
+
 - (CGPoint)accelerationForPoint:(CGPoint)point;
 
 @end
@@ -37,11 +37,26 @@
   location_ = NSPointToCGPoint([pt point]);
 }
 
+//------------------------------------------------------------------------------
+- (id)location {
+  return [[[PointObject alloc] initWithPoint:NSPointFromCGPoint(location_)] autorelease];
+}
+
+//------------------------------------------------------------------------------
+- (CGPoint)cgPointLocation {
+  return location_;
+}
+
 //------------------------------------------------------------------------------
 - (void)setGravity:(CGFloat)g {
   gravity_ = g;
 }
 
+//------------------------------------------------------------------------------
+- (CGFloat)gravity {
+  return gravity_;
+}
+
 //------------------------------------------------------------------------------
 - (NSString *)toString {
   return [NSString stringWithFormat:@"GravityWell: %@, g=%g", 
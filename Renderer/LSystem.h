@@ -14,6 +14,7 @@
 
 // Implement L-System module
 
+#import "LSystemCore.h"
 #import "RuntimeObject.h"
 
 @class Function;
@@ -32,6 +33,12 @@
   
   Runtime *runtime_;
   CGContextRef layerRef_;
+
+  LSystemCore *core_;         // Compiled rules and memoized expansions
+  BOOL rulesChanged_;
+  LSystemSegments segments_;   // Geometry for segmentsParams_
+  LSystemParameters segmentsParams_;
+  BOOL segmentsValid_;
 }
 
 @end
@@ -17,6 +17,7 @@
 #import "Layer.h"
 #import "LSystem.h"
 #import "PointObject.h"
+#import "RectObject.h"
 #import "Runtime.h"
 
 static inline CGFloat DegToRad(CGFloat deg) {
@@ -28,9 +29,31 @@ static inline CGFloat RadToDeg(CGFloat rad) {
 }
 
 @interface LSystem(PrivateMethods)
-- (void)drawRule:(NSString *)rule depth:(int)depth length:(CGFloat)length;
+- (void)compileRules;
+- (void)drawFunctionWithDelta:(const LSystemTransform *)delta depth:(int)depth
+                     lastRule:(unichar)lastRule lastTurn:(unichar)lastTurn;
+- (void)getParameters:(LSystemParameters *)params depth:(int)depth;
+- (BOOL)expandToDepth:(int)depth;
+- (void)strokeSegmentsWithTransform:(CGAffineTransform)transform;
+- (void)drawInLayer:(Layer *)layer depth:(int)depth fitRect:(const CGRect *)fitRect;
+- (void)saveState;
+- (void)restoreState;
 @end
 
+static void DrawCallback(void *context, const LSystemTransform *delta, int depth,
+                         double length, uint16_t lastRule, uint16_t lastTurn) {
+  [(LSystem *)context drawFunctionWithDelta:delta depth:depth lastRule:lastRule
+                                   lastTurn:lastTurn];
+}
+
+static void PushCallback(void *context) {
+  [(LSystem *)context saveState];
+}
+
+static void PopCallback(void *context) {
+  [(LSystem *)context restoreState];
+}
+
 @implementation LSystem
 //------------------------------------------------------------------------------
 #pragma mark -
@@ -55,7 +78,8 @@ static inline CGFloat RadToDeg(CGFloat rad) {
 
 //------------------------------------------------------------------------------
 + (NSSet *)methods {
-  return [NSSet setWithObjects:@"addRule", @"drawInLayer", @"toString", nil];
+  return [NSSet setWithObjects:@"addRule", @"bounds", @"drawInLayer", @"drawInRect",
+          @"toString", nil];
 }
 
 //------------------------------------------------------------------------------
@@ -68,6 +92,8 @@ static inline CGFloat RadToDeg(CGFloat rad) {
     rules_ = [[NSMutableDictionary alloc] init];
     
     [rules_ setObject:@"DD+1" forKey:@"1"];
+    core_ = LSystemCoreCreate();
+    rulesChanged_ = YES;
   }
   return self;
 }
@@ -75,6 +101,10 @@ static inline CGFloat RadToDeg(CGFloat rad) {
 //------------------------------------------------------------------------------
 - (void)dealloc {
   [drawFunction_ release];
+  [rules_ release];
+  [root_ release];
+  LSystemCoreRelease(core_);
+  LSystemSegmentsRelease(&segments_);
   [super dealloc];
 }
 
@@ -122,6 +152,7 @@ static inline CGFloat RadToDeg(CGFloat rad) {
 - (void)setRoot:(NSString *)root {
   [root_ release];
   root_ = [root copy];
+  rulesChanged_ = YES;
 }
 
 //------------------------------------------------------------------------------
@@ -153,76 +184,199 @@ static inline CGFloat RadToDeg(CGFloat rad) {
   NSString *rule = [RuntimeObject coerceObject:[arguments objectAtIndex:0] toClass:[NSString class]];
   NSString *replacement = [RuntimeObject coerceObject:[arguments objectAtIndex:1] toClass:[NSString class]];
   
-  if (rule && replacement)
+  if (rule && replacement) {
     [rules_ setObject:replacement forKey:rule];
+    rulesChanged_ = YES;
+  }
 }
 
 //------------------------------------------------------------------------------
-- (void)drawAtCurrentLocation:(int)depth length:(CGFloat)length{
-  if (drawFunction_) {
-    depth_ = depth;
-    [[drawFunction_ runtime] invokeFunction:drawFunction_ arguments:[NSArray arrayWithObject:self]];
-  } else {
-    CGContextBeginPath(layerRef_);
-    CGContextMoveToPoint(layerRef_, 0, 0);
-    CGContextAddLineToPoint(layerRef_, 0, length);
-    CGContextStrokePath(layerRef_);
+- (void)compileRules {
+  NSEnumerator *e = [rules_ keyEnumerator];
+  NSString *rule;
+  unichar *chars = NULL;
+  
+  LSystemCoreReset(core_);
+  
+  // Rules are keyed by a single character
+  while ((rule = [e nextObject])) {
+    NSString *replacement = [rules_ objectForKey:rule];
+    NSUInteger length = [replacement length];
+    
+    if ([rule length] != 1)
+      continue;
+    
+    chars = realloc(chars, sizeof(unichar) * (length + 1));
+    [replacement getCharacters:chars];
+    LSystemCoreSetRule(core_, [rule characterAtIndex:0], chars, length);
   }
   
-  CGContextTranslateCTM(layerRef_, 0, length);
+  NSUInteger length = [root_ length];
+  chars = realloc(chars, sizeof(unichar) * (length + 1));
+  [root_ getCharacters:chars];
+  LSystemCoreSetRoot(core_, chars, length);
+  free(chars);
+  
+  rulesChanged_ = NO;
+  segmentsValid_ = NO;
 }
 
 //------------------------------------------------------------------------------
-- (void)drawCommand:(unichar)cmd depth:(int)depth length:(CGFloat)length {
-  lastRule_ = cmd;
+- (void)drawFunctionWithDelta:(const LSystemTransform *)delta depth:(int)depth
+                     lastRule:(unichar)lastRule lastTurn:(unichar)lastTurn {
+  // Move to the turtle's location and heading
+  CGContextConcatCTM(layerRef_, CGAffineTransformMake(delta->a, delta->b, delta->c, delta->d,
+                                                      delta->tx, delta->ty));
+  depth_ = depth;
+  lastRule_ = lastRule;
+  lastTurn_ = lastTurn;
+  [runtime_ invokeFunction:drawFunction_ arguments:[NSArray arrayWithObject:self]];
+}
 
-  switch (cmd) {
-    case '+':
-      CGContextRotateCTM(layerRef_, -angle_);
-      lastTurn_ = cmd;
-      break;
-      
-    case '-':
-      CGContextRotateCTM(layerRef_, angle_);
-      lastTurn_ = cmd;
-      break;
-      
-    case '[':
-      CGContextSaveGState(layerRef_);
-      break;
-      
-    case ']':
-      CGContextRestoreGState(layerRef_);
-      break;
+//------------------------------------------------------------------------------
+- (void)saveState {
+  CGContextSaveGState(layerRef_);
+}
+
+//------------------------------------------------------------------------------
+- (void)restoreState {
+  CGContextRestoreGState(layerRef_);
+}
+
+//------------------------------------------------------------------------------
+- (void)getParameters:(LSystemParameters *)params depth:(int)depth {
+  bzero(params, sizeof(LSystemParameters));  // Compared with memcmp()
+  params->length = length_;
+  params->lengthScale = lengthScale_;
+  params->angle = angle_;
+  params->maxDepth = depth;
+}
+
+//------------------------------------------------------------------------------
+// Fill segments_ with the lines for |depth|, unless they're already there
+- (BOOL)expandToDepth:(int)depth {
+  LSystemParameters params;
+
+  if (rulesChanged_)
+    [self compileRules];
+
+  [self getParameters:&params depth:depth];
+
+  if (segmentsValid_ && !memcmp(&params, &segmentsParams_, sizeof(params)))
+    return YES;
+
+  segments_.count = 0;
+  segmentsParams_ = params;
+  segmentsValid_ = LSystemCoreRun(core_, &params, &segments_, NULL, NULL, &lastRule_,
+                                  &lastTurn_);
+
+  return segmentsValid_;
+}
+
+//------------------------------------------------------------------------------
+// Connected segments become one polyline and many polylines share a path, so
+// a large system is only a few strokes.
+- (void)strokeSegmentsWithTransform:(CGAffineTransform)transform {
+  static const size_t kSegmentsPerPath = 8192;
+  const double *points = segments_.points;
+  CGPoint last = CGPointZero;
+  
+  for (size_t i = 0; i < segments_.count; ++i, points += 4) {
+    CGPoint start = CGPointApplyAffineTransform(CGPointMake(points[0], points[1]), transform);
+    CGPoint end = CGPointApplyAffineTransform(CGPointMake(points[2], points[3]), transform);
+    BOOL newPath = !(i % kSegmentsPerPath);
+    
+    if (newPath) {
+      if (i)
+        CGContextStrokePath(layerRef_);
       
-    default: {
-      if (depth < maxDepth_) {
-        NSString *cmdStr = [NSString stringWithCharacters:&cmd length:1];
-        NSString *rule = [rules_ objectForKey:cmdStr];
-        [self drawRule:rule depth:depth length:length];
-      } else {
-        [self drawAtCurrentLocation:depth length:length];
-      }
+      CGContextBeginPath(layerRef_);
     }
+    
+    if (newPath || !CGPointEqualToPoint(start, last))
+      CGContextMoveToPoint(layerRef_, start.x, start.y);
+    
+    CGContextAddLineToPoint(layerRef_, end.x, end.y);
+    last = end;
   }
+  
+  if (segments_.count)
+    CGContextStrokePath(layerRef_);
 }
 
 //------------------------------------------------------------------------------
-- (void)drawRule:(NSString *)rule depth:(int)depth length:(CGFloat)length {
-  int len = [rule length];
+- (void)drawInLayer:(Layer *)layer depth:(int)depth fitRect:(const CGRect *)fitRect {
+  CGAffineTransform transform = CGAffineTransformIdentity;
   
-  length *= lengthScale_;
+  runtime_ = [drawFunction_ runtime];
+  layerRef_ = [layer backingStore];
+  
+  if (!layerRef_)
+    return;
+
+  [layer markDirty];
+
+  // Fitting needs the geometry first; without a draw function, so does drawing
+  if ((fitRect || !drawFunction_) && ![self expandToDepth:depth])
+    return;
   
-  if (len) {
-    for (int i = 0; i < len; ++i)
-      [self drawCommand:[rule characterAtIndex:i] depth:depth + 1 length:length];
+  double minX, minY, maxX, maxY;
+  if (fitRect && LSystemSegmentsGetBounds(&segments_, &minX, &minY, &maxX, &maxY)) {
+    CGFloat width = maxX - minX, height = maxY - minY;
+    CGFloat scale = 1;
+    
+    // Scale uniformly to fit and center
+    if (width > 0 && height > 0)
+      scale = MIN(CGRectGetWidth(*fitRect) / width, CGRectGetHeight(*fitRect) / height);
+    else if (width > 0)
+      scale = CGRectGetWidth(*fitRect) / width;
+    else if (height > 0)
+      scale = CGRectGetHeight(*fitRect) / height;
+    
+    transform = CGAffineTransformMakeTranslation(CGRectGetMidX(*fitRect),
+                                                 CGRectGetMidY(*fitRect));
+    transform = CGAffineTransformScale(transform, scale, scale);
+    transform = CGAffineTransformTranslate(transform, -(minX + maxX) / 2, -(minY + maxY) / 2);
+  }
+  
+  CGContextSaveGState(layerRef_);
+
+  if (drawFunction_) {
+    // The draw function is called with the context at each location
+    LSystemCallbacks callbacks = { DrawCallback, PushCallback, PopCallback };
+    LSystemParameters params;
+    
+    [self getParameters:&params depth:depth];
+    CGContextConcatCTM(layerRef_, transform);
+    LSystemCoreRun(core_, &params, NULL, &callbacks, self, &lastRule_, &lastTurn_);
   } else {
-    [self drawAtCurrentLocation:depth length:length];
+    // The points are transformed, rather than the context, to keep the line
+    // width the same
+    [self strokeSegmentsWithTransform:transform];
   }
+
+  CGContextRestoreGState(layerRef_);
 }
 
 //------------------------------------------------------------------------------
-// Args: layer, depth
+// Args: [depth]
+- (RectObject *)bounds:(NSArray *)arguments {
+  int depth = 10;
+  double minX = 0, minY = 0, maxX = 0, maxY = 0;
+
+  if ([arguments count] > 0)
+    depth = [RuntimeObject coerceObjectToInteger:[arguments objectAtIndex:0]];
+
+  if ([self expandToDepth:depth])
+    LSystemSegmentsGetBounds(&segments_, &minX, &minY, &maxX, &maxY);
+
+  NSRect rect = NSMakeRect(minX, minY, maxX - minX, maxY - minY);
+
+  return [[(RectObject *)[RectObject alloc] initWithRect:rect] autorelease];
+}
+
+//------------------------------------------------------------------------------
+// Args: layer, [depth]
 - (void)drawInLayer:(NSArray *)arguments {
   if ([arguments count] < 1 || [arguments count] > 2)
     return;
@@ -231,14 +385,28 @@ static inline CGFloat RadToDeg(CGFloat rad) {
   if ([arguments count] > 1)
     maxDepth_ = [RuntimeObject coerceObjectToInteger:[arguments objectAtIndex:1]];
   
-  runtime_ = [drawFunction_ runtime];
   Layer *layer = [RuntimeObject coerceObject:[arguments objectAtIndex:0] toClass:[Layer class]];
-  layerRef_ = [layer backingStore];
+  [self drawInLayer:layer depth:maxDepth_ fitRect:NULL];
+}
 
-  // Draw
-  CGContextSaveGState(layerRef_);
-  [self drawRule:root_ depth:0 length:length_];
-  CGContextRestoreGState(layerRef_);
+//------------------------------------------------------------------------------
+// Args: layer, rect, [depth]
+- (void)drawInRect:(NSArray *)arguments {
+  if ([arguments count] < 2 || [arguments count] > 3)
+    return;
+  
+  maxDepth_ = 10;
+  if ([arguments count] > 2)
+    maxDepth_ = [RuntimeObject coerceObjectToInteger:[arguments objectAtIndex:2]];
+  
+  Layer *layer = [RuntimeObject coerceObject:[arguments objectAtIndex:0] toClass:[Layer class]];
+  RectObject *rectObj = [RuntimeObject coerceObject:[arguments objectAtIndex:1] toClass:[RectObject class]];
+  
+  if (!rectObj)
+    return;
+  
+  CGRect rect = NSRectToCGRect([rectObj rect]);
+  [self drawInLayer:layer depth:maxDepth_ fitRect:&rect];
 }
 
 @end
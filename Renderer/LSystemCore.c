@@ -0,0 +1,658 @@
+// Copyright 2008 Google Inc.
+//
+// Licensed under the Apache License, Version 2.0 (the "License"); you may not
+// use this file except in compliance with the License.  You may obtain a copy
+// of the License at
+//
+// http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS, WITHOUT
+// WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.  See the
+// License for the specific language governing permissions and limitations under
+// the License.
+
+#include <math.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "LSystemCore.h"
+
+// Expansions with more segments than this are expanded each time
+#define kMaxMemoSegments 1024
+
+// Opcodes other than symbols, which are >= 0
+enum {
+  kOpTurnLeft = -1,       // '+'
+  kOpTurnRight = -2,      // '-'
+  kOpPush = -3,           // '['
+  kOpPop = -4             // ']'
+};
+
+typedef struct {
+  uint16_t symbol;
+  int hasRule;
+  int32_t *ops;
+  size_t count;
+} Symbol;
+
+enum {
+  kExpansionUnknown = 0,
+  kExpansionMemoized,
+  kExpansionTooLarge
+};
+
+// A memoized expansion, relative to the turtle that starts it
+typedef struct {
+  int state;
+  LSystemSegments segments;
+  LSystemTransform end;
+  uint16_t lastRule;      // 0 if unchanged
+  uint16_t lastTurn;
+} Expansion;
+
+struct LSystemCore {
+  Symbol *symbols;
+  size_t symbolCount;
+  size_t symbolCapacity;
+  int32_t *root;
+  size_t rootCount;
+
+  // Indexed by symbol * (maxDepth + 1) + depth, for the parameters in |memoParams|
+  LSystemParameters memoParams;
+  int memoValid;
+  Expansion *expansions;
+  size_t *segmentCounts;  // 0 until computed
+  int8_t *balanced;       // -1 until computed
+  double *lengths;        // Length at each depth
+  double cosAngle;
+  double sinAngle;
+};
+
+typedef struct {
+  const int32_t *ops;
+  size_t count;
+  size_t index;
+  int depth;
+} Frame;
+
+typedef struct {
+  LSystemTransform turtle;
+  LSystemTransform applied;
+} StackEntry;
+
+static const LSystemTransform kIdentity = { 1, 0, 0, 1, 0, 0 };
+
+//------------------------------------------------------------------------------
+// Transforms
+//------------------------------------------------------------------------------
+// Same as CGAffineTransformRotate(*t, angle)
+static inline void Rotate(LSystemTransform *t, double cosAngle, double sinAngle) {
+  double a = t->a, b = t->b, c = t->c, d = t->d;
+
+  t->a = cosAngle * a + sinAngle * c;
+  t->b = cosAngle * b + sinAngle * d;
+  t->c = cosAngle * c - sinAngle * a;
+  t->d = cosAngle * d - sinAngle * b;
+}
+
+// Same as CGAffineTransformTranslate(*t, 0, length)
+static inline void Forward(LSystemTransform *t, double length) {
+  t->tx += t->c * length;
+  t->ty += t->d * length;
+}
+
+// Same as CGAffineTransformConcat(t1, t2)
+static LSystemTransform Concat(const LSystemTransform *t1, const LSystemTransform *t2) {
+  LSystemTransform result;
+
+  result.a = t1->a * t2->a + t1->b * t2->c;
+  result.b = t1->a * t2->b + t1->b * t2->d;
+  result.c = t1->c * t2->a + t1->d * t2->c;
+  result.d = t1->c * t2->b + t1->d * t2->d;
+  result.tx = t1->tx * t2->a + t1->ty * t2->c + t2->tx;
+  result.ty = t1->tx * t2->b + t1->ty * t2->d + t2->ty;
+
+  return result;
+}
+
+static LSystemTransform Invert(const LSystemTransform *t) {
+  double det = t->a * t->d - t->b * t->c;
+  LSystemTransform result;
+
+  if (det == 0)
+    return *t;
+
+  result.a = t->d / det;
+  result.b = -t->b / det;
+  result.c = -t->c / det;
+  result.d = t->a / det;
+  result.tx = (t->c * t->ty - t->d * t->tx) / det;
+  result.ty = (t->b * t->tx - t->a * t->ty) / det;
+
+  return result;
+}
+
+//------------------------------------------------------------------------------
+// Segments
+//------------------------------------------------------------------------------
+static int ReserveSegments(LSystemSegments *segments, size_t count) {
+  if (segments->count + count <= segments->capacity)
+    return 1;
+
+  size_t capacity = segments->capacity ? segments->capacity * 2 : 256;
+  while (capacity < segments->count + count)
+    capacity *= 2;
+
+  double *points = (double *)realloc(segments->points, sizeof(double) * 4 * capacity);
+  if (!points)
+    return 0;
+
+  segments->points = points;
+  segments->capacity = capacity;
+
+  return 1;
+}
+
+int LSystemSegmentsGetBounds(const LSystemSegments *segments, double *minX, double *minY,
+                             double *maxX, double *maxY) {
+  const double *points = segments->points;
+  size_t count = 2 * segments->count;
+
+  if (!count)
+    return 0;
+
+  double left = points[0], right = points[0], bottom = points[1], top = points[1];
+
+  for (size_t i = 1; i < count; ++i) {
+    double x = points[2 * i], y = points[2 * i + 1];
+
+    left = x < left ? x : left;
+    right = x > right ? x : right;
+    bottom = y < bottom ? y : bottom;
+    top = y > top ? y : top;
+  }
+
+  *minX = left;
+  *minY = bottom;
+  *maxX = right;
+  *maxY = top;
+
+  return 1;
+}
+
+void LSystemSegmentsRelease(LSystemSegments *segments) {
+  free(segments->points);
+  memset(segments, 0, sizeof(LSystemSegments));
+}
+
+//------------------------------------------------------------------------------
+// Rules
+//------------------------------------------------------------------------------
+LSystemCore *LSystemCoreCreate(void) {
+  return (LSystemCore *)calloc(1, sizeof(LSystemCore));
+}
+
+static void ForgetExpansions(LSystemCore *core) {
+  if (core->expansions) {
+    size_t count = core->symbolCount * (core->memoParams.maxDepth + 1);
+
+    for (size_t i = 0; i < count; ++i)
+      LSystemSegmentsRelease(&core->expansions[i].segments);
+  }
+
+  free(core->expansions);
+  free(core->segmentCounts);
+  free(core->balanced);
+  free(core->lengths);
+  core->expansions = NULL;
+  core->segmentCounts = NULL;
+  core->balanced = NULL;
+  core->lengths = NULL;
+  core->memoValid = 0;
+}
+
+void LSystemCoreReset(LSystemCore *core) {
+  ForgetExpansions(core);
+
+  for (size_t i = 0; i < core->symbolCount; ++i)
+    free(core->symbols[i].ops);
+
+  free(core->root);
+  core->symbolCount = 0;
+  core->root = NULL;
+  core->rootCount = 0;
+}
+
+void LSystemCoreRelease(LSystemCore *core) {
+  if (!core)
+    return;
+
+  LSystemCoreReset(core);
+  free(core->symbols);
+  free(core);
+}
+
+static int32_t SymbolIndex(LSystemCore *core, uint16_t symbol) {
+  for (size_t i = 0; i < core->symbolCount; ++i)
+    if (core->symbols[i].symbol == symbol)
+      return (int32_t)i;
+
+  if (core->symbolCount == core->symbolCapacity) {
+    size_t capacity = core->symbolCapacity ? core->symbolCapacity * 2 : 16;
+    Symbol *symbols = (Symbol *)realloc(core->symbols, sizeof(Symbol) * capacity);
+
+    if (!symbols)
+      return -1;
+
+    core->symbols = symbols;
+    core->symbolCapacity = capacity;
+  }
+
+  Symbol *added = &core->symbols[core->symbolCount];
+  memset(added, 0, sizeof(Symbol));
+  added->symbol = symbol;
+
+  return (int32_t)core->symbolCount++;
+}
+
+static uint16_t OpSymbol(const LSystemCore *core, int32_t op) {
+  switch (op) {
+    case kOpTurnLeft: return '+';
+    case kOpTurnRight: return '-';
+    case kOpPush: return '[';
+    case kOpPop: return ']';
+  }
+
+  return core->symbols[op].symbol;
+}
+
+static int32_t *Compile(LSystemCore *core, const uint16_t *chars, size_t count) {
+  int32_t *ops = (int32_t *)malloc(sizeof(int32_t) * (count ? count : 1));
+
+  if (!ops)
+    return NULL;
+
+  for (size_t i = 0; i < count; ++i) {
+    switch (chars[i]) {
+      case '+': ops[i] = kOpTurnLeft; break;
+      case '-': ops[i] = kOpTurnRight; break;
+      case '[': ops[i] = kOpPush; break;
+      case ']': ops[i] = kOpPop; break;
+      default:
+        if ((ops[i] = SymbolIndex(core, chars[i])) < 0) {
+          free(ops);
+          return NULL;
+        }
+    }
+  }
+
+  return ops;
+}
+
+int LSystemCoreSetRule(LSystemCore *core, uint16_t symbol, const uint16_t *chars,
+                       size_t count) {
+  ForgetExpansions(core);
+
+  int32_t index = SymbolIndex(core, symbol);
+  int32_t *ops = index < 0 ? NULL : Compile(core, chars, count);
+
+  if (!ops)
+    return 0;
+
+  // Compiling may have moved the symbols
+  Symbol *s = &core->symbols[index];
+  free(s->ops);
+  s->ops = ops;
+  s->count = count;
+  s->hasRule = 1;
+
+  return 1;
+}
+
+int LSystemCoreSetRoot(LSystemCore *core, const uint16_t *chars, size_t count) {
+  ForgetExpansions(core);
+
+  int32_t *ops = Compile(core, chars, count);
+
+  if (!ops)
+    return 0;
+
+  free(core->root);
+  core->root = ops;
+  core->rootCount = count;
+
+  return 1;
+}
+
+//------------------------------------------------------------------------------
+// Memoization
+//------------------------------------------------------------------------------
+static int PrepareExpansions(LSystemCore *core, const LSystemParameters *params) {
+  const LSystemParameters *memo = &core->memoParams;
+
+  if (core->memoValid && memo->length == params->length &&
+      memo->lengthScale == params->lengthScale && memo->angle == params->angle &&
+      memo->maxDepth == params->maxDepth)
+    return 1;
+
+  ForgetExpansions(core);
+
+  size_t levels = params->maxDepth + 1;
+  size_t count = core->symbolCount * levels;
+
+  core->memoParams = *params;
+  core->expansions = (Expansion *)calloc(count ? count : 1, sizeof(Expansion));
+  core->segmentCounts = (size_t *)calloc(count ? count : 1, sizeof(size_t));
+  core->balanced = (int8_t *)malloc(count ? count : 1);
+  core->lengths = (double *)malloc(sizeof(double) * (levels + 1));
+
+  if (!core->expansions || !core->segmentCounts || !core->balanced || !core->lengths) {
+    ForgetExpansions(core);
+    return 0;
+  }
+
+  memset(core->balanced, -1, count);
+
+  // Scaled once per level, as the recursive version did
+  core->lengths[0] = params->length;
+  for (size_t i = 1; i <= levels; ++i)
+    core->lengths[i] = core->lengths[i - 1] * params->lengthScale;
+
+  core->cosAngle = cos(params->angle);
+  core->sinAngle = sin(params->angle);
+  core->memoValid = 1;
+
+  return 1;
+}
+
+static inline int IsTerminal(const LSystemCore *core, int32_t symbol, int depth) {
+  const Symbol *s = &core->symbols[symbol];
+
+  return depth >= core->memoParams.maxDepth || !s->hasRule || !s->count;
+}
+
+// Segments drawn by |symbol| at |depth|, saturating
+static size_t SegmentCount(LSystemCore *core, int32_t symbol, int depth) {
+  if (IsTerminal(core, symbol, depth))
+    return 1;
+
+  size_t *count = &core->segmentCounts[symbol * (core->memoParams.maxDepth + 1) + depth];
+
+  if (!*count) {
+    const Symbol *s = &core->symbols[symbol];
+    size_t total = 0;
+
+    for (size_t i = 0; i < s->count && total < SIZE_MAX; ++i) {
+      if (s->ops[i] >= 0) {
+        size_t child = SegmentCount(core, s->ops[i], depth + 1);
+        total = total > SIZE_MAX - child ? SIZE_MAX : total + child;
+      }
+    }
+
+    *count = total ? total : SIZE_MAX;  // Only turns: don't bother
+  }
+
+  return *count;
+}
+
+// Whether the expansion of |symbol| at |depth| leaves the bracket stack as it
+// found it, without popping anything it didn't push
+static int IsBalanced(LSystemCore *core, int32_t symbol, int depth) {
+  if (IsTerminal(core, symbol, depth))
+    return 1;
+
+  int8_t *balanced = &core->balanced[symbol * (core->memoParams.maxDepth + 1) + depth];
+
+  if (*balanced < 0) {
+    const Symbol *s = &core->symbols[symbol];
+    long level = 0;
+
+    *balanced = 1;
+    for (size_t i = 0; i < s->count && *balanced; ++i) {
+      if (s->ops[i] == kOpPush)
+        ++level;
+      else if (s->ops[i] == kOpPop && --level < 0)
+        *balanced = 0;
+      else if (s->ops[i] >= 0 && !IsBalanced(core, s->ops[i], depth + 1))
+        *balanced = 0;
+    }
+
+    if (level)
+      *balanced = 0;
+  }
+
+  return *balanced;
+}
+
+//------------------------------------------------------------------------------
+// Expansion
+//------------------------------------------------------------------------------
+typedef struct {
+  const LSystemCallbacks *callbacks;
+  void *context;
+  LSystemSegments *segments;
+  LSystemTransform turtle;
+  LSystemTransform applied;
+  uint16_t lastRule;
+  uint16_t lastTurn;
+} Turtle;
+
+static const Expansion *Memoized(LSystemCore *core, int32_t symbol, int depth);
+
+static int Draw(Turtle *turtle, int depth, double length) {
+  LSystemTransform *t = &turtle->turtle;
+
+  if (turtle->callbacks) {
+    // The context is at |applied|; move it to the turtle
+    LSystemTransform inverse = Invert(&turtle->applied);
+    LSystemTransform delta = Concat(t, &inverse);
+
+    turtle->applied = *t;
+    turtle->callbacks->draw(turtle->context, &delta, depth, length, turtle->lastRule,
+                            turtle->lastTurn);
+  } else {
+    LSystemSegments *segments = turtle->segments;
+
+    if (!ReserveSegments(segments, 1))
+      return 0;
+
+    double *points = segments->points + 4 * segments->count++;
+    points[0] = t->tx;
+    points[1] = t->ty;
+    points[2] = t->tx + t->c * length;
+    points[3] = t->ty + t->d * length;
+  }
+
+  Forward(t, length);
+
+  return 1;
+}
+
+static int Emit(Turtle *turtle, const Expansion *expansion) {
+  const LSystemSegments *from = &expansion->segments;
+  LSystemSegments *to = turtle->segments;
+  LSystemTransform *t = &turtle->turtle;
+
+  if (!ReserveSegments(to, from->count))
+    return 0;
+
+  const double *src = from->points;
+  double *dst = to->points + 4 * to->count;
+  double a = t->a, b = t->b, c = t->c, d = t->d, tx = t->tx, ty = t->ty;
+
+  for (size_t i = 0; i < 2 * from->count; ++i) {
+    double x = src[2 * i], y = src[2 * i + 1];
+    dst[2 * i] = a * x + c * y + tx;
+    dst[2 * i + 1] = b * x + d * y + ty;
+  }
+
+  to->count += from->count;
+  *t = Concat(&expansion->end, t);
+
+  if (expansion->lastRule)
+    turtle->lastRule = expansion->lastRule;
+
+  if (expansion->lastTurn)
+    turtle->lastTurn = expansion->lastTurn;
+
+  return 1;
+}
+
+// Run |ops| at |depth| with an explicit stack of frames in place of recursion
+static int Expand(LSystemCore *core, const int32_t *ops, size_t count, int depth,
+                  Turtle *turtle) {
+  int maxDepth = core->memoParams.maxDepth;
+  Frame *frames = (Frame *)malloc(sizeof(Frame) * (maxDepth + 2));
+  size_t frameCount = 0;
+  StackEntry *stack = NULL;
+  size_t stackCount = 0, stackCapacity = 0;
+  int result = 1;
+
+  if (!frames)
+    return 0;
+
+  frames[frameCount++] = (Frame){ ops, count, 0, depth };
+
+  while (frameCount && result) {
+    Frame *frame = &frames[frameCount - 1];
+
+    if (frame->index == frame->count) {
+      --frameCount;
+      continue;
+    }
+
+    int32_t op = frame->ops[frame->index++];
+    int k = frame->depth;
+
+    turtle->lastRule = OpSymbol(core, op);
+
+    switch (op) {
+      case kOpTurnLeft:
+        Rotate(&turtle->turtle, core->cosAngle, -core->sinAngle);
+        turtle->lastTurn = turtle->lastRule;
+        break;
+
+      case kOpTurnRight:
+        Rotate(&turtle->turtle, core->cosAngle, core->sinAngle);
+        turtle->lastTurn = turtle->lastRule;
+        break;
+
+      case kOpPush:
+        if (stackCount == stackCapacity) {
+          size_t capacity = stackCapacity ? stackCapacity * 2 : 32;
+          StackEntry *resized = (StackEntry *)realloc(stack, sizeof(StackEntry) * capacity);
+
+          if (!resized) {
+            result = 0;
+            break;
+          }
+
+          stack = resized;
+          stackCapacity = capacity;
+        }
+
+        stack[stackCount].turtle = turtle->turtle;
+        stack[stackCount++].applied = turtle->applied;
+
+        if (turtle->callbacks)
+          turtle->callbacks->push(turtle->context);
+        break;
+
+      case kOpPop:
+        if (stackCount) {
+          --stackCount;
+          turtle->turtle = stack[stackCount].turtle;
+          turtle->applied = stack[stackCount].applied;
+
+          if (turtle->callbacks)
+            turtle->callbacks->pop(turtle->context);
+        } else {
+          // Unmatched: back to where we started
+          turtle->turtle = kIdentity;
+        }
+        break;
+
+      default: {
+        const Expansion *expansion;
+
+        if (IsTerminal(core, op, k))
+          result = Draw(turtle, k, core->lengths[k >= maxDepth ? k : k + 1]);
+        else if (!turtle->callbacks && (expansion = Memoized(core, op, k)))
+          result = Emit(turtle, expansion);
+        else
+          frames[frameCount++] = (Frame){ core->symbols[op].ops, core->symbols[op].count, 0,
+                                          k + 1 };
+      }
+    }
+  }
+
+  free(stack);
+  free(frames);
+
+  return result;
+}
+
+static const Expansion *Memoized(LSystemCore *core, int32_t symbol, int depth) {
+  Expansion *expansion = &core->expansions[symbol * (core->memoParams.maxDepth + 1) + depth];
+
+  if (expansion->state == kExpansionUnknown) {
+    expansion->state = kExpansionTooLarge;
+
+    if (SegmentCount(core, symbol, depth) <= kMaxMemoSegments &&
+        IsBalanced(core, symbol, depth)) {
+      const Symbol *s = &core->symbols[symbol];
+      Turtle local;
+
+      memset(&local, 0, sizeof(local));
+      local.segments = &expansion->segments;
+      local.turtle = kIdentity;
+
+      if (Expand(core, s->ops, s->count, depth + 1, &local)) {
+        expansion->end = local.turtle;
+        expansion->lastRule = local.lastRule;
+        expansion->lastTurn = local.lastTurn;
+        expansion->state = kExpansionMemoized;
+      } else {
+        LSystemSegmentsRelease(&expansion->segments);
+      }
+    }
+  }
+
+  return expansion->state == kExpansionMemoized ? expansion : NULL;
+}
+
+int LSystemCoreRun(LSystemCore *core, const LSystemParameters *params,
+                   LSystemSegments *segments, const LSystemCallbacks *callbacks,
+                   void *context, uint16_t *lastRule, uint16_t *lastTurn) {
+  LSystemParameters clamped = *params;
+  Turtle turtle;
+  int result;
+
+  if (clamped.maxDepth < 0)
+    clamped.maxDepth = 0;
+
+  if (!PrepareExpansions(core, &clamped))
+    return 0;
+
+  memset(&turtle, 0, sizeof(turtle));
+  turtle.callbacks = callbacks;
+  turtle.context = context;
+  turtle.segments = segments;
+  turtle.turtle = turtle.applied = kIdentity;
+  turtle.lastRule = lastRule ? *lastRule : 0;
+  turtle.lastTurn = lastTurn ? *lastTurn : 0;
+
+  if (core->rootCount)
+    result = Expand(core, core->root, core->rootCount, 1, &turtle);
+  else
+    result = Draw(&turtle, 0, core->lengths[1]);
+
+  if (lastRule)
+    *lastRule = turtle.lastRule;
+
+  if (lastTurn)
+    *lastTurn = turtle.lastTurn;
+
+  return result;
+}
@@ -0,0 +1,95 @@
+// Copyright 2008 Google Inc.
+//
+// Licensed under the Apache License, Version 2.0 (the "License"); you may not
+// use this file except in compliance with the License.  You may obtain a copy
+// of the License at
+//
+// http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS, WITHOUT
+// WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.  See the
+// License for the specific language governing permissions and limitations under
+// the License.
+
+// L-System expansion without the Objective-C runtime.  The rules are compiled
+// into opcodes and expanded by a loop with an explicit stack (rather than by
+// recursion), with its own turtle transform instead of the context's CTM.
+// Without a draw callback the output is a list of line segments, and
+// expansions that are small and leave the bracket stack as they found it are
+// memoized per (symbol, depth) and reused as a block of segments.
+
+#ifndef LSYSTEMCORE_H
+#define LSYSTEMCORE_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+// An affine transform in the same layout and conventions as CGAffineTransform
+typedef struct {
+  double a, b, c, d;
+  double tx, ty;
+} LSystemTransform;
+
+typedef struct {
+  double length;          // Length of the first level
+  double lengthScale;     // Applied at each level
+  double angle;           // In radians
+  int maxDepth;
+} LSystemParameters;
+
+// Line segments as x0, y0, x1, y1 in the coordinates of the starting turtle
+typedef struct {
+  size_t count;
+  size_t capacity;
+  double *points;
+} LSystemSegments;
+
+// Called for each drawing command instead of producing a segment.  |delta|
+// moves from the transform at the previous callback (or the last '[') to the
+// turtle's; the turtle steps forward by |length| afterwards.  |push| and |pop|
+// are called for '[' and ']'.
+typedef struct {
+  void (*draw)(void *context, const LSystemTransform *delta, int depth, double length,
+               uint16_t lastRule, uint16_t lastTurn);
+  void (*push)(void *context);
+  void (*pop)(void *context);
+} LSystemCallbacks;
+
+typedef struct LSystemCore LSystemCore;
+
+LSystemCore *LSystemCoreCreate(void);
+void LSystemCoreRelease(LSystemCore *core);
+
+// Forget the rules and root
+void LSystemCoreReset(LSystemCore *core);
+
+// |symbol| is replaced by |chars| at each level.  '+', '-', '[' and ']' are
+// turns and the bracket stack; everything else draws when it is not replaced.
+int LSystemCoreSetRule(LSystemCore *core, uint16_t symbol, const uint16_t *chars,
+                       size_t count);
+int LSystemCoreSetRoot(LSystemCore *core, const uint16_t *chars, size_t count);
+
+// Expand the root.  With |callbacks|, they are called for each command and
+// |segments| is unused; otherwise segments are appended to |segments|.  The
+// last command and turn are returned in |lastRule| and |lastTurn| (if not
+// NULL).  Returns 0 if memory runs out, with the output up to that point.
+int LSystemCoreRun(LSystemCore *core, const LSystemParameters *params,
+                   LSystemSegments *segments, const LSystemCallbacks *callbacks,
+                   void *context, uint16_t *lastRule, uint16_t *lastTurn);
+
+// The bounding box of the segments.  Returns 0 if there are none.
+int LSystemSegmentsGetBounds(const LSystemSegments *segments, double *minX, double *minY,
+                             double *maxX, double *maxY);
+
+void LSystemSegmentsRelease(LSystemSegments *segments);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif  // LSYSTEMCORE_H
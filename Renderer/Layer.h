@@ -19,7 +19,9 @@
 
 #import "RuntimeObject.h"
 
+@class CIContext;
 @class Color;
+@class FilterPipeline;
 @class Gradient;
 @class RectObject;
 
@@ -29,6 +31,15 @@
   CGContextRef backingStore_; // CGBitmapContext
   CGImageRef image_;
   Gradient *fillGradient_;
+  CIContext *ciContext_;      // For the backing store, created as needed
+  FilterPipeline *filterPipeline_;
+  
+  // Pixels that may have been drawn since the backing store was created.  The
+  // stroke and shadow sizes only grow so that the region is never too small.
+  CGRect dirtyRect_;          // Backing store pixels, CGRectNull when clean
+  CGFloat maxLineWidth_;
+  CGFloat maxMiterLimit_;
+  CGFloat shadowOutset_;
   
   // Used in WavyLine drawing
   CGPoint *segments_;
@@ -46,4 +57,14 @@
 - (CGImageRef)cgImage;
 - (CGContextRef)backingStore;
 
+// Objects that draw directly into the backing store mark what they drew, in
+// the layer's current user space, or the whole layer.
+- (void)markDirtyRect:(CGRect)rect;
+- (void)markDirty;
+- (CGRect)dirtyRect;
+
+// Byte offsets of red, green, blue, and alpha in each pixel of the backing
+// store.  Returns NO if it isn't 32-bit premultiplied.
+- (BOOL)getPixelChannelOffsets:(int *)offsets;
+
 @end
@@ -15,21 +15,35 @@
 #import <QuartzCore/QuartzCore.h>
 
 #import "Color.h"
+#import "ColoredRectCore.h"
 #import "Exporter.h"
 #import "Filter.h"
+#import "FilterPipeline.h"
 #import "Gradient.h"
 #import "Image.h"
 #import "Layer.h"
+#import "NumberArray.h"
 #import "PatternObject.h"
 #import "PointObject.h"
 #import "Randomizer.h"
 #import "RectObject.h"
+#import "ReflectCore.h"
 #import "Text.h"
 
 @interface Layer(PrivateMethods)
 - (void)releaseBackingStore;
 - (BOOL)resizeBackingStore;
-- (void)drawColoredRect:(NSArray *)arguments;
+- (void)markDirtyDeviceRect:(CGRect)rect;
+- (void)markDirtyPath:(CGPathDrawingMode)mode;
+- (CGFloat)strokeOutset;
+- (void)drawColoredRect:(CGRect)rect withCPUColors:(Color **)colors;
+- (BOOL)getPixelRegion:(CGRect *)region fromRect:(RectObject *)rectObj;
+- (void)drawColoredRect:(CGRect)rect withCoreImageColors:(Color **)colors;
+- (void)drawItems:(const double *)values count:(NSUInteger)count stride:(NSUInteger)stride
+          addItem:(void (*)(CGContextRef, const double *))addItem
+             mode:(CGPathDrawingMode)mode colors:(const CGFloat *)colors;
+- (void)drawBatch:(NSArray *)arguments stride:(NSUInteger)stride 
+          addItem:(void (*)(CGContextRef, const double *))addItem defaultMode:(CGPathDrawingMode)defaultMode;
 @end
 
 @implementation Layer
@@ -67,9 +81,11 @@
           @"applyFilter", 
           @"circle", @"coloredRect", @"colorAtPoint",
           @"curveFit",
+          @"drawCircles", @"drawPolyline", @"drawRects", @"drawSegments",
           @"drawText",
           @"ellipse", 
-          @"fillLayer", @"fillStroke",
+          @"fillLayer", @"fillStroke", @"filterTimings",
+          @"getPixels", @"putPixels",
           @"reflect", @"roundedRect", 
           @"shadow", 
           @"toString", 
@@ -101,6 +117,7 @@
     sBlendMode = [[NSDictionary dictionaryWithObjectsAndKeys:
                    [NSNumber numberWithInt:kCGBlendModeNormal], @"normal",
                    [NSNumber numberWithInt:kCGBlendModeMultiply], @"multiply",
+                   [NSNumber numberWithInt:kCGBlendModeScreen], @"screen",
                    [NSNumber numberWithInt:kCGBlendModeOverlay], @"overlay",
                    [NSNumber numberWithInt:kCGBlendModeDarken], @"darken",
                    [NSNumber numberWithInt:kCGBlendModeLighten], @"lighten",
@@ -197,6 +214,10 @@
   image_ = NULL;  
   [fillGradient_ release];
   fillGradient_ = nil;
+  [ciContext_ release];
+  ciContext_ = nil;
+  [filterPipeline_ release];
+  filterPipeline_ = nil;
 }
 
 - (void)dealloc {
@@ -235,6 +256,53 @@
   return backingStore_;
 }
 
+- (void)markDirtyDeviceRect:(CGRect)rect {
+  CGRect bounds = CGRectMake(0, 0, CGBitmapContextGetWidth(backingStore_), 
+                             CGBitmapContextGetHeight(backingStore_));
+  
+  if (CGRectIsNull(rect))
+    return;
+  
+  // The shadow is offset in device space
+  rect = CGRectInset(rect, -shadowOutset_, -shadowOutset_);
+  rect = CGRectIntersection(CGRectIntegral(rect), bounds);
+  
+  if (!CGRectIsEmpty(rect))
+    dirtyRect_ = CGRectUnion(dirtyRect_, rect);
+}
+
+- (void)markDirtyRect:(CGRect)rect {
+  if (!CGRectIsNull(rect))
+    [self markDirtyDeviceRect:CGContextConvertRectToDeviceSpace(backingStore_, rect)];
+}
+
+- (void)markDirty {
+  [self markDirtyDeviceRect:CGRectMake(0, 0, CGBitmapContextGetWidth(backingStore_), 
+                                       CGBitmapContextGetHeight(backingStore_))];
+}
+
+- (CGRect)dirtyRect {
+  return dirtyRect_;
+}
+
+// Distance that a stroke can extend past its path, in user space
+- (CGFloat)strokeOutset {
+  return maxLineWidth_ * MAX(maxMiterLimit_, M_SQRT2) / 2;
+}
+
+// Mark the current path before it is drawn with |mode|
+- (void)markDirtyPath:(CGPathDrawingMode)mode {
+  CGRect rect = CGContextGetPathBoundingBox(backingStore_);
+  
+  if (CGRectIsNull(rect))
+    return;
+  
+  if (mode == kCGPathStroke || mode == kCGPathFillStroke || mode == kCGPathEOFillStroke)
+    rect = CGRectInset(rect, -[self strokeOutset], -[self strokeOutset]);
+  
+  [self markDirtyRect:rect];
+}
+
 - (BOOL)resizeBackingStore {
   CGContextRelease(backingStore_);
   CGColorSpaceRef cs = [Color createDefaultCGColorSpace];
@@ -242,6 +310,12 @@
   backingStore_ = CGBitmapContextCreate(NULL, NSWidth(frame_), NSHeight(frame_), 8, 0, cs, info);
   CGColorSpaceRelease(cs);
   
+  // A new backing store is transparent with the default graphics state
+  dirtyRect_ = CGRectNull;
+  maxLineWidth_ = 1;
+  maxMiterLimit_ = 10;
+  shadowOutset_ = 0;
+  
   return backingStore_ ? YES : NO;
 }
 
@@ -288,6 +362,7 @@
 
 - (void)setLineWidth:(float)width {
   CGContextSetLineWidth(backingStore_, width);
+  maxLineWidth_ = MAX(maxLineWidth_, fabs(width));
 }
 
 - (void)setLineCap:(NSString *)str {
@@ -316,6 +391,7 @@
 
 - (void)setMiterLimit:(CGFloat)limit {
   CGContextSetMiterLimit(backingStore_, limit);
+  maxMiterLimit_ = MAX(maxMiterLimit_, limit);
 }
 
 - (void)setCompositingMode:(NSString *)str {
@@ -758,6 +834,7 @@ CGPathRef CreateCurveWithPoints(CGPoint *points, NSUInteger count, CGFloat flatn
 
 - (void)clearRect:(NSArray *)arguments {
   RectObject *rectObject = [[RectObject alloc] initWithArguments:arguments];
+  [self markDirtyRect:NSRectToCGRect([rectObject rect])];
   CGContextClearRect(backingStore_, NSRectToCGRect([rectObject rect]));
   [rectObject release];
 }
@@ -825,14 +902,58 @@ CGPathRef CreateCurveWithPoints(CGPoint *points, NSUInteger count, CGFloat flatn
     CGContextAddArc(backingStore_, [pt x], [pt y], radius, 0, M_PI * 2.0, 0);
 }
 
-- (void)coloredRect:(NSArray *)arguments {
-  // args: rect, bl, tl, tr, br colors
-  if ([arguments count] == 5) {
-    RectObject *rect = [RuntimeObject coerceObject:[arguments objectAtIndex:0] toClass:[RectObject class]];
-    Color *bl = [RuntimeObject coerceObject:[arguments objectAtIndex:1] toClass:[Color class]];
-    Color *tl = [RuntimeObject coerceObject:[arguments objectAtIndex:2] toClass:[Color class]];
-    Color *tr = [RuntimeObject coerceObject:[arguments objectAtIndex:3] toClass:[Color class]];
-    Color *br = [RuntimeObject coerceObject:[arguments objectAtIndex:4] toClass:[Color class]];
+// Rects up to this many pixels are filled on the CPU, larger ones by Core Image
+static const size_t kMaxCPUColoredRectPixels = 1024 * 1024;
+
+- (void)drawColoredRect:(CGRect)rect withCPUColors:(Color **)colors {
+  ColoredRectParameters params;
+  
+  bzero(&params, sizeof(params));
+  params.width = ceil(CGRectGetWidth(rect));
+  params.height = ceil(CGRectGetHeight(rect));
+  
+  if (!params.width || !params.height)
+    return;
+  
+  params.rowBytes = ((4 * params.width) + 0xF) & ~0xF; // 16 byte alignment
+  params.pixels = (uint8_t *)malloc(params.height * params.rowBytes);
+  
+  if (!params.pixels) {
+    MethodLog("Unable to allocate %lu x %lu", (unsigned long)params.width,
+              (unsigned long)params.height);
+    return;
+  }
+  
+  for (int i = 0; i < 4; ++i) {
+    CGFloat c[4];
+    [colors[i] getComponents:c];
+    
+    for (int k = 0; k < 4; ++k)
+      params.corners[i][k] = c[k];
+  }
+  
+  ColoredRectFill(&params);
+  
+  // Draw through an image so that the transform, clip and compositing mode of
+  // the layer apply
+  CGColorSpaceRef cs = [Color createDefaultCGColorSpace];
+  CGContextRef context = CGBitmapContextCreate(params.pixels, params.width, params.height, 8, 
+                                               params.rowBytes, cs, 
+                                               kCGImageAlphaPremultipliedLast | kCGBitmapByteOrder32Big);
+  CGImageRef image = CGBitmapContextCreateImage(context);
+  CGContextDrawImage(backingStore_, rect, image);
+  
+  CGImageRelease(image);
+  CGContextRelease(context);
+  CGColorSpaceRelease(cs);
+  free(params.pixels);
+}
+
+- (void)drawColoredRect:(CGRect)rect withCoreImageColors:(Color **)colors {
+  static CIKernel *sColoredKernel = nil;
+  static dispatch_once_t onceToken;
+  
+  dispatch_once(&onceToken, ^{
     NSString *program =
     @"kernel vec4 coloredRect(__color topLeft, __color topRight, __color bottomLeft, __color bottomRight, vec2 size)"
     "{ vec2 t = destCoord() / size;"
@@ -840,32 +961,64 @@ CGPathRef CreateCurveWithPoints(CGPoint *points, NSUInteger count, CGFloat flatn
     "vec4 rightCol = mix(bottomRight, topRight, t.y);"
     "return mix(leftCol, rightCol, t.x); }";
     NSArray *kernels = [CIKernel kernelsWithString:program];
-    CIKernel *coloredKernel = [kernels objectAtIndex:0];
-    CIFilter *crop = [CIFilter filterWithName:@"CICrop" keysAndValues:
-                      @"inputRectangle", [CIVector vectorWithX:0 Y:0 Z:[rect width] W:[rect height]], nil];
-    CIColor *topLeft = [[[CIColor alloc] initWithColor:[tl color]] autorelease];
-    CIColor *topRight = [[[CIColor alloc] initWithColor:[tr color]] autorelease]; 
-    CIColor *bottomLeft = [[[CIColor alloc] initWithColor:[bl color]] autorelease]; 
-    CIColor *bottomRight = [[[CIColor alloc] initWithColor:[br color]] autorelease]; 
-    CIVector *size = [CIVector vectorWithX:[rect width] Y:[rect height]];
-    CIImage *result = [crop apply:coloredKernel, topLeft, topRight, bottomLeft, bottomRight, size, nil];
-
+    sColoredKernel = [[kernels objectAtIndex:0] retain];
+  });
+  
+  CGFloat width = CGRectGetWidth(rect);
+  CGFloat height = CGRectGetHeight(rect);
+  CIFilter *crop = [CIFilter filterWithName:@"CICrop" keysAndValues:
+                    @"inputRectangle", [CIVector vectorWithX:0 Y:0 Z:width W:height], nil];
+  CIColor *bottomLeft = [[[CIColor alloc] initWithColor:[colors[kColoredRectBottomLeft] color]] autorelease]; 
+  CIColor *topLeft = [[[CIColor alloc] initWithColor:[colors[kColoredRectTopLeft] color]] autorelease];
+  CIColor *topRight = [[[CIColor alloc] initWithColor:[colors[kColoredRectTopRight] color]] autorelease]; 
+  CIColor *bottomRight = [[[CIColor alloc] initWithColor:[colors[kColoredRectBottomRight] color]] autorelease]; 
+  CIVector *size = [CIVector vectorWithX:width Y:height];
+  CIImage *result = [crop apply:sColoredKernel, topLeft, topRight, bottomLeft, bottomRight, size, nil];
+
+  // The context is kept until the backing store changes
+  if (!ciContext_) {
     // Use device RGB space (not linear or generic as they don't do what you expect)
-//    CGColorSpaceRef csRef = CGColorSpaceCreateWithName(kCGColorSpaceGenericRGBLinear);	
     CGColorSpaceRef csRef = CGColorSpaceCreateDeviceRGB();
     NSDictionary *options = [NSDictionary dictionaryWithObjectsAndKeys:(id)csRef, kCIContextWorkingColorSpace, 
-                                    (id)csRef, kCIContextOutputColorSpace,nil];
+                             (id)csRef, kCIContextOutputColorSpace,nil];
     CGColorSpaceRelease(csRef);
-    CIContext *context = [CIContext contextWithCGContext:backingStore_ options:options];
-    [context drawImage:result atPoint:CGPointMake([rect x], [rect y]) fromRect:CGRectMake(0, 0, [rect width], [rect height])];
+    ciContext_ = [[CIContext contextWithCGContext:backingStore_ options:options] retain];
+  }
+  
+  [ciContext_ drawImage:result atPoint:rect.origin fromRect:CGRectMake(0, 0, width, height)];
+}
+
+- (void)coloredRect:(NSArray *)arguments {
+  // args: rect, bl, tl, tr, br colors
+  if ([arguments count] == 5) {
+    RectObject *rect = [RuntimeObject coerceObject:[arguments objectAtIndex:0] toClass:[RectObject class]];
+    Color *colors[4];
+    
+    for (int i = 0; i < 4; ++i) {
+      colors[i] = [RuntimeObject coerceObject:[arguments objectAtIndex:i + 1] toClass:[Color class]];
+      
+      if (!colors[i])
+        return;
+    }
+    
+    CGRect cgRect = NSRectToCGRect([rect rect]);
+    [self markDirtyRect:cgRect];
+    
+    if (CGRectGetWidth(cgRect) * CGRectGetHeight(cgRect) <= kMaxCPUColoredRectPixels)
+      [self drawColoredRect:cgRect withCPUColors:colors];
+    else
+      [self drawColoredRect:cgRect withCoreImageColors:colors];
   }
 }
 
 - (void)stroke {
+  [self markDirtyPath:kCGPathStroke];
   CGContextDrawPath(backingStore_, kCGPathStroke);
 }
 
 - (void)fill:(NSArray *)arguments {
+  [self markDirtyPath:kCGPathFill];
+  
   if (fillGradient_) {
     CGPoint start = NSPointToCGPoint([[fillGradient_ start] point]);
     CGPoint end = NSPointToCGPoint([[fillGradient_ end] point]);
@@ -902,6 +1055,7 @@ CGPathRef CreateCurveWithPoints(CGPoint *points, NSUInteger count, CGFloat flatn
 - (void)fillRect:(NSArray *)arguments {
   if ([arguments count]) {
     RectObject *rect = [RuntimeObject coerceObject:[arguments objectAtIndex:0] toClass:[RectObject class]];
+    [self markDirtyRect:NSRectToCGRect([rect rect])];
     CGContextFillRect(backingStore_, NSRectToCGRect([rect rect]));
   }
 }
@@ -909,6 +1063,7 @@ CGPathRef CreateCurveWithPoints(CGPoint *points, NSUInteger count, CGFloat flatn
 - (void)strokeRect:(NSArray *)arguments {
   if ([arguments count]) {
     RectObject *rect = [RuntimeObject coerceObject:[arguments objectAtIndex:0] toClass:[RectObject class]];
+    [self markDirtyRect:CGRectInset(NSRectToCGRect([rect rect]), -[self strokeOutset], -[self strokeOutset])];
     CGContextStrokeRect(backingStore_, NSRectToCGRect([rect rect]));
   }
 }
@@ -916,9 +1071,209 @@ CGPathRef CreateCurveWithPoints(CGPoint *points, NSUInteger count, CGFloat flatn
 - (void)fillStroke {
   // TODO: Use a separate CGPath so that we can properly draw gradients and
   // patterns in the path as well as stroke it.
+  [self markDirtyPath:kCGPathFillStroke];
   CGContextDrawPath(backingStore_, kCGPathFillStroke);
 }
 
+//------------------------------------------------------------------------------
+// Batched drawing.  Each item is |stride| values from a flat array of numbers.
+static void AddCircle(CGContextRef context, const double *v) {
+  // x, y, radius
+  CGContextAddEllipseInRect(context, CGRectMake(v[0] - v[2], v[1] - v[2], v[2] * 2, v[2] * 2));
+}
+
+static void AddRect(CGContextRef context, const double *v) {
+  // x, y, width, height
+  CGContextAddRect(context, CGRectMake(v[0], v[1], v[2], v[3]));
+}
+
+static void AddSegment(CGContextRef context, const double *v) {
+  // x0, y0, x1, y1
+  CGContextMoveToPoint(context, v[0], v[1]);
+  CGContextAddLineToPoint(context, v[2], v[3]);
+}
+
+static CGPathDrawingMode DrawingModeFromString(NSString *str, CGPathDrawingMode defaultMode) {
+  str = [str lowercaseString];
+  
+  if ([str isEqualToString:@"fill"])
+    return kCGPathFill;
+  
+  if ([str isEqualToString:@"stroke"])
+    return kCGPathStroke;
+
+  if ([str isEqualToString:@"fillstroke"])
+    return kCGPathFillStroke;
+  
+  return defaultMode;
+}
+
+// Fill |components| with RGBA for |count| items from |obj|, which is either an
+// array of Color or a flat array of r, g, b, a values.  Returns NO if there
+// aren't enough colors.
+static BOOL GetItemColors(id obj, NSUInteger count, CGFloat *components) {
+  NSArray *array = [RuntimeObject coerceObject:obj toClass:[NSArray class]];
+  
+  if (!array || ![array count])
+    return NO;
+  
+  if ([[array objectAtIndex:0] isKindOfClass:[Color class]]) {
+    if ([array count] < count)
+      return NO;
+    
+    for (NSUInteger i = 0; i < count; ++i) {
+      Color *color = [RuntimeObject coerceObject:[array objectAtIndex:i] toClass:[Color class]];
+      
+      if (!color)
+        return NO;
+      
+      [color getComponents:components + i * 4];
+    }
+    
+    return YES;
+  }
+  
+  NSUInteger valueCount;
+  const double *values = [RuntimeObject coerceObjectToDoubles:array count:&valueCount];
+  
+  if (valueCount < count * 4)
+    return NO;
+  
+  for (NSUInteger i = 0; i < count * 4; ++i)
+    components[i] = values[i];
+  
+  return YES;
+}
+
+- (void)drawItems:(const double *)values count:(NSUInteger)count stride:(NSUInteger)stride
+          addItem:(void (*)(CGContextRef, const double *))addItem
+             mode:(CGPathDrawingMode)mode colors:(const CGFloat *)colors {
+  if (!colors) {
+    // Everything in one path with the current styles
+    CGContextBeginPath(backingStore_);
+    
+    for (NSUInteger i = 0; i < count; ++i)
+      addItem(backingStore_, values + i * stride);
+    
+    [self markDirtyPath:mode];
+    
+    if (mode == kCGPathFill)
+      [self fill:nil];
+    else
+      CGContextDrawPath(backingStore_, mode);
+    
+    return;
+  }
+  
+  // One path for each run of items with the same opaque color, in order.
+  // Translucent items are drawn one at a time, because where they overlap a
+  // single path would only cover once.  With a compositingMode other than
+  // normal, overlapping items of one opaque color are also composited once.
+  CGContextSaveGState(backingStore_);
+  
+  for (NSUInteger i = 0; i < count;) {
+    const CGFloat *c = colors + i * 4;
+    
+    CGContextBeginPath(backingStore_);
+    
+    do {
+      addItem(backingStore_, values + i * stride);
+      ++i;
+    } while (c[3] >= 1 && i < count && !memcmp(c, colors + i * 4, sizeof(CGFloat) * 4));
+    
+    CGContextSetRGBFillColor(backingStore_, c[0], c[1], c[2], c[3]);
+    CGContextSetRGBStrokeColor(backingStore_, c[0], c[1], c[2], c[3]);
+    [self markDirtyPath:mode];
+    CGContextDrawPath(backingStore_, mode);
+  }
+  
+  CGContextRestoreGState(backingStore_);
+}
+
+- (void)drawBatch:(NSArray *)arguments stride:(NSUInteger)stride 
+          addItem:(void (*)(CGContextRef, const double *))addItem defaultMode:(CGPathDrawingMode)defaultMode {
+  // args: values [, mode [, colors]]
+  int argCount = [arguments count];
+  NSUInteger valueCount;
+  const double *values = NULL;
+  
+  if (argCount)
+    values = [RuntimeObject coerceObjectToDoubles:[arguments objectAtIndex:0] count:&valueCount];
+  
+  if (!values || valueCount < stride)
+    return;
+  
+  NSUInteger count = valueCount / stride;
+  CGPathDrawingMode mode = defaultMode;
+  CGFloat *colors = NULL;
+  
+  if (argCount > 1) {
+    NSString *modeStr = [RuntimeObject coerceObject:[arguments objectAtIndex:1] toClass:[NSString class]];
+    mode = DrawingModeFromString(modeStr, defaultMode);
+  }
+  
+  if (argCount > 2) {
+    colors = (CGFloat *)malloc(sizeof(CGFloat) * 4 * count);
+    
+    if (!colors) {
+      MethodLog("Unable to allocate colors for %lu items", (unsigned long)count);
+      return;
+    }
+    
+    if (!GetItemColors([arguments objectAtIndex:2], count, colors)) {
+      free(colors);
+      colors = NULL;
+    }
+  }
+  
+  [self drawItems:values count:count stride:stride addItem:addItem mode:mode colors:colors];
+  free(colors);
+}
+
+- (void)drawCircles:(NSArray *)arguments {
+  // args: [x, y, radius, ...] [, mode [, colors]]
+  [self drawBatch:arguments stride:3 addItem:AddCircle defaultMode:kCGPathFill];
+}
+
+- (void)drawRects:(NSArray *)arguments {
+  // args: [x, y, width, height, ...] [, mode [, colors]]
+  [self drawBatch:arguments stride:4 addItem:AddRect defaultMode:kCGPathFill];
+}
+
+- (void)drawSegments:(NSArray *)arguments {
+  // args: [x0, y0, x1, y1, ...] [, colors]
+  NSMutableArray *batchArgs = [NSMutableArray arrayWithArray:arguments];
+
+  if ([batchArgs count] > 1)
+    [batchArgs insertObject:@"stroke" atIndex:1];
+
+  [self drawBatch:batchArgs stride:4 addItem:AddSegment defaultMode:kCGPathStroke];
+}
+
+- (void)drawPolyline:(NSArray *)arguments {
+  // args: [x, y, ...] [, closed]
+  NSUInteger valueCount;
+  const double *values = NULL;
+  
+  if ([arguments count])
+    values = [RuntimeObject coerceObjectToDoubles:[arguments objectAtIndex:0] count:&valueCount];
+  
+  if (!values || valueCount < 4)
+    return;
+  
+  CGContextBeginPath(backingStore_);
+  CGContextMoveToPoint(backingStore_, values[0], values[1]);
+  
+  for (NSUInteger i = 2; i + 1 < valueCount; i += 2)
+    CGContextAddLineToPoint(backingStore_, values[i], values[i + 1]);
+  
+  if ([arguments count] > 1 && [RuntimeObject coerceObjectToInteger:[arguments objectAtIndex:1]])
+    CGContextClosePath(backingStore_);
+  
+  [self markDirtyPath:kCGPathStroke];
+  CGContextStrokePath(backingStore_);
+}
+
 - (void)shadow:(NSArray *)arguments {
   // arguments: offset, size, color
   int count = [arguments count];
@@ -937,6 +1292,9 @@ CGPathRef CreateCurveWithPoints(CGPoint *points, NSUInteger count, CGFloat flatn
   
   CGContextSetShadowWithColor(backingStore_, size, blur, colorRef);
   CGColorRelease(colorRef);
+  
+  if (colorRef)
+    shadowOutset_ = MAX(shadowOutset_, MAX(fabs(size.width), fabs(size.height)) + blur * 2);
 }
 
 - (void)drawImage:(NSArray *)arguments {
@@ -972,6 +1330,7 @@ CGPathRef CreateCurveWithPoints(CGPoint *points, NSUInteger count, CGFloat flatn
     dest = NSRectToCGRect([destRect rect]);
   }
     
+  [self markDirtyRect:dest];
   CGContextSaveGState(backingStore_);
   CGContextSetBlendMode(backingStore_, [image cgBlendMode]);
   CGContextSetAlpha(backingStore_, [image alpha]);
@@ -1009,6 +1368,12 @@ CGPathRef CreateCurveWithPoints(CGPoint *points, NSUInteger count, CGFloat flatn
     if (NSWidth(srcRect) == 0)
       srcRect.size = [str size];
     
+    // Glyphs can extend past the rect and the line fragments
+    NSRect textRect = [str boundingRectWithSize:srcRect.size options:options];
+    textRect = NSOffsetRect(textRect, NSMinX(srcRect), NSMinY(srcRect));
+    textRect = NSInsetRect(NSUnionRect(textRect, srcRect), -[text fontSize], -[text fontSize]);
+    [self markDirtyRect:NSRectToCGRect(textRect)];
+    
     [str drawWithRect:srcRect options:options];
     [str release];
 
@@ -1046,107 +1411,35 @@ CGPathRef CreateCurveWithPoints(CGPoint *points, NSUInteger count, CGFloat flatn
 }
 
 - (void)applyFilter:(NSArray *)arguments {
-  if ([arguments count] == 1) {
+  // args: filter [, rect]
+  int count = [arguments count];
+  
+  if (count == 1 || count == 2) {
     Filter *filter = [RuntimeObject coerceObject:[arguments objectAtIndex:0] toClass:[Filter class]];
-    CIFilter *ciFilter = [filter ciFilter];
+    CGRect rect = CGRectMake(0, 0, NSWidth(frame_), NSHeight(frame_));
     
-    if (!ciFilter)
+    if (!filter)
       return;
     
-    // Find the first filter
-    Filter *firstFilter = filter;
-    CGRect bounds = CGRectMake(0, 0, NSWidth(frame_), NSHeight(frame_));
-    CIVector *cropBounds = [CIVector vectorWithX:CGRectGetMinX(bounds)
-                                               Y:CGRectGetMinY(bounds)
-                                               Z:CGRectGetMaxX(bounds)
-                                               W:CGRectGetMaxY(bounds)];
-    // Keep track of any filters that need chaining
-    NSMutableArray *filtersToChain = [NSMutableArray array];
-    
-    do {
-      Filter *inputFilter = [firstFilter inputFilter];
-
-      if (!inputFilter)
-        break;
+    if (count == 2) {
+      RectObject *rectObj = [RuntimeObject coerceObject:[arguments objectAtIndex:1] toClass:[RectObject class]];
       
-      // There's an input filter - save this one for chaining
-      [filtersToChain insertObject:firstFilter atIndex:0];
-      
-      firstFilter = [firstFilter inputFilter];
-    } while (1);
-    
-    // Create an image of our background
-    CGImageRef current = CGBitmapContextCreateImage(backingStore_);
-    CIImage *input = [CIImage imageWithCGImage:current];
-    
-    // Always put an CIAffineClamp at the head so that the edge is duplicated
-    CIFilter *clampFilter = [CIFilter filterWithName:@"CIAffineClamp"];
-    [clampFilter setDefaults];
-    [clampFilter setValue:[NSAffineTransform transform]
-                   forKey:@"inputTransform"];
-    [clampFilter setValue:input forKey:@"inputImage"];
-    CIImage *affineInput = [clampFilter valueForKey:@"outputImage"];
-
-    // If this is a generator, it may not respond to this message
-    @try {
-      [[firstFilter ciFilter] setValue:affineInput forKey:@"inputImage"];
-    }
-    
-    @catch (NSException *e) {
-      // We don't care if there was an exception in setting the input image
-      // because we'll assume that it was a generator
-    }
-    
-    // Chain the other filters, if any
-    NSEnumerator *e = [filtersToChain objectEnumerator];
-    Filter *previousFilter = firstFilter;
-    CIVector *outputSize = [CIVector vectorWithX:CGRectGetWidth(bounds) Y:CGRectGetHeight(bounds)];
-    
-    while ((filter = [e nextObject])) {
-      @try {
-        // Set our special outputSize on the previous fit
-        if ([[NSSet setWithArray:[[previousFilter ciFilter] inputKeys]] containsObject:@"outputSize"])
-          [[previousFilter ciFilter] setValue:outputSize forKey:@"outputSize"];
-        
-        CIImage *input = [[previousFilter ciFilter] valueForKey:@"outputImage"];
-        [[filter ciFilter] setValue:input forKey:@"inputImage"];
-      }
-      
-      @catch (NSException *e) {
-        NSLog(@"Filter Chaining: %@", e);
-        // Something
-      }
-      
-      previousFilter = filter;
+      if (rectObj)
+        rect = NSRectToCGRect([rectObj rect]);
     }
     
-    @try {
-      // Set our special outputSize on the filter
-      if ([[NSSet setWithArray:[ciFilter inputKeys]] containsObject:@"outputSize"])
-        [ciFilter setValue:outputSize forKey:@"outputSize"];
-    }
-    @catch (NSException *e) {
-      NSLog(@"Setting output size: %@", e);
-    }
-
-    // Always crop the output
-    CIFilter *crop = [CIFilter filterWithName:@"CICrop"];
-    [crop setValue:cropBounds forKey:@"inputRectangle"];
-    [crop setValue:[ciFilter valueForKey:@"outputImage"] forKey:@"inputImage"];
-    CIImage *output = [crop valueForKey:@"outputImage"];
-    CGImageRelease(current);
+    if (!filterPipeline_)
+      filterPipeline_ = [[FilterPipeline alloc] initWithContext:backingStore_];
     
-    // Use the applications colorspace
-    CGColorSpaceRef csRef = [Color createDefaultCGColorSpace];
-    NSDictionary *options = [NSDictionary dictionaryWithObjectsAndKeys:(id)csRef, kCIContextWorkingColorSpace, 
-                             (id)csRef, kCIContextOutputColorSpace,nil];
-    CGColorSpaceRelease(csRef);
-    
-    CIContext *context = [CIContext contextWithCGContext:backingStore_ options:options];
-    [context drawImage:output atPoint:CGPointZero fromRect:bounds];
+    if ([filterPipeline_ applyFilter:filter inRect:rect])
+      [self markDirtyRect:rect];
   }
 }
 
+- (NSArray *)filterTimings {
+  return [filterPipeline_ timings];
+}
+
 - (void)fillLayer:(NSArray *)arguments {
   if ([arguments count] == 1) {
     // args: color, pattern, gradient
@@ -1154,6 +1447,7 @@ CGPathRef CreateCurveWithPoints(CGPoint *points, NSUInteger count, CGFloat flatn
     CGRect bounds = [self cgRectFrame];
     bounds.origin.x = bounds.origin.y = 0;
 
+    [self markDirty];
     CGContextSaveGState(backingStore_);
 
     // Centered gradient
@@ -1205,91 +1499,98 @@ CGPathRef CreateCurveWithPoints(CGPoint *points, NSUInteger count, CGFloat flatn
     // args: 4 colors
     NSMutableArray *newArguments = [NSMutableArray arrayWithArray:arguments];
     [newArguments insertObject:[self bounds] atIndex:0];
-    [self drawColoredRect:newArguments];
+    [self coloredRect:newArguments];
   }
 }
 
 - (void)reflect:(NSArray *)arguments {
   if ([arguments count] >= 1) {
     NSString *mode = [RuntimeObject coerceObject:[arguments objectAtIndex:0] toClass:[NSString class]];
-    CGFloat alpha = 1.0;
-    CGImageRef baseImage = CGBitmapContextCreateImage(backingStore_);
-    CGImageRef srcImage = NULL;
-    CGRect bounds = [self cgRectFrame];
-    bounds.origin.x = bounds.origin.y = 0;
-    CGRect srcRect;
-
-    CGContextSaveGState(backingStore_);
+    ReflectParameters params;
+    
+    bzero(&params, sizeof(params));
+    params.alpha = 1.0;
     
     if ([arguments count] == 2)
-       alpha = [RuntimeObject coerceObjectToDouble:[arguments objectAtIndex:1]];
+       params.alpha = [RuntimeObject coerceObjectToDouble:[arguments objectAtIndex:1]];
     
-    if ([mode isEqualToString:@"top"]) {
-      srcRect = bounds;
-      srcRect.size.height /= 2.0;
-      
-      // Sub-image coords start with (0, 0) in upper left...
-      srcImage = CGImageCreateWithImageInRect(baseImage, srcRect);
-      
-      // Flip bottom over top
-      CGContextTranslateCTM(backingStore_, 0, CGRectGetHeight(srcRect));
-      CGContextScaleCTM(backingStore_, 1, -1);
-      CGContextSetAlpha(backingStore_, alpha);
-      CGContextClearRect(backingStore_, srcRect);
-      CGContextDrawImage(backingStore_, srcRect, srcImage);
-    } else if ([mode isEqualToString:@"left"]) {
-      srcRect = bounds;
-      srcRect.size.width /= 2.0;
-      
-      // Sub-image coords start with (0, 0) in upper left...
-      srcImage = CGImageCreateWithImageInRect(baseImage, srcRect);
-      
-      // Flip left over right
-      CGContextTranslateCTM(backingStore_, 2 * CGRectGetWidth(srcRect), 0);
-      CGContextScaleCTM(backingStore_, -1, 1);
-      CGContextSetAlpha(backingStore_, alpha);
-      CGContextClearRect(backingStore_, srcRect);
-      CGContextDrawImage(backingStore_, srcRect, srcImage);
-    } else if ([mode isEqualToString:@"quarter"]) {
-      srcRect = bounds;
-      srcRect.size.width /= 2.0;
-      srcRect.size.height /= 2.0;
-
-      // Sub-image coords start with (0, 0) in upper left...
-      srcImage = CGImageCreateWithImageInRect(baseImage, srcRect);
-      
-      // Flip left over right
-      CGContextSaveGState(backingStore_);
-      CGContextTranslateCTM(backingStore_, 2 * CGRectGetWidth(srcRect), CGRectGetHeight(srcRect));
-      CGContextScaleCTM(backingStore_, -1, 1);
-      CGContextClearRect(backingStore_, srcRect);
-      CGContextSetAlpha(backingStore_, alpha);
-      CGContextDrawImage(backingStore_, srcRect, srcImage);
-      CGContextRestoreGState(backingStore_);
-      
-      // Flip down and right
-      CGContextSaveGState(backingStore_);
-      CGContextTranslateCTM(backingStore_, 2 * CGRectGetWidth(srcRect), CGRectGetHeight(srcRect));
-      CGContextScaleCTM(backingStore_, -1, -1);
-      CGContextClearRect(backingStore_, srcRect);
-      CGContextSetAlpha(backingStore_, alpha);
-      CGContextDrawImage(backingStore_, srcRect, srcImage);
-      CGContextRestoreGState(backingStore_);
-      
-      // Flip down
-      CGContextSaveGState(backingStore_);
-      CGContextTranslateCTM(backingStore_, 0, CGRectGetHeight(srcRect));
-      CGContextScaleCTM(backingStore_, 1, -1);
-      CGContextClearRect(backingStore_, srcRect);
-      CGContextSetAlpha(backingStore_, alpha);
-      CGContextDrawImage(backingStore_, srcRect, srcImage);
-      CGContextRestoreGState(backingStore_);
-    }
+    if ([mode isEqualToString:@"top"])
+      params.mode = kReflectTop;
+    else if ([mode isEqualToString:@"bottom"])
+      params.mode = kReflectBottom;
+    else if ([mode isEqualToString:@"left"])
+      params.mode = kReflectLeft;
+    else if ([mode isEqualToString:@"right"])
+      params.mode = kReflectRight;
+    else if ([mode isEqualToString:@"quarter"])
+      params.mode = kReflectQuarter;
+    else
+      return;
     
-    CGContextRestoreGState(backingStore_);
-    CGImageRelease(baseImage);
-    CGImageRelease(srcImage);
+    // The pixels are premultiplied, so the channel order doesn't matter
+    params.pixels = CGBitmapContextGetData(backingStore_);
+    
+    if (!params.pixels || CGBitmapContextGetBitsPerPixel(backingStore_) != 32)
+      return;
+    
+    params.width = CGBitmapContextGetWidth(backingStore_);
+    params.height = CGBitmapContextGetHeight(backingStore_);
+    params.rowPixels = CGBitmapContextGetBytesPerRow(backingStore_) / sizeof(uint32_t);
+    
+    ReflectPixels(&params, WorkQueueGetShared());
+    [self markDirty];
+  }
+}
+
+// Byte offsets of the red, green, blue and alpha channels in each pixel of
+// |context|.  Returns NO unless it has 8 bit premultiplied RGBA pixels.
+static BOOL GetPixelChannelOffsets(CGContextRef context, int offsets[4]) {
+  CGImageAlphaInfo alphaInfo = CGBitmapContextGetAlphaInfo(context);
+  CGBitmapInfo byteOrder = CGBitmapContextGetBitmapInfo(context) & kCGBitmapByteOrderMask;
+  
+  if (CGBitmapContextGetBitsPerPixel(context) != 32 || CGBitmapContextGetBitsPerComponent(context) != 8)
+    return NO;
+  
+  if (alphaInfo == kCGImageAlphaPremultipliedFirst) {
+    offsets[0] = 1; offsets[1] = 2; offsets[2] = 3; offsets[3] = 0;
+  } else if (alphaInfo == kCGImageAlphaPremultipliedLast) {
+    offsets[0] = 0; offsets[1] = 1; offsets[2] = 2; offsets[3] = 3;
+  } else {
+    return NO;
+  }
+  
+  if (byteOrder == kCGBitmapByteOrder32Little) {
+    for (int i = 0; i < 4; ++i)
+      offsets[i] = 3 - offsets[i];
+  } else if (byteOrder != kCGBitmapByteOrderDefault && byteOrder != kCGBitmapByteOrder32Big) {
+    return NO;
   }
+  
+  return YES;
+}
+
+// Unpremultiplied 0 - 255 RGBA for the pixel at |p|
+static inline void GetPixelRGBA(const uint8_t *p, const int offsets[4], double *rgba) {
+  double alpha = p[offsets[3]];
+  
+  for (int k = 0; k < 3; ++k)
+    rgba[k] = alpha ? MIN(255, round(p[offsets[k]] * 255.0 / alpha)) : 0;
+  
+  rgba[3] = alpha;
+}
+
+// Premultiply and store unpremultiplied 0 - 255 |rgba| at |p|
+static inline void SetPixelRGBA(uint8_t *p, const int offsets[4], const double *rgba) {
+  double alpha = MAX(0, MIN(255, rgba[3]));
+  
+  for (int k = 0; k < 3; ++k)
+    p[offsets[k]] = (uint8_t)round(MAX(0, MIN(255, rgba[k])) * alpha / 255.0);
+  
+  p[offsets[3]] = (uint8_t)round(alpha);
+}
+
+- (BOOL)getPixelChannelOffsets:(int *)offsets {
+  return GetPixelChannelOffsets(backingStore_, offsets);
 }
 
 - (Color *)colorAtPoint:(NSArray *)arguments {
@@ -1297,37 +1598,125 @@ CGPathRef CreateCurveWithPoints(CGPoint *points, NSUInteger count, CGFloat flatn
   NSPoint pt = [ptObj point];
   [ptObj release];
   
-  if (NSPointInRect(pt, frame_)) {
-    // Create a 1x1 image at that point
-    unsigned long pixel = 0;
-    unsigned int width = 1;
-    unsigned int height = 1;
-    CGContextRef temp = CGBitmapContextCreate(&pixel, width, height, 
-                                              CGBitmapContextGetBitsPerComponent(backingStore_),
-                                              4,
-                                              CGBitmapContextGetColorSpace(backingStore_), 
-                                              kCGImageAlphaPremultipliedLast);
-    CGImageRef current = CGBitmapContextCreateImage(backingStore_);
-    // The bits are flipped from the actual image
-    CGImageRef subImage = CGImageCreateWithImageInRect(current, CGRectMake(floor(pt.x), NSHeight(frame_) - floor(pt.y), 1, 1));
-    CGContextDrawImage(temp, CGRectMake(0, 0, 1, 1), subImage);
-    CGImageRelease(subImage);
-    CGImageRelease(current);
-    CGContextRelease(temp);
-    
-    // The pixel is ABGR -- this might not be right on PPC...
-    NSNumber *a = [NSNumber numberWithFloat:(float)((pixel >> 24) & 0xFF) / 255.0];
-    NSNumber *b = [NSNumber numberWithFloat:(float)((pixel >> 16) & 0xFF) / 255.0];
-    NSNumber *g = [NSNumber numberWithFloat:(float)((pixel >> 8) & 0xFF) / 255.0];
-    NSNumber *r = [NSNumber numberWithFloat:(float)((pixel >> 0) & 0xFF) / 255.0];
-    NSArray *colorArguments = [NSArray arrayWithObjects:r, g, b, a, nil];
+  size_t width = CGBitmapContextGetWidth(backingStore_);
+  size_t height = CGBitmapContextGetHeight(backingStore_);
+  const uint8_t *data = CGBitmapContextGetData(backingStore_);
+  int offsets[4];
+  
+  if (!data || !GetPixelChannelOffsets(backingStore_, offsets))
+    return nil;
+  
+  if (pt.x < 0 || pt.y < 0 || pt.x >= width || pt.y >= height)
+    return nil;
+  
+  // Rows are stored from the top
+  size_t row = height - 1 - (size_t)pt.y;
+  const uint8_t *pixel = data + row * CGBitmapContextGetBytesPerRow(backingStore_) + (size_t)pt.x * 4;
+  double rgba[4];
+  
+  GetPixelRGBA(pixel, offsets, rgba);
+  
+  for (int k = 0; k < 4; ++k)
+    rgba[k] /= 255.0;
+  
+  NumberArray *colorArguments = [[NumberArray alloc] initWithValues:rgba count:4];
+  Color *color = [[[Color alloc] initWithArguments:colorArguments] autorelease];
+  [colorArguments release];
+  
+  return color;
+}
+
+- (BOOL)getPixelRegion:(CGRect *)region fromRect:(RectObject *)rectObj {
+  CGRect bounds = CGRectMake(0, 0, CGBitmapContextGetWidth(backingStore_), 
+                             CGBitmapContextGetHeight(backingStore_));
+  
+  *region = rectObj ? CGRectIntegral(NSRectToCGRect([rectObj rect])) : bounds;
+
+  return CGRectContainsRect(bounds, *region) && !CGRectIsEmpty(*region);
+}
+
+- (NSArray *)getPixels:(NSArray *)arguments {
+  // args: [rect]
+  RectObject *rectObj = [RuntimeObject coerceArray:arguments objectAtIndex:0 toClass:[RectObject class]];
+  uint8_t *data = CGBitmapContextGetData(backingStore_);
+  size_t rowBytes = CGBitmapContextGetBytesPerRow(backingStore_);
+  size_t height = CGBitmapContextGetHeight(backingStore_);
+  int offsets[4];
+  CGRect region;
+  
+  if (!data || !GetPixelChannelOffsets(backingStore_, offsets) || 
+      ![self getPixelRegion:&region fromRect:rectObj])
+    return nil;
+  
+  size_t x = CGRectGetMinX(region);
+  size_t y = CGRectGetMinY(region);
+  size_t width = CGRectGetWidth(region);
+  size_t regionHeight = CGRectGetHeight(region);
+  size_t count = width * regionHeight * 4;
+  
+  // Larger regions have to be read a piece at a time
+  if (count > kMaxPackedArrayLength) {
+    [self setException:[NSString stringWithFormat:@"getPixels: %lu x %lu is more than %d values",
+                        (unsigned long)width, (unsigned long)regionHeight, kMaxPackedArrayLength]];
+    return nil;
+  }
+  
+  double *values = (double *)malloc(sizeof(double) * count);
+  double *value = values;
+  
+  if (!values) {
+    [self setException:[NSString stringWithFormat:@"getPixels: unable to allocate %lu values",
+                        (unsigned long)count]];
+    return nil;
+  }
+  
+  // From the bottom row of the region up
+  for (size_t j = 0; j < regionHeight; ++j) {
+    const uint8_t *pixel = data + (height - 1 - (y + j)) * rowBytes + x * 4;
     
-    return [[[Color alloc] initWithArguments:colorArguments] autorelease];
+    for (size_t i = 0; i < width; ++i, pixel += 4, value += 4)
+      GetPixelRGBA(pixel, offsets, value);
   }
   
-  return nil;
+  return [[[NumberArray alloc] initWithValuesNoCopy:values count:count] autorelease];
 }
-                    
+
+- (void)putPixels:(NSArray *)arguments {
+  // args: rect, pixels
+  if ([arguments count] != 2)
+    return;
+  
+  RectObject *rectObj = [RuntimeObject coerceObject:[arguments objectAtIndex:0] toClass:[RectObject class]];
+  uint8_t *data = CGBitmapContextGetData(backingStore_);
+  size_t rowBytes = CGBitmapContextGetBytesPerRow(backingStore_);
+  size_t height = CGBitmapContextGetHeight(backingStore_);
+  NSUInteger count;
+  const double *values = [RuntimeObject coerceObjectToDoubles:[arguments objectAtIndex:1] count:&count];
+  int offsets[4];
+  CGRect region;
+  
+  if (!data || !values || !rectObj || !GetPixelChannelOffsets(backingStore_, offsets) || 
+      ![self getPixelRegion:&region fromRect:rectObj])
+    return;
+  
+  size_t x = CGRectGetMinX(region);
+  size_t y = CGRectGetMinY(region);
+  size_t width = CGRectGetWidth(region);
+  size_t regionHeight = CGRectGetHeight(region);
+  
+  if (count < width * regionHeight * 4)
+    return;
+  
+  [self markDirtyDeviceRect:region];
+  
+  for (size_t j = 0; j < regionHeight; ++j) {
+    uint8_t *pixel = data + (height - 1 - (y + j)) * rowBytes + x * 4;
+    
+    for (size_t i = 0; i < width; ++i, pixel += 4, values += 4)
+      SetPixelRGBA(pixel, offsets, values);
+  }
+}
+
 - (NSString *)toString {
   return [self description];
 }
@@ -26,6 +26,7 @@
   CGFloat alpha_;
   unsigned int width_;
   unsigned int height_;
+  uint64_t seed_;
 }
 
 //------------------------------------------------------------------------------
@@ -12,18 +12,17 @@
 // License for the specific language governing permissions and limitations under
 // the License.
 
-#import <Accelerate/Accelerate.h>
-
 #import "Color.h"
 #import "Image.h"
 #import "Layer.h"
 #import "Noise.h"
+#import "NoiseCore.h"
+#import "Randomizer.h"
 #import "RuntimeObject.h"
 
 @interface Noise(PrivateMethods)
 - (void)invalidate;
 - (void)ensureBitmap;
-- (BOOL)randomlyFillBytes:(unsigned char *)bytes size:(size_t)size;
 - (void)render;
 @end
 
@@ -47,7 +46,7 @@
     return;
   
   // Use width and height for a 32-bit/pixel ARGB.  16 byte align rowbytes
-  int rowBytes = 0xFFF0 & ((4 * width_) + 0xF);
+  size_t rowBytes = ((4 * width_) + 0xF) & ~0xF;
   buffer_ = malloc(height_ * rowBytes);
   CGColorSpaceRef cs = [Color createDefaultCGColorSpace];
   CGBitmapInfo info = kCGImageAlphaPremultipliedFirst;
@@ -72,86 +71,23 @@
   CGRect destRect = [layer cgRectFrame];
   CGContextRef dest = [layer backingStore];
   
+  [layer markDirtyRect:destRect];
   CGContextDrawImage(dest, destRect, [self cgImage]);
 }
 
-//------------------------------------------------------------------------------
-- (BOOL)randomlyFillBytes:(unsigned char *)bytes size:(size_t)size {
-  int fd = open("/dev/random", O_RDONLY);
-  
-  if (fd == -1)
-    return NO;
-  
-  read(fd, bytes, size);
-  close(fd);
-
-  return YES;
-}
-
 //------------------------------------------------------------------------------
 - (void)render {
-  // We'll be duplicating the data for all channels, so
-  unsigned long rowBytes = CGBitmapContextGetBytesPerRow(bitmap_);
-  unsigned long planeBytes = height_ * rowBytes;
-  unsigned char *rData = malloc(planeBytes);
-  unsigned char *gData = NULL;
-  unsigned char *bData = NULL;
-  unsigned char *aData = NULL;
-  unsigned char *tempData = malloc(planeBytes * 4);
-  
-  if (alpha_ > 0.0) {
-    aData = malloc(planeBytes);
-    memset(aData, (unsigned long)floor(alpha_ * 255.0), planeBytes);
-  }
-  
-  if (grayscale_) {
-    gData = rData;
-    bData = rData;
-    
-    if (!aData)
-      aData = rData;
-    
-    [self randomlyFillBytes:rData size:planeBytes];
-  } else {
-    gData = malloc(planeBytes);
-    bData = malloc(planeBytes);
-    
-    if (!aData) {
-      aData = malloc(planeBytes);
-      [self randomlyFillBytes:aData size:planeBytes];
-    }
-    
-    [self randomlyFillBytes:rData size:planeBytes];
-    [self randomlyFillBytes:gData size:planeBytes];
-    [self randomlyFillBytes:bData size:planeBytes];    
-  }
-  
-  vImage_Buffer srcA = { aData, height_, width_, rowBytes };
-  vImage_Buffer srcR = { rData, height_, width_, rowBytes };
-  vImage_Buffer srcG = { gData, height_, width_, rowBytes };
-  vImage_Buffer srcB = { bData, height_, width_, rowBytes };
-  vImage_Buffer tempDest = { tempData, height_, width_, rowBytes };
-  vImage_Flags flags = kvImageDoNotTile;
-  
-  // Convert
-  vImageConvert_Planar8toARGB8888(&srcA, &srcR, &srcG, &srcB, &tempDest, flags);
+  // Generate straight into the premultiplied ARGB bitmap
+  NoiseParameters params;
+  params.pixels = CGBitmapContextGetData(bitmap_);
+  params.width = width_;
+  params.height = height_;
+  params.rowBytes = CGBitmapContextGetBytesPerRow(bitmap_);
+  params.alpha = alpha_ > 0.0 ? MIN(255, (int)floor(alpha_ * 255.0)) : -1;
+  params.grayscale = grayscale_;
+  params.seed = seed_;
 
-  // Push into our bitmap
-  unsigned char *bitmapData = CGBitmapContextGetData(bitmap_);
-  vImage_Buffer dest = { bitmapData, height_, width_, rowBytes };
-  vImagePremultiplyData_ARGB8888(&tempDest, &dest, flags);
-  
-  // Cleanup
-  free(rData);
-  free(tempData);
-  
-  if (gData != rData) {
-    free(gData);
-    free(bData);
-  }
-  
-  if (aData != rData)
-    free(aData);
+  NoiseRender(&params, WorkQueueGetShared());
 }
 
 //------------------------------------------------------------------------------
@@ -184,6 +120,9 @@
     [self setGrayscale:NO];
     [self setAlpha:0];
     
+    // Changing the properties re-renders the same noise
+    seed_ = RandomizerSeedValue();
+    
     // args: width, height, [alpha], [grayscale]
     int count = [arguments count];
     
@@ -0,0 +1,91 @@
+// Copyright 2008 Google Inc.
+//
+// Licensed under the Apache License, Version 2.0 (the "License"); you may not
+// use this file except in compliance with the License.  You may obtain a copy
+// of the License at
+//
+// http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS, WITHOUT
+// WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.  See the
+// License for the specific language governing permissions and limitations under
+// the License.
+
+
+#include "NoiseCore.h"
+#include "RandomStream.h"
+
+// Rows per task
+#define kNoiseBandRows 32
+
+typedef struct {
+  const NoiseParameters *params;
+  RandomStream stream;
+} NoiseJob;
+
+// c * a / 255, rounded
+static inline uint32_t Premultiply(uint32_t c, uint32_t a) {
+  uint32_t t = c * a + 128;
+  return (t + (t >> 8)) >> 8;
+}
+
+static void RenderBand(void *context, size_t index, int worker) {
+  const NoiseJob *job = (const NoiseJob *)context;
+  const NoiseParameters *p = job->params;
+  size_t firstRow = index * kNoiseBandRows;
+  size_t lastRow = firstRow + kNoiseBandRows;
+
+  (void)worker;
+
+  if (lastRow > p->height)
+    lastRow = p->height;
+
+  for (size_t y = firstRow; y < lastRow; ++y) {
+    uint8_t *dest = p->pixels + y * p->rowBytes;
+    uint64_t position = (uint64_t)y * p->width;
+
+    // One 64-bit value for every two pixels in color, eight in grayscale
+    if (p->grayscale) {
+      uint64_t bits = RandomStreamBitsAt(&job->stream, position >> 3) >> ((position & 7) * 8);
+
+      for (size_t x = 0; x < p->width; ++x, dest += 4) {
+        if (((position + x) & 7) == 0)
+          bits = RandomStreamBitsAt(&job->stream, (position + x) >> 3);
+
+        uint32_t gray = bits & 0xFF;
+        uint32_t a = p->alpha < 0 ? gray : (uint32_t)p->alpha;
+        uint32_t c = Premultiply(gray, a);
+        dest[0] = a;
+        dest[1] = dest[2] = dest[3] = c;
+        bits >>= 8;
+      }
+    } else {
+      uint64_t bits = RandomStreamBitsAt(&job->stream, position >> 1) >> ((position & 1) * 32);
+
+      for (size_t x = 0; x < p->width; ++x, dest += 4) {
+        if (((position + x) & 1) == 0)
+          bits = RandomStreamBitsAt(&job->stream, (position + x) >> 1);
+
+        uint32_t a = p->alpha < 0 ? (bits >> 24) & 0xFF : (uint32_t)p->alpha;
+        dest[0] = a;
+        dest[1] = Premultiply((bits >> 16) & 0xFF, a);
+        dest[2] = Premultiply((bits >> 8) & 0xFF, a);
+        dest[3] = Premultiply(bits & 0xFF, a);
+        bits >>= 32;
+      }
+    }
+  }
+}
+
+void NoiseRender(const NoiseParameters *params, WorkQueue *queue) {
+  if (!params->pixels || !params->width || !params->height)
+    return;
+
+  NoiseJob job;
+  job.params = params;
+  RandomStreamInit(&job.stream, params->seed, RandomStreamIDForName("Noise"));
+
+  WorkQueueApply(queue, (params->height + kNoiseBandRows - 1) / kNoiseBandRows, RenderBand,
+                 &job);
+}
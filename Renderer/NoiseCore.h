@@ -0,0 +1,48 @@
+// Copyright 2008 Google Inc.
+//
+// Licensed under the Apache License, Version 2.0 (the "License"); you may not
+// use this file except in compliance with the License.  You may obtain a copy
+// of the License at
+//
+// http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS, WITHOUT
+// WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.  See the
+// License for the specific language governing permissions and limitations under
+// the License.
+
+
+// White noise rendering into a premultiplied ARGB buffer.  The random bits for
+// a pixel are read from a RandomStream at the pixel's position, so the image
+// for a seed doesn't depend on how the rows are split between threads.
+
+#ifndef NOISECORE_H
+#define NOISECORE_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+#include "WorkQueue.h"
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+typedef struct {
+  uint8_t *pixels;        // A, R, G, B bytes, premultiplied
+  size_t width;
+  size_t height;
+  size_t rowBytes;
+  int alpha;              // 0 - 255, or -1 for random alpha
+  int grayscale;          // Same value for R, G, B (and A if it's random)
+  uint64_t seed;
+} NoiseParameters;
+
+void NoiseRender(const NoiseParameters *params, WorkQueue *queue);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif  // NOISECORE_H
@@ -0,0 +1,39 @@
+// Copyright 2008 Google Inc.
+//
+// Licensed under the Apache License, Version 2.0 (the "License"); you may not
+// use this file except in compliance with the License.  You may obtain a copy
+// of the License at
+//
+// http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS, WITHOUT
+// WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.  See the
+// License for the specific language governing permissions and limitations under
+// the License.
+
+// An immutable array of numbers, stored as doubles instead of NSNumber
+// objects.  The Runtime converts JavaScript arrays of numbers to these, so
+// that native methods can read bulk numeric data (e.g., coordinates) directly
+// with -values.  -objectAtIndex: returns an autoreleased NSNumber.
+
+#import <Foundation/Foundation.h>
+
+// Most values that are packed into one NumberArray from a script or a bulk
+// read.  Anything larger is converted element by element or refused.
+#define kMaxPackedArrayLength (1 << 24)
+
+@interface NumberArray : NSArray {
+  double *values_;
+  NSUInteger count_;
+}
+
+// Copy |count| |values|
+- (id)initWithValues:(const double *)values count:(NSUInteger)count;
+
+// Take ownership of |values|, which must have been allocated with malloc()
+- (id)initWithValuesNoCopy:(double *)values count:(NSUInteger)count;
+
+- (const double *)values;
+
+@end
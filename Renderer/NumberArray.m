@@ -0,0 +1,64 @@
+// Copyright 2008 Google Inc.
+//
+// Licensed under the Apache License, Version 2.0 (the "License"); you may not
+// use this file except in compliance with the License.  You may obtain a copy
+// of the License at
+//
+// http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS, WITHOUT
+// WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.  See the
+// License for the specific language governing permissions and limitations under
+// the License.
+
+#import "NumberArray.h"
+
+@implementation NumberArray
+- (id)initWithValues:(const double *)values count:(NSUInteger)count {
+  double *copy = (double *)malloc(sizeof(double) * (count ? count : 1));
+  
+  if (!copy) {
+    [self release];
+    return nil;
+  }
+  
+  if (count)
+    memcpy(copy, values, sizeof(double) * count);
+  
+  return [self initWithValuesNoCopy:copy count:count];
+}
+
+- (id)initWithValuesNoCopy:(double *)values count:(NSUInteger)count {
+  if ((self = [super init])) {
+    values_ = values;
+    count_ = count;
+  } else {
+    free(values);
+  }
+  
+  return self;
+}
+
+- (void)dealloc {
+  free(values_);
+  [super dealloc];
+}
+
+- (const double *)values {
+  return values_;
+}
+
+- (NSUInteger)count {
+  return count_;
+}
+
+- (id)objectAtIndex:(NSUInteger)index {
+  if (index >= count_)
+    [NSException raise:NSRangeException format:@"Index %lu beyond count %lu", 
+     (unsigned long)index, (unsigned long)count_];
+  
+  return [NSNumber numberWithDouble:values_[index]];
+}
+
+@end
@@ -0,0 +1,595 @@
+// Copyright 2008 Google Inc.
+//
+// Licensed under the Apache License, Version 2.0 (the "License"); you may not
+// use this file except in compliance with the License.  You may obtain a copy
+// of the License at
+//
+// http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS, WITHOUT
+// WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.  See the
+// License for the specific language governing permissions and limitations under
+// the License.
+
+
+// For posix_memalign() in strict C99 builds
+#ifndef _POSIX_C_SOURCE
+#define _POSIX_C_SOURCE 200112L
+#endif
+
+#include <math.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "ParticleCore.h"
+
+#define kAlignment 32
+
+static int Resize(void **array, size_t elementSize, size_t count, size_t capacity) {
+  void *resized = NULL;
+
+  if (posix_memalign(&resized, kAlignment, elementSize * capacity))
+    return 0;
+
+  if (*array)
+    memcpy(resized, *array, elementSize * count);
+
+  free(*array);
+  *array = resized;
+
+  return 1;
+}
+
+int ParticleStoreReserve(ParticleStore *store, size_t capacity) {
+  if (capacity <= store->capacity)
+    return 1;
+
+  // Build the new arrays on the side so that a failure leaves the store alone
+  ParticleStore resized;
+  float **floats[] = {
+    &resized.x, &resized.y, &resized.lastX, &resized.lastY, &resized.vx, &resized.vy,
+    &resized.ax, &resized.ay, &resized.red, &resized.green, &resized.blue, &resized.alpha
+  };
+  size_t floatCount = sizeof(floats) / sizeof(floats[0]);
+  size_t i;
+
+  memset(&resized, 0, sizeof(resized));
+
+  for (i = 0; i < floatCount; ++i)
+    if (!Resize((void **)floats[i], sizeof(float), 0, capacity))
+      break;
+
+  if (i < floatCount || !Resize((void **)&resized.age, sizeof(uint32_t), 0, capacity) ||
+      !Resize((void **)&resized.state, sizeof(uint8_t), 0, capacity)) {
+    ParticleStoreRelease(&resized);
+    return 0;
+  }
+
+  float **oldFloats[] = {
+    &store->x, &store->y, &store->lastX, &store->lastY, &store->vx, &store->vy,
+    &store->ax, &store->ay, &store->red, &store->green, &store->blue, &store->alpha
+  };
+
+  for (i = 0; i < floatCount; ++i)
+    if (*oldFloats[i])
+      memcpy(*floats[i], *oldFloats[i], sizeof(float) * store->count);
+
+  if (store->age)
+    memcpy(resized.age, store->age, sizeof(uint32_t) * store->count);
+
+  if (store->state)
+    memcpy(resized.state, store->state, sizeof(uint8_t) * store->count);
+
+  resized.count = store->count;
+  resized.capacity = capacity;
+  ParticleStoreRelease(store);
+  *store = resized;
+
+  return 1;
+}
+
+void ParticleStoreRelease(ParticleStore *store) {
+  free(store->x);
+  free(store->y);
+  free(store->lastX);
+  free(store->lastY);
+  free(store->vx);
+  free(store->vy);
+  free(store->ax);
+  free(store->ay);
+  free(store->red);
+  free(store->green);
+  free(store->blue);
+  free(store->alpha);
+  free(store->age);
+  free(store->state);
+  memset(store, 0, sizeof(ParticleStore));
+}
+
+int ParticleWellsReserve(ParticleWells *wells, size_t capacity) {
+  if (capacity <= wells->capacity)
+    return 1;
+
+  if (!Resize((void **)&wells->x, sizeof(float), wells->count, capacity) ||
+      !Resize((void **)&wells->y, sizeof(float), wells->count, capacity) ||
+      !Resize((void **)&wells->gravity, sizeof(float), wells->count, capacity))
+    return 0;
+
+  wells->capacity = capacity;
+
+  return 1;
+}
+
+void ParticleWellsRelease(ParticleWells *wells) {
+  free(wells->x);
+  free(wells->y);
+  free(wells->gravity);
+  memset(wells, 0, sizeof(ParticleWells));
+}
+
+int ParticleTrailsReserve(ParticleTrails *trails, size_t capacity) {
+  if (capacity <= trails->capacity)
+    return 1;
+
+  // Leave room to grow when segments are collected over several steps
+  if (capacity < trails->capacity * 2)
+    capacity = trails->capacity * 2;
+
+  ParticleSegment *segments = (ParticleSegment *)malloc(sizeof(ParticleSegment) * capacity);
+  ParticleSegment *scratch = (ParticleSegment *)malloc(sizeof(ParticleSegment) * capacity);
+
+  if (!segments || !scratch) {
+    free(segments);
+    free(scratch);
+    return 0;
+  }
+
+  if (trails->count)
+    memcpy(segments, trails->segments, sizeof(ParticleSegment) * trails->count);
+
+  free(trails->segments);
+  free(trails->scratch);
+  trails->segments = segments;
+  trails->scratch = scratch;
+  trails->capacity = capacity;
+
+  return 1;
+}
+
+void ParticleTrailsRelease(ParticleTrails *trails) {
+  free(trails->segments);
+  free(trails->scratch);
+  memset(trails, 0, sizeof(ParticleTrails));
+}
+
+static inline uint32_t QuantizeComponent(float value) {
+  value = value < 0 ? 0 : (value > 1 ? 1 : value);
+
+  return (uint32_t)(value * 255.0f + 0.5f);
+}
+
+int ParticleTrailsAdd(ParticleTrails *trails, const ParticleStore *store) {
+  if (!ParticleTrailsReserve(trails, trails->count + store->count))
+    return 0;
+
+  ParticleSegment *segment = trails->segments + trails->count;
+
+  for (size_t i = 0; i < store->count; ++i) {
+    if (store->state[i] == kParticleExpired)
+      continue;
+
+    segment->x0 = store->lastX[i];
+    segment->y0 = store->lastY[i];
+    segment->x1 = store->x[i];
+    segment->y1 = store->y[i];
+    segment->color = QuantizeComponent(store->red[i]) << 24 |
+      QuantizeComponent(store->green[i]) << 16 | QuantizeComponent(store->blue[i]) << 8 |
+      QuantizeComponent(store->alpha[i]);
+    ++segment;
+  }
+
+  trails->count = segment - trails->segments;
+
+  return 1;
+}
+
+// LSD radix sort, a byte at a time.  Bytes that are the same for every
+// segment (often the color channels, when only alpha varies) are skipped.
+void ParticleTrailsSort(ParticleTrails *trails) {
+  size_t count = trails->count;
+  ParticleSegment *from = trails->segments;
+  ParticleSegment *to = trails->scratch;
+
+  if (count < 2)
+    return;
+
+  for (int shift = 0; shift < 32; shift += 8) {
+    size_t offsets[256];
+    size_t i;
+
+    memset(offsets, 0, sizeof(offsets));
+    for (i = 0; i < count; ++i)
+      ++offsets[(from[i].color >> shift) & 0xFF];
+
+    if (offsets[(from[0].color >> shift) & 0xFF] == count)
+      continue;
+
+    size_t total = 0;
+    for (i = 0; i < 256; ++i) {
+      size_t bucketCount = offsets[i];
+      offsets[i] = total;
+      total += bucketCount;
+    }
+
+    for (i = 0; i < count; ++i)
+      to[offsets[(from[i].color >> shift) & 0xFF]++] = from[i];
+
+    ParticleSegment *swap = from;
+    from = to;
+    to = swap;
+  }
+
+  trails->segments = from;
+  trails->scratch = to;
+}
+
+void ParticleWellAcceleration(float wellX, float wellY, float gravity, float x, float y,
+                              float *ax, float *ay) {
+  float dx = x - wellX;
+  float dy = y - wellY;
+  float mag = sqrtf(dx * dx + dy * dy);
+
+  // Toward the well, with a strength of gravity / distance on each axis
+  if (mag > 0) {
+    *ax = gravity / (mag * (dx > 0 ? -1 : 1));
+    *ay = gravity / (mag * (dy > 0 ? -1 : 1));
+  } else {
+    *ax = *ay = gravity;
+  }
+}
+
+// Add the acceleration toward every well for each (x, y)
+static void AccumulateWells(size_t count, const float *restrict x, const float *restrict y,
+                            float *restrict ax, float *restrict ay,
+                            const ParticleWells *wells) {
+  for (size_t w = 0; w < wells->count; ++w) {
+    float wellX = wells->x[w];
+    float wellY = wells->y[w];
+    float gravity = wells->gravity[w];
+
+    // Branch free so that it vectorizes
+    for (size_t i = 0; i < count; ++i) {
+      float dx = x[i] - wellX;
+      float dy = y[i] - wellY;
+      float mag = sqrtf(dx * dx + dy * dy);
+      float scale = gravity / (mag > 0 ? mag : 1.0f);
+      ax[i] += dx > 0 ? -scale : scale;
+      ay[i] += dy > 0 ? -scale : scale;
+    }
+  }
+}
+
+void ParticleStoreApplyWells(ParticleStore *store, const ParticleWells *wells) {
+  AccumulateWells(store->count, store->x, store->y, store->ax, store->ay, wells);
+}
+
+//------------------------------------------------------------------------------
+// Approximate field
+//------------------------------------------------------------------------------
+// Within a cell, each well's contribution to one axis is +/-g/r with a fixed
+// sign, as long as the cell doesn't straddle the well's row or column.
+// Bilinear interpolation of 1/r over a cell of size h is off by at most about
+// (h^2 / 8) * (4 / r^3), or h^2 / (2 r^2) relative to the value.  So each cell
+// keeps a list of the wells closer than h / sqrt(2 * tolerance) or straddling
+// it; their interpolated contribution is swapped for the exact one.
+
+static inline void WellAcceleration(float wellX, float wellY, float gravity, float x, float y,
+                                    float *ax, float *ay) {
+  float dx = x - wellX;
+  float dy = y - wellY;
+  float mag = sqrtf(dx * dx + dy * dy);
+  float scale = gravity / (mag > 0 ? mag : 1.0f);
+
+  *ax = dx > 0 ? -scale : scale;
+  *ay = dy > 0 ? -scale : scale;
+}
+
+static int SameField(const ParticleField *field, const ParticleWells *wells,
+                     const ParticleFieldParameters *params) {
+  if (!field->valid || field->wells.count != wells->count ||
+      memcmp(&field->params, params, sizeof(ParticleFieldParameters)))
+    return 0;
+
+  size_t size = sizeof(float) * wells->count;
+
+  return !memcmp(field->wells.x, wells->x, size) && !memcmp(field->wells.y, wells->y, size) &&
+    !memcmp(field->wells.gravity, wells->gravity, size);
+}
+
+static int CopyWells(ParticleWells *to, const ParticleWells *from) {
+  if (!ParticleWellsReserve(to, from->count))
+    return 0;
+
+  size_t size = sizeof(float) * from->count;
+  memcpy(to->x, from->x, size);
+  memcpy(to->y, from->y, size);
+  memcpy(to->gravity, from->gravity, size);
+  to->count = from->count;
+
+  return 1;
+}
+
+static int ReserveGrid(ParticleField *field, size_t cornerCount, size_t cellCount) {
+  if (cornerCount > field->cornerCapacity) {
+    float **arrays[] = { &field->cornerX, &field->cornerY, &field->ax, &field->ay };
+
+    for (size_t i = 0; i < sizeof(arrays) / sizeof(arrays[0]); ++i)
+      if (!Resize((void **)arrays[i], sizeof(float), 0, cornerCount))
+        return 0;
+
+    field->cornerCapacity = cornerCount;
+  }
+
+  if (cellCount + 1 > field->cellCapacity) {
+    if (!Resize((void **)&field->nearStart, sizeof(uint32_t), 0, cellCount + 1))
+      return 0;
+
+    field->cellCapacity = cellCount + 1;
+  }
+
+  return 1;
+}
+
+static inline void AddNearWell(ParticleField *field, size_t cell, size_t w,
+                               uint32_t *nearWells) {
+  if (nearWells)
+    nearWells[field->nearStart[cell]++] = (uint32_t)w;
+  else
+    ++field->nearStart[cell + 1];
+}
+
+// Visit each cell that well |w| is near.  With no |nearWells|, count them in
+// nearStart[cell + 1]; otherwise append |w| at nearStart[cell]++.
+static void VisitNearCells(ParticleField *field, size_t w, uint32_t *nearWells) {
+  const ParticleFieldParameters *params = &field->params;
+  float cellSize = params->cellSize;
+  float radius = cellSize / sqrtf(2.0f * params->tolerance);
+  float wellX = field->wells.x[w], wellY = field->wells.y[w];
+  long columns = (long)field->columns;
+  long rows = (long)field->rows;
+
+  // Cell coordinates of the well, which may be outside of the grid
+  float cx = (wellX - params->minX) / cellSize;
+  float cy = (wellY - params->minY) / cellSize;
+  float reach = radius / cellSize;
+  long left = (long)floorf(cx - reach) - 1, right = (long)floorf(cx + reach) + 1;
+  long top = (long)floorf(cy - reach) - 1, bottom = (long)floorf(cy + reach) + 1;
+  long column = (long)floorf(cx);
+
+  left = left < 0 ? 0 : left;
+  top = top < 0 ? 0 : top;
+  right = right >= columns ? columns - 1 : right;
+  bottom = bottom >= rows ? rows - 1 : bottom;
+
+  for (long r = 0; r < rows; ++r) {
+    float y0 = params->minY + r * cellSize;
+    long c;
+
+    // Straddling the well's row: every cell in it
+    if (y0 <= wellY && wellY <= y0 + cellSize) {
+      for (c = 0; c < columns; ++c)
+        AddNearWell(field, r * columns + c, w, nearWells);
+
+      continue;
+    }
+
+    // Straddling the well's column.  Both cells when it's on a grid line.
+    for (c = column - 1; c <= column; ++c) {
+      float x0 = params->minX + c * cellSize;
+
+      if (c >= 0 && c < columns && x0 <= wellX && wellX <= x0 + cellSize)
+        AddNearWell(field, r * columns + c, w, nearWells);
+    }
+
+    if (r < top || r > bottom)
+      continue;
+
+    // Too close to the well
+    float dy = wellY < y0 ? y0 - wellY : wellY - y0 - cellSize;
+    for (c = left; c <= right; ++c) {
+      float x0 = params->minX + c * cellSize;
+
+      if (x0 <= wellX && wellX <= x0 + cellSize)
+        continue;  // Already added
+
+      float dx = wellX < x0 ? x0 - wellX : wellX - x0 - cellSize;
+
+      if (dx * dx + dy * dy < radius * radius)
+        AddNearWell(field, r * columns + c, w, nearWells);
+    }
+  }
+}
+
+static int BuildNearLists(ParticleField *field) {
+  size_t cellCount = field->columns * field->rows;
+  size_t w;
+
+  memset(field->nearStart, 0, sizeof(uint32_t) * (cellCount + 1));
+
+  for (w = 0; w < field->wells.count; ++w)
+    if (field->wells.gravity[w] != 0)
+      VisitNearCells(field, w, NULL);
+
+  for (size_t cell = 0; cell < cellCount; ++cell)
+    field->nearStart[cell + 1] += field->nearStart[cell];
+
+  size_t total = field->nearStart[cellCount];
+  if (total > field->nearCapacity) {
+    if (!Resize((void **)&field->nearWells, sizeof(uint32_t), 0, total))
+      return 0;
+
+    field->nearCapacity = total;
+  }
+
+  // Filling advances each start to the next cell's; shift them back after
+  for (w = 0; w < field->wells.count; ++w)
+    if (field->wells.gravity[w] != 0)
+      VisitNearCells(field, w, field->nearWells);
+
+  memmove(field->nearStart + 1, field->nearStart, sizeof(uint32_t) * cellCount);
+  field->nearStart[0] = 0;
+
+  return 1;
+}
+
+int ParticleFieldUpdate(ParticleField *field, const ParticleWells *wells,
+                        const ParticleFieldParameters *params) {
+  if (SameField(field, wells, params))
+    return 1;
+
+  field->valid = 0;
+
+  if (params->cellSize <= 0 || params->tolerance <= 0 || params->maxX <= params->minX ||
+      params->maxY <= params->minY || wells->count > UINT32_MAX)
+    return 0;
+
+  size_t columns = (size_t)ceilf((params->maxX - params->minX) / params->cellSize);
+  size_t rows = (size_t)ceilf((params->maxY - params->minY) / params->cellSize);
+  size_t cornerCount = (columns + 1) * (rows + 1);
+
+  if (!ReserveGrid(field, cornerCount, columns * rows) || !CopyWells(&field->wells, wells))
+    return 0;
+
+  field->params = *params;
+  field->columns = columns;
+  field->rows = rows;
+
+  for (size_t row = 0, i = 0; row <= rows; ++row) {
+    for (size_t column = 0; column <= columns; ++column, ++i) {
+      field->cornerX[i] = params->minX + column * params->cellSize;
+      field->cornerY[i] = params->minY + row * params->cellSize;
+    }
+  }
+
+  memset(field->ax, 0, sizeof(float) * cornerCount);
+  memset(field->ay, 0, sizeof(float) * cornerCount);
+  AccumulateWells(cornerCount, field->cornerX, field->cornerY, field->ax, field->ay, wells);
+
+  if (!BuildNearLists(field))
+    return 0;
+
+  field->valid = 1;
+
+  return 1;
+}
+
+void ParticleFieldRelease(ParticleField *field) {
+  free(field->cornerX);
+  free(field->cornerY);
+  free(field->ax);
+  free(field->ay);
+  free(field->nearStart);
+  free(field->nearWells);
+  ParticleWellsRelease(&field->wells);
+  memset(field, 0, sizeof(ParticleField));
+}
+
+void ParticleStoreApplyField(ParticleStore *store, const ParticleField *field) {
+  const ParticleFieldParameters *params = &field->params;
+  const ParticleWells *wells = &field->wells;
+  size_t cornerColumns = field->columns + 1;
+  float invCellSize = 1.0f / params->cellSize;
+
+  for (size_t i = 0; i < store->count; ++i) {
+    float x = store->x[i], y = store->y[i];
+    float fx = (x - params->minX) * invCellSize;
+    float fy = (y - params->minY) * invCellSize;
+
+    if (!(fx >= 0 && fy >= 0 && fx < field->columns && fy < field->rows)) {
+      AccumulateWells(1, store->x + i, store->y + i, store->ax + i, store->ay + i, wells);
+      continue;
+    }
+
+    size_t column = (size_t)fx;
+    size_t row = (size_t)fy;
+    size_t cell = row * field->columns + column;
+    size_t corner = row * cornerColumns + column;
+    float u = fx - column, v = fy - row;
+    float w00 = (1 - u) * (1 - v), w10 = u * (1 - v), w01 = (1 - u) * v, w11 = u * v;
+    float ax = w00 * field->ax[corner] + w10 * field->ax[corner + 1] +
+      w01 * field->ax[corner + cornerColumns] + w11 * field->ax[corner + cornerColumns + 1];
+    float ay = w00 * field->ay[corner] + w10 * field->ay[corner + 1] +
+      w01 * field->ay[corner + cornerColumns] + w11 * field->ay[corner + cornerColumns + 1];
+
+    // Swap the interpolated contribution of the nearby wells for the exact one
+    float x0 = field->cornerX[corner], y0 = field->cornerY[corner];
+    float x1 = x0 + params->cellSize, y1 = y0 + params->cellSize;
+
+    for (uint32_t n = field->nearStart[cell]; n < field->nearStart[cell + 1]; ++n) {
+      uint32_t w = field->nearWells[n];
+      float wellX = wells->x[w], wellY = wells->y[w], gravity = wells->gravity[w];
+      float ax00, ay00, ax10, ay10, ax01, ay01, ax11, ay11, exactX, exactY;
+
+      WellAcceleration(wellX, wellY, gravity, x0, y0, &ax00, &ay00);
+      WellAcceleration(wellX, wellY, gravity, x1, y0, &ax10, &ay10);
+      WellAcceleration(wellX, wellY, gravity, x0, y1, &ax01, &ay01);
+      WellAcceleration(wellX, wellY, gravity, x1, y1, &ax11, &ay11);
+      WellAcceleration(wellX, wellY, gravity, x, y, &exactX, &exactY);
+      ax += exactX - (w00 * ax00 + w10 * ax10 + w01 * ax01 + w11 * ax11);
+      ay += exactY - (w00 * ay00 + w10 * ay10 + w01 * ay01 + w11 * ay11);
+    }
+
+    store->ax[i] += ax;
+    store->ay[i] += ay;
+  }
+}
+
+// One axis at a time keeps the number of streams small enough to vectorize
+static void MoveAlongAxis(size_t count, float *restrict position, float *restrict last,
+                          float *restrict velocity, const float *restrict acceleration,
+                          float gravity, float timeStep) {
+  for (size_t i = 0; i < count; ++i) {
+    float p = position[i];
+    float v = velocity[i] + (acceleration[i] + gravity) * timeStep;
+    last[i] = p;
+    velocity[i] = v;
+    position[i] = p + v * timeStep;
+  }
+}
+
+void ParticleStoreIntegrate(ParticleStore *store, const ParticleStepParameters *params) {
+  size_t count = store->count;
+  float alphaDelta = params->alphaDelta;
+  float *restrict alpha = store->alpha;
+  uint32_t *restrict age = store->age;
+  uint8_t *restrict state = store->state;
+
+  // Motion
+  MoveAlongAxis(count, store->x, store->lastX, store->vx, store->ax, params->gravityX,
+                params->timeStep);
+  MoveAlongAxis(count, store->y, store->lastY, store->vy, store->ay, params->gravityY,
+                params->timeStep);
+
+  // Age and fade
+  for (size_t i = 0; i < count; ++i) {
+    uint32_t newAge = age[i] + 1;
+    age[i] = newAge;
+    alpha[i] += (!params->alphaDelay || params->alphaDelay < newAge) ? alphaDelta : 0;
+  }
+
+  // Regeneration.  Bitwise operators keep this free of branches.
+  const float *restrict x = store->x;
+  const float *restrict y = store->y;
+  int fadingOut = alphaDelta < 0;
+  int fadingIn = alphaDelta > 0;
+  uint32_t maxAge = params->maxAge ? params->maxAge : UINT32_MAX;
+
+  for (size_t i = 0; i < count; ++i) {
+    int expired = ((alpha[i] <= 0) & fadingOut) | ((alpha[i] >= 1) & fadingIn) | (age[i] > maxAge);
+    int outside = (x[i] < params->minX) | (x[i] >= params->maxX) |
+      (y[i] < params->minY) | (y[i] >= params->maxY);
+
+    state[i] = expired ? kParticleExpired : (outside ? kParticleLeaving : kParticleAlive);
+  }
+}
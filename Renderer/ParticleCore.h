@@ -0,0 +1,167 @@
+// Copyright 2008 Google Inc.
+//
+// Licensed under the Apache License, Version 2.0 (the "License"); you may not
+// use this file except in compliance with the License.  You may obtain a copy
+// of the License at
+//
+// http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS, WITHOUT
+// WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.  See the
+// License for the specific language governing permissions and limitations under
+// the License.
+
+
+// Structure-of-arrays storage and integration for the Particles simulator
+// object.  Every attribute lives in its own aligned array so that the step
+// loops run over plain floats (and vectorize) instead of sending messages.
+
+#ifndef PARTICLECORE_H
+#define PARTICLECORE_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+// What happened to a particle in the last ParticleStoreIntegrate()
+enum {
+  kParticleAlive = 0,
+  kParticleExpired,       // Faded out or too old: regenerate without drawing
+  kParticleLeaving        // Draw its trail, then regenerate
+};
+
+typedef struct {
+  size_t count;
+  size_t capacity;
+  float *x;
+  float *y;
+  float *lastX;           // Location before the last step
+  float *lastY;
+  float *vx;
+  float *vy;
+  float *ax;
+  float *ay;
+  float *red;
+  float *green;
+  float *blue;
+  float *alpha;
+  uint32_t *age;
+  uint8_t *state;
+} ParticleStore;
+
+// Gravity wells, flattened
+typedef struct {
+  size_t count;
+  size_t capacity;
+  float *x;
+  float *y;
+  float *gravity;
+} ParticleWells;
+
+typedef struct {
+  float gravityX;
+  float gravityY;
+  float timeStep;
+  float alphaDelta;
+  uint32_t alphaDelay;    // Steps before alphaDelta is applied (0 for none)
+  uint32_t maxAge;        // 0 for no limit
+  float minX;             // Particles leave when they cross these
+  float minY;
+  float maxX;
+  float maxY;
+} ParticleStepParameters;
+
+// A trail segment, with its color quantized to 0xRRGGBBAA
+typedef struct {
+  float x0;
+  float y0;
+  float x1;
+  float y1;
+  uint32_t color;
+} ParticleSegment;
+
+// Segments collected over one or more steps.  Sorting groups them by color so
+// that each color can be stroked as one path.
+typedef struct {
+  size_t count;
+  size_t capacity;
+  ParticleSegment *segments;
+  ParticleSegment *scratch;
+} ParticleTrails;
+
+// Grow the arrays to hold at least |capacity| particles.  Returns 0 on
+// failure, in which case the store is unchanged.
+int ParticleStoreReserve(ParticleStore *store, size_t capacity);
+void ParticleStoreRelease(ParticleStore *store);
+
+int ParticleWellsReserve(ParticleWells *wells, size_t capacity);
+void ParticleWellsRelease(ParticleWells *wells);
+
+int ParticleTrailsReserve(ParticleTrails *trails, size_t capacity);
+void ParticleTrailsRelease(ParticleTrails *trails);
+
+// Append a segment for each particle that isn't kParticleExpired.  Returns 0
+// if the trails couldn't grow to hold them, in which case nothing is added.
+int ParticleTrailsAdd(ParticleTrails *trails, const ParticleStore *store);
+
+// Stable sort by color; segments of one color keep the order they were added
+void ParticleTrailsSort(ParticleTrails *trails);
+
+// The acceleration from a single well (see -[GravityPoint accelerationForPoint:])
+void ParticleWellAcceleration(float wellX, float wellY, float gravity, float x, float y,
+                              float *ax, float *ay);
+
+// Add the acceleration from every well to the particles
+void ParticleStoreApplyWells(ParticleStore *store, const ParticleWells *wells);
+
+// An approximation of the combined well field, sampled on a grid of corners
+// and bilinearly interpolated.  Wells for which that would be off by more than
+// |tolerance| (relative to the well's contribution) are evaluated exactly.
+typedef struct {
+  float minX;             // Area covered by the grid
+  float minY;
+  float maxX;
+  float maxY;
+  float cellSize;         // In pixels
+  float tolerance;        // > 0
+} ParticleFieldParameters;
+
+typedef struct {
+  ParticleFieldParameters params;
+  ParticleWells wells;    // The wells the grid was built from
+  int valid;
+  size_t columns;         // In cells
+  size_t rows;
+  size_t cornerCapacity;
+  size_t cellCapacity;
+  size_t nearCapacity;
+  float *cornerX;
+  float *cornerY;
+  float *ax;              // Field at each corner
+  float *ay;
+  uint32_t *nearStart;    // Cell i's nearby wells are nearWells[nearStart[i] ..
+  uint32_t *nearWells;    //   nearStart[i + 1]]
+} ParticleField;
+
+// Rebuild the grid unless it was built from the same wells and parameters.
+// Returns 0 if the grid can't be built; use ParticleStoreApplyWells() instead.
+int ParticleFieldUpdate(ParticleField *field, const ParticleWells *wells,
+                        const ParticleFieldParameters *params);
+void ParticleFieldRelease(ParticleField *field);
+
+// Like ParticleStoreApplyWells(), but from the field
+void ParticleStoreApplyField(ParticleStore *store, const ParticleField *field);
+
+// Integrate and age every particle and set its state.  The wells must have
+// already been applied.
+void ParticleStoreIntegrate(ParticleStore *store, const ParticleStepParameters *params);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif  // PARTICLECORE_H
@@ -0,0 +1,198 @@
+// Copyright 2008 Google Inc.
+//
+// Licensed under the Apache License, Version 2.0 (the "License"); you may not
+// use this file except in compliance with the License.  You may obtain a copy
+// of the License at
+//
+// http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS, WITHOUT
+// WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.  See the
+// License for the specific language governing permissions and limitations under
+// the License.
+
+// Standalone benchmark for the gravity well grid in ParticleCore.  It times
+// ParticleStoreApplyWells() against the grid, rebuilt with
+// ParticleFieldUpdate() every step as it is when the wells move, plus
+// ParticleStoreApplyField(), and checks that every particle's acceleration from the grid is within the
+// tolerance of the exact one.  It isn't part of the Xcode targets; build it
+// anywhere with:
+//
+//   cc -O3 -std=c99 -D_POSIX_C_SOURCE=200809L -o ParticleCoreBench ParticleCoreBench.c
+//     ParticleCore.c -lm
+//
+// Usage: ParticleCoreBench [particles] [steps]
+
+#include <math.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include "ParticleCore.h"
+
+#define kWidth 2560
+#define kHeight 1600
+#define kCellSize 8
+#define kTolerance 0.01f
+
+static const size_t kWellCounts[] = { 4, 16, 64, 256 };
+
+//------------------------------------------------------------------------------
+static double Now(void) {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec + ts.tv_nsec * 1e-9;
+}
+
+//------------------------------------------------------------------------------
+// Repeatable, and independent of the C library
+static float Random(uint32_t *state) {
+  *state = *state * 1664525u + 1013904223u;
+  return (*state >> 8) * (1.0f / 16777216.0f);
+}
+
+//------------------------------------------------------------------------------
+static void ClearAcceleration(ParticleStore *store) {
+  memset(store->ax, 0, store->count * sizeof(float));
+  memset(store->ay, 0, store->count * sizeof(float));
+}
+
+//------------------------------------------------------------------------------
+// The number of particles whose grid acceleration is further from the exact one
+// than the tolerance allows for the sum of the wells' contributions
+static size_t CountErrors(const ParticleStore *store, const float *exactX, const float *exactY,
+                          const ParticleWells *wells, double *maxError) {
+  size_t errors = 0;
+  
+  *maxError = 0;
+  
+  for (size_t i = 0; i < store->count; ++i) {
+    double bound = 0;
+    
+    for (size_t w = 0; w < wells->count; ++w) {
+      float ax, ay;
+      ParticleWellAcceleration(wells->x[w], wells->y[w], wells->gravity[w], store->x[i],
+                               store->y[i], &ax, &ay);
+      bound += fabs(ax) + fabs(ay);
+    }
+    
+    double error = fabs(store->ax[i] - exactX[i]) + fabs(store->ay[i] - exactY[i]);
+    double relative = bound > 0 ? error / bound : error;
+    
+    if (relative > *maxError)
+      *maxError = relative;
+    
+    // Allow for float rounding in the sums
+    if (error > bound * kTolerance * 1.01 + 1e-5)
+      ++errors;
+  }
+  
+  return errors;
+}
+
+//------------------------------------------------------------------------------
+int main(int argc, const char *argv[]) {
+  size_t count = argc > 1 ? strtoul(argv[1], NULL, 10) : 100000;
+  int steps = argc > 2 ? atoi(argv[2]) : 20;
+  ParticleStore store;
+  uint32_t state = 42;
+  int failed = 0;
+  
+  if (steps < 1)
+    steps = 1;
+  
+  memset(&store, 0, sizeof(store));
+  
+  if (!count || !ParticleStoreReserve(&store, count)) {
+    fprintf(stderr, "Unable to allocate %lu particles\n", (unsigned long)count);
+    return 1;
+  }
+  
+  store.count = count;
+  
+  for (size_t i = 0; i < count; ++i) {
+    store.x[i] = Random(&state) * kWidth;
+    store.y[i] = Random(&state) * kHeight;
+  }
+  
+  float *exactX = (float *)malloc(count * sizeof(float));
+  float *exactY = (float *)malloc(count * sizeof(float));
+  
+  if (!exactX || !exactY)
+    return 1;
+  
+  printf("%lu particles, %d steps, %dx%d, cell %d, tolerance %g\n", (unsigned long)count,
+         steps, kWidth, kHeight, kCellSize, kTolerance);
+  
+  for (size_t n = 0; n < sizeof(kWellCounts) / sizeof(kWellCounts[0]); ++n) {
+    ParticleWells wells;
+    ParticleField field;
+    ParticleFieldParameters params = { 0, 0, kWidth, kHeight, kCellSize, kTolerance };
+    double start, exactTime, buildTime = 0, applyTime = 0, gridTime, maxError;
+    
+    memset(&wells, 0, sizeof(wells));
+    memset(&field, 0, sizeof(field));
+    
+    if (!ParticleWellsReserve(&wells, kWellCounts[n]))
+      return 1;
+    
+    wells.count = kWellCounts[n];
+    
+    for (size_t w = 0; w < wells.count; ++w) {
+      wells.x[w] = Random(&state) * kWidth;
+      wells.y[w] = Random(&state) * kHeight;
+      wells.gravity[w] = (Random(&state) - 0.5f) * 20;
+    }
+    
+    start = Now();
+    for (int s = 0; s < steps; ++s) {
+      ClearAcceleration(&store);
+      ParticleStoreApplyWells(&store, &wells);
+    }
+    exactTime = (Now() - start) / steps;
+    memcpy(exactX, store.ax, count * sizeof(float));
+    memcpy(exactY, store.ay, count * sizeof(float));
+    
+    for (int s = 0; s < steps; ++s) {
+      // As if the wells had moved
+      field.valid = 0;
+      start = Now();
+      
+      if (!ParticleFieldUpdate(&field, &wells, &params)) {
+        fprintf(stderr, "Unable to build the grid for %lu wells\n", (unsigned long)wells.count);
+        return 1;
+      }
+      
+      double built = Now();
+      
+      ClearAcceleration(&store);
+      ParticleStoreApplyField(&store, &field);
+      buildTime += built - start;
+      applyTime += Now() - built;
+    }
+    buildTime /= steps;
+    applyTime /= steps;
+    gridTime = buildTime + applyTime;
+    
+    size_t errors = CountErrors(&store, exactX, exactY, &wells, &maxError);
+    
+    printf("%4lu wells  exact: %8.2f ms  grid: %8.2f ms (build %7.2f + apply %7.2f)  %5.1fx  "
+           "max error %.4f  %s\n", (unsigned long)wells.count, exactTime * 1000,
+           gridTime * 1000, buildTime * 1000, applyTime * 1000, exactTime / gridTime, maxError,
+           errors ? "FAILED" : "ok");
+    
+    if (errors)
+      failed = 1;
+    
+    ParticleFieldRelease(&field);
+    ParticleWellsRelease(&wells);
+  }
+  
+  free(exactX);
+  free(exactY);
+  ParticleStoreRelease(&store);
+  
+  return failed;
+}
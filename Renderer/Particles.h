@@ -15,24 +15,19 @@
 // Manage particles with color and other physical attributes.  For use in the
 // simulator.
 
+#import "ParticleCore.h"
 #import "SimulatorObject.h"
 
 @class Layer;
 @class Randomizer;
 
-typedef struct Particle {
-  CGPoint location;
-  CGPoint velocity;
-  CGPoint acceleration;
-  CGFloat color[4];
-  unsigned long age;
-} Particle;
-
 @interface Particles : SimulatorObject {
  @protected
   CGPoint gravity_;
   CGPoint location_;
   CGFloat trailWidth_;
+  CGFloat gravityTolerance_;
+  CGFloat gravityCellSize_;
   CGFloat alphaDelta_;
   unsigned long alphaDelay_;
   unsigned long maxAge_;
@@ -42,8 +37,16 @@ typedef struct Particle {
   Randomizer *accelerationYRandomizer_;
   NSUInteger maxParticleCount_;
 
-  Particle *particles_;
-  NSUInteger currentCount_;
+  ParticleStore store_;
+  ParticleWells wells_;
+  ParticleField field_;     // Approximation of the wells, if enabled
+  ParticleTrails trails_;   // Segments waiting to be drawn
+  NSUInteger trailSteps_;
+  NSUInteger pendingSteps_;
+  ParticleStepParameters stepParams_;
+  BOOL trailsAdded_;
+  size_t *resetIndexes_;    // Scratch space for regenerating particles
+  float *resetValues_;
   
   NSMutableArray *colors_;
   NSMutableArray *gravityPoints_;
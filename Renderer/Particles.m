@@ -21,9 +21,11 @@
 
 @interface Particles(PrivateMethods)
 - (void)addColor:(NSArray *)arguments;
-- (Color *)randomColor;
-- (void)reset:(Particle *)p;
+- (void)fillValues:(float *)values count:(size_t)count randomizer:(Randomizer *)randomizer;
+- (void)resetParticles:(const size_t *)indexes count:(size_t)count;
 - (void)generate:(NSUInteger)count;
+- (void)updateWells;
+- (void)flushTrails;
 
 - (void)setMaxParticles:(NSUInteger)max;
 
@@ -38,8 +40,8 @@
   return [NSSet setWithObjects:@"maxParticles", @"gravity", @"location", 
           @"velocityXRandomizer", @"velocityYRandomizer",
           @"accelerationXRandomizer", @"accelerationYRandomizer",
-          @"alphaDelay", @"alphaDelta", @"trailWidth", @"maxAge",
-          nil];
+          @"alphaDelay", @"alphaDelta", @"trailWidth", @"trailSteps", @"maxAge",
+          @"gravityTolerance", @"gravityCellSize", nil];
 }
 
 + (NSSet *)methods {
@@ -52,6 +54,8 @@
     alphaDelta_ = -0.01;
     alphaDelay_ = 0;
     maxAge_ = 0;
+    trailSteps_ = 1;
+    gravityCellSize_ = 8;
     [self setMaxParticles:100];
     
     colors_ = [[NSMutableArray alloc] init];
@@ -65,21 +69,32 @@
   [velocityYRandomizer_ release];
   [accelerationXRandomizer_ release];
   [accelerationYRandomizer_ release];
-  free(particles_);
+  ParticleStoreRelease(&store_);
+  ParticleWellsRelease(&wells_);
+  ParticleFieldRelease(&field_);
+  ParticleTrailsRelease(&trails_);
+  free(resetIndexes_);
+  free(resetValues_);
   [colors_ release];
   [gravityPoints_ release];
   [super dealloc];
 }
 
 - (void)setMaxParticles:(NSUInteger)max {
-  if (max > maxParticleCount_) {
-    NSUInteger currentMax = maxParticleCount_;
-    Particle *p = realloc(particles_, sizeof(Particle) * max);
+  if (max > store_.capacity) {
+    size_t *indexes = realloc(resetIndexes_, sizeof(size_t) * max);
     
-    if (p)
-      particles_ = p;
-    else
-      max = currentMax;
+    if (indexes)
+      resetIndexes_ = indexes;
+    
+    float *values = realloc(resetValues_, sizeof(float) * max);
+    
+    if (values)
+      resetValues_ = values;
+    
+    if (!indexes || !values || !ParticleStoreReserve(&store_, max) ||
+        !ParticleTrailsReserve(&trails_, max))
+      max = maxParticleCount_;
   }
   
   maxParticleCount_ = max;
@@ -161,6 +176,32 @@
   return trailWidth_;
 }
 
+- (void)setTrailSteps:(NSUInteger)steps {
+  [self flushTrails];
+  trailSteps_ = MAX(steps, 1);
+}
+
+- (NSUInteger)trailSteps {
+  return trailSteps_;
+}
+
+- (void)setGravityTolerance:(CGFloat)tolerance {
+  gravityTolerance_ = MAX(tolerance, 0);
+}
+
+- (CGFloat)gravityTolerance {
+  return gravityTolerance_;
+}
+
+- (void)setGravityCellSize:(CGFloat)size {
+  if (size > 0)
+    gravityCellSize_ = size;
+}
+
+- (CGFloat)gravityCellSize {
+  return gravityCellSize_;
+}
+
 - (void)setMaxAge:(unsigned long)age {
   maxAge_ = age;
 }
@@ -199,115 +240,209 @@
   }
 }
 
-- (Color *)randomColor {
-  NSUInteger count = [colors_ count];
-  
+- (void)fillValues:(float *)values count:(size_t)count randomizer:(Randomizer *)randomizer {
+  if (randomizer)
+    [randomizer getFloatValues:values count:count];
+  else
+    bzero(values, sizeof(float) * count);
+}
+
+- (void)resetParticles:(const size_t *)indexes count:(size_t)count {
   if (!count)
-    return nil;
+    return;
   
-  NSUInteger idx = floor(RandomizerFloatValue() * (float)count);
+  // Draw the random values for an attribute all at once, rather than a
+  // message per attribute per particle
+  float *values = resetValues_;
+  size_t i;
 
-  return [colors_ objectAtIndex:idx];
-}
+  [self fillValues:values count:count randomizer:accelerationXRandomizer_];
+  for (i = 0; i < count; ++i)
+    store_.ax[indexes[i]] = values[i];
 
-- (void)reset:(Particle *)p {
-  p->location = location_;
-  p->acceleration.x = [accelerationXRandomizer_ floatValue];
-  p->acceleration.y = [accelerationYRandomizer_ floatValue];
-  p->velocity.x = [velocityXRandomizer_ floatValue];
-  p->velocity.y = [velocityYRandomizer_ floatValue];
-  p->age = 0;
+  [self fillValues:values count:count randomizer:accelerationYRandomizer_];
+  for (i = 0; i < count; ++i)
+    store_.ay[indexes[i]] = values[i];
+
+  [self fillValues:values count:count randomizer:velocityXRandomizer_];
+  for (i = 0; i < count; ++i)
+    store_.vx[indexes[i]] = values[i];
+
+  [self fillValues:values count:count randomizer:velocityYRandomizer_];
+  for (i = 0; i < count; ++i)
+    store_.vy[indexes[i]] = values[i];
+
+  NSUInteger colorCount = [colors_ count];
+  CGFloat components[4] = { 1.0, 1.0, 1.0, 1.0 };
+
+  if (colorCount)
+    RandomizerFill(values, count);
   
-  Color *c = [self randomColor];
-  if (c)
-    [c getComponents:p->color];
-  else
-    p->color[0] = p->color[1] = p->color[2] = p->color[3] = 1.0;
+  for (i = 0; i < count; ++i) {
+    size_t idx = indexes[i];
+
+    if (colorCount) {
+      NSUInteger colorIdx = floor(values[i] * (float)colorCount);
+      [[colors_ objectAtIndex:MIN(colorIdx, colorCount - 1)] getComponents:components];
+    }
+
+    store_.x[idx] = store_.lastX[idx] = location_.x;
+    store_.y[idx] = store_.lastY[idx] = location_.y;
+    store_.red[idx] = components[0];
+    store_.green[idx] = components[1];
+    store_.blue[idx] = components[2];
+    store_.alpha[idx] = components[3];
+    store_.age[idx] = 0;
+    store_.state[idx] = kParticleAlive;
+  }
 }
 
 - (void)generate:(NSUInteger)count {
-  if (count + currentCount_ > maxParticleCount_)
-    count = maxParticleCount_ - currentCount_;
+  if (count + store_.count > maxParticleCount_)
+    count = maxParticleCount_ - store_.count;
+  
+  for (NSUInteger i = 0; i < count; ++i)
+    resetIndexes_[i] = store_.count + i;
   
-  while (count--) {
-    [self reset:&particles_[currentCount_]];
-    ++currentCount_;
+  store_.count += count;
+  [self resetParticles:resetIndexes_ count:count];
+}
+
+- (void)updateWells {
+  NSUInteger count = [gravityPoints_ count];
+  
+  wells_.count = 0;
+
+  if (!count || !ParticleWellsReserve(&wells_, count))
+    return;
+
+  for (NSUInteger i = 0; i < count; ++i) {
+    GravityPoint *gp = [gravityPoints_ objectAtIndex:i];
+    CGPoint location = [gp cgPointLocation];
+
+    wells_.x[i] = location.x;
+    wells_.y[i] = location.y;
+    wells_.gravity[i] = [gp gravity];
   }
+  
+  wells_.count = count;
 }
 
-- (void)step {
+- (void)flushTrails {
+  pendingSteps_ = 0;
+
+  if (!trails_.count)
+    return;
+
+  ParticleTrailsSort(&trails_);
+
   CGContextRef context = [layer_ backingStore];
-  CGRect frame = [layer_ cgRectFrame];
+  const ParticleSegment *segments = trails_.segments;
+  
+  [layer_ markDirty];
+  size_t count = trails_.count;
 
   CGContextSetLineWidth(context, trailWidth_);
 
+  // One path per color
+  for (size_t start = 0; start < count;) {
+    uint32_t color = segments[start].color;
+    size_t end = start;
+
+    CGContextBeginPath(context);
+    for (; end < count && segments[end].color == color; ++end) {
+      CGContextMoveToPoint(context, segments[end].x0, segments[end].y0);
+      CGContextAddLineToPoint(context, segments[end].x1, segments[end].y1);
+    }
+
+    CGContextSetRGBStrokeColor(context, (color >> 24) / 255.0, ((color >> 16) & 0xFF) / 255.0,
+                               ((color >> 8) & 0xFF) / 255.0, (color & 0xFF) / 255.0);
+    CGContextStrokePath(context);
+    start = end;
+  }
+
+  trails_.count = 0;
+}
+
+- (BOOL)canStepConcurrently {
+  return YES;
+}
+
+- (void)beginStep {
+  CGRect frame = [layer_ cgRectFrame];
+  ParticleStepParameters *params = &stepParams_;
+
   // Generate one per step
-  if (currentCount_ < maxParticleCount_) 
+  if (store_.count < maxParticleCount_) 
     [self generate:1];
 
-  for (NSUInteger i = 0; i < currentCount_; ++i) {
-    Particle *p = &particles_[i];
-    CGPoint last = p->location;
-    
-    // Add any contribution from the gravity wells
-    if (gravityPoints_) {
-      NSUInteger gravityCount = [gravityPoints_ count];
-      for (NSUInteger gravityIdx = 0; gravityIdx < gravityCount; ++gravityIdx) {
-        GravityPoint *gp = [gravityPoints_ objectAtIndex:gravityIdx];
-        CGPoint gravityPointAccel = [gp accelerationForPoint:p->location];
-        p->acceleration.x += gravityPointAccel.x;
-        p->acceleration.y += gravityPointAccel.y;
-      }
-    }
-    
-    // Apply acceleration to velocity
-    p->velocity.x += (p->acceleration.x + gravity_.x) * timeStep_;
-    p->velocity.y += (p->acceleration.y + gravity_.y) * timeStep_;
-    
-    // Apply velocity to location
-    p->location.x += p->velocity.x * timeStep_;
-    p->location.y += p->velocity.y * timeStep_;
-    
-    // Alpha delta 
-    p->age += 1;
+  params->gravityX = gravity_.x;
+  params->gravityY = gravity_.y;
+  params->timeStep = timeStep_;
+  params->alphaDelta = alphaDelta_;
+  params->alphaDelay = MIN(alphaDelay_, UINT32_MAX);
+  params->maxAge = MIN(maxAge_, UINT32_MAX);
+  params->minX = CGRectGetMinX(frame);
+  params->minY = CGRectGetMinY(frame);
+  params->maxX = CGRectGetMaxX(frame);
+  params->maxY = CGRectGetMaxY(frame);
+
+  [self updateWells];
+}
 
-    if (!alphaDelay_ || alphaDelay_ < p->age)
-      p->color[3] += alphaDelta_;
-    
-    // Check if this needs regeneration
-    BOOL regenerate = NO;
-    
-    if (p->color[3] <= 0.0) {
-      if (alphaDelta_ < 0)
-        regenerate = YES;
-    } else if (p->color[3] >= 1.0) {
-      if (alphaDelta_ > 0)
-        regenerate = YES;
-    }
-    
-    if (maxAge_ && p->age > maxAge_)
-      regenerate = YES;
+- (void)advanceStep {
+  // Add any contribution from the gravity wells, then move everything.  The
+  // approximate field is only rebuilt when the wells change.
+  if (wells_.count && gravityTolerance_ > 0) {
+    ParticleFieldParameters fieldParams;
     
-    if (regenerate) {
-      [self reset:p];
-      continue;
-    }
-    
-    // Draw a line
-    CGContextBeginPath(context);
-    CGContextMoveToPoint(context, last.x, last.y);
-    CGContextAddLineToPoint(context, p->location.x, p->location.y);
-    CGContextSetRGBStrokeColor(context, p->color[0], p->color[1], p->color[2], p->color[3]);
-    CGContextStrokePath(context);
+    fieldParams.minX = stepParams_.minX;
+    fieldParams.minY = stepParams_.minY;
+    fieldParams.maxX = stepParams_.maxX;
+    fieldParams.maxY = stepParams_.maxY;
+    fieldParams.cellSize = gravityCellSize_;
+    fieldParams.tolerance = gravityTolerance_;
+
+    if (ParticleFieldUpdate(&field_, &wells_, &fieldParams))
+      ParticleStoreApplyField(&store_, &field_);
+    else
+      ParticleStoreApplyWells(&store_, &wells_);
+  } else {
+    ParticleStoreApplyWells(&store_, &wells_);
+  }
+
+  ParticleStoreIntegrate(&store_, &stepParams_);
+
+  // Drawing has to wait for -endStep
+  trailsAdded_ = ParticleTrailsAdd(&trails_, &store_);
+}
+
+- (void)endStep {
+  // Draw the trails a batch at a time
+  if (!trailsAdded_) {
+    [self flushTrails];
+    ParticleTrailsAdd(&trails_, &store_);
+  }
+
+  if (++pendingSteps_ >= trailSteps_)
+    [self flushTrails];
 
-    // If we've now drawn our line outside of the bounds, we're done
-    if (!CGRectContainsPoint(frame, p->location))
-      [self reset:p];
+  // Regenerate the particles that faded out or left the frame
+  size_t resetCount = 0;
+  for (size_t i = 0; i < store_.count; ++i) {
+    if (store_.state[i] != kParticleAlive)
+      resetIndexes_[resetCount++] = i;
   }
+
+  [self resetParticles:resetIndexes_ count:resetCount];
+}
+
+- (void)finish {
+  [self flushTrails];
 }
 
 - (NSString *)toString {
-  return [NSString stringWithFormat:@"Particles: %lu (max: %lu)", (unsigned long)currentCount_, (unsigned long)maxParticleCount_];
+  return [NSString stringWithFormat:@"Particles: %lu (max: %lu)", (unsigned long)store_.count, (unsigned long)maxParticleCount_];
 }
 
 @end
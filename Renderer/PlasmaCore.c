@@ -0,0 +1,410 @@
+// Copyright 2008 Google Inc.
+//
+// Licensed under the Apache License, Version 2.0 (the "License"); you may not
+// use this file except in compliance with the License.  You may obtain a copy
+// of the License at
+//
+// http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS, WITHOUT
+// WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.  See the
+// License for the specific language governing permissions and limitations under
+// the License.
+
+#include <stdlib.h>
+#include <string.h>
+
+#include "PlasmaCore.h"
+#include "RandomStream.h"
+
+// Tiles are subdivided until they're no larger than this (in either dimension)
+// so that a tile's pixels stay in the cache while its levels are filled in.
+#define kPlasmaTileSize 128
+
+// Midpoint subdivision of an image splits every rectangle at a level along
+// the same x (and y) coordinates, so the points of a level are the product of
+// one list of columns and one list of rows.  A PlasmaAxis holds those lists
+// for every level of one dimension.
+typedef struct {
+  size_t *coords;
+  size_t *starts;       // Level L is coords[starts[L]] to coords[starts[L + 1]]
+  int levelCount;
+} PlasmaAxis;
+
+// The coordinates of one level that fall inside a rectangle
+typedef struct {
+  const size_t *coords;
+  size_t count;
+} PlasmaSpan;
+
+// Inclusive pixel coordinates of the corners
+typedef struct {
+  size_t x0;
+  size_t y0;
+  size_t x1;
+  size_t y1;
+} PlasmaRect;
+
+typedef struct {
+  RandomStream stream;
+  int32_t scale;        // 255 * variation, 8.8 fixed point
+} PlasmaBlender;
+
+typedef struct {
+  const PlasmaParameters *params;
+  PlasmaAxis x;
+  PlasmaAxis y;
+  int levelCount;       // Number of subdivisions to do
+  int tileLevel;        // First level that is done per tile
+  PlasmaSpan tileColumns;
+  PlasmaSpan tileRows;
+} PlasmaRenderer;
+
+typedef int32_t PlasmaVector __attribute__((vector_size(16)));
+
+//------------------------------------------------------------------------------
+static int PlasmaAxisCreate(PlasmaAxis *axis, size_t size) {
+  size_t capacity = 2 * size + 2;
+  size_t levelCapacity = 8;
+  size_t count = 0;
+
+  axis->coords = (size_t *)malloc(capacity * sizeof(size_t));
+  axis->starts = (size_t *)malloc(levelCapacity * sizeof(size_t));
+  axis->levelCount = 1;
+
+  if (!axis->coords || !axis->starts)
+    return 0;
+
+  axis->starts[0] = 0;
+  axis->coords[count++] = 0;
+  if (size > 1)
+    axis->coords[count++] = size - 1;
+
+  for (;;) {
+    size_t begin = axis->starts[axis->levelCount - 1];
+    size_t end = count;
+    int split = 0;
+
+    for (size_t i = begin; i + 1 < end; ++i)
+      split |= (axis->coords[i + 1] - axis->coords[i]) >= 2;
+
+    if (!split)
+      break;
+
+    // The next level can be at most twice as long
+    if (count + 2 * (end - begin) > capacity) {
+      capacity = 2 * capacity + 2 * (end - begin);
+      size_t *coords = (size_t *)realloc(axis->coords, capacity * sizeof(size_t));
+      if (!coords)
+        return 0;
+      axis->coords = coords;
+    }
+
+    if ((size_t)axis->levelCount + 2 > levelCapacity) {
+      levelCapacity *= 2;
+      size_t *starts = (size_t *)realloc(axis->starts, levelCapacity * sizeof(size_t));
+      if (!starts)
+        return 0;
+      axis->starts = starts;
+    }
+
+    axis->starts[axis->levelCount++] = count;
+
+    for (size_t i = begin; i < end; ++i) {
+      axis->coords[count++] = axis->coords[i];
+
+      if (i + 1 < end && (axis->coords[i + 1] - axis->coords[i]) >= 2)
+        axis->coords[count++] = axis->coords[i] + (axis->coords[i + 1] - axis->coords[i]) / 2;
+    }
+  }
+
+  axis->starts[axis->levelCount] = count;
+
+  return 1;
+}
+
+static void PlasmaAxisRelease(PlasmaAxis *axis) {
+  free(axis->coords);
+  free(axis->starts);
+}
+
+// Index of the first coordinate that is >= |value|
+static size_t LowerBound(const size_t *coords, size_t count, size_t value) {
+  size_t first = 0;
+
+  while (count) {
+    size_t half = count / 2;
+
+    if (coords[first + half] < value) {
+      first += half + 1;
+      count -= half + 1;
+    } else {
+      count = half;
+    }
+  }
+
+  return first;
+}
+
+// Once an axis can't be split any more, its last level is used for the rest
+static PlasmaSpan PlasmaAxisSpan(const PlasmaAxis *axis, int level, size_t lo, size_t hi) {
+  if (level >= axis->levelCount)
+    level = axis->levelCount - 1;
+
+  const size_t *coords = axis->coords + axis->starts[level];
+  size_t count = axis->starts[level + 1] - axis->starts[level];
+  size_t first = LowerBound(coords, count, lo);
+  size_t last = LowerBound(coords, count, hi + 1);
+
+  PlasmaSpan span = { coords + first, last - first };
+
+  return span;
+}
+
+//------------------------------------------------------------------------------
+static inline uint32_t *PixelAddress(const PlasmaParameters *p, size_t x, size_t y) {
+  return p->pixels + y * p->rowPixels + x;
+}
+
+static inline PlasmaVector UnpackPixel(uint32_t p) {
+  PlasmaVector v = { (int32_t)(p >> 24), (int32_t)((p >> 16) & 0xFF),
+    (int32_t)((p >> 8) & 0xFF), (int32_t)(p & 0xFF) };
+  return v;
+}
+
+static inline uint32_t PackPixel(PlasmaVector v) {
+  return (uint32_t)v[0] << 24 | (uint32_t)v[1] << 16 | (uint32_t)v[2] << 8 | (uint32_t)v[3];
+}
+
+// Four signed offsets in [-255 * variation, 255 * variation] from 64 random bits
+static inline PlasmaVector RandomOffsets(uint64_t bits, int32_t scale) {
+  PlasmaVector r = { (int32_t)(bits & 0xFFFF), (int32_t)((bits >> 16) & 0xFFFF),
+    (int32_t)((bits >> 32) & 0xFFFF), (int32_t)(bits >> 48) };
+  return ((32768 - r) * scale) >> 23;
+}
+
+static inline PlasmaVector Clamp255(PlasmaVector v) {
+  PlasmaVector low = v < 0;
+  PlasmaVector high = v > 255;
+  return ((v & ~low) & ~high) | (high & 255);
+}
+
+// Blend two pixels with a random offset for each channel.  The offsets only
+// depend on the pixel being set, so the order that pixels are visited in
+// (and thus the tiling and the number of threads) doesn't change the image.
+static inline uint32_t BlendPixel(const PlasmaParameters *p, const PlasmaBlender *blender,
+                                  uint32_t a, uint32_t b, size_t x, size_t y) {
+  PlasmaVector va = UnpackPixel(a);
+  PlasmaVector vb = UnpackPixel(b);
+
+  if (blender->scale) {
+    uint64_t bits = RandomStreamBitsAt(&blender->stream, y * p->width + x);
+    va = Clamp255(va + RandomOffsets(bits, blender->scale));
+    vb = Clamp255(vb + RandomOffsets(RandomStreamMix(bits), blender->scale));
+  }
+
+  va = (va + vb) >> 1;
+
+  if (p->grayscale)
+    return ((uint32_t)va[3] * 0x01010101) | p->opaqueMask;
+
+  return PackPixel(va) | p->opaqueMask;
+}
+
+// Bytewise average of two pixels
+static inline uint32_t AveragePixel(uint32_t a, uint32_t b) {
+  return (a & b) + (((a ^ b) & 0xFEFEFEFE) >> 1);
+}
+
+static PlasmaBlender BlenderForLevel(const PlasmaParameters *p, int level) {
+  // The whole image is depth 1; less as you go deeper
+  float variation = p->variation * p->variation / (float)(level + 1);
+  PlasmaBlender blender;
+
+  if (variation > 1)
+    variation = 1;
+
+  RandomStreamInit(&blender.stream, p->seed, 0);
+  blender.scale = variation > 0 ? (int32_t)(variation * 255.0f * 256.0f) : 0;
+
+  return blender;
+}
+
+//------------------------------------------------------------------------------
+// New points along row |y| between the columns in |xs|
+static void HorizontalMidpoints(const PlasmaParameters *p, const PlasmaBlender *blender,
+                                size_t y, PlasmaSpan xs) {
+  uint32_t *row = PixelAddress(p, 0, y);
+
+  for (size_t i = 0; i + 1 < xs.count; ++i) {
+    size_t xa = xs.coords[i], xb = xs.coords[i + 1];
+
+    if (xb - xa >= 2) {
+      size_t xm = xa + (xb - xa) / 2;
+      row[xm] = BlendPixel(p, blender, row[xa], row[xb], xm, y);
+    }
+  }
+}
+
+// New points on row |ym| halfway between rows |ya| and |yb| at |columns|
+static void VerticalMidpoints(const PlasmaParameters *p, const PlasmaBlender *blender,
+                              size_t ya, size_t ym, size_t yb, PlasmaSpan columns) {
+  const uint32_t *top = PixelAddress(p, 0, ya);
+  const uint32_t *bottom = PixelAddress(p, 0, yb);
+  uint32_t *row = PixelAddress(p, 0, ym);
+
+  for (size_t i = 0; i < columns.count; ++i) {
+    size_t x = columns.coords[i];
+    row[x] = BlendPixel(p, blender, top[x], bottom[x], x, ym);
+  }
+}
+
+// The centers have no variation: the average of the edge midpoints
+static void Centers(const PlasmaParameters *p, size_t ya, size_t ym, size_t yb, PlasmaSpan xs) {
+  const uint32_t *top = PixelAddress(p, 0, ya);
+  const uint32_t *bottom = PixelAddress(p, 0, yb);
+  uint32_t *row = PixelAddress(p, 0, ym);
+
+  for (size_t i = 0; i + 1 < xs.count; ++i) {
+    size_t xa = xs.coords[i], xb = xs.coords[i + 1];
+
+    if (xb - xa >= 2) {
+      size_t xm = xa + (xb - xa) / 2;
+      uint32_t center = AveragePixel(AveragePixel(top[xm], bottom[xm]),
+                                     AveragePixel(row[xa], row[xb]));
+
+      if (p->grayscale)
+        center = (center & 0xFF) * 0x01010101;
+
+      row[xm] = center | p->opaqueMask;
+    }
+  }
+}
+
+// Subdivide every rectangle of |level| inside |rect|.  When |protect| is set,
+// the points on the boundary of |rect| were already done and are only read.
+static void RenderLevel(const PlasmaRenderer *r, const PlasmaRect *rect, int level,
+                        int protect) {
+  const PlasmaParameters *p = r->params;
+  PlasmaBlender blender = BlenderForLevel(p, level);
+  PlasmaSpan xs = PlasmaAxisSpan(&r->x, level, rect->x0, rect->x1);
+  PlasmaSpan ys = PlasmaAxisSpan(&r->y, level, rect->y0, rect->y1);
+  PlasmaSpan rows = ys;
+  PlasmaSpan columns = xs;
+
+  if (protect) {
+    rows.coords += 1;
+    rows.count = ys.count > 2 ? ys.count - 2 : 0;
+    columns.coords += 1;
+    columns.count = xs.count > 2 ? xs.count - 2 : 0;
+  }
+
+  // Top and bottom edges
+  for (size_t j = 0; j < rows.count; ++j)
+    HorizontalMidpoints(p, &blender, rows.coords[j], xs);
+
+  // Left and right edges, then the centers that are on the same row
+  for (size_t j = 0; j + 1 < ys.count; ++j) {
+    size_t ya = ys.coords[j], yb = ys.coords[j + 1];
+
+    if (yb - ya < 2)
+      continue;
+
+    size_t ym = ya + (yb - ya) / 2;
+    VerticalMidpoints(p, &blender, ya, ym, yb, columns);
+    Centers(p, ya, ym, yb, xs);
+  }
+}
+
+// Finish the rows and columns that are shared by the tiles
+static void RenderTileEdges(const PlasmaRenderer *r) {
+  const PlasmaParameters *p = r->params;
+
+  for (int level = r->tileLevel; level < r->levelCount; ++level) {
+    PlasmaBlender blender = BlenderForLevel(p, level);
+    PlasmaSpan xs = PlasmaAxisSpan(&r->x, level, 0, p->width - 1);
+    PlasmaSpan ys = PlasmaAxisSpan(&r->y, level, 0, p->height - 1);
+
+    for (size_t j = 0; j < r->tileRows.count; ++j)
+      HorizontalMidpoints(p, &blender, r->tileRows.coords[j], xs);
+
+    for (size_t j = 0; j + 1 < ys.count; ++j) {
+      size_t ya = ys.coords[j], yb = ys.coords[j + 1];
+
+      if (yb - ya >= 2)
+        VerticalMidpoints(p, &blender, ya, ya + (yb - ya) / 2, yb, r->tileColumns);
+    }
+  }
+}
+
+static void RenderTile(void *context, size_t index, int worker) {
+  const PlasmaRenderer *r = (const PlasmaRenderer *)context;
+  size_t columns = r->tileColumns.count - 1;
+  size_t i = index % columns, j = index / columns;
+  PlasmaRect rect = {
+    r->tileColumns.coords[i], r->tileRows.coords[j],
+    r->tileColumns.coords[i + 1], r->tileRows.coords[j + 1]
+  };
+
+  (void)worker;
+
+  for (int level = r->tileLevel; level < r->levelCount; ++level)
+    RenderLevel(r, &rect, level, 1);
+}
+
+static int TileLevel(size_t width, size_t height) {
+  size_t largest = width > height ? width : height;
+  int level = 0;
+
+  while ((largest >> level) > kPlasmaTileSize)
+    ++level;
+
+  return level;
+}
+
+//------------------------------------------------------------------------------
+void PlasmaRender(const PlasmaParameters *params, WorkQueue *queue) {
+  if (!params->pixels || !params->width || !params->height)
+    return;
+
+  PlasmaRenderer r;
+
+  memset(&r, 0, sizeof(r));
+  r.params = params;
+
+  if (!PlasmaAxisCreate(&r.x, params->width) || !PlasmaAxisCreate(&r.y, params->height)) {
+    PlasmaAxisRelease(&r.x);
+    PlasmaAxisRelease(&r.y);
+    return;
+  }
+
+  PlasmaRect whole = { 0, 0, params->width - 1, params->height - 1 };
+  *PixelAddress(params, whole.x0, whole.y0) = params->corners[kPlasmaTopLeft];
+  *PixelAddress(params, whole.x1, whole.y0) = params->corners[kPlasmaTopRight];
+  *PixelAddress(params, whole.x0, whole.y1) = params->corners[kPlasmaBottomLeft];
+  *PixelAddress(params, whole.x1, whole.y1) = params->corners[kPlasmaBottomRight];
+
+  r.levelCount = (r.x.levelCount > r.y.levelCount ? r.x.levelCount : r.y.levelCount) - 1;
+  r.tileLevel = TileLevel(params->width, params->height);
+
+  // A single row or column isn't worth splitting up
+  if (r.tileLevel > r.levelCount || params->width < 2 || params->height < 2)
+    r.tileLevel = r.levelCount;
+
+  // The first few levels cover the whole image
+  for (int level = 0; level < r.tileLevel; ++level)
+    RenderLevel(&r, &whole, level, 0);
+
+  if (r.tileLevel < r.levelCount) {
+    r.tileColumns = PlasmaAxisSpan(&r.x, r.tileLevel, whole.x0, whole.x1);
+    r.tileRows = PlasmaAxisSpan(&r.y, r.tileLevel, whole.y0, whole.y1);
+    RenderTileEdges(&r);
+
+    // Tile interiors don't overlap, so there's nothing to synchronize
+    WorkQueueApply(queue, (r.tileColumns.count - 1) * (r.tileRows.count - 1), RenderTile, &r);
+  }
+
+  PlasmaAxisRelease(&r.x);
+  PlasmaAxisRelease(&r.y);
+}
@@ -0,0 +1,63 @@
+// Copyright 2008 Google Inc.
+//
+// Licensed under the Apache License, Version 2.0 (the "License"); you may not
+// use this file except in compliance with the License.  You may obtain a copy
+// of the License at
+//
+// http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS, WITHOUT
+// WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.  See the
+// License for the specific language governing permissions and limitations under
+// the License.
+
+// Midpoint displacement ("plasma") rendering into a 32-bit pixel buffer.
+//
+// The image is subdivided one level at a time, a row of midpoints at a time.
+// After the first few levels it is split into tiles whose size depends only on
+// the image size; the rows and columns shared by the tiles are finished
+// serially and then the tile interiors are filled in parallel on a WorkQueue.
+// The random offsets for a pixel are read from a RandomStream at the pixel's
+// position, so the output for a given seed is identical no matter how many
+// threads are used.
+
+#ifndef PLASMACORE_H
+#define PLASMACORE_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+#include "WorkQueue.h"
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+// Corner indexes.  Row 0 of |pixels| is the top.
+enum {
+  kPlasmaTopLeft = 0,
+  kPlasmaTopRight,
+  kPlasmaBottomLeft,
+  kPlasmaBottomRight
+};
+
+typedef struct {
+  uint32_t *pixels;       // Every pixel is written
+  size_t width;
+  size_t height;
+  size_t rowPixels;       // Distance between rows, in pixels
+  uint32_t corners[4];    // Packed in the same byte order as |pixels|
+  uint32_t opaqueMask;    // OR'd into every generated pixel
+  float variation;        // 0 - 1
+  int grayscale;          // Only use the lowest byte and replicate it
+  uint64_t seed;
+} PlasmaParameters;
+
+void PlasmaRender(const PlasmaParameters *params, WorkQueue *queue);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif  // PLASMACORE_H
@@ -0,0 +1,117 @@
+// Copyright 2008 Google Inc.
+//
+// Licensed under the Apache License, Version 2.0 (the "License"); you may not
+// use this file except in compliance with the License.  You may obtain a copy
+// of the License at
+//
+// http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS, WITHOUT
+// WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.  See the
+// License for the specific language governing permissions and limitations under
+// the License.
+
+// Standalone benchmark for PlasmaCore, reporting megapixels per second at
+// 1080p, 5K and 8K on one thread and on the shared WorkQueue.  It isn't part
+// of the Xcode targets; build it anywhere with:
+//
+//   cc -O3 -std=c99 -D_POSIX_C_SOURCE=200809L -o PlasmaCoreBench PlasmaCoreBench.c
+//     PlasmaCore.c RandomStream.c WorkQueue.c -lpthread
+//
+// Usage: PlasmaCoreBench [iterations]
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include "PlasmaCore.h"
+
+typedef struct {
+  const char *name;
+  size_t width;
+  size_t height;
+} BenchSize;
+
+static const BenchSize kSizes[] = {
+  { "1080p", 1920, 1080 },
+  { "5K", 5120, 2880 },
+  { "8K", 7680, 4320 },
+};
+
+//------------------------------------------------------------------------------
+static double Now(void) {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec + ts.tv_nsec * 1e-9;
+}
+
+//------------------------------------------------------------------------------
+// Best time of |iterations| renders
+static double Time(PlasmaParameters *params, WorkQueue *queue, int iterations) {
+  double best = 0;
+  
+  for (int i = 0; i < iterations; ++i) {
+    double start = Now();
+    PlasmaRender(params, queue);
+    double elapsed = Now() - start;
+    
+    if (!i || elapsed < best)
+      best = elapsed;
+  }
+  
+  return best;
+}
+
+//------------------------------------------------------------------------------
+int main(int argc, const char *argv[]) {
+  int iterations = argc > 1 ? atoi(argv[1]) : 3;
+  WorkQueue *queue = WorkQueueGetShared();
+  int failed = 0;
+  
+  if (iterations < 1)
+    iterations = 1;
+  
+  printf("%d threads, best of %d\n", WorkQueueThreadCount(queue), iterations);
+  
+  for (size_t i = 0; i < sizeof(kSizes) / sizeof(kSizes[0]); ++i) {
+    const BenchSize *size = &kSizes[i];
+    size_t count = size->width * size->height;
+    uint32_t *serial = (uint32_t *)malloc(count * sizeof(uint32_t));
+    uint32_t *parallel = (uint32_t *)malloc(count * sizeof(uint32_t));
+    PlasmaParameters params;
+    
+    if (!serial || !parallel) {
+      fprintf(stderr, "%s: out of memory\n", size->name);
+      return 1;
+    }
+    
+    memset(&params, 0, sizeof(params));
+    params.width = size->width;
+    params.height = size->height;
+    params.rowPixels = size->width;
+    params.corners[kPlasmaTopLeft] = 0xFF0000FF;
+    params.corners[kPlasmaTopRight] = 0x00FF00FF;
+    params.corners[kPlasmaBottomLeft] = 0x0000FFFF;
+    params.corners[kPlasmaBottomRight] = 0xFFFFFFFF;
+    params.variation = 0.5f;
+    params.seed = 42;
+    
+    params.pixels = serial;
+    double serialTime = Time(&params, NULL, iterations);
+    params.pixels = parallel;
+    double parallelTime = Time(&params, queue, iterations);
+    int same = !memcmp(serial, parallel, count * sizeof(uint32_t));
+    
+    printf("%-6s %5zux%-5zu  1 thread: %8.1f MP/s  queue: %8.1f MP/s  %s\n",
+           size->name, size->width, size->height, count / serialTime * 1e-6,
+           count / parallelTime * 1e-6, same ? "identical" : "DIFFERENT");
+    
+    failed |= !same;
+    free(serial);
+    free(parallel);
+  }
+  
+  return failed;
+}
@@ -0,0 +1,46 @@
+// Copyright 2008 Google Inc.
+//
+// Licensed under the Apache License, Version 2.0 (the "License"); you may not
+// use this file except in compliance with the License.  You may obtain a copy
+// of the License at
+//
+// http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS, WITHOUT
+// WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.  See the
+// License for the specific language governing permissions and limitations under
+// the License.
+
+
+#include "RandomStream.h"
+
+void RandomStreamInit(RandomStream *stream, uint64_t seed, uint64_t streamID) {
+  stream->key = RandomStreamMix(seed ^ RandomStreamMix(streamID + 0x9E3779B97F4A7C15ULL));
+  stream->counter = 0;
+}
+
+uint64_t RandomStreamIDForName(const char *name) {
+  // FNV-1a
+  uint64_t hash = 0xCBF29CE484222325ULL;
+
+  while (name && *name) {
+    hash ^= (unsigned char)*name++;
+    hash *= 0x100000001B3ULL;
+  }
+
+  return RandomStreamMix(hash);
+}
+
+void RandomStreamFill(RandomStream *stream, float *dest, size_t count) {
+  uint64_t key = stream->key;
+  uint64_t counter = stream->counter;
+
+  // No dependency between iterations, so this vectorizes
+  for (size_t i = 0; i < count; ++i) {
+    uint64_t bits = RandomStreamMix(key + (counter + i) * 0x9E3779B97F4A7C15ULL);
+    dest[i] = RandomStreamFloatFromBits(bits);
+  }
+
+  stream->counter = counter + count;
+}
@@ -0,0 +1,89 @@
+// Copyright 2008 Google Inc.
+//
+// Licensed under the Apache License, Version 2.0 (the "License"); you may not
+// use this file except in compliance with the License.  You may obtain a copy
+// of the License at
+//
+// http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS, WITHOUT
+// WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.  See the
+// License for the specific language governing permissions and limitations under
+// the License.
+
+
+// Counter based random number streams.  The value at position |n| of a stream
+// is a 64-bit hash of the stream's key and |n|, so a stream is just two
+// integers, any position can be read directly, and streams with different
+// keys are independent.  There is no shared state: each thread (or object)
+// that needs random values keeps its own RandomStream.
+//
+// Reproducibility: the values depend only on the seed, the stream ID and the
+// position.  They are computed with 64-bit integer math and converted exactly
+// to floating point, so a seed gives the same values on every machine and
+// with any number of threads.
+
+#ifndef RANDOMSTREAM_H
+#define RANDOMSTREAM_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+typedef struct {
+  uint64_t key;
+  uint64_t counter;       // Position of the next value
+} RandomStream;
+
+// Start the stream |streamID| for |seed| at position 0
+void RandomStreamInit(RandomStream *stream, uint64_t seed, uint64_t streamID);
+
+// A stream ID for a name (e.g., a JavaScript object or a subsystem)
+uint64_t RandomStreamIDForName(const char *name);
+
+// Fill |dest| with |count| floats in [0, 1).  Same values as calling
+// RandomStreamNextFloat() |count| times.
+void RandomStreamFill(RandomStream *stream, float *dest, size_t count);
+
+static inline uint64_t RandomStreamMix(uint64_t z) {
+  z = (z ^ (z >> 30)) * 0xBF58476D1CE4E5B9ULL;
+  z = (z ^ (z >> 27)) * 0x94D049BB133111EBULL;
+  return z ^ (z >> 31);
+}
+
+// 64 random bits at |position| without advancing the stream
+static inline uint64_t RandomStreamBitsAt(const RandomStream *stream, uint64_t position) {
+  return RandomStreamMix(stream->key + position * 0x9E3779B97F4A7C15ULL);
+}
+
+static inline uint64_t RandomStreamNextBits(RandomStream *stream) {
+  return RandomStreamBitsAt(stream, stream->counter++);
+}
+
+static inline float RandomStreamFloatFromBits(uint64_t bits) {
+  return (float)(bits >> 40) * (1.0f / 16777216.0f);
+}
+
+static inline double RandomStreamDoubleFromBits(uint64_t bits) {
+  return (double)(bits >> 11) * (1.0 / 9007199254740992.0);
+}
+
+// [0, 1)
+static inline float RandomStreamNextFloat(RandomStream *stream) {
+  return RandomStreamFloatFromBits(RandomStreamNextBits(stream));
+}
+
+// [0, 1)
+static inline double RandomStreamNextDouble(RandomStream *stream) {
+  return RandomStreamDoubleFromBits(RandomStreamNextBits(stream));
+}
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif  // RANDOMSTREAM_H
@@ -14,14 +14,25 @@
 
 // Object to return random value within a specified range
 
+#import "RandomStream.h"
 #import "RuntimeObject.h"
 
-// C-api to getting a float value between 0 and 1
+// C-api to getting a float value between 0 and 1 from the shared stream.  Safe
+// to call from any thread; the values are only reproducible if the calls are
+// made in the same order.
 CGFloat RandomizerFloatValue();
 
+// Fill |dest| with |count| values between 0 and 1 from the shared stream
+void RandomizerFill(float *dest, size_t count);
+
+// 64 bits from the shared stream.  Use this to seed a private RandomStream
+// for work that is spread across threads.
+uint64_t RandomizerSeedValue();
+
 @interface Randomizer : RuntimeObject {
   CGFloat min_;
   CGFloat max_;
+  RandomStream stream_;
 }
 
 + (void)setSharedSeed:(NSUInteger)seed;
@@ -31,4 +42,7 @@ CGFloat RandomizerFloatValue();
 - (CGFloat)floatValue;
 - (CGFloat)integerValue;
 
+// Fill |values| with the next |count| float values
+- (void)getFloatValues:(float *)values count:(NSUInteger)count;
+
 @end
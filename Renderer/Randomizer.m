@@ -12,49 +12,64 @@
 // License for the specific language governing permissions and limitations under
 // the License.
 
+#import <libkern/OSAtomic.h>
+
 #import "Randomizer.h"
 
-// Use a CGFloat lookup table to speed things up
-static NSUInteger kSeed = 0;
-static const NSUInteger kRandomTableSize = 65536;
-static CGFloat *kRandomTable = NULL;
-static NSUInteger kRandomTableIndex = 0;
+// The shared stream.  Its position is bumped atomically, so every caller gets
+// a different value without a lock.
+static BOOL sInitialized = NO;
+static uint64_t sSeed = 0;
+static RandomStream sSharedStream;
+static volatile int64_t sSharedPosition = 0;
+
+// Number of Randomizer objects created since the seed was set.  Used as the
+// stream ID of objects without a name.
+static volatile int64_t sObjectCount = 0;
 
 static void InitializeRandomizerWithSeed(NSUInteger seed) {
   @synchronized ([Randomizer class]) {
-    if (!kRandomTable)
-      kRandomTable = (CGFloat *)malloc(sizeof(CGFloat) * kRandomTableSize);
-
-    // Choose a random starting point as well.  It seems like making it 0 will
-    // cause the first value to be 0.
-    kRandomTableIndex = arc4random() % kRandomTableSize;
-
-    kSeed = seed;
-    NSUInteger lo = kSeed, hi = ~kSeed;
-    for (NSUInteger i = 0; i < kRandomTableSize; ++i) {
-      hi = (hi << 16) + (hi >> 16);
-      hi += lo;
-      lo += hi;
-      kRandomTable[i] = (CGFloat)hi / (CGFloat)NSUIntegerMax;
-    }
+    sSeed = seed;
+    RandomStreamInit(&sSharedStream, sSeed, RandomStreamIDForName("shared"));
+    sSharedPosition = 0;
+    sObjectCount = 0;
+    OSMemoryBarrier();
+    sInitialized = YES;
   }
 }
 
-CGFloat RandomizerFloatValue() {
-  if (!kRandomTable)
+static inline void EnsureInitialized() {
+  if (!sInitialized)
     InitializeRandomizerWithSeed(CFAbsoluteTimeGetCurrent() * 10);
+}
+
+static inline uint64_t NextSharedPosition(size_t count) {
+  return (uint64_t)(OSAtomicAdd64((int64_t)count, &sSharedPosition) - (int64_t)count);
+}
+
+CGFloat RandomizerFloatValue() {
+  EnsureInitialized();
+
+  uint64_t bits = RandomStreamBitsAt(&sSharedStream, NextSharedPosition(1));
+#if CGFLOAT_IS_DOUBLE
+  return RandomStreamDoubleFromBits(bits);
+#else
+  return RandomStreamFloatFromBits(bits);
+#endif
+}
 
-  if (kRandomTableIndex >= kRandomTableSize)
-    kRandomTableIndex = 0;
+void RandomizerFill(float *dest, size_t count) {
+  EnsureInitialized();
 
-  // In case there's a threaded access to bump this, we'll get a local
-  // copy of the index and also check it
-  NSUInteger idx = kRandomTableIndex++;
+  RandomStream stream = sSharedStream;
+  stream.counter = NextSharedPosition(count);
+  RandomStreamFill(&stream, dest, count);
+}
 
-  if (idx >= kRandomTableSize)
-    idx = 0;
+uint64_t RandomizerSeedValue() {
+  EnsureInitialized();
 
-  return kRandomTable[idx];
+  return RandomStreamBitsAt(&sSharedStream, NextSharedPosition(1));
 }
 
 @implementation Randomizer
@@ -79,10 +94,21 @@ CGFloat RandomizerFloatValue() {
 
 - (id)initWithArguments:(NSArray *)arguments {
   if ((self = [super initWithArguments:arguments])) {
+    NSUInteger count = [arguments count];
     min_ = 0;
     max_ = 1.0;
 
-    if ([arguments count] == 2) {
+    // Each object has its own stream.  A named stream gives the same values
+    // for a seed no matter how many other Randomizers the script creates.
+    EnsureInitialized();
+    if (count == 3) {
+      NSString *name = [RuntimeObject coerceObject:[arguments objectAtIndex:2] toClass:[NSString class]];
+      RandomStreamInit(&stream_, sSeed, RandomStreamIDForName([name UTF8String]));
+    } else {
+      RandomStreamInit(&stream_, sSeed, (uint64_t)OSAtomicIncrement64(&sObjectCount));
+    }
+
+    if (count == 2 || count == 3) {
       min_ = [RuntimeObject coerceObjectToDouble:[arguments objectAtIndex:0]];
       max_ = [RuntimeObject coerceObjectToDouble:[arguments objectAtIndex:1]];
 
@@ -98,11 +124,19 @@ CGFloat RandomizerFloatValue() {
 }
 
 - (CGFloat)floatValue {
-  return min_ + RandomizerFloatValue() * (max_ - min_);
+  return min_ + RandomStreamNextDouble(&stream_) * (max_ - min_);
+}
+
+- (void)getFloatValues:(float *)values count:(NSUInteger)count {
+  float range = max_ - min_;
+
+  RandomStreamFill(&stream_, values, count);
+  for (NSUInteger i = 0; i < count; ++i)
+    values[i] = min_ + values[i] * range;
 }
 
 - (BOOL)boolValue {
-  return RandomizerFloatValue() > 0.5 ? YES : NO;
+  return RandomStreamNextDouble(&stream_) > 0.5 ? YES : NO;
 }
 
 - (BOOL)booleanValue {
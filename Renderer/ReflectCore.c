@@ -0,0 +1,133 @@
+// Copyright 2008 Google Inc.
+//
+// Licensed under the Apache License, Version 2.0 (the "License"); you may not
+// use this file except in compliance with the License.  You may obtain a copy
+// of the License at
+//
+// http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS, WITHOUT
+// WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.  See the
+// License for the specific language governing permissions and limitations under
+// the License.
+
+#include <string.h>
+
+#include "ReflectCore.h"
+
+// Rows per WorkQueue task
+#define kReflectBandRows 32
+
+typedef struct {
+  const ReflectParameters *params;
+  uint32_t alpha;         // 0 - 255
+} ReflectContext;
+
+//------------------------------------------------------------------------------
+// Scale each of the four bytes of |p| by |alpha| / 255, rounded, two at a time
+static inline uint32_t ScalePixel(uint32_t p, uint32_t alpha) {
+  uint32_t rb = (p & 0x00FF00FF) * alpha + 0x00800080;
+  uint32_t ag = ((p >> 8) & 0x00FF00FF) * alpha + 0x00800080;
+  
+  rb = ((rb + ((rb >> 8) & 0x00FF00FF)) >> 8) & 0x00FF00FF;
+  ag = (ag + ((ag >> 8) & 0x00FF00FF)) & 0xFF00FF00;
+  
+  return rb | ag;
+}
+
+//------------------------------------------------------------------------------
+static void CopyRow(uint32_t *dst, const uint32_t *src, size_t count, uint32_t alpha) {
+  if (alpha == 255) {
+    memcpy(dst, src, count * sizeof(uint32_t));
+    return;
+  }
+  
+  for (size_t i = 0; i < count; ++i)
+    dst[i] = ScalePixel(src[i], alpha);
+}
+
+//------------------------------------------------------------------------------
+// dst[i] = src[-i], i.e., |src| points at the last pixel to read
+static void CopyRowReversed(uint32_t *dst, const uint32_t *src, size_t count, uint32_t alpha) {
+  if (alpha == 255) {
+    for (size_t i = 0; i < count; ++i)
+      dst[i] = *(src - i);
+    return;
+  }
+  
+  for (size_t i = 0; i < count; ++i)
+    dst[i] = ScalePixel(*(src - i), alpha);
+}
+
+//------------------------------------------------------------------------------
+static void ReflectRow(const ReflectParameters *params, uint32_t alpha, size_t row) {
+  size_t width = params->width;
+  size_t height = params->height;
+  size_t halfWidth = width / 2;
+  size_t halfHeight = height / 2;
+  uint32_t *dst = params->pixels + row * params->rowPixels;
+  const uint32_t *mirror = params->pixels + (height - 1 - row) * params->rowPixels;
+  
+  switch (params->mode) {
+    case kReflectTop:
+      if (row >= height - halfHeight)
+        CopyRow(dst, mirror, width, alpha);
+      break;
+      
+    case kReflectBottom:
+      if (row < halfHeight)
+        CopyRow(dst, mirror, width, alpha);
+      break;
+      
+    case kReflectLeft:
+      CopyRowReversed(dst + width - halfWidth, dst + halfWidth - 1, halfWidth, alpha);
+      break;
+      
+    case kReflectRight:
+      CopyRowReversed(dst, dst + width - 1, halfWidth, alpha);
+      break;
+      
+    case kReflectQuarter:
+      if (row < halfHeight) {
+        // Top right from the top left of the same row
+        CopyRowReversed(dst + width - halfWidth, dst + halfWidth - 1, halfWidth, alpha);
+      } else if (row >= height - halfHeight) {
+        // Bottom left and right from the top left of the mirrored row
+        CopyRow(dst, mirror, halfWidth, alpha);
+        CopyRowReversed(dst + width - halfWidth, mirror + halfWidth - 1, halfWidth, alpha);
+      }
+      break;
+  }
+}
+
+//------------------------------------------------------------------------------
+static void ReflectBand(void *context, size_t index, int worker) {
+  ReflectContext *reflect = (ReflectContext *)context;
+  const ReflectParameters *params = reflect->params;
+  size_t start = index * kReflectBandRows;
+  size_t end = start + kReflectBandRows;
+  
+  (void)worker;
+  
+  if (end > params->height)
+    end = params->height;
+  
+  for (size_t row = start; row < end; ++row)
+    ReflectRow(params, reflect->alpha, row);
+}
+
+//------------------------------------------------------------------------------
+void ReflectPixels(const ReflectParameters *params, WorkQueue *queue) {
+  ReflectContext context;
+  float alpha = params->alpha < 0 ? 0 : (params->alpha > 1 ? 1 : params->alpha);
+  
+  if (!params->width || !params->height)
+    return;
+  
+  context.params = params;
+  context.alpha = (uint32_t)(alpha * 255.0f + 0.5f);
+  
+  size_t bands = (params->height + kReflectBandRows - 1) / kReflectBandRows;
+  WorkQueueApply(queue, bands, ReflectBand, &context);
+}
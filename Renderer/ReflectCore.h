@@ -0,0 +1,57 @@
+// Copyright 2008 Google Inc.
+//
+// Licensed under the Apache License, Version 2.0 (the "License"); you may not
+// use this file except in compliance with the License.  You may obtain a copy
+// of the License at
+//
+// http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS, WITHOUT
+// WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.  See the
+// License for the specific language governing permissions and limitations under
+// the License.
+
+// Mirror half (or a quarter) of a 32-bit premultiplied pixel buffer over the
+// rest of it, in place, as in Layer's reflect().  The reflected pixels are
+// scaled by an alpha.  The rows are split into bands that are run on a
+// WorkQueue; no band reads pixels that another one writes.
+
+#ifndef REFLECTCORE_H
+#define REFLECTCORE_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+#include "WorkQueue.h"
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+// The part of the image that is reflected over the opposite part.  Quarter
+// reflects the top left quarter into the other three.
+typedef enum {
+  kReflectTop,
+  kReflectBottom,
+  kReflectLeft,
+  kReflectRight,
+  kReflectQuarter
+} ReflectMode;
+
+typedef struct {
+  uint32_t *pixels;       // Row 0 is the top
+  size_t width;
+  size_t height;
+  size_t rowPixels;       // Distance between rows, in pixels
+  ReflectMode mode;
+  float alpha;            // 0 - 1
+} ReflectParameters;
+
+void ReflectPixels(const ReflectParameters *params, WorkQueue *queue);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif  // REFLECTCORE_H
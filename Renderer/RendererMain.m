@@ -14,10 +14,14 @@
 
 // The command line renderer
 
+#import <libkern/OSAtomic.h>
 #import <unistd.h>
 
 #import "Compositor.h"
 #import "Exporter.h"
+#import "NSScreen+Convenience.h"
+#import "RendererEvent.h"
+#import "WorkQueue.h"
 
 typedef struct {
   NSString *name;
@@ -29,23 +33,113 @@ typedef struct {
   BOOL canTerminate;
   BOOL shouldSplit;
   BOOL disableMenubarRendering;
+  BOOL isServer;
   unsigned long seed;
   NSSize size;
 } Options;
 
+typedef struct {
+  Compositor *compositor;
+  Options *options;
+  NSString *basePath;     // Without the extension or screen index
+  CGRect *rects;          // Of each screen on the desktop
+  NSString **paths;       // Written for each screen, or nil
+  int32_t completedSteps; // Of |totalSteps|, updated by the screen threads
+  int32_t totalSteps;
+} ScreenImages;
+
+// The server sends RendererEvents to its client.  Otherwise, each event is
+// written as a "<time> <type>: <text>" line for the person running the command.
+static BOOL sSendsEvents = NO;
+
+//------------------------------------------------------------------------------
+// Write the event immediately.  This is called from the screen threads, too.
+static void SendEvent(NSString *type, NSDictionary *values, NSString *text) {
+  NSMutableDictionary *event = [NSMutableDictionary dictionaryWithDictionary:values];
+  CFAbsoluteTime now = CFAbsoluteTimeGetCurrent();
+  
+  [event setObject:type forKey:RendererEventTypeKey];
+  [event setObject:[NSNumber numberWithDouble:now] forKey:RendererEventTimeKey];
+  
+  @synchronized([RendererEvent class]) {
+    if (sSendsEvents) {
+      NSData *data = [RendererEvent dataWithEvent:event];
+      fwrite([data bytes], 1, [data length], stdout);
+    } else {
+      fprintf(stdout, "%.3f %s: %s\n", now, [type UTF8String], [text UTF8String]);
+    }
+    
+    fflush(stdout);
+  }
+}
+
 //------------------------------------------------------------------------------
 static void Log(NSString *fmt, ...) {
   va_list args;
   va_start(args, fmt);
   NSString *logStr = [[NSString alloc] initWithFormat:fmt arguments:args];
   va_end(args);
-  fprintf(stdout, "%.3f %s\n", CFAbsoluteTimeGetCurrent(), [logStr UTF8String]);
+  SendEvent(RendererLogEvent, [NSDictionary dictionaryWithObject:logStr 
+                                                          forKey:RendererEventMessageKey], logStr);
   [logStr release];
 }
 
 //------------------------------------------------------------------------------
 static void Logging(const char *msg, void *context) {
-  Log(@"Log:%s", msg);
+  Log(@"%s", msg);
+}
+
+//------------------------------------------------------------------------------
+// Script errors are "<line> - <message>"
+static void SendError(NSString *errorStr) {
+  NSScanner *scanner = [NSScanner scannerWithString:errorStr];
+  NSString *message = errorStr;
+  int line = 0;
+  
+  if ([scanner scanInt:&line]) {
+    [scanner scanUpToCharactersFromSet:[NSCharacterSet alphanumericCharacterSet] intoString:nil];
+    message = [errorStr substringFromIndex:[scanner scanLocation]];
+  }
+  
+  NSDictionary *values = [NSDictionary dictionaryWithObjectsAndKeys:
+                          message, RendererEventMessageKey,
+                          [NSNumber numberWithInt:line], RendererEventLineKey,
+                          nil];
+  SendEvent(RendererErrorEvent, values, errorStr);
+}
+
+//------------------------------------------------------------------------------
+static void SendProgress(int32_t completedSteps, int32_t totalSteps) {
+  float progress = totalSteps ? (float)completedSteps / totalSteps : 1;
+  NSDictionary *values = [NSDictionary dictionaryWithObject:[NSNumber numberWithFloat:progress]
+                                                     forKey:RendererEventProgressKey];
+  SendEvent(RendererProgressEvent, values, [NSString stringWithFormat:@"%.0f%%", progress * 100]);
+}
+
+//------------------------------------------------------------------------------
+static void SendPhase(NSString *phase, CFAbsoluteTime startTime) {
+  CFAbsoluteTime duration = CFAbsoluteTimeGetCurrent() - startTime;
+  NSDictionary *values = [NSDictionary dictionaryWithObjectsAndKeys:
+                          phase, RendererEventPhaseKey,
+                          [NSNumber numberWithDouble:duration], RendererEventDurationKey,
+                          nil];
+  SendEvent(RendererPhaseEvent, values, [NSString stringWithFormat:@"%@ %.3f", phase, duration]);
+}
+
+//------------------------------------------------------------------------------
+static void SendOutput(NSString *screenID, NSString *path) {
+  NSDictionary *values = [NSDictionary dictionaryWithObjectsAndKeys:
+                          screenID, RendererEventScreenKey,
+                          path, RendererEventPathKey,
+                          nil];
+  SendEvent(RendererOutputEvent, values, [NSString stringWithFormat:@"%@:%@", screenID, path]);
+}
+
+//------------------------------------------------------------------------------
+static void SendSeed(unsigned long seed) {
+  NSDictionary *values = [NSDictionary dictionaryWithObject:[NSNumber numberWithUnsignedLong:seed]
+                                                     forKey:RendererEventSeedKey];
+  SendEvent(RendererSeedEvent, values, [NSString stringWithFormat:@"%lu", seed]);
 }
 
 //------------------------------------------------------------------------------
@@ -64,14 +158,89 @@ static NSString *Preprocess(Options *options, NSString *path) {
 }
 
 //------------------------------------------------------------------------------
-static void Process(Options *options) {
-  NSString *source = Preprocess(options, options->sourcePath);
+static void WriteScreenImage(void *context, size_t index, int worker) {
+  ScreenImages *screenImages = (ScreenImages *)context;
+  NSAutoreleasePool *pool = [[NSAutoreleasePool alloc] init];
+  CGImageRef image = [screenImages->compositor createImageInRect:screenImages->rects[index]];
+  NSString *path = [screenImages->basePath stringByAppendingFormat:@"-%d", (int)index];
+  
+  if (image)
+    screenImages->paths[index] = [[Exporter exportImage:image path:path 
+                                                   type:screenImages->options->type 
+                                                quality:1.0] retain];
+  
+  CGImageRelease(image);
+  SendProgress(OSAtomicIncrement32(&screenImages->completedSteps), screenImages->totalSteps);
+  [pool release];
+}
+
+//------------------------------------------------------------------------------
+// Composite and write each screen's part of the desktop on its own thread.
+// The space between screens is never composited.
+static void WriteScreenImages(Compositor *compositor, Options *options, 
+                              int32_t completedSteps, int32_t totalSteps) {
+  NSArray *screens = [NSScreen screens];
+  NSUInteger count = [screens count];
+  NSString *baseName = [[options->destPath lastPathComponent] stringByDeletingPathExtension];
+  NSString *baseDir = [options->destPath stringByDeletingLastPathComponent];
+  ScreenImages screenImages;
+  
+  screenImages.compositor = compositor;
+  screenImages.options = options;
+  screenImages.basePath = [baseDir stringByAppendingPathComponent:baseName];
+  screenImages.rects = (CGRect *)calloc(count, sizeof(CGRect));
+  screenImages.paths = (NSString **)calloc(count, sizeof(NSString *));
+  screenImages.completedSteps = completedSteps;
+  screenImages.totalSteps = totalSteps;
+  
+  if (!screenImages.rects || !screenImages.paths) {
+    free(screenImages.rects);
+    free(screenImages.paths);
+    SendError([NSString stringWithFormat:@"Unable to write: %@", options->destPath]);
+    return;
+  }
+  
+  for (NSUInteger i = 0; i < count; ++i)
+    screenImages.rects[i] = NSRectToCGRect([[screens objectAtIndex:i] globalFrame]);
+  
+  // Make sure that Cocoa knows it has to be thread-safe
+  if (![NSThread isMultiThreaded])
+    [NSThread detachNewThreadSelector:@selector(self) toTarget:[NSObject class] withObject:nil];
+  
+  [compositor prepareForImagesInRects];
+  WorkQueueApply(WorkQueueGetShared(), count, WriteScreenImage, &screenImages);
+  
+  for (NSUInteger i = 0; i < count; ++i) {
+    NSString *path = screenImages.paths[i];
+    
+    if (path)
+      SendOutput([Exporter idForScreen:[screens objectAtIndex:i]], path);
+    else
+      MethodLog("Failed to write to %@-%d", screenImages.basePath, (int)i);
+    
+    [path release];
+  }
+  
+  free(screenImages.rects);
+  free(screenImages.paths);
+}
+
+//------------------------------------------------------------------------------
+// Progress is reported in steps: evaluating the script, and then compositing
+// and writing each image.
+static BOOL Render(Options *options, NSString *source) {
   Compositor *c = [[Compositor alloc] initWithSource:source name:options->name];
   NSString *errorStr = nil;
+  NSUInteger screenCount = [[NSScreen screens] count];
+  BOOL writesScreens = options->shouldSplit && screenCount > 1;
+  int32_t totalSteps = writesScreens ? 1 + (int32_t)screenCount : 3;
+  CFAbsoluteTime startTime = CFAbsoluteTimeGetCurrent();
   [c setLoggingCallback:Logging context:options];
   [c setMaximumSize:options->size];
   [c setDisableMenubarRendering:options->disableMenubarRendering];
 
+  SendProgress(0, totalSteps);
+  
   @try {
     errorStr = [c evaluateWithSeed:options->seed];
   }
@@ -80,50 +249,207 @@ static void Process(Options *options) {
     errorStr = [NSString stringWithFormat:@"Exception: %@", e];
   }
   
+  SendPhase(@"Evaluate", startTime);
+  
   if (!errorStr) {
-    CGImageRef image = [c image];
-    
-    // Add a preamble because sometimes the first output string gets skipped
-    Log(@"Preamble: Top Draw Renderer v 1.0");
+    SendProgress(1, totalSteps);
     
-    if (options->shouldSplit) {
-      NSDictionary *imageDict = [Exporter partitionAndWriteImage:image path:options->destPath 
-																														type:options->type];
-			NSArray *screenKeys = [imageDict allKeys];
-			for (NSString *screenID in screenKeys) {
-        Log(@"Output: %@:%@", screenID, [imageDict objectForKey:screenID]);
-			}
+    if (writesScreens) {
+      startTime = CFAbsoluteTimeGetCurrent();
+      WriteScreenImages(c, options, 1, totalSteps);
+      SendPhase(@"Screens", startTime);
     } else {
-      NSString *outputPath = [Exporter exportImage:image path:options->destPath type:options->type 
-																					 quality:options->quality];
+      startTime = CFAbsoluteTimeGetCurrent();
+      CGImageRef image = [c image];
+      SendPhase(@"Composite", startTime);
+      SendProgress(2, totalSteps);
       
-      if ([outputPath length])
-        Log(@"Output: %@:%@", @"default", outputPath);
-      else
-        Log(@"Error: Unable to write: %@", options->destPath);
+      startTime = CFAbsoluteTimeGetCurrent();
+      
+      if (options->shouldSplit) {
+        NSDictionary *imageDict = [Exporter partitionAndWriteImage:image path:options->destPath 
+                                                              type:options->type];
+        
+        for (NSString *screenID in imageDict)
+          SendOutput(screenID, [imageDict objectForKey:screenID]);
+      } else {
+        NSString *outputPath = [Exporter exportImage:image path:options->destPath type:options->type 
+                                             quality:options->quality];
+        
+        if ([outputPath length])
+          SendOutput(@"default", outputPath);
+        else
+          SendError([NSString stringWithFormat:@"Unable to write: %@", options->destPath]);
+      }
+      
+      SendPhase(@"Export", startTime);
+      SendProgress(3, totalSteps);
     }
     
-    Log(@"Seed: %d", [c randomSeed]);
+    SendSeed([c randomSeed]);
   } else {
-    Log(@"Error: %s", [errorStr UTF8String]);
-    
-    // Strangely, if we return too quickly from the task, not all of the output
-    // seems to go out.  If we have an error, sleep for a small amount of time.
-    usleep(1000 * 100);  // 0.1 sec
+    SendError(errorStr);
   }
   
   // Cleanup
   [c release];
   
+  return errorStr ? NO : YES;
+}
+
+//------------------------------------------------------------------------------
+static void Process(Options *options) {
+  NSString *source = Preprocess(options, options->sourcePath);
+  
+  Render(options, source);
   options->canTerminate = YES;
 }
 
+//------------------------------------------------------------------------------
+static NSString *AllowedType(NSString *type) {
+  NSSet *allowedTypes = [NSSet setWithObjects:@"png", @"tiff", @"jpeg", nil];
+  
+  type = [[type lowercaseString] 
+          stringByTrimmingCharactersInSet:[NSCharacterSet whitespaceCharacterSet]];
+  
+  if (![allowedTypes containsObject:type]) {
+    NSLog(@"Unallowed type: '%@' -- using tiff", type);
+    type = @"tiff";
+  }
+  
+  return type;
+}
+
+//------------------------------------------------------------------------------
+// WxH, or NSZeroSize
+static NSSize SizeFromString(const char *str) {
+  char *ptr = NULL;
+  NSUInteger width = 0, height = 0;
+  width = strtoul(str, &ptr, 10);
+  
+  if (ptr) {
+    while (!isdigit(*ptr) && *ptr)
+      ++ptr;
+    
+    height = strtoul(ptr, NULL, 10);
+  }
+  
+  if (width > 0 && height > 0)
+    return NSMakeSize(width, height);
+  
+  return NSZeroSize;
+}
+
+//------------------------------------------------------------------------------
+// A job is a header of "Key: value" lines, a blank line, and then Length bytes
+// of UTF-8 source.  Returns NO at the end of |input|.
+static BOOL ReadJob(FILE *input, Options *options, NSString **source) {
+  NSCharacterSet *ws = [NSCharacterSet whitespaceAndNewlineCharacterSet];
+  BOOL hasHeader = NO;
+  size_t length = 0;
+  char line[4096];
+  
+  bzero(options, sizeof(Options));
+  options->name = @"Untitled";
+  options->seed = 42;
+  options->quality = 1.0;
+  options->type = @"jpeg";
+  options->isServer = YES;
+  
+  while (fgets(line, sizeof(line), input)) {
+    NSString *str = [[NSString stringWithUTF8String:line] stringByTrimmingCharactersInSet:ws];
+    NSRange colon = [str rangeOfString:@":"];
+    
+    // Skip blank lines between jobs
+    if (![str length]) {
+      if (hasHeader)
+        break;
+      
+      continue;
+    }
+    
+    hasHeader = YES;
+    
+    if (colon.location == NSNotFound)
+      continue;
+    
+    NSString *key = [str substringToIndex:colon.location];
+    NSString *value = [[str substringFromIndex:NSMaxRange(colon)] stringByTrimmingCharactersInSet:ws];
+    
+    if ([key isEqualToString:@"Seed"])
+      options->seed = strtoul([value UTF8String], NULL, 10);
+    else if ([key isEqualToString:@"Type"])
+      options->type = AllowedType(value);
+    else if ([key isEqualToString:@"Quality"])
+      options->quality = MAX(0, MIN(1, [value floatValue]));
+    else if ([key isEqualToString:@"Name"])
+      options->name = value;
+    else if ([key isEqualToString:@"Size"])
+      options->size = SizeFromString([value UTF8String]);
+    else if ([key isEqualToString:@"Split"])
+      options->shouldSplit = [value boolValue];
+    else if ([key isEqualToString:@"DisableMenubar"])
+      options->disableMenubarRendering = [value boolValue];
+    else if ([key isEqualToString:@"Output"])
+      options->destPath = value;
+    else if ([key isEqualToString:@"Length"])
+      length = strtoul([value UTF8String], NULL, 10);
+  }
+  
+  if (!hasHeader)
+    return NO;
+  
+  NSMutableData *data = [NSMutableData dataWithLength:length];
+  
+  if (fread([data mutableBytes], 1, length, input) != length)
+    return NO;
+  
+  *source = [[[NSString alloc] initWithData:data encoding:NSUTF8StringEncoding] autorelease];
+  options->isValid = [*source length] ? YES : NO;
+  
+  return YES;
+}
+
+//------------------------------------------------------------------------------
+// Render jobs from stdin until it's closed.  The process (and its frameworks,
+// worker threads and JavaScript class definitions) stays warm between jobs.
+// Jobs are rendered one at a time because the scripting objects share the
+// process-wide random seed and compositor.  The events for each job end with a
+// Done event.
+static void Serve(void) {
+  Options options;
+  NSString *source;
+  BOOL done = NO;
+  
+  sSendsEvents = YES;
+  
+  while (!done) {
+    NSAutoreleasePool *pool = [[NSAutoreleasePool alloc] init];
+    
+    if (ReadJob(stdin, &options, &source)) {
+      if (!options.isValid)
+        SendError(@"No source");
+      else if (![options.destPath length])
+        SendError(@"No output path");
+      else
+        Render(&options, source);
+      
+      SendEvent(RendererDoneEvent, nil, @"");
+    } else {
+      done = YES;
+    }
+    
+    [pool release];
+  }
+}
+
 //------------------------------------------------------------------------------
 static void Usage(int argc, const char *argv[], int errorCode) {
   NSString *path = [NSString stringWithUTF8String:argv[0]];
   const char *exe = [[path lastPathComponent] fileSystemRepresentation];
   fprintf(stderr, "Render a Top Draw Document into an output image\n"); 
   fprintf(stderr, "Usage: %s [-r randomSeed][-t type][-q quality][-s][-d][-o output-image][-m WxH][-n name] source-file\n", exe);
+  fprintf(stderr, "       %s -S\n", exe);
   fprintf(stderr, "\tsource-file: a Top Draw Document\n");
   fprintf(stderr, "\t-r: Specify the random seed to use\n");
   fprintf(stderr, "\t-f: Specify the type (default: jpeg; allowed: jpeg, png, tiff)\n");
@@ -133,6 +459,7 @@ static void Usage(int argc, const char *argv[], int errorCode) {
   fprintf(stderr, "\t-m: Specify maximum width and height (default: actual desktop)\n");
   fprintf(stderr, "\t-n: Name of the script (default: Untitled)\n");
   fprintf(stderr, "\t-d: Disable rendering of menubar area (default: NO)\n");
+  fprintf(stderr, "\t-S: Render jobs read from stdin until it is closed, writing RendererEvents to stdout\n");
   fprintf(stderr, "\t-h: Usage\n");
   fprintf(stderr, "\t-?: Usage\n");
   exit(errorCode);
@@ -143,8 +470,6 @@ static void SetupOptions(int argc, const char *argv[], Options *options) {
   extern char *optarg;
   extern int optind;
   int ch;
-  NSSet *allowedTypes = [NSSet setWithObjects:@"png", @"tiff", @"jpeg", nil];
-  NSString *type;
   
   // Initialize
   bzero(options, sizeof(Options));
@@ -153,8 +478,12 @@ static void SetupOptions(int argc, const char *argv[], Options *options) {
   options->quality = 1.0;
   options->type = @"jpeg";
 
-  while ((ch = getopt(argc, (char * const *)argv, "dn:m:sq:t:r:o:h?")) != -1) {
+  while ((ch = getopt(argc, (char * const *)argv, "dn:m:sSq:t:r:o:h?")) != -1) {
     switch (ch) {
+      case 'S':
+        options->isServer = YES;
+        break;
+        
       case 's':
         options->shouldSplit = YES;
         break;
@@ -172,14 +501,7 @@ static void SetupOptions(int argc, const char *argv[], Options *options) {
         break;
         
       case 't':
-        type = [[[NSString stringWithUTF8String:optarg] lowercaseString] 
-                stringByTrimmingCharactersInSet:[NSCharacterSet whitespaceCharacterSet]];
-        if (![allowedTypes containsObject:type]) {
-          NSLog(@"Unallowed type: '%@' -- using tiff", type);
-          type = @"tiff";
-        }
-        
-        options->type = [type copy];
+        options->type = [AllowedType([NSString stringWithUTF8String:optarg]) copy];
         break;
         
       case 'r':
@@ -193,23 +515,9 @@ static void SetupOptions(int argc, const char *argv[], Options *options) {
         break;
       }
         
-      case 'm': {
-        char *ptr = NULL;
-        NSUInteger width = 0, height = 0;
-        width = strtoul(optarg, &ptr, 10);
-        
-        if (ptr) {
-          while (!isdigit(*ptr) && *ptr)
-            ++ptr;
-          
-          height = strtoul(ptr, NULL, 10);
-        }
-        
-        if (width > 0 && height > 0)
-          options->size = NSMakeSize(width, height);
-        
+      case 'm':
+        options->size = SizeFromString(optarg);
         break;
-      }
         
       case 'n': {
         options->name = [[[NSString stringWithUTF8String:optarg]
@@ -235,6 +543,9 @@ static void SetupOptions(int argc, const char *argv[], Options *options) {
     }
   }
   
+  if (options->isServer)
+    return;
+  
   if (!options->isValid) {
     fprintf(stderr, "No valid file specified\n");
     Usage(argc, argv, 1);
@@ -247,6 +558,13 @@ int main(int argc, const char *argv[]) {
   
   Options options;
   SetupOptions(argc, argv, &options);
+  
+  if (options.isServer) {
+    Serve();
+    [pool release];
+    
+    return 0;
+  }
 
   NSRunLoop *rl = [NSRunLoop currentRunLoop];
   BOOL isProcessing = NO;
@@ -26,11 +26,14 @@
   NSString *name_;
   JSGlobalContextRef globalContext_;
   JSObjectRef global_;
+  JSObjectRef arrayConstructor_;
+  JSStringRef lengthString_;
   NSMapTable *classMap_;  // Map from JSClassRef to ObjC Class
+  NSMapTable *jsClassMap_;  // Map from ObjC Class to JSClassRef
+  NSMapTable *propertyTableMap_;  // Map from ObjC Class to its properties
   NSMapTable *constructorMap_;  // Map from Constructor JSObjectRef to JSClassRef
-  NSMapTable *methodMap_; // Map from function JSObjectRef to NSString method name
+  NSMapTable *methodMap_; // Map from function JSObjectRef to RuntimeMethod
   NSMutableSet *methodNames_;
-  NSHashTable *staticClassElements_;
   NSHashTable *prototypeUpdated_; // If we've updated the prototype for a class, it will be in here
   id delegate_;
 }
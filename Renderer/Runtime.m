@@ -12,35 +12,440 @@
 // License for the specific language governing permissions and limitations under
 // the License.
 
+#import <objc/runtime.h>
+
 #import "Function.h"
+#import "NumberArray.h"
 #import "Runtime.h"
 
+// Arguments are gathered on the stack for calls with up to this many
+#define kStackArgumentCount 16
+
+// The ObjC side of a JS method, resolved once per class when its prototype is
+// set up so that calls don't need to look up selectors or build invocations.
+@interface RuntimeMethod : NSObject {
+ @public
+  NSString *name_;
+  Class class_;
+  SEL selector_;              // NULL if the class doesn't implement the method
+  IMP imp_;
+  BOOL takesArguments_;       // Method is of the form -name:(NSArray *)arguments
+  char returnType_;           // ObjC type encoding, without qualifiers
+}
+
+- (id)initWithName:(NSString *)name class:(Class)class;
+- (id)initWithName:(NSString *)name selector:(SEL)selector class:(Class)class;
+- (BOOL)canInvoke;
+- (id)invokeWithObject:(id)obj arguments:(NSArray *)arguments;
+@end
+
+// A property of a registered class.  If the class has plain accessors for it,
+// they're resolved once and called directly instead of going through KVC.
+@interface RuntimeProperty : NSObject {
+ @public
+  NSString *name_;
+  JSStringRef jsName_;
+  BOOL readOnly_;
+  Class class_;
+  RuntimeMethod *getter_;     // nil to use KVC
+  SEL setter_;                // NULL to use KVC
+  IMP setterIMP_;
+  char setterType_;
+}
+
+- (id)initWithName:(NSString *)name class:(Class)class readOnly:(BOOL)readOnly
+      useAccessors:(BOOL)useAccessors;
+- (id)valueForObject:(id)obj;
+- (void)setValue:(id)value forObject:(id)obj;
+@end
+
+// The properties of a registered class, hashed by name so that a property
+// can be found from the JSStringRef that JavaScriptCore passes in.
+@interface RuntimePropertyTable : NSObject {
+ @public
+  BOOL customGetter_;         // Class overrides -valueForProperty:
+  BOOL customSetter_;         // Class overrides -setValue:forProperty:
+  NSArray *properties_;
+  NSUInteger mask_;
+  NSUInteger *slots_;         // Index + 1 into |properties_|, 0 if empty
+}
+
+- (id)initWithClass:(Class)class;
+- (RuntimeProperty *)propertyForName:(JSStringRef)name;
+@end
+
 @interface Runtime(PrivateMethods)
 - (id)convertJSValue:(JSValueRef)value exception:(JSValueRef *)exception context:(JSContextRef)context;
 - (JSValueRef)convertObject:(id)object context:(JSContextRef)context;
 - (NSArray *)convertJSArguments:(const JSValueRef *)arguments count:(size_t)count
                       exception:(JSValueRef *)exception context:(JSContextRef)context;
+- (NSArray *)convertJSArray:(JSObjectRef)array exception:(JSValueRef *)exception context:(JSContextRef)context;
+- (NSArray *)convertJSTypedArray:(JSObjectRef)array exception:(JSValueRef *)exception context:(JSContextRef)context;
 - (NSArray *)propertyNamesForObject:(JSObjectRef)object exception:(JSValueRef *)exception context:(JSContextRef)context;
 - (NSDictionary *)propertiesForObject:(JSObjectRef)object exception:(JSValueRef *)exception context:(JSContextRef)context;
 
 - (JSClassRef)registeredClassForConstructor:(JSObjectRef)constructor;
 - (Class)registeredClassForJSClass:(JSClassRef)class;
 - (JSClassRef)registeredJSClassForClass:(Class)class;
-- (NSString *)methodNameForFunction:(JSObjectRef)function;
-- (void)setMethodName:(NSString *)name forFunction:(JSObjectRef)function;
-- (void)updateObjectPrototype:(JSObjectRef)protoObj forMethods:(NSSet *)methods;
+- (RuntimePropertyTable *)propertyTableForClass:(Class)class;
+- (RuntimeMethod *)methodForFunction:(JSObjectRef)function;
+- (void)updateObjectPrototype:(JSObjectRef)protoObj forClass:(Class)class;
 
 - (JSStaticValue *)staticValuesForClass:(Class)class;
 - (JSStaticFunction *)staticFunctionsForClass:(Class)class;
+- (JSClassRef)sharedJSClassForClass:(Class)class propertyTable:(RuntimePropertyTable **)propertyTable;
 
 @end
 
+// The JSClassRefs (and the static values and functions they're made from) and
+// the property tables only depend on the ObjC class, so they're created once
+// and shared by every Runtime in the process.  The global contexts are all
+// created in one context group, so the JavaScriptCore VM (its heap, compiled
+// code caches and structures) is kept warm between jobs.  Each Runtime still
+// has its own global context, so nothing that a script does is seen by the
+// next one.  Scripts in the group run one at a time.
+static NSMapTable *sJSClasses = NULL;         // ObjC Class to JSClassRef
+static NSMapTable *sPropertyTables = NULL;    // ObjC Class to RuntimePropertyTable
+static NSHashTable *sStaticClassElements = NULL;
+static JSClassRef sGlobalClass = NULL;
+static JSContextGroupRef sContextGroup = NULL;
+
 static Runtime *RuntimeFromContext(JSContextRef ctx) {
   JSObjectRef global = JSContextGetGlobalObject(ctx);
   
   return JSObjectGetPrivate(global);
 }
 
+// Raise a JS Error with |message|
+static void SetException(JSContextRef ctx, NSString *message, JSValueRef *exception) {
+  if (!exception)
+    return;
+  
+  JSStringRef str = JSStringCreateWithCFString((CFStringRef)message);
+  JSValueRef messageValue = JSValueMakeString(ctx, str);
+  JSStringRelease(str);
+  *exception = JSObjectMakeError(ctx, 1, &messageValue, NULL);
+}
+
+// Raise a JS Error for an array of |count| numbers that couldn't be allocated
+static void SetOutOfMemoryException(JSContextRef ctx, NSUInteger count, JSValueRef *exception) {
+  SetException(ctx, [NSString stringWithFormat:@"Unable to allocate %lu numbers", (unsigned long)count],
+               exception);
+}
+
+// Skip any qualifiers (const, oneway, etc.) of an ObjC type encoding
+static char TypeWithoutQualifiers(const char *type) {
+  while (*type && strchr("rnNoORV", *type))
+    ++type;
+  
+  return *type;
+}
+
+// The scalar and object types that can be passed to and from methods
+static BOOL IsSupportedType(char type) {
+  return type && strchr("@cBsilqCSILQfd", type);
+}
+
+@implementation RuntimeMethod
+- (id)initWithName:(NSString *)name class:(Class)class {
+  SEL selector = NSSelectorFromString(name);
+  
+  // Check if this needs a ":" to indicate that it takes some more args
+  if (![class instancesRespondToSelector:selector])
+    selector = NSSelectorFromString([name stringByAppendingString:@":"]);
+  
+  return [self initWithName:name selector:selector class:class];
+}
+
+- (id)initWithName:(NSString *)name selector:(SEL)selector class:(Class)class {
+  if ((self = [super init])) {
+    name_ = [name copy];
+    class_ = class;
+    
+    if ([class instancesRespondToSelector:selector]) {
+      NSMethodSignature *methodSig = [class instanceMethodSignatureForSelector:selector];
+      selector_ = selector;
+      imp_ = [class instanceMethodForSelector:selector_];
+      takesArguments_ = [methodSig numberOfArguments] > 2;
+      returnType_ = TypeWithoutQualifiers([methodSig methodReturnType]);
+    }
+  }
+  
+  return self;
+}
+
+- (BOOL)canInvoke {
+  return selector_ && (returnType_ == 'v' || IsSupportedType(returnType_));
+}
+
+- (void)dealloc {
+  [name_ release];
+  [super dealloc];
+}
+
+// Call |imp| with the return type |type|
+#define InvokeIMP(type, imp) (takesArguments_ ? \
+  ((type (*)(id, SEL, NSArray *))imp)(obj, selector_, arguments) : \
+  ((type (*)(id, SEL))imp)(obj, selector_))
+
+- (id)invokeWithObject:(id)obj arguments:(NSArray *)arguments {
+  IMP imp = imp_;
+  
+  // The cached implementation is only valid for the class that it was
+  // resolved from.
+  if (object_getClass(obj) != class_)
+    imp = [obj methodForSelector:selector_];
+  
+  switch (returnType_) {
+    case 'v':
+      InvokeIMP(void, imp);
+      return nil;
+    case 'c':
+      return [NSNumber numberWithInt:InvokeIMP(char, imp)];
+    case 'B':
+      return [NSNumber numberWithBool:InvokeIMP(bool, imp)];
+    case 's':
+      return [NSNumber numberWithInt:InvokeIMP(short, imp)];
+    case 'i':
+      return [NSNumber numberWithInt:InvokeIMP(int, imp)];
+    case 'l':
+      return [NSNumber numberWithLong:InvokeIMP(long, imp)];
+    case 'q':
+      return [NSNumber numberWithLongLong:InvokeIMP(long long, imp)];
+    case 'C':
+      return [NSNumber numberWithUnsignedInt:InvokeIMP(unsigned char, imp)];
+    case 'S':
+      return [NSNumber numberWithUnsignedInt:InvokeIMP(unsigned short, imp)];
+    case 'I':
+      return [NSNumber numberWithUnsignedInt:InvokeIMP(unsigned int, imp)];
+    case 'L':
+      return [NSNumber numberWithUnsignedLong:InvokeIMP(unsigned long, imp)];
+    case 'Q':
+      return [NSNumber numberWithUnsignedLongLong:InvokeIMP(unsigned long long, imp)];
+    case 'f':
+      return [NSNumber numberWithDouble:InvokeIMP(float, imp)];
+    case 'd':
+      return [NSNumber numberWithDouble:InvokeIMP(double, imp)];
+    case '@':
+      return InvokeIMP(id, imp);
+    default:
+      MethodLog("Unexpected return type (%c) from %@", returnType_, name_);
+  }
+  
+  return nil;
+}
+
+#undef InvokeIMP
+
+@end
+
+@implementation RuntimeProperty
+- (id)initWithName:(NSString *)name class:(Class)class readOnly:(BOOL)readOnly
+      useAccessors:(BOOL)useAccessors {
+  if ((self = [super init])) {
+    name_ = [name copy];
+    jsName_ = JSStringCreateWithCFString((CFStringRef)name_);
+    readOnly_ = readOnly;
+    class_ = class;
+    
+    if (useAccessors) {
+      getter_ = [[RuntimeMethod alloc] initWithName:name_ selector:NSSelectorFromString(name_) class:class];
+      
+      // Getters that take arguments or return structs are left to KVC
+      if (![getter_ canInvoke] || getter_->takesArguments_ || getter_->returnType_ == 'v') {
+        [getter_ release];
+        getter_ = nil;
+      }
+      
+      NSString *setterName = [NSString stringWithFormat:@"set%@%@:", 
+                              [[name_ substringToIndex:1] uppercaseString], [name_ substringFromIndex:1]];
+      SEL setter = NSSelectorFromString(setterName);
+      
+      if (!readOnly_ && [class instancesRespondToSelector:setter]) {
+        NSMethodSignature *methodSig = [class instanceMethodSignatureForSelector:setter];
+        char type = TypeWithoutQualifiers([methodSig getArgumentTypeAtIndex:2]);
+        
+        if (IsSupportedType(type)) {
+          setter_ = setter;
+          setterIMP_ = [class instanceMethodForSelector:setter_];
+          setterType_ = type;
+        }
+      }
+    }
+  }
+  
+  return self;
+}
+
+- (void)dealloc {
+  JSStringRelease(jsName_);
+  [getter_ release];
+  [name_ release];
+  [super dealloc];
+}
+
+- (id)valueForObject:(id)obj {
+  if (getter_)
+    return [getter_ invokeWithObject:obj arguments:nil];
+  
+  return [obj valueForKey:name_];
+}
+
+// Call the setter with |value| converted to |type|
+#define InvokeSetter(type, value) ((void (*)(id, SEL, type))imp)(obj, setter_, (type)(value))
+
+- (void)setValue:(id)value forObject:(id)obj {
+  if (!setter_) {
+    [obj setValue:value forKey:name_];
+    return;
+  }
+  
+  IMP imp = setterIMP_;
+  
+  if (object_getClass(obj) != class_)
+    imp = [obj methodForSelector:setter_];
+  
+  switch (setterType_) {
+    case '@':
+      InvokeSetter(id, value);
+      break;
+    case 'c':
+      InvokeSetter(char, [RuntimeObject coerceObjectToInteger:value]);
+      break;
+    case 'B':
+      InvokeSetter(bool, [RuntimeObject coerceObjectToInteger:value]);
+      break;
+    case 's':
+      InvokeSetter(short, [RuntimeObject coerceObjectToInteger:value]);
+      break;
+    case 'i':
+      InvokeSetter(int, [RuntimeObject coerceObjectToInteger:value]);
+      break;
+    case 'l':
+      InvokeSetter(long, [RuntimeObject coerceObjectToLongLong:value]);
+      break;
+    case 'q':
+      InvokeSetter(long long, [RuntimeObject coerceObjectToLongLong:value]);
+      break;
+    case 'C':
+      InvokeSetter(unsigned char, [RuntimeObject coerceObjectToInteger:value]);
+      break;
+    case 'S':
+      InvokeSetter(unsigned short, [RuntimeObject coerceObjectToInteger:value]);
+      break;
+    case 'I':
+      InvokeSetter(unsigned int, [RuntimeObject coerceObjectToUnsignedLongLong:value]);
+      break;
+    case 'L':
+      InvokeSetter(unsigned long, [RuntimeObject coerceObjectToUnsignedLongLong:value]);
+      break;
+    case 'Q':
+      InvokeSetter(unsigned long long, [RuntimeObject coerceObjectToUnsignedLongLong:value]);
+      break;
+    case 'f':
+      InvokeSetter(float, [RuntimeObject coerceObjectToDouble:value]);
+      break;
+    case 'd':
+      InvokeSetter(double, [RuntimeObject coerceObjectToDouble:value]);
+      break;
+  }
+}
+
+#undef InvokeSetter
+
+@end
+
+static NSUInteger HashJSString(JSStringRef str) {
+  const JSChar *chars = JSStringGetCharactersPtr(str);
+  size_t length = JSStringGetLength(str);
+  NSUInteger hash = 2166136261U;
+  
+  for (size_t i = 0; i < length; ++i)
+    hash = (hash ^ chars[i]) * 16777619U;
+  
+  return hash;
+}
+
+// YES if |class| has its own implementation of |selector|, rather than the
+// one from RuntimeObject
+static BOOL OverridesRuntimeObject(Class class, SEL selector) {
+  return [class instanceMethodForSelector:selector] != [RuntimeObject instanceMethodForSelector:selector];
+}
+
+@implementation RuntimePropertyTable
+- (id)initWithClass:(Class)class {
+  if ((self = [super init])) {
+    NSSet *names = [class properties];
+    NSSet *readOnly = [class readOnlyProperties];
+    NSMutableArray *properties = [NSMutableArray arrayWithCapacity:[names count]];
+    NSEnumerator *e = [names objectEnumerator];
+    NSString *name;
+    
+    customGetter_ = OverridesRuntimeObject(class, @selector(valueForProperty:));
+    customSetter_ = OverridesRuntimeObject(class, @selector(setValue:forProperty:));
+    
+    // Classes that implement KVC themselves (e.g., Color) get their values
+    // through it rather than through accessors
+    BOOL useAccessors = !OverridesRuntimeObject(class, @selector(valueForKey:)) &&
+      !OverridesRuntimeObject(class, @selector(setValue:forKey:));
+    
+    while ((name = [e nextObject])) {
+      RuntimeProperty *property = [[RuntimeProperty alloc] initWithName:name class:class
+                                                               readOnly:[readOnly containsObject:name]
+                                                           useAccessors:useAccessors];
+      [properties addObject:property];
+      [property release];
+    }
+    
+    properties_ = [properties copy];
+    
+    // Open addressing with at least half of the slots empty
+    NSUInteger count = [properties_ count];
+    NSUInteger size = 4;
+    
+    while (size < count * 2)
+      size *= 2;
+    
+    mask_ = size - 1;
+    slots_ = (NSUInteger *)calloc(size, sizeof(NSUInteger));
+    
+    for (NSUInteger i = 0; i < count; ++i) {
+      RuntimeProperty *property = [properties_ objectAtIndex:i];
+      NSUInteger slot = HashJSString(property->jsName_) & mask_;
+      
+      while (slots_[slot])
+        slot = (slot + 1) & mask_;
+      
+      slots_[slot] = i + 1;
+    }
+  }
+  
+  return self;
+}
+
+- (void)dealloc {
+  free(slots_);
+  [properties_ release];
+  [super dealloc];
+}
+
+- (RuntimeProperty *)propertyForName:(JSStringRef)name {
+  NSUInteger slot = HashJSString(name) & mask_;
+  
+  while (slots_[slot]) {
+    RuntimeProperty *property = [properties_ objectAtIndex:slots_[slot] - 1];
+    
+    if (JSStringIsEqual(property->jsName_, name))
+      return property;
+    
+    slot = (slot + 1) & mask_;
+  }
+  
+  return nil;
+}
+
+@end
+
 @implementation Runtime
 #pragma mark -
 #pragma mark || JS Binding Functions ||
@@ -56,7 +461,7 @@ static JSObjectRef Constructor(JSContextRef ctx, JSObjectRef constructor,
   
   // Insert any of the functions
   JSObjectRef protoObj = (JSObjectRef)JSObjectGetPrototype(ctx, jsObj);
-  [runtime updateObjectPrototype:protoObj forMethods:[class methods]];
+  [runtime updateObjectPrototype:protoObj forClass:class];
   
   [pool release];
   
@@ -72,24 +477,45 @@ JSValueRef GetProperty(JSContextRef ctx, JSObjectRef object,
                        JSStringRef propertyName, JSValueRef *exception) {
   RuntimeObject *runtimeObj = JSObjectGetPrivate(object);
   Runtime *runtime = RuntimeFromContext(ctx);
-  NSString *propertyStr = (NSString *)JSStringCopyCFString(NULL, propertyName);
-  id propertyObj = [runtimeObj valueForProperty:propertyStr];
-  JSValueRef result = [runtime convertObject:propertyObj context:ctx];
-  [propertyStr release];
+  RuntimePropertyTable *table = [runtime propertyTableForClass:[runtimeObj class]];
+  RuntimeProperty *property = [table propertyForName:propertyName];
+  id propertyObj;
   
-  return result;
+  if (!property) {
+    NSString *propertyStr = (NSString *)JSStringCopyCFString(NULL, propertyName);
+    propertyObj = [runtimeObj valueForProperty:propertyStr];
+    [propertyStr release];
+  } else if (table->customGetter_) {
+    propertyObj = [runtimeObj valueForProperty:property->name_];
+  } else {
+    propertyObj = [property valueForObject:runtimeObj];
+  }
+  
+  return [runtime convertObject:propertyObj context:ctx];
 }
 
 bool SetProperty(JSContextRef ctx, JSObjectRef object, JSStringRef propertyName, 
                  JSValueRef value, JSValueRef *exception) {
   RuntimeObject *runtimeObj = JSObjectGetPrivate(object);
   Runtime *runtime = RuntimeFromContext(ctx);
-  NSString *propertyStr = (NSString *)JSStringCopyCFString(NULL, propertyName); 
+  RuntimePropertyTable *table = [runtime propertyTableForClass:[runtimeObj class]];
+  RuntimeProperty *property = [table propertyForName:propertyName];
   NSAutoreleasePool *pool = [[NSAutoreleasePool alloc] init];
   id objCValue = [runtime convertJSValue:value exception:exception context:ctx];
-  [runtimeObj setValue:objCValue forProperty:propertyStr];
+  
+  if (!property) {
+    NSString *propertyStr = (NSString *)JSStringCopyCFString(NULL, propertyName); 
+    [runtimeObj setValue:objCValue forProperty:propertyStr];
+    [propertyStr release];
+  } else if (table->customSetter_) {
+    [runtimeObj setValue:objCValue forProperty:property->name_];
+  } else if (property->readOnly_) {
+    [runtimeObj setException:[NSString stringWithFormat:@"Read-only property: %@", property->name_]];
+  } else {
+    [property setValue:objCValue forObject:runtimeObj];
+  }
+  
   [pool release];
-  [propertyStr release];
   
   return true;
 }
@@ -99,80 +525,32 @@ static JSValueRef CallAsFunction(JSContextRef ctx, JSObjectRef function, JSObjec
   NSAutoreleasePool *pool = [[NSAutoreleasePool alloc] init];
   RuntimeObject *runtimeObj = JSObjectGetPrivate(object);
   Runtime *runtime = RuntimeFromContext(ctx);
-  NSString *methodName = [runtime methodNameForFunction:function];
-  SEL methodSel = NSSelectorFromString(methodName);
+  RuntimeMethod *method = [runtime methodForFunction:function];
   id result = nil;
   
-  // Check if this needs a ":" to indicate that it takes some more args
-  if (![runtimeObj respondsToSelector:methodSel]) {
-    methodName = [methodName stringByAppendingString:@":"];
-    methodSel = NSSelectorFromString(methodName);
-    
-    // Change the name in the runtime if this one works
-    if ([runtimeObj respondsToSelector:methodSel])
-      [runtime setMethodName:methodName forFunction:function];
-    else
-      methodSel = NULL;
-  }
-  
-  if (methodSel) {
-    NSArray *args = [runtime convertJSArguments:arguments count:count exception:exception context:ctx];
-    NSMethodSignature *methodSig = [runtimeObj methodSignatureForSelector:methodSel];
-    int returnLength = [methodSig methodReturnLength];
-    NSInvocation *invocation = [NSInvocation invocationWithMethodSignature:methodSig];
-    
-    [invocation setTarget:runtimeObj];
-    [invocation setSelector:methodSel];
-    
-    if (([methodSig numberOfArguments] > 2) && args)
-      [invocation setArgument:&args atIndex:2];
-    
-    [invocation invoke];
-    
-    if (returnLength) {
-      const char *returnType = [methodSig methodReturnType];
-      if (strlen(returnType)) {
-        char type = returnType[0];
-        int returnInt = 0;
-        unsigned int returnUnsignedInt = 0;
-        float returnFloat = 0.0;
-        double returnDouble = 0.0;
-        switch (type) {
-          case 'c':
-          case 'i':
-          case 's':
-          case 'l':
-            [invocation getReturnValue:&returnInt];
-            result = [NSNumber numberWithInt:returnInt];
-            break;
-          case 'C':
-          case 'I':
-          case 'S':
-          case 'L':
-            [invocation getReturnValue:&returnUnsignedInt];
-            result = [NSNumber numberWithUnsignedInt:returnInt];
-            break;
-          case 'd':
-            [invocation getReturnValue:&returnDouble];
-            result = [NSNumber numberWithDouble:returnDouble];
-            break;
-          case 'f':
-            [invocation getReturnValue:&returnFloat];
-            result = [NSNumber numberWithDouble:returnFloat];
-            break;
-          case '@':
-            [invocation getReturnValue:&result];
-            break;
-          default:
-            MethodLog("Unexpected return type (%s) from %@", returnType, methodName);
-            result = nil;
-        }
+  if (method && method->selector_) {
+    NSArray *args = nil;
+    
+    if (method->takesArguments_)
+      args = [runtime convertJSArguments:arguments count:count exception:exception context:ctx];
+    
+    // Don't call through with arguments that couldn't be converted.  A method
+    // that fails reports it to the script with -setException:.
+    if (!exception || !*exception) {
+      BOOL reportsErrors = [runtimeObj isKindOfClass:[RuntimeObject class]];
+      
+      if (reportsErrors)
+        [runtimeObj setException:nil];
+      
+      result = [method invokeWithObject:runtimeObj arguments:args];
+      
+      if (reportsErrors && [runtimeObj exception]) {
+        SetException(ctx, [runtimeObj exception], exception);
+        [runtimeObj setException:nil];
       }
-    } else {
-      result = nil;
     }
   } else {
-    NSLog(@"%@ doesn't respond to %@ method", NSStringFromClass([runtimeObj class]), methodName);
+    NSLog(@"%@ doesn't respond to %@ method", NSStringFromClass([runtimeObj class]), method ? method->name_ : nil);
   }
   
   JSValueRef returnRef = [runtime convertObject:result context:ctx];
@@ -248,26 +626,11 @@ static JSValueRef LogFn(JSContextRef ctx, JSObjectRef function, JSObjectRef this
         if (JSObjectIsFunction(context, objRef)) {
           // Try function
           obj = [[[Function alloc] initWithJSFunction:objRef runtime:self] autorelease];
+        } else if (JSValueIsInstanceOfConstructor(context, value, arrayConstructor_, NULL)) {
+          obj = [self convertJSArray:objRef exception:exception context:context];
         } else {
-          // Try to convert array to NSArray
-          JSStringRef array = JSStringCreateWithUTF8CString("Array");
-          JSObjectRef arrayConstructor = JSValueToObject(context, JSObjectGetProperty(context, global_, array, NULL), NULL);
-          JSStringRelease(array);
-          
-          if (JSValueIsInstanceOfConstructor(context, value, arrayConstructor, NULL)) {
-            JSValueRef val;
-            obj = [NSMutableArray array];
-            
-            for (int i = 0; i < INT_MAX; ++i) {
-              val = JSObjectGetPropertyAtIndex(context, objRef, i, NULL);
-              if (JSValueIsUndefined(context, val))
-                break;
-              id valObj = [self convertJSValue:val exception:exception context:context];
-              if (valObj)
-                [obj addObject:valObj];
-            }
-          }
-        } 
+          obj = [self convertJSTypedArray:objRef exception:exception context:context];
+        }
         
         if (!obj)
           obj = [NSString stringWithFormat:@"[Object %p]", objRef];
@@ -294,14 +657,21 @@ static JSValueRef LogFn(JSContextRef ctx, JSObjectRef function, JSObjectRef this
     JSStringRef str = JSStringCreateWithCFString((CFStringRef)object);
     value = JSValueMakeString(context, str);
     JSStringRelease(str);
+  } else if ([object isKindOfClass:[NumberArray class]]) {
+    JSValueRef exception;
+    JSObjectRef array = JSObjectCallAsConstructor(context, arrayConstructor_, 0, nil, &exception);
+    if (array) {
+      const double *values = [object values];
+      int count = [object count];
+      for (int i = 0; i < count; ++i)
+        JSObjectSetPropertyAtIndex(context, array, i, JSValueMakeNumber(context, values[i]), &exception);
+      
+      value = array;
+    }
   } else if ([object isKindOfClass:[NSArray class]]) {
     NSAutoreleasePool *pool = [[NSAutoreleasePool alloc] init];
-    JSStringRef arrayStr = JSStringCreateWithUTF8CString("Array");
-    JSObjectRef arrayConstructor = JSValueToObject(context, JSObjectGetProperty(context, global_, arrayStr, NULL), NULL);
-    JSStringRelease(arrayStr);
-
     JSValueRef exception;
-    JSObjectRef array = JSObjectCallAsConstructor(context, arrayConstructor, 0, nil, &exception);
+    JSObjectRef array = JSObjectCallAsConstructor(context, arrayConstructor_, 0, nil, &exception);
     if (array) {
       int count = [object count];
       for (int i = 0; i < count; ++i) {
@@ -323,7 +693,7 @@ static JSValueRef LogFn(JSContextRef ctx, JSObjectRef function, JSObjectRef this
       // probably be refactored.
       JSObjectRef jsObj = JSObjectMake(context, jsClass, object);
       JSObjectRef protoObj = (JSObjectRef)JSObjectGetPrototype(context, jsObj);
-      [self updateObjectPrototype:protoObj forMethods:[class methods]];
+      [self updateObjectPrototype:protoObj forClass:class];
 
       // The object should be on an autorelease pool or retained privately.
       // When the JS object is finalized, it will release this object, so we
@@ -339,18 +709,141 @@ static JSValueRef LogFn(JSContextRef ctx, JSObjectRef function, JSObjectRef this
 
 - (NSArray *)convertJSArguments:(const JSValueRef *)arguments count:(size_t)count 
                       exception:(JSValueRef *)exception context:(JSContextRef)context {
-  NSMutableArray *array = [NSMutableArray array];
+  id stackObjects[kStackArgumentCount];
+  id *objects = stackObjects;
+  NSUInteger objectCount = 0;
+  
+  if (count > kStackArgumentCount)
+    objects = (id *)malloc(sizeof(id) * count);
   
   for (int i = 0; i < count; ++i) {
     id obj = [self convertJSValue:arguments[i] exception:exception context:context];
     
     if (obj)
-      [array addObject:obj];
+      objects[objectCount++] = obj;
   }
   
+  NSArray *array = [NSArray arrayWithObjects:objects count:objectCount];
+  
+  if (objects != stackObjects)
+    free(objects);
+  
   return array;
 }
 
+- (NSArray *)convertJSArray:(JSObjectRef)array exception:(JSValueRef *)exception context:(JSContextRef)context {
+  JSValueRef lengthValue = JSObjectGetProperty(context, array, lengthString_, NULL);
+  NSUInteger length = (NSUInteger)JSValueToNumber(context, lengthValue, NULL);
+  
+  // The length is whatever the script set, so don't trust it with an
+  // allocation.  Convert up to the first undefined element instead.
+  if (length > kMaxPackedArrayLength) {
+    NSMutableArray *objects = [NSMutableArray array];
+    
+    for (NSUInteger i = 0; i < length; ++i) {
+      JSValueRef val = JSObjectGetPropertyAtIndex(context, array, i, NULL);
+      if (JSValueIsUndefined(context, val))
+        break;
+      id valObj = [self convertJSValue:val exception:exception context:context];
+      if (valObj)
+        [objects addObject:valObj];
+    }
+    
+    return objects;
+  }
+  
+  double *values = (double *)malloc(sizeof(double) * (length ? length : 1));
+  NSMutableArray *objects = nil;
+  
+  if (!values) {
+    SetOutOfMemoryException(context, length, exception);
+    return nil;
+  }
+  
+  // Arrays of numbers are kept as doubles.  Otherwise, any numbers converted so
+  // far are moved into an array of objects.
+  for (NSUInteger i = 0; i < length; ++i) {
+    JSValueRef val = JSObjectGetPropertyAtIndex(context, array, i, NULL);
+    
+    if (!objects) {
+      if (JSValueIsNumber(context, val)) {
+        values[i] = JSValueToNumber(context, val, NULL);
+        continue;
+      }
+      
+      objects = [NSMutableArray arrayWithCapacity:length];
+      for (NSUInteger j = 0; j < i; ++j)
+        [objects addObject:[NSNumber numberWithDouble:values[j]]];
+    }
+    
+    id valObj = [self convertJSValue:val exception:exception context:context];
+    if (valObj)
+      [objects addObject:valObj];
+  }
+  
+  if (objects) {
+    free(values);
+    return objects;
+  }
+  
+  return [[[NumberArray alloc] initWithValuesNoCopy:values count:length] autorelease];
+}
+
+- (NSArray *)convertJSTypedArray:(JSObjectRef)array exception:(JSValueRef *)exception context:(JSContextRef)context {
+#ifdef JSTypedArray_h
+  // Typed arrays are only available in newer versions of JavaScriptCore
+  if (!JSValueGetTypedArrayType)
+    return nil;
+  
+  JSTypedArrayType type = JSValueGetTypedArrayType(context, array, NULL);
+  
+  if (type == kJSTypedArrayTypeNone || type == kJSTypedArrayTypeArrayBuffer)
+    return nil;
+  
+  // Copy the elements straight out of the backing store
+  JSObjectRef buffer = JSObjectGetTypedArrayBuffer(context, array, NULL);
+  const char *bytes = (const char *)JSObjectGetArrayBufferBytesPtr(context, buffer, NULL);
+  size_t length = JSObjectGetTypedArrayLength(context, array, NULL);
+  
+  if (!bytes)
+    return nil;
+  
+  double *values = (double *)malloc(sizeof(double) * (length ? length : 1));
+  
+  if (!values) {
+    SetOutOfMemoryException(context, length, exception);
+    return nil;
+  }
+  
+  bytes += JSObjectGetTypedArrayByteOffset(context, array, NULL);
+  
+#define CopyTypedValues(type) \
+  for (size_t i = 0; i < length; ++i) \
+    values[i] = ((const type *)bytes)[i]
+  
+  switch (type) {
+    case kJSTypedArrayTypeInt8Array: CopyTypedValues(int8_t); break;
+    case kJSTypedArrayTypeInt16Array: CopyTypedValues(int16_t); break;
+    case kJSTypedArrayTypeInt32Array: CopyTypedValues(int32_t); break;
+    case kJSTypedArrayTypeUint8Array: 
+    case kJSTypedArrayTypeUint8ClampedArray: CopyTypedValues(uint8_t); break;
+    case kJSTypedArrayTypeUint16Array: CopyTypedValues(uint16_t); break;
+    case kJSTypedArrayTypeUint32Array: CopyTypedValues(uint32_t); break;
+    case kJSTypedArrayTypeFloat32Array: CopyTypedValues(float); break;
+    case kJSTypedArrayTypeFloat64Array: CopyTypedValues(double); break;
+    default:
+      free(values);
+      return nil;
+  }
+  
+#undef CopyTypedValues
+  
+  return [[[NumberArray alloc] initWithValuesNoCopy:values count:length] autorelease];
+#else
+  return nil;
+#endif
+}
+
 - (NSArray *)propertyNamesForObject:(JSObjectRef)object 
                           exception:(JSValueRef *)exception
                             context:(JSContextRef)context {
@@ -403,33 +896,23 @@ static JSValueRef LogFn(JSContextRef ctx, JSObjectRef function, JSObjectRef this
 }
 
 - (JSClassRef)registeredJSClassForClass:(Class)class {
-  NSMapEnumerator e = NSEnumerateMapTable(classMap_);
-  JSClassRef jsClass;
-  Class foundClass;
-  while (NSNextMapEnumeratorPair(&e, (void *)&jsClass, (void *)&foundClass)) {
-    if (foundClass == class) {
-      NSEndMapTableEnumeration(&e);
-      return jsClass;
-    }
-  }
-  
-  NSEndMapTableEnumeration(&e);
-  return NULL;
+  return NSMapGet(jsClassMap_, class);
 }
 
-- (NSString *)methodNameForFunction:(JSObjectRef)function {
-  return NSMapGet(methodMap_, function);
+- (RuntimePropertyTable *)propertyTableForClass:(Class)class {
+  return NSMapGet(propertyTableMap_, class);
 }
 
-- (void)setMethodName:(NSString *)name forFunction:(JSObjectRef)function {
-  NSMapInsert(methodMap_, function, name);
+- (RuntimeMethod *)methodForFunction:(JSObjectRef)function {
+  return NSMapGet(methodMap_, function);
 }
 
-- (void)updateObjectPrototype:(JSObjectRef)protoObj forMethods:(NSSet *)methods {
+- (void)updateObjectPrototype:(JSObjectRef)protoObj forClass:(Class)class {
   // If this isn't an object or we've already updated the prototype
   if (!JSValueIsObject(globalContext_, protoObj) || NSHashGet(prototypeUpdated_, protoObj))
     return;
   
+  NSSet *methods = [class methods];
   JSPropertyNameArrayRef propertyArray = JSObjectCopyPropertyNames(globalContext_, protoObj);
   int count = JSPropertyNameArrayGetCount(propertyArray);
 
@@ -440,7 +923,9 @@ static JSValueRef LogFn(JSContextRef ctx, JSObjectRef function, JSObjectRef this
     // If this is one of our known methods, add the object to our table
     if ([methods containsObject:methodStr]) {
       JSObjectRef methodObj = (JSObjectRef)JSObjectGetProperty(globalContext_, protoObj, methodRef, NULL);
-      NSMapInsertKnownAbsent(methodMap_, methodObj, [methods member:methodStr]);
+      RuntimeMethod *method = [[RuntimeMethod alloc] initWithName:methodStr class:class];
+      NSMapInsertKnownAbsent(methodMap_, methodObj, method);
+      [method release];
     }
       
     [methodStr release];
@@ -470,11 +955,11 @@ static void CopyStringToCString(NSString *str, char **cStr) {
     valuePtr->attributes = kJSPropertyAttributeDontDelete;
     
     // Keep track of the name for later cleanup
-    NSHashInsertKnownAbsent(staticClassElements_, valuePtr->name);
+    NSHashInsertKnownAbsent(sStaticClassElements, valuePtr->name);
     ++valuePtr;
   }
 
-  NSHashInsertKnownAbsent(staticClassElements_, values);
+  NSHashInsertKnownAbsent(sStaticClassElements, values);
   
   return values;
 }
@@ -491,41 +976,98 @@ static void CopyStringToCString(NSString *str, char **cStr) {
     functionPtr->attributes = kJSPropertyAttributeDontDelete | kJSPropertyAttributeReadOnly;
     
     // Keep track of the name for later cleanup
-    NSHashInsertKnownAbsent(staticClassElements_, functionPtr->name);
+    NSHashInsertKnownAbsent(sStaticClassElements, functionPtr->name);
     ++functionPtr;
   }
 
-  NSHashInsertKnownAbsent(staticClassElements_, functions);
+  NSHashInsertKnownAbsent(sStaticClassElements, functions);
   
   return functions;  
 }
 
+- (JSClassRef)sharedJSClassForClass:(Class)objCClass propertyTable:(RuntimePropertyTable **)propertyTable {
+  JSClassRef jsClass;
+  
+  @synchronized([Runtime class]) {
+    if (!sJSClasses) {
+      sJSClasses = NSCreateMapTable(NSNonOwnedPointerMapKeyCallBacks, NSNonOwnedPointerMapValueCallBacks, 0);
+      sPropertyTables = NSCreateMapTable(NSNonOwnedPointerMapKeyCallBacks, NSObjectMapValueCallBacks, 0);
+      
+      // Container for static values & functions for defined classes
+      sStaticClassElements = NSCreateHashTable(NSOwnedPointerHashCallBacks, 0);
+    }
+    
+    jsClass = NSMapGet(sJSClasses, objCClass);
+    
+    if (!jsClass) {
+      JSClassDefinition def = kJSClassDefinitionEmpty;
+      const char *classNameChars = [[objCClass className] UTF8String];
+      int len = strlen(classNameChars) + 1;
+      
+      // Create the JS class
+      def.className = malloc(len);
+      strlcpy((char *)def.className, classNameChars, len);
+      def.staticValues = [self staticValuesForClass:objCClass];
+      def.staticFunctions = [self staticFunctionsForClass:objCClass];
+      def.finalize = Finalize;
+      def.callAsFunction = CallAsFunction;
+      def.convertToType = ConvertToType;
+      jsClass = JSClassCreate(&def);
+      NSHashInsertKnownAbsent(sStaticClassElements, def.className);
+      NSMapInsertKnownAbsent(sJSClasses, objCClass, jsClass);
+      
+      RuntimePropertyTable *table = [[RuntimePropertyTable alloc] initWithClass:objCClass];
+      NSMapInsertKnownAbsent(sPropertyTables, objCClass, table);
+      [table release];
+    }
+    
+    *propertyTable = NSMapGet(sPropertyTables, objCClass);
+  }
+  
+  return jsClass;
+}
+
 #pragma mark -
 #pragma mark || Public ||
 
 - (id)initWithName:(NSString *)name {
   if ((self = [super init])) {
     // We'll have an "empty" global object
-    JSClassDefinition def = kJSClassDefinitionEmpty;
-    JSClassRef globalRef = JSClassCreate(&def);
+    @synchronized([Runtime class]) {
+      if (!sGlobalClass) {
+        JSClassDefinition def = kJSClassDefinitionEmpty;
+        sGlobalClass = JSClassCreate(&def);
+        sContextGroup = JSContextGroupCreate();
+      }
+    }
     
     // Create the context with our global object
-    globalContext_ = JSGlobalContextCreate(globalRef);
+    globalContext_ = JSGlobalContextCreateInGroup(sContextGroup, sGlobalClass);
     global_ = JSContextGetGlobalObject(globalContext_);
     JSObjectSetPrivate(global_, self);
     
+    // Cache the Array constructor for converting arrays
+    JSStringRef arrayStr = JSStringCreateWithUTF8CString("Array");
+    arrayConstructor_ = JSValueToObject(globalContext_, JSObjectGetProperty(globalContext_, global_, arrayStr, NULL), NULL);
+    JSValueProtect(globalContext_, arrayConstructor_);
+    JSStringRelease(arrayStr);
+    lengthString_ = JSStringCreateWithUTF8CString("length");
+    
     // Map from JSClassRef to ObjC Class
     classMap_ = NSCreateMapTable(NSNonOwnedPointerMapKeyCallBacks, NSNonRetainedObjectMapValueCallBacks, 0);
     
+    // Map from ObjC Class to JSClassRef
+    jsClassMap_ = NSCreateMapTable(NSNonOwnedPointerMapKeyCallBacks, NSNonOwnedPointerMapValueCallBacks, 0);
+    
+    // Map from ObjC Class to RuntimePropertyTable
+    propertyTableMap_ = NSCreateMapTable(NSNonOwnedPointerMapKeyCallBacks, NSObjectMapValueCallBacks, 0);
+    
     // Map from constructor (JSObjectRef) to JSClassRef
     constructorMap_ = NSCreateMapTable(NSNonOwnedPointerMapKeyCallBacks, NSNonOwnedPointerMapValueCallBacks, 0);
     
-    // Map from function (JSObjectRef) to NSString method name
+    // Map from function (JSObjectRef) to RuntimeMethod
     methodMap_ = NSCreateMapTable(NSNonOwnedPointerMapKeyCallBacks, NSObjectMapValueCallBacks, 0); 
     
-    // Container for static values & functions for defined classes
-    staticClassElements_ = NSCreateHashTable(NSOwnedPointerHashCallBacks, 0);
-    
     // Container for JSObjectRef that are prototypes that we've updated the
     // functions to have the strings set as private data
     prototypeUpdated_ = NSCreateHashTable(NSNonOwnedPointerHashCallBacks, 0);
@@ -546,23 +1088,17 @@ static void CopyStringToCString(NSString *str, char **cStr) {
 - (void)dealloc {
   // This seems a bit strange, as you'd expect the release to invalidate the
   // context.  However, the documentation (and when running), it seems to work.
+  JSValueUnprotect(globalContext_, arrayConstructor_);
+  JSStringRelease(lengthString_);
   JSGarbageCollect(globalContext_);
   JSGlobalContextRelease(globalContext_);
 
-  // Release the created JSClassRef objects that we allocated
-  NSMapEnumerator e = NSEnumerateMapTable(classMap_);
-  void *key, *value;
-  while ((NSNextMapEnumeratorPair(&e, &key, &value))) {
-    JSClassRelease((JSClassRef)key);
-  }
-  
-  NSEndMapTableEnumeration(&e);
-  
-  // Cleanup the mapping/hash tables
+  // The JSClassRefs are shared, so only cleanup the mapping/hash tables
   NSFreeMapTable(classMap_);
+  NSFreeMapTable(jsClassMap_);
+  NSFreeMapTable(propertyTableMap_);
   NSFreeMapTable(constructorMap_);
   NSFreeMapTable(methodMap_);  
-  NSFreeHashTable(staticClassElements_);
   NSFreeHashTable(prototypeUpdated_);
   
   [name_ release];
@@ -579,21 +1115,9 @@ static void CopyStringToCString(NSString *str, char **cStr) {
 
 - (BOOL)registerClass:(Class)objCClass {
   BOOL result = NO;  
-  JSClassRef jsClass;
-  JSClassDefinition def = kJSClassDefinitionEmpty;
   NSString *classNameForJS = [objCClass className];
-  const char *classNameChars = [classNameForJS UTF8String];
-  int len = strlen(classNameChars) + 1;
-  
-  // Create the JS class
-  def.className = malloc(len);
-  strlcpy((char *)def.className, classNameChars, len);
-  def.staticValues = [self staticValuesForClass:objCClass];
-  def.staticFunctions = [self staticFunctionsForClass:objCClass];
-  def.finalize = Finalize;
-  def.callAsFunction = CallAsFunction;
-  def.convertToType = ConvertToType;
-  jsClass = JSClassCreate(&def);
+  RuntimePropertyTable *propertyTable;
+  JSClassRef jsClass = [self sharedJSClassForClass:objCClass propertyTable:&propertyTable];
   
   // Create a constructor for it and attach it to the global object
   JSObjectRef constructor = JSObjectMakeConstructor(globalContext_, jsClass, Constructor);
@@ -607,8 +1131,9 @@ static void CopyStringToCString(NSString *str, char **cStr) {
     NSLog(@"Exception when registering %@", NSStringFromClass(objCClass));
   
   NSMapInsertKnownAbsent(classMap_, jsClass, objCClass);
+  NSMapInsertKnownAbsent(jsClassMap_, objCClass, jsClass);
+  NSMapInsertKnownAbsent(propertyTableMap_, objCClass, propertyTable);
   NSMapInsertKnownAbsent(constructorMap_, constructor, jsClass);
-  NSHashInsertKnownAbsent(staticClassElements_, def.className);
 
   return result;
 }
@@ -631,7 +1156,7 @@ static void CopyStringToCString(NSString *str, char **cStr) {
   
   // Insert any of the functions
   JSObjectRef protoObj = (JSObjectRef)JSObjectGetPrototype(globalContext_, jsObj);
-  [self updateObjectPrototype:protoObj forMethods:[class methods]];
+  [self updateObjectPrototype:protoObj forClass:class];
   
   // Add the object to the global object
   JSStringRef jsName = JSStringCreateWithCFString((CFStringRef)name);
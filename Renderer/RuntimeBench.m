@@ -0,0 +1,107 @@
+// Copyright 2008 Google Inc.
+//
+// Licensed under the Apache License, Version 2.0 (the "License"); you may not
+// use this file except in compliance with the License.  You may obtain a copy
+// of the License at
+//
+// http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS, WITHOUT
+// WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.  See the
+// License for the specific language governing permissions and limitations under
+// the License.
+
+// Standalone microbenchmark for calls from JavaScript into RuntimeObjects:
+// property gets and sets (RuntimePropertyTable), method calls (RuntimeMethod)
+// and construction, reported in nanoseconds per operation with the cost of an
+// empty loop taken out.  It only uses the Runtime API that predates those
+// tables, so building it against an older tree (without NumberArray.m)
+// reproduces the comparison.  It isn't part of the Xcode targets; build it on
+// Mac OS X with:
+//
+//   cc -O2 -include Renderer_Prefix.pch -framework Cocoa -framework JavaScriptCore
+//     -o RuntimeBench RuntimeBench.m Runtime.m RuntimeObject.m Function.m NumberArray.m
+//     PointObject.m
+//
+// Usage: RuntimeBench [iterations]
+
+#import "PointObject.h"
+#import "Runtime.h"
+
+typedef struct {
+  NSString *name;
+  NSString *body;         // Run |iterations| times with i as the counter
+} BenchCase;
+
+static BenchCase kCases[] = {
+  { @"empty loop", @"" },
+  { @"property get", @"s += p.x;" },
+  { @"property set", @"p.x = i;" },
+  { @"method, 1 argument", @"s += p.distance(q);" },
+  { @"method, toString", @"t = p.toString();" },
+  { @"constructor", @"t = new Point(i, 2);" },
+};
+
+//------------------------------------------------------------------------------
+// Best of three runs, in seconds
+static double Time(Runtime *runtime, NSString *body, long iterations) {
+  NSString *script = [NSString stringWithFormat:
+                      @"(function() { var p = new Point(3, 4), q = new Point(1, 1), s = 0, t;"
+                      @"for (var i = 0; i < %ld; ++i) { %@ } return s; })();", iterations, body];
+  double best = 0;
+  
+  for (int run = 0; run < 3; ++run) {
+    NSAutoreleasePool *pool = [[NSAutoreleasePool alloc] init];
+    NSException *exception = nil;
+    CFAbsoluteTime start = CFAbsoluteTimeGetCurrent();
+    
+    // The result doesn't report success, so check the exception
+    [runtime evaluateScript:script exception:&exception];
+    
+    if (exception) {
+      fprintf(stderr, "%s: %s\n", [body UTF8String], [[exception description] UTF8String]);
+      exit(1);
+    }
+    
+    double elapsed = CFAbsoluteTimeGetCurrent() - start;
+    
+    if (!run || elapsed < best)
+      best = elapsed;
+    
+    [pool release];
+  }
+  
+  return best;
+}
+
+//------------------------------------------------------------------------------
+int main(int argc, const char *argv[]) {
+  NSAutoreleasePool *pool = [[NSAutoreleasePool alloc] init];
+  long iterations = argc > 1 ? strtol(argv[1], NULL, 10) : 200000;
+  Runtime *runtime = [[Runtime alloc] initWithName:@"RuntimeBench"];
+  double empty = 0;
+  
+  if (iterations < 1)
+    iterations = 1;
+  
+  [runtime registerClass:[PointObject class]];
+  printf("%ld iterations, best of 3\n", iterations);
+  
+  for (size_t i = 0; i < sizeof(kCases) / sizeof(kCases[0]); ++i) {
+    double seconds = Time(runtime, kCases[i].body, iterations);
+    
+    if (!i) {
+      empty = seconds;
+      printf("%-20s %8.1f ns\n", [kCases[i].name UTF8String], seconds / iterations * 1e9);
+    } else {
+      printf("%-20s %8.1f ns/op\n", [kCases[i].name UTF8String], 
+             (seconds - empty) / iterations * 1e9);
+    }
+  }
+  
+  [runtime release];
+  [pool release];
+  
+  return 0;
+}
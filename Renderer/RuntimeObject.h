@@ -48,8 +48,16 @@
 }
 
 + (NSInteger)coerceObjectToInteger:(id)obj;
++ (long long)coerceObjectToLongLong:(id)obj;
++ (unsigned long long)coerceObjectToUnsignedLongLong:(id)obj;
 + (double)coerceObjectToDouble:(id)obj;
 + (id)coerceObject:(id)object toClass:(Class)classType;
 + (id)coerceArray:(NSArray *)array objectAtIndex:(NSUInteger)index toClass:(Class)classType;
 
+// Return the values of |obj|, an array of numbers, as doubles and set |count|.
+// Arrays converted from JavaScript numbers are returned without copying;
+// other arrays are converted into an autoreleased buffer.  Returns NULL if
+// |obj| isn't an array.
++ (const double *)coerceObjectToDoubles:(id)obj count:(NSUInteger *)count;
+
 @end
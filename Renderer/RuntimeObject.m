@@ -12,11 +12,35 @@
 // License for the specific language governing permissions and limitations under
 // the License.
 
+#import "NumberArray.h"
 #import "RuntimeObject.h"
 
 @interface RuntimeObject(PrivateMethods)
++ (NSSet *)cachedProperties;
++ (NSSet *)cachedReadOnlyProperties;
 @end
 
+// Subclasses build their +properties and +readOnlyProperties sets each time
+// they're called, so keep them per class.  Properties are only accessed from
+// the main thread.
+static NSSet *CachedSet(NSMapTable **table, Class class, SEL selector) {
+  if (!*table)
+    *table = NSCreateMapTable(NSNonOwnedPointerMapKeyCallBacks, NSObjectMapValueCallBacks, 0);
+  
+  NSSet *set = NSMapGet(*table, class);
+  
+  if (!set) {
+    set = [class performSelector:selector];
+    
+    if (!set)
+      set = [NSSet set];
+    
+    NSMapInsertKnownAbsent(*table, class, set);
+  }
+  
+  return set;
+}
+
 @implementation RuntimeObject
 + (NSInteger)coerceObjectToInteger:(id)obj {
   if ([obj isMemberOfClass:[NSNumber class]])
@@ -28,6 +52,26 @@
   return 0;
 }
 
++ (long long)coerceObjectToLongLong:(id)obj {
+  if ([obj respondsToSelector:@selector(longLongValue)])
+    return [obj longLongValue];
+  
+  return 0;
+}
+
++ (unsigned long long)coerceObjectToUnsignedLongLong:(id)obj {
+  if (![obj respondsToSelector:@selector(longLongValue)])
+    return 0;
+  
+  // Negative values wrap around as they would in a C cast
+  long long value = [obj longLongValue];
+  
+  if (value < 0 || ![obj respondsToSelector:@selector(unsignedLongLongValue)])
+    return (unsigned long long)value;
+  
+  return [obj unsignedLongLongValue];
+}
+
 + (double)coerceObjectToDouble:(id)obj {
   if ([obj isMemberOfClass:[NSNumber class]])
     return [obj doubleValue];
@@ -58,6 +102,28 @@
   return result;
 }
 
++ (const double *)coerceObjectToDoubles:(id)obj count:(NSUInteger *)count {
+  *count = 0;
+  
+  if ([obj isKindOfClass:[NumberArray class]]) {
+    *count = [obj count];
+    return [obj values];
+  }
+  
+  if (![obj isKindOfClass:[NSArray class]])
+    return NULL;
+  
+  NSUInteger arrayCount = [obj count];
+  NSMutableData *data = [NSMutableData dataWithLength:sizeof(double) * arrayCount];
+  double *values = (double *)[data mutableBytes];
+  
+  for (NSUInteger i = 0; i < arrayCount; ++i)
+    values[i] = [self coerceObjectToDouble:[obj objectAtIndex:i]];
+  
+  *count = arrayCount;
+  return values;
+}
+
 + (NSString *)className {
   return @"RuntimeObject";
 }
@@ -74,6 +140,16 @@
   return nil;
 }
 
++ (NSSet *)cachedProperties {
+  static NSMapTable *sProperties = NULL;
+  return CachedSet(&sProperties, self, @selector(properties));
+}
+
++ (NSSet *)cachedReadOnlyProperties {
+  static NSMapTable *sReadOnlyProperties = NULL;
+  return CachedSet(&sReadOnlyProperties, self, @selector(readOnlyProperties));
+}
+
 - (id)initWithArguments:(NSArray *)arguments {
   if ((self = [super init])) {
   }
@@ -87,7 +163,7 @@
 }
 
 - (id)valueForProperty:(NSString *)property {
-  if ([[[self class] properties] containsObject:property])
+  if ([[[self class] cachedProperties] containsObject:property])
     return [self valueForKey:property];
   
   [self setException:[NSString stringWithFormat:@"Unknown property: %@", property]];
@@ -95,12 +171,14 @@
 }
 
 - (void)setValue:(id)value forProperty:(NSString *)property {
-  if ([[[self class] properties] containsObject:property]) {
+  if ([[[self class] cachedProperties] containsObject:property]) {
 
-    if (![[[self class] readOnlyProperties] containsObject:property])
+    if (![[[self class] cachedReadOnlyProperties] containsObject:property])
       [self setValue:value forKey:property];
     else
       [self setException:[NSString stringWithFormat:@"Read-only property: %@", property]];
+    
+    return;
   }
   
   [self setException:[NSString stringWithFormat:@"Unknown property: %@", property]];
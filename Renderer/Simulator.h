@@ -22,6 +22,7 @@
  @protected
   NSMutableArray *objects_;
   CGFloat timeStep_;
+  BOOL parallel_;
 }
 
 @end
@@ -15,6 +15,20 @@
 #import "Layer.h"
 #import "Simulator.h"
 #import "SimulatorObject.h"
+#import "WorkQueue.h"
+
+static void AdvanceObject(void *context, size_t index, int worker) {
+  NSAutoreleasePool *pool = [[NSAutoreleasePool alloc] init];
+  SimulatorObject **objects = (SimulatorObject **)context;
+
+  [objects[index] advanceStep];
+  [pool release];
+}
+
+@interface Simulator(PrivateMethods)
+- (void)runSeriallyFor:(CGFloat)time;
+- (void)runInParallelFor:(CGFloat)time;
+@end
 
 @implementation Simulator
 + (NSString *)className {
@@ -22,7 +36,7 @@
 }
 
 + (NSSet *)properties {
-  return [NSSet setWithObjects:@"timeStep", nil];
+  return [NSSet setWithObjects:@"timeStep", @"parallel", nil];
 }
 
 + (NSSet *)methods {
@@ -51,6 +65,14 @@
   return timeStep_;
 }
 
+- (void)setParallel:(BOOL)parallel {
+  parallel_ = parallel;
+}
+
+- (BOOL)parallel {
+  return parallel_;
+}
+
 - (void)addSimulatorObject:(NSArray *)arguments {
   if ([arguments count] == 1) {
     SimulatorObject *so = [RuntimeObject coerceObject:[arguments objectAtIndex:0] toClass:[SimulatorObject class]];
@@ -65,16 +87,68 @@
   if ([arguments count] == 2) {
     Layer *layer = [RuntimeObject coerceArray:arguments objectAtIndex:0 toClass:[Layer class]];
     CGFloat time = [RuntimeObject coerceObjectToDouble:[arguments objectAtIndex:1]];
-    CGFloat current = 0;
     
     [objects_ makeObjectsPerformSelector:@selector(setLayer:) withObject:layer];
     [objects_ makeObjectsPerformSelector:@selector(setTimeStep:) withObject:[NSNumber numberWithFloat:timeStep_]];
     
-    while (current < time) {
-      [objects_ makeObjectsPerformSelector:@selector(step)];
-      current += timeStep_;
+    if (parallel_)
+      [self runInParallelFor:time];
+    else
+      [self runSeriallyFor:time];
+
+    [objects_ makeObjectsPerformSelector:@selector(finish)];
+  }
+}
+
+- (void)runSeriallyFor:(CGFloat)time {
+  for (CGFloat current = 0; current < time; current += timeStep_)
+    [objects_ makeObjectsPerformSelector:@selector(step)];
+}
+
+// Only -advanceStep runs on the workers.  Everything that draws or uses a
+// Randomizer happens here, in the order the objects were added, so the
+// result doesn't depend on the number of threads.
+- (void)runInParallelFor:(CGFloat)time {
+  NSUInteger count = [objects_ count];
+  SimulatorObject **concurrent = (SimulatorObject **)malloc(sizeof(SimulatorObject *) * (count + 1));
+  NSUInteger concurrentCount = 0;
+
+  for (NSUInteger i = 0; i < count; ++i) {
+    SimulatorObject *so = [objects_ objectAtIndex:i];
+
+    if ([so canStepConcurrently])
+      concurrent[concurrentCount++] = so;
+  }
+
+  if (concurrentCount < 2) {
+    free(concurrent);
+    [self runSeriallyFor:time];
+    return;
+  }
+
+  // Make sure that Cocoa knows it has to be thread-safe
+  if (![NSThread isMultiThreaded])
+    [NSThread detachNewThreadSelector:@selector(self) toTarget:[NSObject class] withObject:nil];
+
+  WorkQueue *queue = WorkQueueGetShared();
+
+  for (CGFloat current = 0; current < time; current += timeStep_) {
+    for (NSUInteger i = 0; i < concurrentCount; ++i)
+      [concurrent[i] beginStep];
+
+    WorkQueueApply(queue, concurrentCount, AdvanceObject, concurrent);
+
+    for (NSUInteger i = 0; i < count; ++i) {
+      SimulatorObject *so = [objects_ objectAtIndex:i];
+
+      if ([so canStepConcurrently])
+        [so endStep];
+      else
+        [so step];
     }
   }
+
+  free(concurrent);
 }
 
 - (NSString *)toString {
@@ -27,4 +27,18 @@
 - (void)setTimeStep:(NSNumber *)step;
 - (void)step;
 
+// A step in three parts, so that the Simulator can run the middle part of
+// several objects at once.  -beginStep and -endStep are always called on the
+// Simulator's thread, in the order the objects were added.  -advanceStep may
+// run on another thread, alongside other objects' -advanceStep; it must not
+// draw, use Randomizers or touch anything shared with other objects.  The
+// default -step calls all three.
+- (BOOL)canStepConcurrently;
+- (void)beginStep;
+- (void)advanceStep;
+- (void)endStep;
+
+// Called when the simulation has run its course
+- (void)finish;
+
 @end
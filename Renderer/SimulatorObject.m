@@ -30,6 +30,28 @@
 }
 
 - (void)step {
+  [self beginStep];
+  [self advanceStep];
+  [self endStep];
+}
+
+- (BOOL)canStepConcurrently {
+  return NO;
+}
+
+- (void)beginStep {
+  // Default is to do nothing
+}
+
+- (void)advanceStep {
+  // Default is to do nothing
+}
+
+- (void)endStep {
+  // Default is to do nothing
+}
+
+- (void)finish {
   // Default is to do nothing
 }
 
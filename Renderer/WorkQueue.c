@@ -0,0 +1,295 @@
+// Copyright 2008 Google Inc.
+//
+// Licensed under the Apache License, Version 2.0 (the "License"); you may not
+// use this file except in compliance with the License.  You may obtain a copy
+// of the License at
+//
+// http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS, WITHOUT
+// WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.  See the
+// License for the specific language governing permissions and limitations under
+// the License.
+
+#include <pthread.h>
+#include <stdlib.h>
+#include <unistd.h>
+
+#include "WorkQueue.h"
+
+#define kMaxWorkers 64
+
+// The range of task indexes that a worker still has to run.  The owner takes
+// from the front and thieves take from the back.
+typedef struct {
+  pthread_mutex_t lock;
+  size_t begin;
+  size_t end;
+} WorkRange;
+
+struct WorkQueue {
+  int threadCount;
+  pthread_t *threads;
+  WorkRange *ranges;
+
+  pthread_mutex_t lock;
+  pthread_cond_t workAvailable;
+  pthread_cond_t workDone;
+  unsigned long generation;
+  int busy;
+  int shuttingDown;
+
+  // The current job; only valid while |busy|
+  WorkQueueFunction function;
+  void *context;
+  size_t count;
+  size_t completed;
+  int activeWorkers;
+};
+
+typedef struct {
+  WorkQueue *queue;
+  int worker;
+} WorkerStart;
+
+static int ProcessorCount(void) {
+  long count = sysconf(_SC_NPROCESSORS_ONLN);
+
+  if (count < 1)
+    count = 1;
+
+  return count > kMaxWorkers ? kMaxWorkers : (int)count;
+}
+
+static int TakeFromRange(WorkRange *range, size_t *index) {
+  int found = 0;
+
+  pthread_mutex_lock(&range->lock);
+  if (range->begin < range->end) {
+    *index = range->begin++;
+    found = 1;
+  }
+  pthread_mutex_unlock(&range->lock);
+
+  return found;
+}
+
+// Move the back half of some other worker's range into our own (empty) range
+static int StealRange(WorkQueue *queue, int worker) {
+  for (int i = 1; i < queue->threadCount; ++i) {
+    WorkRange *victim = &queue->ranges[(worker + i) % queue->threadCount];
+    size_t begin = 0, end = 0;
+
+    pthread_mutex_lock(&victim->lock);
+    if (victim->begin < victim->end) {
+      size_t remaining = victim->end - victim->begin;
+      end = victim->end;
+      begin = end - (remaining + 1) / 2;
+      victim->end = begin;
+    }
+    pthread_mutex_unlock(&victim->lock);
+
+    if (begin < end) {
+      WorkRange *own = &queue->ranges[worker];
+      pthread_mutex_lock(&own->lock);
+      own->begin = begin;
+      own->end = end;
+      pthread_mutex_unlock(&own->lock);
+      return 1;
+    }
+  }
+
+  return 0;
+}
+
+static void RunTasks(WorkQueue *queue, int worker, WorkQueueFunction function,
+                     void *context) {
+  WorkRange *own = &queue->ranges[worker];
+  size_t completed = 0;
+  size_t index;
+
+  for (;;) {
+    if (!TakeFromRange(own, &index)) {
+      if (!StealRange(queue, worker))
+        break;
+
+      continue;
+    }
+
+    function(context, index, worker);
+    ++completed;
+  }
+
+  pthread_mutex_lock(&queue->lock);
+  queue->completed += completed;
+  if (queue->completed == queue->count)
+    pthread_cond_broadcast(&queue->workDone);
+  pthread_mutex_unlock(&queue->lock);
+}
+
+static void *WorkerMain(void *arg) {
+  WorkerStart *start = (WorkerStart *)arg;
+  WorkQueue *queue = start->queue;
+  int worker = start->worker;
+  unsigned long seen = 0;
+
+  free(start);
+  pthread_mutex_lock(&queue->lock);
+
+  while (!queue->shuttingDown) {
+    if (queue->generation == seen) {
+      pthread_cond_wait(&queue->workAvailable, &queue->lock);
+      continue;
+    }
+
+    seen = queue->generation;
+
+    // A late wake up could see a job that has already been joined
+    if (!queue->busy)
+      continue;
+
+    WorkQueueFunction function = queue->function;
+    void *context = queue->context;
+    ++queue->activeWorkers;
+    pthread_mutex_unlock(&queue->lock);
+
+    RunTasks(queue, worker, function, context);
+
+    pthread_mutex_lock(&queue->lock);
+    if (--queue->activeWorkers == 0)
+      pthread_cond_broadcast(&queue->workDone);
+  }
+
+  pthread_mutex_unlock(&queue->lock);
+
+  return NULL;
+}
+
+WorkQueue *WorkQueueCreate(int threadCount) {
+  WorkQueue *queue = (WorkQueue *)calloc(1, sizeof(WorkQueue));
+
+  if (!queue)
+    return NULL;
+
+  if (threadCount < 1)
+    threadCount = ProcessorCount();
+  else if (threadCount > kMaxWorkers)
+    threadCount = kMaxWorkers;
+
+  queue->threadCount = threadCount;
+  queue->ranges = (WorkRange *)calloc(threadCount, sizeof(WorkRange));
+  queue->threads = (pthread_t *)calloc(threadCount, sizeof(pthread_t));
+  pthread_mutex_init(&queue->lock, NULL);
+  pthread_cond_init(&queue->workAvailable, NULL);
+  pthread_cond_init(&queue->workDone, NULL);
+
+  for (int i = 0; i < threadCount; ++i)
+    pthread_mutex_init(&queue->ranges[i].lock, NULL);
+
+  // Worker 0 is whoever calls WorkQueueApply()
+  for (int i = 1; i < threadCount; ++i) {
+    WorkerStart *start = (WorkerStart *)malloc(sizeof(WorkerStart));
+    start->queue = queue;
+    start->worker = i;
+
+    if (pthread_create(&queue->threads[i], NULL, WorkerMain, start)) {
+      free(start);
+      queue->threadCount = i;
+      break;
+    }
+  }
+
+  return queue;
+}
+
+void WorkQueueRelease(WorkQueue *queue) {
+  if (!queue)
+    return;
+
+  pthread_mutex_lock(&queue->lock);
+  queue->shuttingDown = 1;
+  pthread_cond_broadcast(&queue->workAvailable);
+  pthread_mutex_unlock(&queue->lock);
+
+  for (int i = 1; i < queue->threadCount; ++i)
+    pthread_join(queue->threads[i], NULL);
+
+  for (int i = 0; i < queue->threadCount; ++i)
+    pthread_mutex_destroy(&queue->ranges[i].lock);
+
+  pthread_cond_destroy(&queue->workDone);
+  pthread_cond_destroy(&queue->workAvailable);
+  pthread_mutex_destroy(&queue->lock);
+  free(queue->threads);
+  free(queue->ranges);
+  free(queue);
+}
+
+static WorkQueue *sSharedQueue = NULL;
+static pthread_once_t sSharedQueueOnce = PTHREAD_ONCE_INIT;
+
+static void CreateSharedQueue(void) {
+  sSharedQueue = WorkQueueCreate(0);
+}
+
+WorkQueue *WorkQueueGetShared(void) {
+  pthread_once(&sSharedQueueOnce, CreateSharedQueue);
+
+  return sSharedQueue;
+}
+
+int WorkQueueThreadCount(WorkQueue *queue) {
+  return queue ? queue->threadCount : 1;
+}
+
+void WorkQueueApply(WorkQueue *queue, size_t count, WorkQueueFunction function,
+                    void *context) {
+  int runSerially = !queue || queue->threadCount < 2 || count < 2;
+
+  if (!runSerially) {
+    pthread_mutex_lock(&queue->lock);
+    if (queue->busy)
+      runSerially = 1;
+    else
+      queue->busy = 1;
+    pthread_mutex_unlock(&queue->lock);
+  }
+
+  if (runSerially) {
+    for (size_t i = 0; i < count; ++i)
+      function(context, i, 0);
+
+    return;
+  }
+
+  // Split evenly.  Contiguous ranges keep neighboring tasks on one worker.
+  int threadCount = queue->threadCount;
+  for (int i = 0; i < threadCount; ++i) {
+    WorkRange *range = &queue->ranges[i];
+    pthread_mutex_lock(&range->lock);
+    range->begin = count * i / threadCount;
+    range->end = count * (i + 1) / threadCount;
+    pthread_mutex_unlock(&range->lock);
+  }
+
+  pthread_mutex_lock(&queue->lock);
+  queue->function = function;
+  queue->context = context;
+  queue->count = count;
+  queue->completed = 0;
+  ++queue->generation;
+  pthread_cond_broadcast(&queue->workAvailable);
+  pthread_mutex_unlock(&queue->lock);
+
+  RunTasks(queue, 0, function, context);
+
+  // Join: every task has run and no worker is still looking at the ranges
+  pthread_mutex_lock(&queue->lock);
+  while (queue->completed < queue->count || queue->activeWorkers)
+    pthread_cond_wait(&queue->workDone, &queue->lock);
+  queue->busy = 0;
+  queue->function = NULL;
+  queue->context = NULL;
+  pthread_mutex_unlock(&queue->lock);
+}
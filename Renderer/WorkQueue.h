@@ -0,0 +1,56 @@
+// Copyright 2008 Google Inc.
+//
+// Licensed under the Apache License, Version 2.0 (the "License"); you may not
+// use this file except in compliance with the License.  You may obtain a copy
+// of the License at
+//
+// http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS, WITHOUT
+// WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.  See the
+// License for the specific language governing permissions and limitations under
+// the License.
+
+// A fixed pool of worker threads for data-parallel rendering.  Work is handed
+// out as a range of task indexes that is split evenly between the workers;
+// idle workers steal half of the remaining range from a busy one.  The caller
+// participates in the work and WorkQueueApply() returns only when every task
+// has finished.  Plain C so that pixel code using it can be built anywhere.
+
+#ifndef WORKQUEUE_H
+#define WORKQUEUE_H
+
+#include <stddef.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+typedef struct WorkQueue WorkQueue;
+
+// |worker| is in [0, WorkQueueThreadCount()) and is stable for the duration of
+// the task, so it can be used to index per-thread scratch memory.
+typedef void (*WorkQueueFunction)(void *context, size_t index, int worker);
+
+// Create a queue with |threadCount| workers (including the calling thread).
+// Use 0 for the number of online processors.
+WorkQueue *WorkQueueCreate(int threadCount);
+void WorkQueueRelease(WorkQueue *queue);
+
+// Process wide queue sized to the machine.  Never released.
+WorkQueue *WorkQueueGetShared(void);
+
+int WorkQueueThreadCount(WorkQueue *queue);
+
+// Run |function| for every index in [0, count) and wait for all of them.  If
+// the queue is already busy (e.g., a nested call from inside a task) or
+// |queue| is NULL, the tasks are run serially on the calling thread.
+void WorkQueueApply(WorkQueue *queue, size_t count, WorkQueueFunction function,
+                    void *context);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif  // WORKQUEUE_H